@@ -26,6 +26,7 @@ from pyperf.perf_enum import *
 from pyperf.perf_attr import *
 import pyperf.perf_util as perf_util
 import pyperf.perf_events as pp
+import pyperf.perf_mux as perf_mux
 
 g_workload = None
 
@@ -41,6 +42,15 @@ parser.add_argument("--sleep", type=float, default=0.1, help="time to wait")
 parser.add_argument("--data", type=perf_util.str_memsize, help="use a data working set as the workload")
 parser.add_argument("--data-dispersion", type=int, help="expansion factor for data working set")
 parser.add_argument("--code", type=perf_util.str_memsize, help="use a code working set as the workload")
+parser.add_argument("--tlb", action="store_true", help="lay out the data working set to stress the TLBs")
+parser.add_argument("--tlb-huge", type=int, default=0, help="percentage of the TLB working set to put in huge pages")
+parser.add_argument("--memory-budget", type=perf_util.str_memsize, help="limit the memory used by workloads")
+parser.add_argument("--isolate", action="store_true", help="run the workload on isolated CPUs with real-time priority")
+parser.add_argument("--settle", type=float, help="wait up to this long for the workload to reach steady state before measuring")
+parser.add_argument("--noise-threshold", type=int, help="flag runs with more preemptions and interrupts than this")
+parser.add_argument("--mux", action="store_true", help="count all events in one workload run, multiplexed in userspace")
+parser.add_argument("--mux-quantum", type=float, default=0.002, help="time each group of events is counted for, with --mux")
+parser.add_argument("--mux-counters", type=int, help="events per group with --mux (default: probe the PMU)")
 parser.add_argument("-e", "--event", type=ecode, action="append", default=[], help="also count this event")
 parser.add_argument("-r", "--repeat", type=int, default=1, help="repeat test N times")
 parser.add_argument("-v", "--verbose", action="count", default=0, help="increase verbosity level")
@@ -226,12 +236,24 @@ class Witness:
 class Workload:
     def __init__(self):
         self.pid = None
+        self.noisy = False
 
     def prepare(self):
         if opts.data or opts.code:
             load_opts = {"data": opts.data, "data_dispersion": opts.data_dispersion, "inst": opts.code, "flags": pysweep.MEM_NO_HUGEPAGE}
+            if opts.tlb:
+                # One line per page, for DTLB_WALK and L1D_TLB_REFILL
+                load_opts["flags"] |= pysweep.MEM_TLB
+                load_opts["tlb_huge_fraction"] = opts.tlb_huge
             self.load = pysweep.Load(load_opts, verbose=max(0, opts.verbose-1))
+            if opts.isolate:
+                # Before start(), so the threads prefault their stacks as they start
+                cpus = self.load.isolate(mlock=True, prefault=256*1024)
+                if opts.verbose:
+                    print("reltest: isolated on CPUs %s" % cpus)
             self.load.start()
+            if opts.verbose >= 2:
+                print("reltest: workload memory: %s" % self.load.memory()["total"])
             self.pid = self.load.tids()[0]
             if opts.verbose:
                 print("reltest: suspend")
@@ -239,6 +261,14 @@ class Workload:
         else:
             self.pid = os.getpid()
 
+    def settle(self):
+        # Get past frequency ramp-up and cache warm-up before we start counting.
+        # The workload is left running.
+        if opts.settle and (opts.data or opts.code) and not command:
+            r = self.load.settle(timeout=opts.settle)
+            if opts.verbose:
+                print("reltest: %s after %.3fs: %s" % (("settled" if r["settled"] else "not settled"), r["time"], r))
+
     def run(self):
         if opts.verbose:
             print("reltest: run")
@@ -253,9 +283,14 @@ class Workload:
                 print(out, end="")
         elif opts.data or opts.code:
             # Run a synthetic workload, for the --sleep duration
+            self.load.noise_reset()
             self.load.resume()
             pysweep.sleep(opts.sleep)
             self.load.suspend()
+            if opts.noise_threshold is not None:
+                self.noisy = self.load.noisy(opts.noise_threshold)
+                if self.noisy and opts.verbose:
+                    print("reltest: noisy run: %s" % self.load.noise())
         else:
             # Just sleep for the --sleep duration, e.g. to pick up background system activity
             pysweep.sleep(opts.sleep)
@@ -272,6 +307,7 @@ def test_relation(r,x):
         opts.code = (x + 1) * 100
 
     g_workload.prepare()
+    g_workload.settle()
     m = Monitor(r, x)
     m.enable()
     g_workload.run() # Dynamic code & data gen
@@ -297,10 +333,42 @@ def test_relation(r,x):
 
     return w.ok
 
+def test_relations_mux(rels):
+    """
+    Test all the relationships in a single workload run, multiplexing the
+    events in userspace. Each event's count is an estimate.
+    """
+    g_workload.prepare()
+    g_workload.settle()
+    if opts.all_cpus:
+        (pid, cpu) = (-1, 0)
+    else:
+        (pid, cpu) = (g_workload.pid, -1)
+    attrs = [PerfEventAttr(type=PERF_TYPE_RAW, config=r.sup, exclude_kernel=False, inherit=True) for r in rels]
+    mux = perf_mux.Multiplexer(attrs, pid=pid, cpu=cpu, counters=opts.mux_counters, quantum=opts.mux_quantum, verbose=opts.verbose)
+    mux.start()
+    g_workload.run()
+    pysweep.br_pred(1)
+    mux.stop()
+    for (r, est) in zip(rels, mux.estimates()):
+        total[0] = int(est.value)
+        ok = r.accepts(total)
+        r.n_tests += 1
+        if not ok:
+            r.n_fails += 1
+        if opts.verbose:
+            print(" (estimate %s, %.1f%% counted)" % (est, est.fraction_running*100.0))
+        show_result(r, ok)
+    mux.close()
+
+
 def show_witness(w):
     # Print more detail about how these values contradict the relationship.
     # (Or perhaps not - when verbose, we also show this for all tests.)
-    r = w.m.r
+    show_result(w.m.r, w.ok)
+
+
+def show_result(r, ok):
     if opts.scaling:
         print(" Rule : %s, event : %04x, count[%08u,%08u,%08u]" % (r.rule, r.sup, total[0], total[1], total[2]), end="")
     else :
@@ -308,18 +376,24 @@ def show_witness(w):
 
     string_revised=r.reason.ljust(30)
     print("  %s" % (string_revised), end="")
+    if g_workload.noisy:
+        print(" (noisy)", end="")
 
-    if not w.ok:
+    if not ok:
         print(" :FAIL")
     else:
         print(" :PASS")
 
 if __name__ == "__main__":
     opts = parser.parse_args()
+    if opts.mux and opts.scaling:
+        parser.error("--mux can't be used with --scaling")
     if opts.command:
         command = ' '.join(opts.command)
     else:
         command = None
+    if opts.memory_budget:
+        pysweep.memory_budget(opts.memory_budget)
     g_workload = Workload()
     rels = list(read_relations())
 
@@ -331,11 +405,15 @@ if __name__ == "__main__":
     print("")
     
     for i in range(opts.repeat):
+        if opts.mux:
+            test_relations_mux(rels)
         for r in rels:
             total[0] = 0
             total[1] = 0
             total[2] = 0
-            if opts.scaling:
+            if opts.mux:
+                pass    # already tested
+            elif opts.scaling:
                 for x in range(0, 3):
                     test_relation(r, x)
             else:
@@ -0,0 +1,267 @@
+#!/usr/bin/python
+
+# Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+# SPDX-License-Identifier : Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Time-aware address space: a set of mappings that change over time,
+which can answer "what was mapped at address A at time T?".
+
+At any one time, the mappings in an address space don't overlap:
+a new mapping replaces whatever was mapped in its range before. So each
+mapping covers a rectangle of (address, time), and the rectangles are
+disjoint. We keep:
+
+  - the live mappings, sorted by address, each with the time it was mapped.
+    Lookups at the current time (e.g. while reading records in time order)
+    are a binary search of these.
+
+  - the retired parts of mappings, i.e. (address range, time range) rectangles,
+    in a segment tree over address. Each rectangle is stored at the O(log n)
+    nodes that together cover its address range; all rectangles at one node
+    cover the node's whole range, so being disjoint they're disjoint in time,
+    and can be binary searched by time. A lookup visits the nodes from the
+    root to the address's leaf, so takes O(log n) steps of O(log n).
+    The tree is rebuilt (lazily) when mappings have been retired since
+    the last build.
+
+When a process forks, the child shares its parent's live mappings until
+one or the other changes them, so a fork followed by exec costs nothing.
+
+Changes should come in time order, but records from different CPUs can
+be slightly out of order. A mapping added at a time before the live
+mapping it overlaps was itself replaced by that mapping, so it's only
+retired, for the time between, and the live mapping stays.
+
+The mapped objects are opaque: for perf.data, they're the MMAP/MMAP2 records.
+"""
+
+from __future__ import print_function
+
+import bisect
+
+
+class AddressSpace:
+    """
+    Mappings in one address space (e.g. a process), over time.
+    Times are integers (e.g. perf timestamps) or None if not known.
+    """
+    def __init__(self, start_time=None):
+        self.start_time = start_time
+        self._lo = []           # start addresses of the live mappings, sorted
+        self._live = []         # live mappings: (lo, hi, t0, obj)
+        self._shared = False    # _lo/_live may be shared with another space
+        self.last_change = start_time
+        self._retired = []      # (lo, hi, t0, t1, obj)
+        self._tree = None       # _SegmentTree built from _retired, or None if out of date
+
+    def fork(self, time=None):
+        """
+        Create a new address space that starts with this one's current mappings.
+        """
+        child = AddressSpace(start_time=time)
+        child._lo = self._lo
+        child._live = self._live
+        child._shared = self._shared = True
+        if time is not None:
+            child.last_change = time
+        return child
+
+    def _unshare(self):
+        if self._shared:
+            self._lo = list(self._lo)
+            self._live = list(self._live)
+            self._shared = False
+
+    def _retire(self, lo, hi, t0, t1, obj):
+        assert t0 is None or t1 is None or t0 <= t1, "mapping retired at %u before it was mapped at %u" % (t1, t0)
+        if self.start_time is not None and (t0 is None or t0 < self.start_time):
+            # inherited from the parent: in this space, it was only mapped from the fork
+            t0 = self.start_time
+        if t0 is not None and t1 is not None and t1 <= t0:
+            # never visible: replaced when it was mapped, or before the fork
+            return
+        self._retired.append((lo, hi, t0, t1, obj))
+        self._tree = None
+
+    def _changed(self, time):
+        if time is not None and (self.last_change is None or time > self.last_change):
+            self.last_change = time
+
+    def add(self, lo, hi, obj, time=None):
+        """
+        Map [lo, hi) to an object from the given time, replacing what was mapped there.
+        """
+        assert lo < hi, "bad mapping range 0x%x-0x%x" % (lo, hi)
+        self._unshare()
+        self._changed(time)
+        i = bisect.bisect_right(self._lo, lo)
+        if i > 0 and self._live[i-1][1] > lo:
+            i -= 1
+        j = i
+        keep = []
+        pieces = []             # the parts of [lo, hi) that the new mapping takes
+        plo = lo
+        while j < len(self._live) and self._live[j][0] < hi:
+            (mlo, mhi, mt0, mobj) = self._live[j]
+            (olo, ohi) = (max(mlo, lo), min(mhi, hi))
+            if time is not None and mt0 is not None and mt0 > time:
+                # Out of order: the live mapping replaced the new one here, so keep it
+                self._retire(olo, ohi, time, mt0, obj)
+                keep.append((mlo, mhi, mt0, mobj))
+                if plo < olo:
+                    pieces.append((plo, olo, time, obj))
+                plo = ohi
+            else:
+                self._retire(olo, ohi, mt0, time, mobj)
+                if mlo < lo:
+                    keep.append((mlo, lo, mt0, mobj))
+                if mhi > hi:
+                    keep.append((hi, mhi, mt0, mobj))
+            j += 1
+        if plo < hi:
+            pieces.append((plo, hi, time, obj))
+        new = sorted(keep + pieces)
+        self._live[i:j] = new
+        self._lo[i:j] = [m[0] for m in new]
+
+    def clear(self, time=None):
+        """
+        Unmap everything, e.g. when the process execs or exits.
+        Mappings added with a later time (out of order) stay mapped.
+        """
+        self._changed(time)
+        later = []
+        for m in self._live:
+            (lo, hi, t0, obj) = m
+            if time is not None and t0 is not None and t0 > time:
+                later.append(m)
+            else:
+                self._retire(lo, hi, t0, time, obj)
+        self._lo = [m[0] for m in later]
+        self._live = later
+        self._shared = False
+
+    def live(self):
+        """
+        Yield the current mappings, in address order, as (lo, hi, obj).
+        """
+        for (lo, hi, t0, obj) in self._live:
+            yield (lo, hi, obj)
+
+    def find(self, addr, time=None):
+        """
+        Find the object mapped at an address at a given time, or at the
+        current time if time is None. Return None if nothing was mapped.
+        """
+        i = bisect.bisect_right(self._lo, addr) - 1
+        if i >= 0:
+            (lo, hi, t0, obj) = self._live[i]
+            if addr < hi and (time is None or t0 is None or t0 <= time):
+                return obj
+        if time is None or (self.last_change is not None and time >= self.last_change) or not self._retired:
+            return None
+        if self._tree is None:
+            self._tree = _SegmentTree(self._retired)
+        return self._tree.find(addr, time)
+
+    def __len__(self):
+        return len(self._live)
+
+
+class _SegmentTree:
+    """
+    Static segment tree over the address boundaries of a list of
+    (lo, hi, t0, t1, obj) rectangles, for point lookups.
+    """
+    def __init__(self, rects):
+        xs = sorted(set([r[0] for r in rects] + [r[1] for r in rects]))
+        self.xs = xs
+        self.n = len(xs) - 1        # number of elementary ranges [xs[k], xs[k+1])
+        size = 1
+        while size < self.n:
+            size *= 2
+        self.size = size
+        nodes = {}
+        for r in rects:
+            self._insert(nodes, 1, 0, size, bisect.bisect_left(xs, r[0]), bisect.bisect_left(xs, r[1]), r)
+        # Sort each node's rectangles by start time; a None start time is taken as the earliest
+        self.nodes = {}
+        for (k, rs) in nodes.items():
+            rs.sort(key=lambda r: (r[2] is not None, r[2]))
+            self.nodes[k] = ([(r[2] if r[2] is not None else -1) for r in rs], rs)
+
+    def _insert(self, nodes, k, nlo, nhi, lo, hi, r):
+        # Insert r, covering elementary ranges [lo, hi), at node k, which covers [nlo, nhi)
+        if hi <= nlo or nhi <= lo:
+            return
+        if lo <= nlo and nhi <= hi:
+            nodes.setdefault(k, []).append(r)
+            return
+        mid = (nlo + nhi) // 2
+        self._insert(nodes, 2*k, nlo, mid, lo, hi, r)
+        self._insert(nodes, 2*k+1, mid, nhi, lo, hi, r)
+
+    def find(self, addr, time):
+        x = bisect.bisect_right(self.xs, addr) - 1
+        if x < 0 or x >= self.n:
+            return None
+        (k, nlo, nhi) = (1, 0, self.size)
+        while True:
+            if k in self.nodes:
+                (t0s, rs) = self.nodes[k]
+                i = bisect.bisect_right(t0s, time) - 1
+                if i >= 0:
+                    (lo, hi, t0, t1, obj) = rs[i]
+                    if t1 is None or time < t1:
+                        return obj
+            if nhi - nlo == 1:
+                return None
+            mid = (nlo + nhi) // 2
+            if x < mid:
+                (k, nhi) = (2*k, mid)
+            else:
+                (k, nlo) = (2*k+1, mid)
+
+
+if __name__ == "__main__":
+    # Self-test: compare lookups against a brute-force list of rectangles
+    import random
+    random.seed(1)
+    a = AddressSpace(start_time=0)
+    history = []
+    for t in range(1, 2000):
+        lo = random.randrange(0, 1000) * 0x1000
+        hi = lo + random.randrange(1, 50) * 0x1000
+        a.add(lo, hi, (lo, hi, t), time=t)
+        history.append((lo, hi, t))
+        if t % 500 == 0:
+            a.clear(time=t)
+            history.append((0, 1 << 64, t))
+    def brute(addr, time):
+        for (lo, hi, t) in reversed(history):
+            if t <= time and lo <= addr < hi:
+                return (lo, hi, t) if hi != (1 << 64) or lo != 0 else None
+        return None
+    n = 0
+    for i in range(20000):
+        addr = random.randrange(0, 1050 * 0x1000)
+        time = random.randrange(0, 2100)
+        assert a.find(addr, time) == brute(addr, time), "0x%x @%u: %s vs %s" % (addr, time, a.find(addr, time), brute(addr, time))
+        n += 1
+    b = a.fork(time=2000)
+    b.add(0, 0x1000, "child", time=2001)
+    assert a.find(0, 2002) != "child" and b.find(0, 2002) == "child"
+    print("%u lookups OK" % n)
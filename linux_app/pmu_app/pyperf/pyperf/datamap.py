@@ -16,11 +16,17 @@
 """
 Build a hierarchical map of sections of a file or other memory space.
 Useful when dealing with complicated file formats like perf.data.
+
+Each range's subranges don't overlap, so they're kept sorted by base
+address, with a parallel list of base addresses for binary search.
+Finding, adding and checking for overlap are then O(log n) at each level
+of the hierarchy (plus a list insertion, which is an append when ranges
+are added in address order, as they mostly are when parsing a file).
 """
 
 from __future__ import print_function
 
-import sys
+import sys, bisect
 
 class DataRange:
     def __init__(self, map, base, size, name, parent=None):
@@ -30,6 +36,7 @@ class DataRange:
         self.size = size
         self.parent = parent
         self.subranges = []    # Ordered by base address
+        self.bases = []        # base addresses of subranges, for bisect
 
     def limit(self):
         return self.base + self.size
@@ -47,28 +54,34 @@ class DataRange:
 
     def add_range(self, range):
         assert self.contains_range(range), "%s should contain %s" % (self, range)
-        down = []
-        for r in self.subranges:
-            if r.contains_range(range):
-                # New range is completely inside one of our subranges
-                assert not down
-                r.add_range(range)
-                return                
-            if range.contains_range(r):
-                # New range contains one of our subranges... and possibly others
+        # Is the new range completely inside one of our subranges?
+        # Only the last subrange starting at or before it could contain it.
+        ix = bisect.bisect_right(self.bases, range.base)
+        if ix > 0 and self.subranges[ix-1].contains_range(range):
+            self.subranges[ix-1].add_range(range)
+            return
+        # Otherwise it goes at this level. Any subranges it contains are consecutive,
+        # starting with the first one at or after its base; they move down into it.
+        lo = bisect.bisect_left(self.bases, range.base)
+        hi = lo
+        while hi < len(self.subranges) and range.contains_range(self.subranges[hi]):
+            hi += 1
+        if lo > 0:
+            prev = self.subranges[lo-1]
+            assert prev.limit() <= range.base, "%s contains consecutive overlapping ranges %s and %s" % (self, prev, range)
+        if hi < len(self.subranges):
+            next = self.subranges[hi]
+            assert range.limit() <= next.base, "%s contains consecutive overlapping ranges %s and %s" % (self, range, next)
+        down = self.subranges[lo:hi]
+        if down:
+            # The new range has no subranges yet, and the moved ones are already in order
+            for r in down:
                 r.parent = range
-                range.add_range(r)
-                down.append(r)
-        for r in down:
-            self.subranges.remove(r)
+            range.subranges[0:0] = down
+            range.bases[0:0] = self.bases[lo:hi]
         range.parent = self
-        ix = 0
-        # Add the new range as one of our subranges, ordered by address 
-        for r in self.subranges:
-            if range.limit() <= r.base:
-                break
-            ix = ix + 1
-        self.subranges.insert(ix, range)
+        self.subranges[lo:hi] = [range]
+        self.bases[lo:hi] = [range.base]
 
     def iter_subranges(self, depth=0):
         for r in self.subranges:
@@ -76,20 +89,29 @@ class DataRange:
             for rr in r.iter_subranges(depth+1):
                 yield rr
 
-    def iter_unmapped(self):
-        start = self.base
-        for r in self.subranges:
+    def iter_unmapped(self, base=None, limit=None):
+        """
+        Yield the gaps between the subranges, optionally only those within [base, limit).
+        """
+        start = self.base if base is None else max(base, self.base)
+        end = self.limit() if limit is None else min(limit, self.limit())
+        ix = bisect.bisect_right(self.bases, start)
+        if ix > 0:
+            ix -= 1
+        for r in self.subranges[ix:]:
+            if r.base >= end:
+                break
             if start < r.base:
                 yield DataRange(self.map, start, r.base-start, "**unmapped**", parent=self)
-            start = r.limit()
-        if start < self.limit():
-            yield DataRange(self.map, start, self.limit()-start, "**unmappped**", parent=self)
+            start = max(start, r.limit())
+        if start < end:
+            yield DataRange(self.map, start, end-start, "**unmapped**", parent=self)
 
     def find_subrange(self, n):
         # Find immediate subrange containing n, or None
-        for r in self.subranges:
-            if r.contains(n):
-                return r
+        ix = bisect.bisect_right(self.bases, n)
+        if ix > 0 and self.subranges[ix-1].contains(n):
+            return self.subranges[ix-1]
         return None
 
     def find(self, n):
@@ -104,6 +126,7 @@ class DataRange:
 
     def check(self):
         last_range = None
+        assert self.bases == [r.base for r in self.subranges], "%s has inconsistent subrange index" % (self)
         for r in self.subranges:
             assert self.contains_range(r), "%s doesn't contain subrange %s" % (self, r)
             if last_range is not None:
@@ -141,15 +164,34 @@ class DataMap:
         self.log = [self.toprange]
 
     def add(self, base, size, name=""):
+        # Overlaps are caught as ranges are added, so we don't need to check the whole map
         dr = DataRange(self, base, size, name)
         self.log.append(dr)
         if size:
-            self.toprange.add_range(dr)
-            self.check()
+            try:
+                self.toprange.add_range(dr)
+            except AssertionError as e:
+                self.report_failure(e)
+                raise
         else:
             dr = None
         return dr
 
+    def add_sorted(self, ranges):
+        """
+        Add a sequence of (base, size, name) ranges, e.g. the records in a file.
+        They're sorted so that each range is added after any range that contains it,
+        so none ever has to be moved down the hierarchy.
+        Return the list of DataRange objects, in the order they were given.
+        """
+        ranges = list(ranges)
+        order = sorted(range(len(ranges)), key=lambda i: (ranges[i][0], -ranges[i][1]))
+        res = [None] * len(ranges)
+        for i in order:
+            (base, size, name) = ranges[i]
+            res[i] = self.add(base, size, name)
+        return res
+
     def find(self, n):
         # Find the most specific subrange
         return self.toprange.find(n)
@@ -165,14 +207,17 @@ class DataMap:
         try:
             self.toprange.check()
         except AssertionError as e:
-            print("Data map consistency check failed: %s" % e, file=sys.stderr)
-            self.toprange.dump()
-            print()
-            print("Log:")
-            for dr in self.log:
-                print(dr)
+            self.report_failure(e)
             raise
 
+    def report_failure(self, e):
+        print("Data map consistency check failed: %s" % e, file=sys.stderr)
+        self.toprange.dump()
+        print()
+        print("Log:")
+        for dr in self.log:
+            print(dr)
+
     def show(self, fmt="%-10s"):
         print_datamap(self, fmt=fmt)
 
@@ -207,6 +252,23 @@ def test():
     d.add(120,256,"data")
     d.add(104,8,"desc 0")
     d.add(112,8,"desc 1")
+    d.check()
+    # Many small ranges, e.g. records in a large file, with some nested ones
+    import random, time
+    random.seed(1)
+    t0 = time.time()
+    d = DataMap()
+    top = d.add(0, 1 << 40, "file")
+    recs = [(base*16, 16, "rec") for base in range(200000)]
+    random.shuffle(recs)
+    for (base, size, name) in recs[:1000]:
+        d.add(base, size, name)
+    d.add_sorted(recs[1000:] + [(base*4096, 4096, "page") for base in range(0, 781)])
+    d.check()
+    assert d.find(12345*16+3).descent()[0].base == 12345*16
+    assert d.find(12345*16+3).descent()[1].name == "page"
+    assert [(r.base, r.size) for r in top.iter_unmapped()] == [(200000*16, (1 << 40) - 200000*16)]
+    print("%u ranges in %.2fs" % (len(d.log), time.time()-t0))
 
 
 if __name__ == "__main__":
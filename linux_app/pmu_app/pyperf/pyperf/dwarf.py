@@ -0,0 +1,346 @@
+# Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+# SPDX-License-Identifier : Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Minimal DWARF reader: just enough to read the line number tables
+in .debug_line (DWARF versions 2 to 5), to map addresses to source lines
+without running addr2line.
+"""
+
+from __future__ import print_function
+
+import struct
+
+
+# Standard opcodes
+DW_LNS_copy                 = 1
+DW_LNS_advance_pc           = 2
+DW_LNS_advance_line         = 3
+DW_LNS_set_file             = 4
+DW_LNS_set_column           = 5
+DW_LNS_negate_stmt          = 6
+DW_LNS_set_basic_block      = 7
+DW_LNS_const_add_pc         = 8
+DW_LNS_fixed_advance_pc     = 9
+DW_LNS_set_prologue_end     = 10
+DW_LNS_set_epilogue_begin   = 11
+DW_LNS_set_isa              = 12
+
+# Extended opcodes
+DW_LNE_end_sequence         = 1
+DW_LNE_set_address          = 2
+DW_LNE_define_file          = 3
+DW_LNE_set_discriminator    = 4
+
+# Content types in DWARF 5 directory and file entry formats
+DW_LNCT_path                = 1
+DW_LNCT_directory_index     = 2
+
+# Attribute forms used in DWARF 5 entry formats
+DW_FORM_block2      = 0x03
+DW_FORM_block4      = 0x04
+DW_FORM_data2       = 0x05
+DW_FORM_data4       = 0x06
+DW_FORM_data8       = 0x07
+DW_FORM_string      = 0x08
+DW_FORM_block       = 0x09
+DW_FORM_block1      = 0x0a
+DW_FORM_data1       = 0x0b
+DW_FORM_sdata       = 0x0d
+DW_FORM_strp        = 0x0e
+DW_FORM_udata       = 0x0f
+DW_FORM_data16      = 0x1e
+DW_FORM_line_strp   = 0x1f
+DW_FORM_strx        = 0x1a
+DW_FORM_strx1       = 0x25
+DW_FORM_strx2       = 0x26
+DW_FORM_strx3       = 0x27
+DW_FORM_strx4       = 0x28
+
+
+class DWARFError(Exception):
+    pass
+
+
+# struct formats for target addresses, by size
+_addr_fmts = {1: "B", 2: "H", 4: "I", 8: "Q"}
+
+
+def uleb128(d, pos):
+    v = 0
+    shift = 0
+    while True:
+        b = d[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not (b & 0x80):
+            return (v, pos)
+
+
+def sleb128(d, pos):
+    v = 0
+    shift = 0
+    while True:
+        b = d[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not (b & 0x80):
+            if b & 0x40:
+                v -= (1 << shift)
+            return (v, pos)
+
+
+def cstring(d, pos):
+    e = d.index(b"\0", pos)
+    return (d[pos:e].decode("utf-8", "replace"), e+1)
+
+
+class LineTable:
+    """
+    The line table for one compilation unit: its file names, and a list of sequences.
+    Each sequence is a list of rows (address, file, line, discriminator), ending
+    with a row for the address after the end of the sequence, with line 0.
+    """
+    def __init__(self):
+        self.version = None
+        self.dirs = []
+        self.files = []         # full file names, by DWARF file number
+        self.sequences = []
+
+
+def _str_offsets(d, order):
+    """
+    Find the string offsets array in a .debug_str_offsets section, for DW_FORM_strx.
+    The array for a unit starts at its DW_AT_str_offsets_base, which is in .debug_info;
+    we don't read that, so we can only use the section if it has a single contribution.
+    Return (data, base, offset size), or None.
+    """
+    if d is None or len(d) < 8:
+        return None
+    d = bytes(d)
+    unit_length = struct.unpack_from(order + "I", d, 0)[0]
+    if unit_length == 0xffffffff:
+        if len(d) < 16 or struct.unpack_from(order + "Q", d, 4)[0] + 12 != len(d):
+            return None
+        return (d, 16, 8)
+    if unit_length + 4 != len(d):
+        return None
+    return (d, 8, 4)
+
+
+def _strx(ix, strings, order):
+    """
+    Resolve a DW_FORM_strx* string index, or return a placeholder if we can't.
+    """
+    offs = strings.get(DW_FORM_strx)
+    s = strings.get(DW_FORM_strp)
+    if offs is not None and s is not None:
+        (d, base, offset_size) = offs
+        pos = base + ix*offset_size
+        if pos + offset_size <= len(d):
+            return cstring(s, struct.unpack_from(order + ("I" if offset_size == 4 else "Q"), d, pos)[0])[0]
+    return "<strx %u>" % ix
+
+
+def _read_form(d, pos, form, offset_size, strings, order):
+    """
+    Read a value in a DWARF 5 directory/file entry. Return (value, new position).
+    """
+    if form == DW_FORM_string:
+        return cstring(d, pos)
+    if form in [DW_FORM_line_strp, DW_FORM_strp]:
+        off = struct.unpack_from(order + ("I" if offset_size == 4 else "Q"), d, pos)[0]
+        s = strings.get(form)
+        name = cstring(s, off)[0] if s is not None else "<strp 0x%x>" % off
+        return (name, pos + offset_size)
+    if form == DW_FORM_udata:
+        return uleb128(d, pos)
+    if form == DW_FORM_sdata:
+        return sleb128(d, pos)
+    fixed = {DW_FORM_data1: "B", DW_FORM_data2: "H", DW_FORM_data4: "I", DW_FORM_data8: "Q"}
+    if form in fixed:
+        return (struct.unpack_from(order + fixed[form], d, pos)[0], pos + struct.calcsize(fixed[form]))
+    if form == DW_FORM_data16:
+        return (d[pos:pos+16], pos + 16)
+    strx = {DW_FORM_strx1: 1, DW_FORM_strx2: 2, DW_FORM_strx3: 3, DW_FORM_strx4: 4}
+    if form in strx:
+        n = strx[form]
+        ix = 0
+        for i in (range(n) if order == ">" else range(n-1, -1, -1)):
+            ix = (ix << 8) | d[pos+i]
+        return (_strx(ix, strings, order), pos + n)
+    if form == DW_FORM_strx:
+        (ix, pos) = uleb128(d, pos)
+        return (_strx(ix, strings, order), pos)
+    if form in [DW_FORM_block, DW_FORM_block1, DW_FORM_block2, DW_FORM_block4]:
+        if form == DW_FORM_block:
+            (n, pos) = uleb128(d, pos)
+        else:
+            fmt = {DW_FORM_block1: "B", DW_FORM_block2: "H", DW_FORM_block4: "I"}[form]
+            n = struct.unpack_from(order + fmt, d, pos)[0]
+            pos += struct.calcsize(fmt)
+        return (d[pos:pos+n], pos + n)
+    raise DWARFError("unsupported form 0x%x in line table header" % form)
+
+
+def _read_entry_formats(d, pos):
+    (n, pos) = (d[pos], pos+1)
+    fmts = []
+    for i in range(n):
+        (ct, pos) = uleb128(d, pos)
+        (form, pos) = uleb128(d, pos)
+        fmts.append((ct, form))
+    return (fmts, pos)
+
+
+def _read_entries(d, pos, fmts, offset_size, strings, order):
+    (n, pos) = uleb128(d, pos)
+    entries = []
+    for i in range(n):
+        e = {}
+        for (ct, form) in fmts:
+            (v, pos) = _read_form(d, pos, form, offset_size, strings, order)
+            e[ct] = v
+        entries.append(e)
+    return (entries, pos)
+
+
+def _join(dir, name):
+    if not dir or name.startswith("/"):
+        return name
+    return dir + "/" + name
+
+
+def line_tables(debug_line, debug_line_str=None, debug_str=None, debug_str_offsets=None, order="<"):
+    """
+    Parse a .debug_line section, yielding a LineTable for each compilation unit.
+    'order' is the struct byte order prefix for the target, from the ELF's EI_DATA.
+    """
+    d = bytes(debug_line)
+    strings = {DW_FORM_line_strp: debug_line_str, DW_FORM_strp: debug_str,
+               DW_FORM_strx: _str_offsets(debug_str_offsets, order)}
+    pos = 0
+    while pos + 4 <= len(d):
+        lt = LineTable()
+        unit_length = struct.unpack_from(order + "I", d, pos)[0]
+        pos += 4
+        offset_size = 4
+        if unit_length == 0xffffffff:
+            unit_length = struct.unpack_from(order + "Q", d, pos)[0]
+            pos += 8
+            offset_size = 8
+        unit_end = pos + unit_length
+        lt.version = struct.unpack_from(order + "H", d, pos)[0]
+        pos += 2
+        if lt.version < 2 or lt.version > 5:
+            raise DWARFError("unsupported .debug_line version %u" % lt.version)
+        if lt.version >= 5:
+            pos += 2        # address_size, segment_selector_size
+        header_length = struct.unpack_from(order + ("I" if offset_size == 4 else "Q"), d, pos)[0]
+        pos += offset_size
+        program = pos + header_length
+        min_inst_length = d[pos]
+        pos += 1
+        if lt.version >= 4:
+            pos += 1        # maximum_operations_per_instruction: VLIW only
+        default_is_stmt = d[pos]
+        line_base = struct.unpack_from("b", d, pos+1)[0]
+        line_range = d[pos+2]
+        opcode_base = d[pos+3]
+        pos += 4
+        std_lengths = [0] + list(d[pos:pos+opcode_base-1])
+        pos += opcode_base - 1
+        if lt.version >= 5:
+            (fmts, pos) = _read_entry_formats(d, pos)
+            (dirs, pos) = _read_entries(d, pos, fmts, offset_size, strings, order)
+            lt.dirs = [e.get(DW_LNCT_path, "") for e in dirs]
+            (fmts, pos) = _read_entry_formats(d, pos)
+            (files, pos) = _read_entries(d, pos, fmts, offset_size, strings, order)
+            for e in files:
+                dix = e.get(DW_LNCT_directory_index, 0)
+                lt.files.append(_join(lt.dirs[dix] if dix < len(lt.dirs) else "", e.get(DW_LNCT_path, "")))
+        else:
+            # Directory 0 is the compilation directory, which is only in .debug_info,
+            # and file 0 isn't used.
+            lt.dirs = [""]
+            while d[pos] != 0:
+                (s, pos) = cstring(d, pos)
+                lt.dirs.append(s)
+            pos += 1
+            lt.files = [""]
+            while d[pos] != 0:
+                (s, pos) = cstring(d, pos)
+                (dix, pos) = uleb128(d, pos)
+                (mtime, pos) = uleb128(d, pos)
+                (size, pos) = uleb128(d, pos)
+                lt.files.append(_join(lt.dirs[dix] if dix < len(lt.dirs) else "", s))
+            pos += 1
+        # Run the line number program
+        pos = program
+        seq = []
+        (address, file, line, disc) = (0, 1, 1, 0)
+        while pos < unit_end:
+            op = d[pos]
+            pos += 1
+            if op >= opcode_base:
+                adj = op - opcode_base
+                address += (adj // line_range) * min_inst_length
+                line += line_base + (adj % line_range)
+                seq.append((address, file, line, disc))
+                disc = 0
+            elif op == 0:
+                (n, pos) = uleb128(d, pos)
+                eop = d[pos]
+                if eop == DW_LNE_end_sequence:
+                    seq.append((address, file, 0, 0))
+                    lt.sequences.append(seq)
+                    seq = []
+                    (address, file, line, disc) = (0, 1, 1, 0)
+                elif eop == DW_LNE_set_address:
+                    # The address size isn't in the header before DWARF 5, so go by the operand length
+                    if n-1 not in _addr_fmts:
+                        raise DWARFError("bad DW_LNE_set_address length %u" % (n-1))
+                    address = struct.unpack_from(order + _addr_fmts[n-1], d, pos+1)[0]
+                elif eop == DW_LNE_set_discriminator:
+                    disc = uleb128(d, pos+1)[0]
+                elif eop == DW_LNE_define_file:
+                    (s, p) = cstring(d, pos+1)
+                    dix = uleb128(d, p)[0]
+                    lt.files.append(_join(lt.dirs[dix] if dix < len(lt.dirs) else "", s))
+                pos += n
+            elif op == DW_LNS_copy:
+                seq.append((address, file, line, disc))
+                disc = 0
+            elif op == DW_LNS_advance_pc:
+                (v, pos) = uleb128(d, pos)
+                address += v * min_inst_length
+            elif op == DW_LNS_advance_line:
+                (v, pos) = sleb128(d, pos)
+                line += v
+            elif op == DW_LNS_set_file:
+                (file, pos) = uleb128(d, pos)
+            elif op == DW_LNS_const_add_pc:
+                address += ((255 - opcode_base) // line_range) * min_inst_length
+            elif op == DW_LNS_fixed_advance_pc:
+                address += struct.unpack_from(order + "H", d, pos)[0]
+                pos += 2
+            else:
+                # Other standard opcodes only change state we don't track: skip their operands
+                for i in range(std_lengths[op]):
+                    (v, pos) = uleb128(d, pos)
+        yield lt
+        pos = unit_end
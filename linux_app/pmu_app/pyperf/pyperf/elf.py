@@ -81,8 +81,19 @@ SHT_ARM_ATTRIBUTES  = 0x70000003
 SHF_WRITE       = 0x0001
 SHF_ALLOC       = 0x0002
 SHF_EXECINSTR   = 0x0004
+SHF_COMPRESSED  = 0x0800
+
+ELFCOMPRESS_ZLIB = 1
+
+# Symbol types, from st_info
+STT_NOTYPE      = 0
+STT_OBJECT      = 1
+STT_FUNC        = 2
+STT_SECTION     = 3
+STT_FILE        = 4
 
 SHN_UNDEX       = 0
+SHN_UNDEF       = 0
 SHN_ABS         = 0xfff1
 SHN_COMMON      = 0xfff2
 
@@ -165,12 +176,26 @@ class Section:
     def data(self):
         if self._data is None:
             self._data = self.file.readat(self.soff, self.ssize)
+            if self.flags & SHF_COMPRESSED:
+                self._data = self.file.decompress(self._data)
         return self._data
 
     def __str__(self):
         s = "#%u" % (self.index)
 
 
+class Symbol:
+    def __init__(self, name, value, size, stype, shndx):
+        self.name = name
+        self.value = value
+        self.size = size
+        self.type = stype       # STT_FUNC etc.
+        self.shndx = shndx      # section index, or SHN_UNDEF for an undefined symbol
+
+    def is_defined(self):
+        return self.shndx != SHN_UNDEF
+
+
 class Note:
     def __init__(self, group, ntype, desc):
         self.group = group
@@ -214,6 +239,7 @@ class ELF:
         self.fd = None
         self.elf_type = None
         self.machine = None
+        self.endian = "<"               # struct byte order prefix, from EI_DATA
         self.is_mapping_symbol = is_mapping_symbol_False
         self.symbol_real_address = symbol_real_address_default
         self.read_headers()
@@ -231,6 +257,7 @@ class ELF:
             #print("%s: not an ELF file" % self.fn, file=sys.stderr)
             #return
             raise NotELF()
+        self.endian = ">" if s[5:6] == b"\x02" else "<"    # ELFDATA2MSB
         self.elf_type = self.read16(16)  # EXE, OBJ etc.
         self.machine = self.read16(18)   # EM_ARM etc.
         if self.machine == EM_ARM:
@@ -246,6 +273,7 @@ class ELF:
             self.shoff = self.read32(32)
             self.shsize = self.read16(46)
             self.shnum = self.read16(48)
+            self.shstrndx = self.read16(50)
         else:
             self.entry = self.read64(24)
             self.phoff = self.read64(32)
@@ -254,6 +282,7 @@ class ELF:
             self.shoff = self.read64(40)
             self.shsize = self.read16(58)
             self.shnum = self.read16(60)
+            self.shstrndx = self.read16(62)
 
     def __str__(self):
         s = self.fn
@@ -276,12 +305,11 @@ class ELF:
         return s
 
     def readnum(self, fmt, n, off, s=None):
-        # TBD: handle endianness conversion
         if s is None:
             s = self.readat(off, n)
         else:
             s = s[off:off+n]
-        return struct.unpack(fmt, s)[0]
+        return struct.unpack(self.endian + fmt, s)[0]
 
     def read64(self, off, s=None):
         return self.readnum("Q", 8, off, s)
@@ -352,27 +380,86 @@ class ELF:
                 return n.desc
         return None
 
+    def section(self, i):
+        """
+        Get the header for section i. The name isn't filled in.
+        """
+        sho = self.shoff + i*self.shsize
+        sh = self.readat(sho, self.shsize)
+        s = Section(self)
+        s.index = i
+        s.name = None
+        s.name_offset = self.read32(0, sh)
+        s.type = self.read32(4, sh)
+        if not self.sf:
+            s.flags = self.read32(8, sh)
+            s.saddr = self.read32(12, sh)
+            s.soff = self.read32(16, sh)
+            s.ssize = self.read32(20, sh)
+            s.link = self.read32(24, sh)
+            s.salign = self.read32(32, sh)
+            s.entsize = self.read32(36, sh)
+        else:
+            s.flags = self.read64(8, sh)
+            s.saddr = self.read64(16, sh)
+            s.soff = self.read64(24, sh)
+            s.ssize = self.read64(32, sh)
+            s.link = self.read32(40, sh)
+            s.salign = self.read64(48, sh)
+            s.entsize = self.read64(56, sh)
+        return s
+
     def sections(self):
+        names = None
+        if 0 < self.shstrndx < self.shnum:
+            names = self.section(self.shstrndx).data()
         for i in range(0, self.shnum):
-            sho = self.shoff + i*self.shsize
-            sh = self.readat(sho, self.shsize)
-            s = Section(self)
-            s.index = i
-            s.type = self.read32(4, sh)
-            if not self.sf:
-                s.flags = self.read32(8, sh)
-                s.saddr = self.read32(12, sh)
-                s.soff = self.read32(16, sh)
-                s.ssize = self.read32(20, sh)
-                s.salign = self.read32(32, sh)
-            else:
-                s.flags = self.read64(8, sh)
-                s.saddr = self.read64(16, sh)
-                s.soff = self.read64(24, sh)
-                s.ssize = self.read64(32, sh)
-                s.salign = self.read64(48, sh)
+            s = self.section(i)
+            if names is not None:
+                no = s.name_offset
+                s.name = names[no:names.index(b"\0", no)].decode("utf-8", "replace")
             yield s
 
+    def section_by_name(self, name):
+        for s in self.sections():
+            if s.name == name:
+                return s
+        return None
+
+    def decompress(self, data):
+        """
+        Decompress the contents of a section with SHF_COMPRESSED, which start with a compression header.
+        """
+        import zlib
+        if not self.sf:
+            (ctype, csize, calign) = struct.unpack(self.endian + "III", data[:12])
+            data = data[12:]
+        else:
+            (ctype, reserved, csize, calign) = struct.unpack(self.endian + "IIQQ", data[:24])
+            data = data[24:]
+        if ctype != ELFCOMPRESS_ZLIB:
+            raise IOError("%s: unsupported section compression type %u" % (self.fn, ctype))
+        return zlib.decompress(data)
+
+    def symbols(self, dynamic=False):
+        """
+        Iterate through the symbols in the symbol table (or the dynamic symbol table).
+        """
+        secs = list(self.sections())
+        for st in secs:
+            if st.type != (SHT_DYNSYM if dynamic else SHT_SYMTAB):
+                continue
+            d = st.data()
+            strtab = secs[st.link].data()
+            esize = 24 if self.sf else 16
+            for pos in range(esize, len(d) - esize + 1, esize):
+                if self.sf:
+                    (no, info, other, shndx, value, size) = struct.unpack_from(self.endian + "IBBHQQ", d, pos)
+                else:
+                    (no, value, size, info, other, shndx) = struct.unpack_from(self.endian + "IIIBBH", d, pos)
+                name = strtab[no:strtab.index(b"\0", no)].decode("utf-8", "replace")
+                yield Symbol(name, value, size, info & 0xf, shndx)
+
 
 if __name__ == "__main__":
     import argparse
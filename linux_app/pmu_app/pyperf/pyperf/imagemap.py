@@ -47,6 +47,11 @@ Note that multi-address-space support could be built on top of
 time-awareness, in the sense that images for an address space could
 have their validity intervals intersected with the set of intervals
 when their address space was the active one.
+
+For perf.data files, addrspace.py does this at the level of mappings:
+PerfDataReader keeps an AddressSpace per pid, with each MMAP record's
+validity interval, so lookup_addr(pid, addr, time) finds the mapping
+(and hence the file to use as an image) at the time of an event.
 """
 
 from __future__ import print_function
@@ -56,8 +61,11 @@ import struct, mmap
 import bisect
 import subprocess
 import platform
+import array
 
 import pyperf.elf as elf
+import pyperf.dwarf as dwarf
+import pyperf.perf_buildid as perf_buildid
 
 # sys.path.append("/root/symbolizer")
 # import symbolizer
@@ -174,6 +182,307 @@ class Symtab():
 
 
 
+class _StringTable():
+    """
+    A list of strings held as one buffer of UTF-8 and an array of offsets into it,
+    so it can be mapped from an index file and decoded only as needed.
+    """
+    def __init__(self, data, offsets):
+        self.data = data
+        self.offsets = offsets      # len(self)+1 offsets
+
+    def __len__(self):
+        return len(self.offsets) - 1
+
+    def __getitem__(self, i):
+        if i < 0 or i >= len(self):
+            raise IndexError(i)
+        return bytes(self.data[self.offsets[i]:self.offsets[i+1]]).decode("utf-8", "replace")
+
+
+def _pack_strings(strs):
+    data = b"".join([x.encode("utf-8") for x in strs])
+    offsets = array.array("I", [0])
+    for x in strs:
+        offsets.append(offsets[-1] + len(x.encode("utf-8")))
+    return (data, offsets)
+
+
+def _index_array(buf, pos, fmt, n):
+    """
+    Get a typed view of n items in a mapped index file. Python 2 has no
+    memoryview.cast(), so copy into an array.
+    """
+    size = n * struct.calcsize(fmt)
+    if sys.version_info[0] >= 3:
+        return (buf[pos:pos+size].cast(fmt), pos+size)
+    a = array.array(fmt)
+    a.fromstring(buf[pos:pos+size].tobytes())
+    return (a, pos+size)
+
+
+# Index file header: magic, byte order check, flags, counts of symbols,
+# line rows and files, and sizes of the symbol name and file name data.
+# Arrays are in native byte order, 8-byte arrays first, then 4-byte, then strings.
+_INDEX_MAGIC = b"PYSYMIX1"
+_INDEX_HEADER = "8sIIIIIII"
+_INDEX_HAS_LINES = 0x1
+
+
+class SymbolIndex():
+    """
+    Address lookup for one ELF file, built in-process from its symbol table
+    and .debug_line, rather than by running nm and addr2line.
+
+    Symbols and line table rows are held in address-sorted arrays:
+      sym_addr[i], sym_name[i]      - symbols (functions, objects etc.)
+      line_addr[i], line_file[i], line_line[i], line_disc[i]
+                                    - line table rows; a row with line 0
+                                      marks the end of a sequence
+      files                         - file names, indexed by line_file
+    Addresses are as in the ELF file, i.e. not adjusted by a load address.
+    """
+    def __init__(self, fn=None):
+        self.build_id = None
+        self.sym_addr = array.array("Q")
+        self.sym_name = []
+        self.line_addr = array.array("Q")
+        self.line_file = array.array("I")
+        self.line_line = array.array("I")
+        self.line_disc = array.array("I")
+        self.files = []
+        self.has_lines = False
+        if fn is not None:
+            self.read_elf(fn)
+
+    def read_elf(self, fn):
+        E = elf.ELF(fn)
+        self.build_id = E.build_id()
+        self.read_symbols(E)
+        self.read_lines(E)
+
+    def read_symbols(self, E):
+        syms = []
+        for dynamic in [False, True]:
+            for sym in E.symbols(dynamic=dynamic):
+                if not sym.is_defined() or not sym.name or sym.type in [elf.STT_SECTION, elf.STT_FILE]:
+                    continue
+                if E.is_mapping_symbol(sym.name):
+                    continue
+                syms.append((E.symbol_real_address(sym.value), sym.name))
+            if syms:
+                # Only use the dynamic symbols if there's no full symbol table
+                break
+        syms.sort(key=lambda a_n: a_n[0])
+        self.sym_addr = array.array("Q", [a for (a, n) in syms])
+        self.sym_name = [n for (a, n) in syms]
+
+    def read_lines(self, E):
+        sec = {}
+        for s in E.sections():
+            if s.name in [".debug_line", ".debug_line_str", ".debug_str", ".debug_str_offsets"]:
+                sec[s.name] = s.data()
+        if ".debug_line" not in sec:
+            return
+        # Code that was discarded by the linker has line table sequences at address zero,
+        # unless there is really code there.
+        zero_ok = any([(s.flags & elf.SHF_EXECINSTR) and s.saddr == 0 for s in E.sections()])
+        file_ix = {}
+        seqs = []
+        for lt in dwarf.line_tables(sec[".debug_line"], sec.get(".debug_line_str"), sec.get(".debug_str"),
+                                    sec.get(".debug_str_offsets"), order=E.endian):
+            fmap = []
+            for fn in lt.files:
+                if fn not in file_ix:
+                    file_ix[fn] = len(self.files)
+                    self.files.append(fn)
+                fmap.append(file_ix[fn])
+            for seq in lt.sequences:
+                if len(seq) < 2 or (seq[0][0] == 0 and not zero_ok):
+                    continue
+                seqs.append([(a, (fmap[f] if f < len(fmap) else 0), ln, disc) for (a, f, ln, disc) in seq])
+        seqs.sort(key=lambda sq: sq[0][0])
+        for seq in seqs:
+            for (a, f, ln, disc) in seq:
+                self.line_addr.append(a)
+                self.line_file.append(f)
+                self.line_line.append(ln)
+                self.line_disc.append(disc)
+        self.has_lines = True
+
+    def save(self, fn):
+        """
+        Write the index to a file, which can be mapped by load().
+        The file is written under a temporary name and renamed,
+        so a reader (maybe another user sharing the cache) never sees it part-written.
+        """
+        (names, name_offs) = _pack_strings(self.sym_name)
+        (files, file_offs) = _pack_strings(self.files)
+        hdr = struct.pack(_INDEX_HEADER, _INDEX_MAGIC, 0x01020304, (_INDEX_HAS_LINES if self.has_lines else 0),
+                          len(self.sym_addr), len(self.line_addr), len(self.files), len(names), len(files))
+        d = os.path.dirname(fn)
+        if d and not os.path.isdir(d):
+            try:
+                os.makedirs(d)
+            except OSError:
+                if not os.path.isdir(d):
+                    raise
+        tmp = "%s.%u.tmp" % (fn, os.getpid())
+        with open(tmp, "wb") as f:
+            f.write(hdr)
+            for a in [self.sym_addr, self.line_addr, name_offs, self.line_file, self.line_line, self.line_disc, file_offs]:
+                f.write(a.tobytes() if hasattr(a, "tobytes") else a.tostring())
+            f.write(names)
+            f.write(files)
+        os.chmod(tmp, 0o644)
+        os.rename(tmp, fn)
+
+    @classmethod
+    def load(cls, fn):
+        """
+        Map an index file written by save(). The arrays are views of the mapped file.
+        Return None if the file is missing or isn't a valid index.
+        """
+        try:
+            f = open(fn, "rb")
+        except IOError:
+            return None
+        try:
+            m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        except (ValueError, mmap.error):
+            return None
+        finally:
+            f.close()
+        buf = memoryview(m)
+        hsize = struct.calcsize(_INDEX_HEADER)
+        if len(buf) < hsize:
+            return None
+        (magic, order, flags, n_sym, n_line, n_files, names_size, files_size) = struct.unpack(_INDEX_HEADER, buf[:hsize])
+        if magic != _INDEX_MAGIC or order != 0x01020304:
+            return None
+        if len(buf) != hsize + (n_sym+n_line)*8 + (n_sym+1 + n_line*3 + n_files+1)*4 + names_size + files_size:
+            return None
+        si = cls()
+        pos = hsize
+        (si.sym_addr, pos) = _index_array(buf, pos, "Q", n_sym)
+        (si.line_addr, pos) = _index_array(buf, pos, "Q", n_line)
+        (name_offs, pos) = _index_array(buf, pos, "I", n_sym+1)
+        (si.line_file, pos) = _index_array(buf, pos, "I", n_line)
+        (si.line_line, pos) = _index_array(buf, pos, "I", n_line)
+        (si.line_disc, pos) = _index_array(buf, pos, "I", n_line)
+        (file_offs, pos) = _index_array(buf, pos, "I", n_files+1)
+        si.sym_name = _StringTable(buf[pos:pos+names_size], name_offs)
+        pos += names_size
+        si.files = _StringTable(buf[pos:pos+files_size], file_offs)
+        si.has_lines = bool(flags & _INDEX_HAS_LINES)
+        return si
+
+    def symbol(self, addr):
+        """
+        Return (symbol address, name) for the nearest symbol at or before an address, or None.
+        """
+        ix = bisect.bisect_right(self.sym_addr, addr)
+        if not ix:
+            return None
+        return (self.sym_addr[ix-1], self.sym_name[ix-1])
+
+    def line(self, addr):
+        """
+        Return (file, line, discriminator) for an address, or None.
+        """
+        ix = bisect.bisect_right(self.line_addr, addr)
+        if not ix or self.line_line[ix-1] == 0:
+            return None
+        return (self.files[self.line_file[ix-1]], self.line_line[ix-1], self.line_disc[ix-1])
+
+    def lookup(self, addrs):
+        """
+        Look up an array of addresses, returning a list of (symbol, file, line)
+        with None for what isn't found. The addresses are sorted once and the
+        tables walked in step, rather than doing a binary search for each.
+        """
+        res = [None] * len(addrs)
+        order = sorted(range(len(addrs)), key=addrs.__getitem__)
+        si = 0
+        li = 0
+        n_sym = len(self.sym_addr)
+        n_line = len(self.line_addr)
+        for i in order:
+            a = addrs[i]
+            while si < n_sym and self.sym_addr[si] <= a:
+                si += 1
+            while li < n_line and self.line_addr[li] <= a:
+                li += 1
+            sym = self.sym_name[si-1] if si else None
+            if li and self.line_line[li-1] != 0:
+                res[i] = (sym, self.files[self.line_file[li-1]], self.line_line[li-1])
+            else:
+                res[i] = (sym, None, None)
+        return res
+
+
+_symbol_indexes = {}     # build-id (or file name) -> SymbolIndex
+
+_index_cache = ""        # buildid cache for persistent indexes: "" for the default, None for none
+
+def set_index_cache(cache):
+    """
+    Set where SymbolIndex files are kept between runs: a BuildIDCache(RO) object,
+    a directory name, "" for the default buildid cache in ~/.debug, or None to
+    not keep them.
+    """
+    global _index_cache
+    _index_cache = cache
+
+
+def _get_index_cache():
+    global _index_cache
+    if _index_cache == "":
+        try:
+            _index_cache = perf_buildid.BuildIDCacheRO()
+        except AssertionError:
+            _index_cache = None
+    elif isinstance(_index_cache, str):
+        _index_cache = perf_buildid.BuildIDCacheRO(_index_cache)
+    return _index_cache
+
+
+def symbol_index(fn):
+    """
+    Get the SymbolIndex for an ELF file. Indexes are shared between files
+    with the same build-id, e.g. the same library mapped by many processes,
+    and are kept in the buildid cache, so the next run can map the index
+    rather than reading the ELF file again.
+    """
+    try:
+        E = elf.ELF(fn)
+        key = E.build_id()
+    except (elf.NotELF, IOError):
+        return None
+    if key is None:
+        key = os.path.realpath(fn)
+    if key in _symbol_indexes:
+        return _symbol_indexes[key]
+    cache = _get_index_cache() if isinstance(key, bytes) else None
+    si = None
+    if cache is not None:
+        ifn = cache.id_index_file(perf_buildid.BuildID(key))
+        si = SymbolIndex.load(ifn)
+        if si is not None and not si.has_lines and E.section_by_name(".debug_line") is not None:
+            # Indexed from a stripped copy with the same build-id: this copy has more
+            si = None
+    if si is None:
+        si = SymbolIndex(fn)
+        if cache is not None:
+            try:
+                si.save(ifn)
+            except (IOError, OSError):
+                # e.g. a shared cache we can't write to
+                pass
+    _symbol_indexes[key] = si
+    return si
+
+
 def read_nm_symlist(sl, symtab, load=0, reject=None, map=None):
     """
     Read a symbol list, as output from 'nm', into a provided symbol table.
@@ -227,6 +536,13 @@ def read_elf_symlist(fn, symtab, load=0):
     The symbol address can be adjusted by a provided load address -
     this is for shared objects.
     """
+    si = symbol_index(fn)
+    if si is not None and si.sym_addr:
+        for (addr, name) in zip(si.sym_addr, si.sym_name):
+            symtab.add(addr + load, name)
+        n = len(si.sym_addr)
+        print("%s: added %u symbols (ELF)" % (fn, n))
+        return n
     E = elf.ELF(fn)
     method = "nm"
     cmd = binutil("nm") + (" %s" % fn)
@@ -343,6 +659,7 @@ class image():
         self.description = description
         self.load_addr = load_addr
         self.a2l_process = None
+        self._symbol_index = None
 
     def data(self):
         if self.deferred:
@@ -365,6 +682,23 @@ class image():
         s = "0x%x..0x%x %s" % (self.base_addr, self.end_addr-1, self.description)
         return s
 
+    def symbol_index(self):
+        """
+        Get the SymbolIndex for this image's ELF file, or None.
+        """
+        if self._symbol_index is None and self.elf is not None and os.path.isfile(self.elf):
+            self._symbol_index = symbol_index(self.elf)
+        return self._symbol_index
+
+    def lookup(self, addrs):
+        """
+        Map a list of absolute addresses to (symbol, file, line), using the SymbolIndex.
+        """
+        si = self.symbol_index()
+        if si is None:
+            return [None] * len(addrs)
+        return si.lookup([a - self.load_addr for a in addrs])
+
     def addr2line(self, addr):
         """
         Given an absolute address, map it to a source position.
@@ -384,6 +718,15 @@ class image():
             if pos[0] == "??":
                 pos = None
             return pos
+        si = self.symbol_index()
+        if si is not None and si.has_lines:
+            # Look up in-process. The function name is from the symbol table,
+            # so unlike addr2line we don't report inlined functions.
+            pos = si.line(addr)
+            if pos is None:
+                return None
+            sym = si.symbol(addr)
+            return ((sym[1] if sym is not None else "?"),) + pos
         if self.a2l_process is None:
             if self.elf is None:
                 # print "no ELF image for address 0x%x" % addr
@@ -661,6 +1004,22 @@ class imagemap():
         else:
             return None
 
+    def lookup(self, addrs):
+        """
+        Map a list of addresses to (symbol, file, line), or None where there's no image.
+        Addresses are grouped by image so that each image's index is walked once.
+        """
+        res = [None] * len(addrs)
+        by_image = {}
+        for (i, a) in enumerate(addrs):
+            im = self.find_image(a, 1)
+            if im is not None:
+                by_image.setdefault(id(im), (im, []))[1].append(i)
+        for (im, ixs) in by_image.values():
+            for (i, r) in zip(ixs, im.lookup([addrs[i] for i in ixs])):
+                res[i] = r
+        return res
+
     def read(self, addr, size):
         im = self.find_image(addr, size)
         if im is not None:
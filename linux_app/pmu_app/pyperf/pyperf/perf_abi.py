@@ -72,6 +72,8 @@ def ip_perf_context(ip):
 def trailing_string(d, check=None):
     # d is a byte array, length a multiple of 8. Extract a string and remove trailing NULs.
     # Check that the NUL is in the expected place.
+    if isinstance(d, memoryview):
+        d = d.tobytes()    # record is a view of a mapped perf.data
     assert isinstance(d, bytearray) or isinstance(d, bytes), "invalid record: %s" % type(d)
     ix = d.find(b'\0')
     if ix < 0:
@@ -16,73 +16,122 @@
 """
 Bridge between ARM SPE and perf.
 
-Currently this module provides a function to translate ARM SPE samples (from arm_pe.py)
+Currently this module provides a function to translate ARM SPE samples
 into objects that behave like perf.data records (from perf_abi.py).
+The SPE data is decoded by perf_events.decode_spe(), which returns
+one array per field, with one entry per SPE record.
+arm_spe.py is only needed to print individual packets.
 """
 
 from __future__ import print_function
 
 from pyperf.perf_enum import *
 from pyperf.perf_data import *
-import arm_spe
+import pyperf.perf_events as perf_events
 
 
-def hw_time_to_kernel_time(t):
-    # TBD convert hardware time to kernel time, using TIME_CONV parameters
-    return t
+# Bits in the SPE events packet
+SPE_EVENT_RETIRED = 0x2
+
+# SPE operation type classes
+SPE_OP_CLASS_OTHER = 0
+SPE_OP_CLASS_LDST  = 1
+SPE_OP_CLASS_BRANCH = 2
+
+
+def spe_timeconv(pd):
+    """
+    Get a TimeConv object for the hardware timestamps in a perf.data file,
+    from its PERF_RECORD_TIME_CONV record. Return None if there wasn't one.
+    """
+    if pd.time_conv is None:
+        return None
+    (time_zero, time_mult, time_shift) = pd.time_conv
+    return perf_events.TimeConv(time_zero=time_zero, time_mult=time_mult, time_shift=time_shift)
+
+
+def hw_time_to_kernel_time(t, timeconv=None):
+    """
+    Convert a hardware timestamp to kernel time, using TIME_CONV parameters.
+    Without them, return the hardware timestamp unchanged.
+    """
+    if timeconv is None:
+        return t
+    return timeconv.to_time(t)
 
 
 class SPERecord:
     """
     This record object is derived from an SPE sample record, and behaves like a PerfData record.
+    It is made from the i'th entry in the columns returned by perf_events.decode_spe().
     """
-    def __init__(self, p, pid=None, cpu=None):
+    def __init__(self, cols, i, pid=None, cpu=None):
         self.type = PERF_RECORD_SAMPLE
         self.misc = 0
         self.pid = pid
         self.cpu = cpu
-        self.ip = p.inst_address
-        if p.EL > 0:
+        self.ip = cols["pc"][i]
+        if cols["el"][i] > 0:
             self.misc |= PERF_RECORD_MISC_KERNEL
-        self.addr = p.data_address
-        self.phys_addr = p.phys_address
-        self.weight = p.total_latency() - p.issue_latency()
-        self.t = hw_time_to_kernel_time(p.timestamp)
+        self.addr = cols["vaddr"][i]
+        self.phys_addr = cols["paddr"][i]
+        self.weight = cols["total_lat"][i] - cols["issue_lat"][i]
+        if "time" in cols:
+            self.t = cols["time"][i]
+        else:
+            self.t = cols["timestamp"][i]
         ds = 0
-        if p.op.is_access():
-            if not p.op.is_store():
+        if cols["op_class"][i] == SPE_OP_CLASS_LDST:
+            subclass = cols["op_subclass"][i]
+            source = cols["data_source"][i]
+            if not (subclass & 0x01):
                 ds |= (PERF_MEM_OP_LOAD << PERF_MEM_OP_SHIFT)
-                if p.data_source == 0:
+                if source == 0:
                     ds |= ((PERF_MEM_LVL_HIT|PERF_MEM_LVL_L1) << PERF_MEM_LVL_SHIFT)
-                elif p.data_source == 8:
+                elif source == 8:
                     ds |= ((PERF_MEM_LVL_HIT|PERF_MEM_LVL_L2) << PERF_MEM_LVL_SHIFT)
-                elif p.data_source == 11:
+                elif source == 11:
                     ds |= ((PERF_MEM_LVL_HIT|PERF_MEM_LVL_L3) << PERF_MEM_LVL_SHIFT)
-                elif p.data_source == 13:
+                elif source == 13:
                     ds |= (PERF_MEM_REMOTE_REMOTE << PERF_MEM_REMOTE_SHIFT)
-                elif p.data_source == 14:
+                elif source == 14:
                     ds |= ((PERF_MEM_LVL_HIT|PERF_MEM_LVL_LOC_RAM) << PERF_MEM_LVL_SHIFT)
                 else:
-                    print("UNKNOWN LEVEL: %u" % p.data_source)
+                    print("UNKNOWN LEVEL: %u" % source)
             else:
                 ds |= (PERF_MEM_OP_STORE << PERF_MEM_OP_SHIFT)
-            if p.op.subclass_bit(1):    # atomic, exclusive etc.
-                if p.op.subclass_bit(2) or p.op.subclass_bit(3):
+            if subclass & 0x02:         # atomic, exclusive etc.
+                if subclass & 0x0c:
                     ds |= (PERF_MEM_LOCK_LOCKED << PERF_MEM_LOCK_SHIFT)
         self.data_src = ds
 
 
-def arm_spe_records(r):
+def arm_spe_records(r, timeconv=None):
     """
     From an AUXTRACE record conaining ARM SPE data, yield a series of SPERecords that behave like samples.
+    Hardware timestamps are converted to kernel time if a TimeConv is given (see spe_timeconv()).
     """
     assert r.type == PERF_RECORD_AUXTRACE and r.auxtrace_info_type == PERF_AUXTRACE_ARM_SPE, "expected AUX with ARM SPE data"
-    for p in arm_spe.Decoder().records(bytearray(r.aux_data)):
-        if p.op.is_access() and p.is_retired():
-            yield SPERecord(p, pid=r.pid, cpu=r.cpu)
+    cols = perf_events.decode_spe(r.aux_data, timeconv=timeconv)
+    op_class = cols["op_class"]
+    events = cols["events"]
+    for i in range(len(op_class)):
+        if op_class[i] == SPE_OP_CLASS_LDST and (events[i] & SPE_EVENT_RETIRED):
+            yield SPERecord(cols, i, pid=r.pid, cpu=r.cpu)
 
 
 class AuxTraceHandlerArmSPE(AuxTraceHandler):
+    def __init__(self):
+        AuxTraceHandler.__init__(self)
+        self.time_conv = None     # (time_zero, time_mult, time_shift), as in PerfData.time_conv
+
+    def decode_buffer(self, data, cpu):
+        tc = None
+        if self.time_conv is not None:
+            (time_zero, time_mult, time_shift) = self.time_conv
+            tc = perf_events.TimeConv(time_zero=time_zero, time_mult=time_mult, time_shift=time_shift)
+        return perf_events.decode_spe(data, timeconv=tc)
+
     def handle_auxtrace_info(self, pd, r):
         r.pmu_type = struct.unpack("Q", r.raw[16:24])[0]
         assert pd.pmu_names[r.pmu_type].startswith("arm_spe")
@@ -94,6 +143,7 @@ class AuxTraceHandlerArmSPE(AuxTraceHandler):
         reporter.print_auxinfo_fields(r, fields, 19)
 
     def report_auxtrace(self, r, reporter):
+        import arm_spe
         dec = arm_spe.Decoder()
         if False:
             # Compact: print one SPE sample per line
@@ -14,20 +14,19 @@
 # limitations under the License.
 
 """
-Decode the PERF_RECORD_AUXTRACE_INFO data for CS_ETM
+Decode the PERF_RECORD_AUXTRACE_INFO data for CS_ETM, and the ETE/ETMv4 trace itself.
+
+The trace is decoded by perf_events.decode_etm(), which returns one array per
+field of the trace elements (instruction ranges, exceptions, timestamps etc.).
+To reconstruct instruction ranges it needs the code, from an imagemap.
 """
 
 from __future__ import print_function
 
-import struct, os, sys
+import struct, os, sys, array
 import pyperf.perf_util as utils
 import pyperf.perf_data as perf_data
-
-cs_etm_enabled = False
-if os.path.isdir("./csdecode"):
-    sys.path.append("./csdecode")         # TBD: locate the CoreSight decoder
-    import cs_decode, cs_decode_etm, cs_viewer_raw, cs_viewer_ds5, cs_viewer_profile, imagemap
-    cs_etm_enabled = True
+import pyperf.perf_events as perf_events
 
 MAGIC_ETM3 = 0x3030303030303030
 MAGIC_ETM4 = 0x4040404040404040
@@ -95,6 +94,9 @@ class AuxInfoETMCPU4(AuxInfoETMCPU):
             return True
         return False
 
+    def decode_config(self):
+        return {"trcidr0": self["TRCIDR0"], "trcidr2": self["TRCIDR2"]}
+
     def etm_version_str(self):
         if not self.use_devarch():
             s = "ETMv4.%u" % ((self["TRCIDR1"] & 0x0f0) >> 4)
@@ -120,6 +122,9 @@ class AuxInfoETECPU(AuxInfoETMCPU):
         # TBD: assume ETE is not being collected in a shared trace buffer
         return True
 
+    def decode_config(self):
+        return {"trcidr0": self["TRCIDR0"], "trcidr2": self["TRCIDR2"]}
+
     def etm_version_str(self):
         return "ETEv%.u" % (self["TRCDEVARCH"] & 0xf)
         
@@ -249,12 +254,138 @@ class AuxInfoETM:
             print("  %s" % ci)
 
 
+# Trace element kinds, in the 'kind' array from decode_etm()
+ETM_ELEMENT_RANGE              = 1
+ETM_ELEMENT_TRACE_ON           = 2
+ETM_ELEMENT_EXCEPTION          = 3
+ETM_ELEMENT_EXCEPTION_RETURN   = 4
+ETM_ELEMENT_TIMESTAMP          = 5
+ETM_ELEMENT_CONTEXT            = 6
+ETM_ELEMENT_ADDR_NACC          = 7
+ETM_ELEMENT_OVERFLOW           = 8
+ETM_ELEMENT_DISCARD            = 9
+ETM_ELEMENT_EVENT              = 10
+ETM_ELEMENT_INSTRUCTION_COUNT  = 11
+ETM_ELEMENT_TRACE_INFO         = 12
+
+ETM_ELEMENT_NAMES = {
+    ETM_ELEMENT_RANGE: "RANGE",
+    ETM_ELEMENT_TRACE_ON: "TRACE_ON",
+    ETM_ELEMENT_EXCEPTION: "EXCEPTION",
+    ETM_ELEMENT_EXCEPTION_RETURN: "EXCEPTION_RETURN",
+    ETM_ELEMENT_TIMESTAMP: "TIMESTAMP",
+    ETM_ELEMENT_CONTEXT: "CONTEXT",
+    ETM_ELEMENT_ADDR_NACC: "ADDR_NACC",
+    ETM_ELEMENT_OVERFLOW: "OVERFLOW",
+    ETM_ELEMENT_DISCARD: "DISCARD",
+    ETM_ELEMENT_EVENT: "EVENT",
+    ETM_ELEMENT_INSTRUCTION_COUNT: "INSTRUCTION_COUNT",
+    ETM_ELEMENT_TRACE_INFO: "TRACE_INFO",
+}
+
+# Class of the last instruction in a range, in the 'last' array
+ETM_INSN_NAMES = ["other", "branch", "call", "indirect", "indirect call", "return", "wfx"]
+
+
+def etm_images(images):
+    """
+    Get the code images from an imagemap, as needed by decode_etm().
+    """
+    if images is None or isinstance(images, list):
+        return images
+    return [(im.base_addr, bytes(im.data())) for im in images.images]
+
+
+def _concat_elements(parts):
+    """
+    Join the element arrays decoded from consecutive pieces of a buffer.
+    """
+    if len(parts) == 1:
+        return parts[0]
+    d = {}
+    for k in parts[0]:
+        if isinstance(parts[0][k], int):
+            d[k] = sum([p[k] for p in parts])
+        else:
+            d[k] = memoryview(b"".join([p[k].tobytes() for p in parts])).cast(parts[0][k].format)
+    return d
+
+
+def etm_decode(data, cpu_info=None, images=None, threads=1):
+    """
+    Decode a buffer of ETE/ETMv4 trace from a single trace source (i.e. unformatted,
+    or from etm_deformat()) into a dict of element arrays.
+    The decoder releases the GIL, so with threads > 1, the buffer is split at
+    A-sync packets and the pieces are decoded in parallel.
+    """
+    kwds = {}
+    if cpu_info is not None and cpu_info.etm_version >= 4:
+        kwds = cpu_info.decode_config()
+    ims = etm_images(images)
+    if threads <= 1 or sys.version_info[0] < 3:
+        return perf_events.decode_etm(data, images=ims, **kwds)
+    syncs = perf_events.etm_sync_points(data)
+    if len(syncs) < 2:
+        return perf_events.decode_etm(data, images=ims, **kwds)
+    # Split into roughly equal pieces, each starting at an A-sync
+    step = max(1, len(syncs) // threads)
+    starts = syncs[::step]
+    ends = starts[1:] + [len(data)]
+    mv = memoryview(data)
+    import concurrent.futures
+    with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as pool:
+        parts = list(pool.map(lambda se: perf_events.decode_etm(mv[se[0]:se[1]], images=ims, offset=se[0], **kwds), zip(starts, ends)))
+    # Each piece counted cycles from zero: add the cycles from the pieces before it
+    base = 0
+    for p in parts:
+        if base and len(p["cycles"]):
+            p["cycles"] = memoryview(array.array("Q", [c + base for c in p["cycles"]]))
+        base += p["total_cycles"]
+    return _concat_elements(parts)
+
+
+def etm_check_threads(data, cpu_info=None, images=None, threads=4):
+    """
+    Check that decoding in parallel pieces gives the same elements as a single decode.
+    Return the number of elements.
+    """
+    d1 = etm_decode(data, cpu_info, images=images, threads=1)
+    dn = etm_decode(data, cpu_info, images=images, threads=threads)
+    assert sorted(d1.keys()) == sorted(dn.keys()), "columns differ: %s vs %s" % (sorted(d1.keys()), sorted(dn.keys()))
+    for k in d1:
+        if isinstance(d1[k], int):
+            assert d1[k] == dn[k], "%s: %u with one thread, %u with %u" % (k, d1[k], dn[k], threads)
+        else:
+            assert d1[k].tobytes() == dn[k].tobytes(), "'%s' column differs with %u threads" % (k, threads)
+    return len(d1["kind"])
+
+
+def etm_elements(d):
+    """
+    Iterate over the decoded elements as (kind, addr, end, count, last, taken, timestamp) tuples.
+    """
+    for i in range(len(d["kind"])):
+        yield (d["kind"][i], d["addr"][i], d["end"][i], d["count"][i], d["last"][i], d["taken"][i], d["timestamp"][i])
+
+
 class AuxTraceHandlerCSETM(perf_data.AuxTraceHandler):
+    """
+    Handle CS_ETM AUX data. To reconstruct instruction ranges, set 'images'
+    to an imagemap containing the traced code.
+    """
+    def __init__(self):
+        perf_data.AuxTraceHandler.__init__(self)
+        self.info = None
+        self.images = None
+        self.threads = 1
+
     def handle_auxtrace_info(self, pd, r):
         e = AuxInfoETM(r.raw)
         pd.auxtrace_info_cs_etm = e
+        self.info = e
 
     def report_auxtrace_info(self, r, reporter):
+        e = self.info
         def padtabs(s):
             ntabs = (31 - len(s)) // 8
             return "\t" + s + ("\t"*ntabs) + "       "
@@ -267,20 +398,63 @@ class AuxTraceHandlerCSETM(perf_data.AuxTraceHandler):
             for fname in cpu_info.regnames:
                 print("%s%x" % (padtabs(fname), cpu_info[fname]))
 
+    def __getstate__(self):
+        # For decoding in another process: pass the code images as plain data
+        state = self.__dict__.copy()
+        state["images"] = etm_images(self.images)
+        return state
+
+    def decode_buffer(self, data, cpu):
+        # The elements from all the trace sources in the buffer, with a 'cpu' array added
+        parts = []
+        for (cpu_info, d) in self.decode_data(data, cpu):
+            d["cpu"] = memoryview(array.array("i", [cpu_info.cpu]) * len(d["kind"]))
+            parts.append(d)
+        return _concat_elements(parts) if parts else None
+
+    def decode(self, r):
+        """
+        Decode the trace in an AUXTRACE record: return a list of (CPU info, element arrays),
+        one for each trace source in the buffer.
+        """
+        return self.decode_data(r.aux_data, r.cpu)
+
+    def decode_data(self, aux_data, cpu):
+        if self.info is None:
+            return []
+        cpu_info = self.info.cpu.get(cpu)
+        if cpu_info is None:
+            cpu_info = list(self.info.iter_cpu())[0]
+        if cpu_info.etm_version >= 4 and cpu_info.is_unformatted():
+            return [(cpu_info, etm_decode(aux_data, cpu_info, images=self.images, threads=self.threads))]
+        res = []
+        for (atid, data) in sorted(perf_events.etm_deformat(aux_data).items()):
+            ci = self.info.id_info.get(atid)
+            if ci is None or ci.etm_version < 4:
+                continue
+            res.append((ci, etm_decode(data, ci, images=self.images, threads=self.threads)))
+        return res
+
     def report_auxtrace(self, r, reporter):
-        if not cs_etm_enabled:
-            return
-        decoders = {}
-        viewer = cs_viewer_raw.viewer()
-        cs_decode_etm.default_verbose = 0
-        images = imagemap.imagemap()
-        cs_decode_etm.default_map = images
-        for cpu_info in p.auxtrace_info_cs_etm.iter_cpu():
-            config = cs_decode_etm.etm_config(arch=cs_decode_etm.ARCH_ETM4)
-            for cr in cpu_info.regnames:
-                config.set_etmv4_reg(cr, cpu_info[cr])
-            decoders[cpu_info.atid()] = cs_decode_etm.decode_etm(config, cpu_info.atid(), viewer=viewer)
-        cs_decode.buffer_decode(r.aux_data, decoders)
+        for (cpu_info, d) in self.decode(r):
+            print(".  CPU #%u: %u elements" % (cpu_info.cpu, len(d["kind"])))
+            for (kind, addr, end, count, last, taken, ts) in etm_elements(d):
+                s = ".  %-18s" % ETM_ELEMENT_NAMES.get(kind, str(kind))
+                if kind == ETM_ELEMENT_RANGE:
+                    s += " 0x%x..0x%x %u insns, %s %s" % (addr, end, count, ETM_INSN_NAMES[last], ("taken" if taken else "not taken"))
+                elif kind == ETM_ELEMENT_EXCEPTION:
+                    s += " type=0x%x ret=0x%x" % (count, addr)
+                elif kind == ETM_ELEMENT_TIMESTAMP:
+                    s += " %u" % ts
+                elif kind in [ETM_ELEMENT_ADDR_NACC, ETM_ELEMENT_INSTRUCTION_COUNT]:
+                    s += " 0x%x" % addr
+                    if kind == ETM_ELEMENT_INSTRUCTION_COUNT:
+                        s += " %u insns" % count
+                elif kind == ETM_ELEMENT_EVENT:
+                    s += " 0x%x" % count
+                print(s)
+            if d["unknown_packets"] or d["lost_atoms"]:
+                print(".  %u unknown packets, %u atoms not decoded" % (d["unknown_packets"], d["lost_atoms"]))
 
 
 perf_data.register_auxtrace_handler(perf_data.PERF_AUXTRACE_CS_ETM, AuxTraceHandlerCSETM())
@@ -291,8 +465,25 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Manage ETM metadata in perf.data files")
     parser.add_argument("-v", "--verbose", action="count", help="increase verbosity level")
     parser.add_argument("-i", "--input", type=str, help="input perf.data file")
+    parser.add_argument("--check-threads", type=int, help="check that decoding the trace with this many threads matches one thread")
     opts = parser.parse_args()
-    if opts.input:
+    if opts.input and opts.check_threads:
+        pd = perf_data.PerfData(opts.input)
+        h = AuxTraceHandlerCSETM()
+        for r in pd.records():
+            if r.type == perf_data.PERF_RECORD_AUXTRACE_INFO:
+                h.handle_auxtrace_info(pd, r)
+            elif r.type == perf_data.PERF_RECORD_AUXTRACE and h.info is not None:
+                cpu_info = h.info.cpu.get(r.cpu) or list(h.info.iter_cpu())[0]
+                if cpu_info.etm_version >= 4 and cpu_info.is_unformatted():
+                    sources = [(cpu_info, r.aux_data)]
+                else:
+                    sources = [(h.info.id_info.get(atid), data) for (atid, data) in sorted(perf_events.etm_deformat(r.aux_data).items())]
+                for (ci, data) in sources:
+                    if ci is not None and ci.etm_version >= 4:
+                        n = etm_check_threads(data, ci, threads=opts.check_threads)
+                        print("CPU #%u: %u elements match" % (ci.cpu, n))
+    elif opts.input:
         import perf_data, hexdump
         pd = perf_data.PerfData(opts.input)
         for r in pd.records():
@@ -0,0 +1,213 @@
+#!/usr/bin/python
+
+# Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+# SPDX-License-Identifier : Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Decode the AUX buffers in a perf.data file in parallel, in a pool of processes.
+
+When reading records, AUX data is decoded on the reader thread, one
+AUXTRACE buffer at a time. For a capture from many CPUs that can take
+a long time. Instead, we make an index of the buffers - where the data
+is in the file, its size, CPU and time - and hand the buffers out to
+worker processes. Each worker maps the file, so the data is shared
+through the page cache rather than copied, and decodes its buffers with
+the registered AuxTraceHandler's decode_buffer() method. The results
+(dicts of arrays, as from perf_events.decode_spe() or decode_etm()) come
+back in buffer time order, and can be merged into a single time-ordered
+stream of rows. Only a window of buffers is in flight at once, so the
+results needn't all fit in memory.
+"""
+
+from __future__ import print_function
+
+import sys, os, mmap, heapq, collections
+
+from pyperf.perf_enum import *
+import pyperf.perf_data as perf_data
+
+
+class AuxBuffer:
+    """
+    Index entry for one AUX buffer, i.e. the data following a PERF_RECORD_AUXTRACE record.
+    """
+    def __init__(self, data_offset, size, cpu, idx, tid, time):
+        self.data_offset = data_offset  # offset of the AUX data in the file
+        self.size = size
+        self.cpu = cpu                  # or -1 for a per-thread event
+        self.idx = idx                  # index of the event (AUX buffer) in perf record's list
+        self.tid = tid
+        self.time = time                # time of the first PERF_RECORD_AUX for this buffer, or None
+
+    def __str__(self):
+        return "AUX @0x%x size=0x%x cpu=%d idx=%u tid=%d time=%s" % (self.data_offset, self.size, self.cpu, self.idx, self.tid, self.time)
+
+
+def auxtrace_index(pd):
+    """
+    Index the AUX buffers in an opened PerfData. This reads the records (but not
+    the AUX data) once, which also gets the metadata the AUX handler needs, e.g.
+    from PERF_RECORD_AUXTRACE_INFO and PERF_RECORD_TIME_CONV.
+    The buffer times come from the PERF_RECORD_AUX records that point into each
+    buffer, so we can't just use the HEADER_AUXTRACE index (auxtrace_buffers_raw()).
+    """
+    assert pd.fn is not None, "need a perf.data file, not a stream"
+    # For a pipe-mode file read without mapping, record offsets don't include the 16-byte header
+    base = 16 if (pd.is_pipe_mode and pd.view is None) else 0
+    bufs = []
+    for r in pd.raw_records(unpack=False, time=True, data=False):
+        if r.type == perf_data.PERF_RECORD_AUXTRACE:
+            times = [ar.t for ar in r.aux_records if getattr(ar, "t", None) is not None]
+            bufs.append(AuxBuffer(base + r.auxtrace_file_offset, r.auxtrace_size, r.cpu, r.idx, r.tid, (min(times) if times else None)))
+    if bufs and pd.has_header(perf_data.HEADER_AUXTRACE):
+        assert len(bufs) == len(list(pd.auxtrace_buffers_raw())), "%s: AUXTRACE index doesn't match records" % pd.fn
+    return bufs
+
+
+def _buffer_order(b):
+    return (b.time if b.time is not None else 0, b.data_offset)
+
+
+# State in the worker processes
+_worker_view = None
+_worker_handler = None
+
+def _worker_init(fn, handler):
+    global _worker_view, _worker_handler
+    f = open(fn, "rb")
+    mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    f.close()
+    _worker_view = memoryview(mm)
+    _worker_handler = handler
+
+
+def _pack_result(d):
+    # memoryviews can't be pickled: send the bytes and format
+    if d is None:
+        return None
+    return dict([(k, ((v.format, v.tobytes()) if isinstance(v, memoryview) else v)) for (k, v) in d.items()])
+
+
+def _unpack_result(d):
+    if d is None:
+        return None
+    return dict([(k, (memoryview(v[1]).cast(v[0]) if isinstance(v, tuple) else v)) for (k, v) in d.items()])
+
+
+def _worker_decode(task):
+    (offset, size, cpu) = task
+    return _pack_result(_worker_handler.decode_buffer(_worker_view[offset:offset+size], cpu))
+
+
+class AuxDecoder:
+    """
+    Decode all the AUX buffers in a perf.data file, using a pool of worker processes.
+    Indexing reads the file's records, so pd should be a newly opened PerfData.
+    The handler is the one registered for the file's AUX type, unless given.
+    It's pickled to the workers after the file's metadata has been read,
+    so it should be set up (e.g. with code images) before calling decode().
+    """
+    def __init__(self, pd, workers=None, handler=None, window=None):
+        self.pd = pd
+        self.workers = workers if workers is not None else (os.cpu_count() if hasattr(os, "cpu_count") else 1)
+        self.window = window if window is not None else 2 * max(self.workers, 1)
+        self.buffers = sorted(auxtrace_index(pd), key=_buffer_order)
+        if handler is None and pd.auxtrace_info_type is not None:
+            handler = perf_data.auxtrace_handlers.get(pd.auxtrace_info_type)
+        self.handler = handler
+        if hasattr(handler, "time_conv") and pd.time_conv is not None:
+            handler.time_conv = pd.time_conv
+
+    def decode(self):
+        """
+        Yield (AuxBuffer, result) for each buffer, in buffer time order.
+        Buffers are decoded in parallel, up to 'window' buffers ahead of the one being yielded.
+        """
+        if self.handler is None or not self.buffers:
+            return
+        tasks = [(b.data_offset, b.size, b.cpu) for b in self.buffers]
+        if self.workers <= 1 or sys.version_info[0] < 3:
+            _worker_init(self.pd.fn, self.handler)
+            for (b, t) in zip(self.buffers, tasks):
+                yield (b, _unpack_result(_worker_decode(t)))
+            return
+        import multiprocessing
+        pool = multiprocessing.Pool(self.workers, initializer=_worker_init, initargs=(self.pd.fn, self.handler))
+        try:
+            todo = iter(zip(self.buffers, tasks))
+            in_flight = collections.deque()
+            for (b, t) in todo:
+                in_flight.append((b, pool.apply_async(_worker_decode, (t,))))
+                if len(in_flight) >= self.window:
+                    break
+            while in_flight:
+                (b, res) = in_flight.popleft()
+                for (nb, t) in todo:
+                    in_flight.append((nb, pool.apply_async(_worker_decode, (t,))))
+                    break
+                yield (b, _unpack_result(res.get()))
+        finally:
+            pool.terminate()
+            pool.join()
+
+    def rows(self, key=None):
+        """
+        Merge the decoded rows from all buffers into time order. Yield (time, buffer, result, index).
+        The time is taken from the 'time' array if the results have one, else 'timestamp'.
+        Each buffer's rows are assumed to be in time order already, as are the
+        successive buffers of each AUX area, so we merge one stream per AUX area.
+        Results are pulled from decode() only as the merge needs them; those for
+        other AUX areas wait in a queue until their stream catches up.
+        """
+        results = enumerate(self.decode())
+        waiting = dict([(b.idx, collections.deque()) for b in self.buffers])
+        def area_rows(idx):
+            q = waiting[idx]
+            while True:
+                while not q:
+                    for (n, (b, d)) in results:
+                        waiting[b.idx].append((n, b, d))
+                        if b.idx == idx:
+                            break
+                    else:
+                        return
+                (n, b, d) = q.popleft()
+                if d is None:
+                    continue
+                t = d[key or ("time" if "time" in d else "timestamp")]
+                for i in range(len(t)):
+                    yield (t[i], n, i, b, d)
+        for (t, n, i, b, d) in heapq.merge(*[area_rows(idx) for idx in sorted(waiting)]):
+            yield (t, b, d, i)
+
+
+if __name__ == "__main__":
+    import argparse, time
+    import pyperf.perf_aux_arm_spe, pyperf.perf_aux_cs_etm
+    parser = argparse.ArgumentParser(description="decode AUX buffers in a perf.data file in parallel")
+    parser.add_argument("-i", "--input", type=str, default="perf.data", help="input perf.data file")
+    parser.add_argument("-j", "--workers", type=int, help="number of worker processes")
+    parser.add_argument("-v", "--verbose", action="count", default=0, help="increase verbosity level")
+    opts = parser.parse_args()
+    pd = perf_data.PerfData(opts.input)
+    t0 = time.time()
+    dec = AuxDecoder(pd, workers=opts.workers)
+    n_rows = 0
+    for (b, d) in dec.decode():
+        n = len(d["pc" if "pc" in d else "kind"]) if d is not None else 0
+        if opts.verbose:
+            print("%s: %u rows" % (b, n))
+        n_rows += n
+    print("%u buffers, %u rows, %.2fs with %u workers" % (len(dec.buffers), n_rows, time.time()-t0, dec.workers))
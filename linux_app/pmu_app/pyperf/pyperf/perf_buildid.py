@@ -155,6 +155,14 @@ class BuildIDCacheRO(object):
     def id_dir(self, id):
         return os.path.join(self.idx, id.index0(), id.index1())
 
+    def id_index_file(self, id):
+        """
+        Return the name of the symbol/line index file for an id (see imagemap.SymbolIndex).
+        Indexes are kept in their own tree, keyed by id like .build-id, rather than
+        alongside the cached ELF file, so the cache layout stays as perf expects.
+        """
+        return os.path.join(self.dir, ".pyperf-index", id.index0(), id.index1())
+
     def id_files(self, id):
         """
         Return the list of unqualified filenames cached for an id. Often ["elf"].
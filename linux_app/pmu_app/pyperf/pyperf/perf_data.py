@@ -33,8 +33,13 @@ import pyperf.perf_buildid as perf_buildid
 
 from pyperf.hexdump import print_hex_dump
 import pyperf.datamap as datamap
+import pyperf.addrspace as addrspace
 
-import os, sys, struct, time, copy, platform
+import os, sys, struct, time, copy, platform, mmap, heapq, threading
+try:
+    import queue
+except ImportError:
+    import Queue as queue
 
 
 PERF_MAGIC = struct.unpack("Q", b"PERFILE2")[0]
@@ -98,8 +103,9 @@ PERF_RECORD_EVENT_UPDATE        = 78
 PERF_RECORD_TIME_CONV           = 79
 PERF_RECORD_HEADER_FEATURE      = 80    # subheaders when streaming
 PERF_RECORD_COMPRESSED          = 81
+PERF_RECORD_FINISHED_INIT       = 82    # end of the synthesized records before the data
 
-PERF_RECORD_MAX                 = 82
+PERF_RECORD_MAX                 = 83
 
 
 # Compression types
@@ -129,6 +135,11 @@ class AuxTraceHandler:
     def report_auxtrace(self, rec, reporter):
         pass
 
+    def decode_buffer(self, data, cpu):
+        # Decode the data from one AUX buffer, returning a dict of memoryview arrays
+        # (see perf_aux_decode.py). The handler may be pickled to run this in another process.
+        return None
+
 
 auxtrace_handlers = {}    # indexed by PERF_AUXTRACE...
 
@@ -351,7 +362,7 @@ class PerfDataRecord(PerfRecord):
             return b""
         for r in self.file.auxtrace_buffers(idx=self.idx):
             if self.aux_offset >= r.auxtrace_offset and (self.aux_offset+self.aux_size) <= (r.auxtrace_offset+r.auxtrace_size):
-                self.aux_data = self.file.readat(r.auxtrace_file_offset+(self.aux_offset-r.auxtrace_offset), self.aux_size)
+                self.aux_data = self.file.viewat(r.auxtrace_file_offset+(self.aux_offset-r.auxtrace_offset), self.aux_size)
                 return self.aux_data
         assert False, "can't find AUXTRACE buffer for AUX: %s" % self
 
@@ -371,6 +382,53 @@ class PerfDataRecord(PerfRecord):
             yield (ar, data)
 
 
+class _Raised:
+    def __init__(self, e):
+        self.e = e
+
+_END = object()
+
+def _read_ahead(items, process, depth=64):
+    """
+    Iterate over (item, process(item)), running the iterator and the processing
+    on a background thread, up to 'depth' items ahead of the consumer.
+    """
+    q = queue.Queue(depth)
+    stop = threading.Event()
+    def put(x):
+        while not stop.is_set():
+            try:
+                q.put(x, timeout=0.1)
+                return True
+            except queue.Full:
+                pass
+        return False
+    def produce():
+        try:
+            for x in items:
+                # Once the consumer has gone, don't process any more
+                if stop.is_set() or not put((x, process(x))):
+                    return
+        except Exception as e:
+            put(_Raised(e))
+            return
+        put(_END)
+    t = threading.Thread(target=produce)
+    t.daemon = True
+    t.start()
+    try:
+        while True:
+            x = q.get()
+            if x is _END:
+                break
+            if isinstance(x, _Raised):
+                raise x.e
+            yield x
+    finally:
+        # If the consumer stops early, let the thread finish
+        stop.set()
+
+
 class PerfData:
     """
     A PerfData object represents the contents of a perf.data file.
@@ -382,10 +440,28 @@ class PerfData:
       - sub-headers describing the data and environment
     The format supports reading the data as a stream, e.g. "perf record | perf report".
     So the data is not dependent on the headers.
+
+    With use_mmap=True, the file is mapped into memory rather than read.
+    Records of kernel types, and the AUX data following PERF_RECORD_AUXTRACE,
+    are then memoryview slices of the file rather than copies, so reading
+    large SPE or ETE captures is limited by decoding, not by file I/O.
+    The views are valid until the PerfData is closed.
+
+    Compressed files ("perf record -z") are decompressed as they are read.
+    With decompress_ahead=True and use_mmap=True, reading and decompression run
+    on a background thread, ahead of the caller; libzstd doesn't hold the GIL,
+    so this overlaps decompression with whatever the caller does with the records.
+    Without the mapping, the thread would share the file position with readat(),
+    so decompression stays on the caller's thread.
     """
-    def __init__(self, fn=None, fd=None, debug=False, buildid_cache=""):
+    def __init__(self, fn=None, fd=None, debug=False, buildid_cache="", use_mmap=False, decompress_ahead=False):
         self.file_is_valid = False
         self.fn = fn
+        self.use_mmap = use_mmap and sys.version_info[0] >= 3
+        self.decompress_ahead = decompress_ahead
+        self.compression_mmap_len = None
+        self.mm = None           # mapping of the whole file, if use_mmap
+        self.view = None         # memoryview of the mapping
         self.perf_data_version = None
         self.set_buildid_cache(buildid_cache)
         self.f = fd
@@ -406,6 +482,7 @@ class PerfData:
         self.kcore_dir = None
         self.auxtrace_info_type = None
         self.auxtrace_buffer_cache = None
+        self.time_conv = None    # (time_zero, time_mult, time_shift) from PERF_RECORD_TIME_CONV
         # Map the section descriptors. This doesn't read the actual descriptors.
         self.section_attr = PerfFileSection(self, 24)       # Section containing some number of perf_event_attr's
         self.section_data = PerfFileSection(self, 40)
@@ -431,6 +508,9 @@ class PerfData:
             self.f = open(fn, "rb")
             self.is_pipe_mode = False
             self.file_size = os.path.getsize(fn)
+            if self.use_mmap and self.file_size > 0:
+                self.mm = mmap.mmap(self.f.fileno(), 0, access=mmap.ACCESS_READ)
+                self.view = memoryview(self.mm)
             self.datatop = self.datamap.add(0, self.file_size, fn)
         self.fn = fn
         self.is_writing = False
@@ -447,6 +527,7 @@ class PerfData:
         # and other information is communicated via records.
         if hsize == 16:
             self.file_is_valid = True    # valid because it's legitimate in pipe reading mode
+            self.is_pipe_mode = True     # e.g. a file saved from 'perf record -o -', or by a Collector
             return
         h = h + self.f.read(hsize-16)
         self.datamap.add(0, hsize, "header")
@@ -604,6 +685,15 @@ class PerfData:
     def close(self):
         if self.f is None:
             return
+        if self.mm is not None:
+            self.view.release()
+            self.view = None
+            try:
+                self.mm.close()
+            except BufferError:
+                # Records are still referring to the mapping: it will be unmapped when they go
+                pass
+            self.mm = None
         if self.is_writing:
             offset = self.f.tell()
             if not self.is_pipe_mode:
@@ -957,6 +1047,7 @@ class PerfData:
             (cver, ctype, clevel, cratio, mmap_size) = struct.unpack("IIIII", hdata)
             self.compression_type = ctype
             self.compression_ratio = cratio
+            self.compression_mmap_len = mmap_size
         else:
             pass
 
@@ -990,6 +1081,16 @@ class PerfData:
             self.seek(opos, restoring=True)
         return data
 
+    def viewat(self, offset, size):
+        """
+        Get data at a given position, as a view of the mapped file if we have
+        one, or else as a copy. Use this for bulk data, like AUX buffers.
+        """
+        if self.view is not None:
+            assert offset + size <= len(self.view), "%s: at offset 0x%x, tried to get %u bytes beyond end of file" % (self.fn, offset, size)
+            return self.view[offset:offset+size]
+        return self.readat(offset, size)
+
     def writeat(self, offset, data):
         """
         Write data at a given position
@@ -1039,9 +1140,9 @@ class PerfData:
     def get_record_data(self, r):
         if r.raw is None:
             assert r.file_offset is not None, "can't read deferred data, offset not known"
-            r.raw = self.readat(r.file_offset, r.size)
+            r.raw = self.viewat(r.file_offset, r.size)
         if r.type == PERF_RECORD_AUXTRACE and r.aux_data is None:
-            r.aux_data = self.readat(r.auxtrace_file_offset, r.auxtrace_size)
+            r.aux_data = self.viewat(r.auxtrace_file_offset, r.auxtrace_size)
         return r
 
     def unpack_record(self, r):
@@ -1084,6 +1185,17 @@ class PerfData:
         """
         Read a single perf record, given an offset (possibly the current position).
         """
+        if self.view is not None:
+            # The file is mapped: take a view of the record, no seek or read needed
+            if eoff + 8 > len(self.view):
+                return None
+            (type, misc, size) = struct.unpack_from("IHH", self.view, eoff)
+            assert size >= 8, "%s: invalid perf record at file offset 0x%x (type=0x%x, size=%d)" % (self.fn, eoff, type, size)
+            e = self.view[eoff:eoff+size]
+            if type >= FIRST_SYNTHETIC_PERF_RECORD and type != PERF_RECORD_AUXTRACE:
+                # Metadata records are small and are parsed as strings, so copy them
+                e = e.tobytes()
+            return self.make_record(e, eoff)
         if not self.is_pipe_mode:
             self.seek(eoff)
         # read the 8-byte header, which gives us the size of the whole record
@@ -1099,6 +1211,12 @@ class PerfData:
             e = h + self.read(size-8)
         except IOError:
             print("** %s: could not read %u-byte payload for record type %u at 0x%x" % (self.fn, size-8, type, eoff))
+        return self.make_record(e, eoff)
+
+    def make_record(self, e, eoff):
+        """
+        Make a record object from the raw record data read from a given offset.
+        """
         r = PerfDataRecord(e, file=self, file_offset=eoff)
         if r.type == PERF_RECORD_AUXTRACE:
             r.auxtrace_file_offset = eoff + r.size
@@ -1123,12 +1241,56 @@ class PerfData:
         The only processing and conditioning we do here:
           - get (or skip over) the raw data buffer following PERF_RECORD_AUXTRACE
           - expand PERF_RECORD_COMPRESSED
+        With decompress_ahead, a mapped file is read and decompressed on a background thread.
+        """
+        # "perf record -z" uses one zstd stream for the session, so each pass over
+        # the file needs a new stream context, kept from one compressed record to the next.
+        # It's local to this pass, so a read-ahead thread left over from an
+        # abandoned pass can't advance the stream of a new one.
+        zstd = {}
+        def decompress(r):
+            return self._decompress_record(r, zstd)
+        recs = self._file_records(data)
+        if self.decompress_ahead and self.view is not None:
+            # The mapping has no file position, so the caller can still use readat()
+            recs = _read_ahead(recs, decompress)
+        else:
+            recs = ((r, decompress(r)) for r in recs)
+        for (r, ucd) in recs:
+            if ucd is None:
+                yield r
+            else:
+                for e in zstd["splitter"].split(ucd):
+                    yield self.make_record(e, None)
+        if "splitter" in zstd and not zstd["splitter"].is_empty():
+            print("** %s: incomplete record at end of compressed data" % (self.fn), file=sys.stderr)
+
+    def _decompress_record(self, r, zstd):
+        """
+        Decompress the data in a PERF_RECORD_COMPRESSED record, continuing the pass's zstd stream,
+        which is created in 'zstd' (a dict) on first use. Return None for other records.
+        """
+        if r.type != PERF_RECORD_COMPRESSED:
+            return None
+        if "decompressor" not in zstd:
+            import pyperf.perf_zstd as perf_zstd
+            zstd["decompressor"] = perf_zstd.Decompressor(out_size=(self.compression_mmap_len or 0x10000))
+            zstd["splitter"] = perf_zstd.RecordSplitter()
+        return zstd["decompressor"].decompress(r.raw[8:])
+
+    def _file_records(self, data):
+        """
+        Iterate over the records as they are in the file, i.e. without expanding PERF_RECORD_COMPRESSED.
         """
         assert self.file_is_valid, "%s: attempt to read records from invalid file" % (self.fn)
         if not self.is_pipe_mode:
             eoff = self.section_data.offset
             self.data_end = self.section_data.offset + self.section_data.size
             self.seek(eoff)
+        elif self.view is not None:
+            # A file saved via a pipe, which we've mapped: the records follow the 16-byte header
+            eoff = 16
+            self.data_end = len(self.view)
         else:
             # Reading from stdin - non-seekable. Or possibly reading from a file saved via a pipe.
             #if self.f != sys.stdin:
@@ -1145,50 +1307,14 @@ class PerfData:
             eoff += r.size
             # if the record has AUX data immediately following, read it now to avoid getting confused about the offset
             if r.type == PERF_RECORD_AUXTRACE:
-                if data or self.is_pipe_mode:
+                if self.view is not None:
+                    r.aux_data = self.viewat(eoff, r.auxtrace_size)     # no copy, so we might as well
+                elif data or self.is_pipe_mode:
                     r.aux_data = self.f.read(r.auxtrace_size)
                 else:
                     r.aux_data = None
                     self.seek(eoff + r.auxtrace_size)   # Not reading it this time, so step past it
                 eoff += r.auxtrace_size
-            elif r.type == PERF_RECORD_COMPRESSED:
-                # TBD this section is work-in-progress
-                # We use our perf_zstd module. zstandard/zstd don't seem to work.
-                zstd_magic = struct.unpack("I",r.raw[8:12])[0]
-                assert zstd_magic == 0xFD2FB528, "%s: bad Zstd magic: 0x%X" % (self.fn, zstd_magic)
-                import pyperf.perf_zstd as perf_zstd
-                ucd = perf_zstd.decompress(r.raw[8:], ratio=8)
-                print_hex_dump(ucd)
-                print("decompressed %u bytes to %u bytes" % (len(r.raw)-8, len(ucd)))
-                while len(ucd) > 0:
-                    (type, misc, size) = struct.unpack("IHH", ucd[:8])
-                    e = ucd[:size]
-                    print("uncompressed: %u %u %u" % (type, misc, size))
-                    r = PerfDataRecord(e, file=self)
-                    #print(r)
-                    yield r
-                    ucd = ucd[size:]
-                continue
-                # Old abandoned ways
-                try:
-                    import zstandard
-                except:
-                    print("** %s: compressed file needs 'zstandard' module to uncompress" % (self.fn), file=sys.stderr)
-                if False:
-                    ddd = zstd.ZSTD_compress("ABCD",1,4)
-                    print_hex_dump(ddd)
-                    eee = zstd.ZSTD_uncompress(ddd)
-                    print_hex_dump(eee)
-                if True:
-                    print("Compressed data:")
-                    print_hex_dump(r.raw[:32])
-                    fp = zstandard.get_frame_parameters(r.raw[8:])
-                    print("  content size: 0x%x" % (fp.content_size))
-                    print("  window size:  0x%x" % (fp.window_size))
-                max_size = (self.compression_ratio + 1) * len(r.raw)
-                print("trying %u bytes -> %u bytes" % (len(r.raw), max_size))
-                ucd = zstandard.ZstdDecompressor().decompress(r.raw[8:], max_output_size=max_size)
-                print_hex_dump(ucd)
             yield r
 
     def raw_records(self, event=False, unpack=False, time=False, data=True):
@@ -1199,6 +1325,7 @@ class PerfData:
         in pipe mode when we don't have a proper header.
         """
         pending_aux = {}     # indexed by event ID: AUX records waiting for AUXTRACE
+        itrace_tid = None    # from the last PERF_RECORD_ITRACE_START
         for r in self.raw0_records(data=data):
             if r.type == PERF_RECORD_HEADER_FEATURE:
                 # pipe mode: this supplies a sub-header
@@ -1240,6 +1367,10 @@ class PerfData:
                 r.pmu_type = None
                 if r.auxtrace_info_type in auxtrace_handlers:
                     auxtrace_handlers[r.auxtrace_info_type].handle_auxtrace_info(self,r)
+            elif r.type == PERF_RECORD_TIME_CONV:
+                # Synthesized by perf: parameters to convert hardware timestamps (e.g. in AUX data) to perf time.
+                (time_shift, time_mult, time_zero) = struct.unpack("QQQ", r.raw[8:32])
+                self.time_conv = (time_zero, time_mult, time_shift)
             elif r.type == PERF_RECORD_AUX:
                 # Generated by kernel to indicate that data is available in the AUX buffer.
                 r.auxtrace_info_type = self.auxtrace_info_type   # TBD should check in case we have multiple AUX events
@@ -1318,13 +1449,7 @@ class PerfData:
         instead, we get the time and not much else, then unpack after sorting.
         """
         if sorted_time:
-            def rectime(r):
-                t = r.t
-                if t is None:
-                    return 0
-                return t
-            sorted_recs = sorted(list(self.raw_records(unpack=False, time=True, data=False)), key=rectime)
-            for r in sorted_recs:
+            for r in self.time_ordered(self.raw_records(unpack=False, time=True, data=False)):
                 self.get_record_data(r)
                 if unpack:
                     self.unpack_record(r)
@@ -1333,6 +1458,39 @@ class PerfData:
             for r in self.raw_records(event=True, time=time, unpack=unpack):
                 yield r
 
+    def time_ordered(self, recs):
+        """
+        Merge records into time order, without holding the whole file in memory.
+
+        perf writes the data in rounds, from each CPU's buffer in turn, and
+        marks the end of each round with PERF_RECORD_FINISHED_ROUND. The buffers
+        are each in time order, and when a round has been written, no later
+        round can have records older than the newest record in the round before
+        it. So, as perf does, at the end of each round we can yield the queued
+        records up to the newest time seen at the end of the previous round.
+        Records with no time (mostly metadata) are yielded as they are seen.
+        If the file has no rounds, this amounts to sorting the whole file.
+        """
+        queue = []             # heap of (time, sequence, record)
+        seq = 0                # keep records with equal times in file order
+        max_time = 0           # newest time seen so far
+        flush_time = None      # newest time seen at the end of the previous round
+        for r in recs:
+            if r.type == PERF_RECORD_FINISHED_ROUND or r.type == PERF_RECORD_FINISHED_INIT:
+                while queue and flush_time is not None and queue[0][0] <= flush_time:
+                    yield heapq.heappop(queue)[2]
+                flush_time = max_time
+                yield r
+            elif r.t is None:
+                yield r
+            else:
+                heapq.heappush(queue, (r.t, seq, r))
+                seq += 1
+                if r.t > max_time:
+                    max_time = r.t
+        while queue:
+            yield heapq.heappop(queue)[2]
+
     def reader(self):
         return PerfDataReader(self)
 
@@ -1386,11 +1544,14 @@ class ThreadInfo:
             return "[tid=%d]" % (self.tid)
 
 
-def proc_map(m):
+def proc_map(m, lo=None, hi=None):
     """
     Generate a /proc/n/maps style line for a PERF_RECORD_MMAP or PERF_RECORD_MMAP2.
+    If the mapping has been partly replaced, lo and hi give the part still mapped.
     """
-    s = "%016x-%016x " % (m.addr, m.addr+m.len)
+    if lo is None:
+        (lo, hi) = (m.addr, m.addr+m.len)
+    s = "%016x-%016x " % (lo, hi)
     s += "-r"[(m.prot & 0x01) != 0]
     s += "-w"[(m.prot & 0x02) != 0]
     s += "-x"[(m.prot & 0x04) != 0]
@@ -1399,7 +1560,7 @@ def proc_map(m):
         s += "-sp?"[((m.flags & 0x01) != 0) + 2*((m.flags & 0x02) != 0)]
     else:       
         s += "?"
-    s += " %08x" % m.pgoff
+    s += " %08x" % (m.pgoff + (lo - m.addr))
     if m.maj is not None:
         s += " %02x:%02x  " % (m.maj, m.min)
     s += m.filename
@@ -1408,25 +1569,37 @@ def proc_map(m):
 
 class ProcessInfo:
     """
-    Track information for a process (address space) at a point in time.
+    Track information for a process (address space).
+    The mappings are kept over time, so addresses can be looked up
+    either at the current time or at the time of some earlier event.
     """
     def __init__(self, pid):
         self.pid = pid     # -1 for kernel etc.
-        self.maps = []     # a list of MMAP/MMAP2 event records
+        self.space = addrspace.AddressSpace()   # MMAP/MMAP2 event records, over time
         self.threads = {}  # threads, indexed by tid
+        self.exited = set()     # tids of threads that have exited
+
+    @property
+    def maps(self):
+        # The current mappings, as a list of MMAP/MMAP2 event records
+        return [m for (lo, hi, m) in self.space.live()]
+
+    def add_map(self, m):
+        self.space.add(m.addr, m.addr + m.len, m, time=getattr(m, "t", None))
 
     def proc_maps(self):
         # Return something looking like /proc/.../maps
         s = ""
-        for m in self.maps:
-            s += proc_map(m) + "\n"
+        for (lo, hi, m) in self.space.live():
+            s += proc_map(m, lo, hi) + "\n"
         return s
 
-    def find_addr(self, addr):
-        for m in self.maps:
-            if addr >= m.addr and addr < (m.addr + m.len):
-                return m
-        return None
+    def find_addr(self, addr, time=None):
+        """
+        Return the MMAP/MMAP2 record for the mapping at an address, at a given
+        time (or now), or None.
+        """
+        return self.space.find(addr, time)
 
     def __str__(self):
         s = "[pid=%d]" % self.pid
@@ -1467,27 +1640,28 @@ class PerfDataReader:
             return t.process
         return None
 
-    def lookup_addr(self, pid, addr):
-        # Return a PERF_RECORD_MMAP PerfRecord, or None
+    def lookup_addr(self, pid, addr, time=None):
+        # Return a PERF_RECORD_MMAP PerfRecord, or None.
+        # If a time is given, return the mapping at that time, rather than the current one.
         p = self.find_proc(pid)
         if p is not None:
-            mr = p.find_addr(addr)
+            mr = p.find_addr(addr, time)
             if mr is not None:
                 return mr
         # Now look again in all-process maps (e.g. VDSO)
-        return self.procs[-1].find_addr(addr)
+        return self.procs[-1].find_addr(addr, time)
 
-    def lookup_addr_all(self, addr):
+    def lookup_addr_all(self, addr, time=None):
         """
-        Look up the address in all current mappings.
+        Look up the address in all current mappings (or all mappings at a given time).
         """
-        mr = self.lookup_addr(-1, addr)
+        mr = self.lookup_addr(-1, addr, time)
         if mr is not None:
             yield (-1, mr)
         else:
             for p in self.procs.values():
                 if p.pid != -1:
-                    m = p.find_addr(addr)
+                    m = p.find_addr(addr, time)
                     if m is not None:
                         yield (p.pid, m) 
 
@@ -1522,8 +1696,12 @@ class PerfDataReader:
                 if not unpack:
                     r.unpack()
                 t = self.get_thread(r.tid)
-                t.set_process(self.get_proc(r.pid))
+                p = self.get_proc(r.pid)
+                t.set_process(p)
                 t.thread_name = r.thread_name
+                if r.misc & PERF_RECORD_MISC_COMM_EXEC:
+                    # exec() replaces the address space
+                    p.space.clear(time=getattr(r, "t", None))
             elif r.type == PERF_RECORD_FORK:
                 # We always create a new thread. We might also create a new process.
                 if not unpack:
@@ -1532,8 +1710,8 @@ class PerfDataReader:
                     # Created new process (with its own main thread)
                     assert r.tid == r.pid, "expected new process to have TID=PID"
                     p = self.get_proc(r.pid)
-                    if r.ppid in self.procs:
-                        p.maps = copy.copy(self.procs[r.ppid].maps)
+                    if r.ppid in self.procs and not len(p.space):
+                        p.space = self.procs[r.ppid].space.fork(time=getattr(r, "t", None))
                 else:
                     # Created new thread in same process
                     p = self.get_proc(r.pid)
@@ -1545,10 +1723,19 @@ class PerfDataReader:
             elif r.type == PERF_RECORD_MMAP or r.type == PERF_RECORD_MMAP2:
                 # Already unpacked
                 p = self.get_proc(r.pid)
-                p.maps.append(r)
+                p.add_map(r)
             elif r.type == PERF_RECORD_EXIT:
-                # Should we delete knowledge of the exiting thread? 
-                pass
+                # Should we delete knowledge of the exiting thread?
+                # When the process exits, its mappings end, but they can still be
+                # looked up at times before the exit. Another thread's exit doesn't
+                # end the process, and the main thread can exit before the others.
+                if not unpack:
+                    r.unpack()
+                p = self.procs.get(r.pid)
+                if p is not None:
+                    p.exited.add(r.tid)
+                    if r.pid in p.exited and all([tid in p.exited for tid in p.threads]):
+                        p.space.clear(time=getattr(r, "t", None))
 
 
 if __name__ == "__main__":
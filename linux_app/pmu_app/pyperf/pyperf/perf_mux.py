@@ -0,0 +1,303 @@
+#!/usr/bin/python
+
+# Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+# SPDX-License-Identifier : Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Count more events than there are hardware counters, by multiplexing
+them from userspace.
+
+If we open more events than the PMU has counters, the kernel rotates
+them on its own timer and we have to scale each count by
+time_enabled/time_running. The rotation is coarse, so the scaled counts
+can be a long way out. Instead, we pack the events into groups that each
+fit on the PMU, and rotate the groups ourselves, enabling one group at a
+time for a short quantum. The total for each event is estimated from its
+rate in the slices where its group was running, with an error bound based
+on how much that rate varied from slice to slice.
+
+The time the totals cover is measured by a software clock that runs
+alongside the groups: task-clock for a task, cpu-clock for a CPU.
+A task's events only run while it's on a CPU, so wall time would
+overstate the total whenever the task sleeps or is descheduled.
+"""
+
+from __future__ import print_function
+
+import sys, time, math, copy, threading
+
+import pyperf.perf_events as perf_events
+from pyperf.perf_enum import *
+from pyperf.perf_attr import PerfEventAttr
+
+
+_read_format = PERF_FORMAT_GROUP|PERF_FORMAT_ID|PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING
+
+
+def _event_attr(e):
+    """
+    Get a PerfEventAttr for an event given as an attribute or as a raw event code.
+    """
+    if isinstance(e, PerfEventAttr):
+        return e
+    return PerfEventAttr(type=PERF_TYPE_RAW, config=e)
+
+
+def _open_event(attr, pid, cpu, group=None, enabled=False):
+    try:
+        return perf_events.Event(attr, pid=pid, cpu=cpu, group=group, enabled=enabled)
+    except (OSError, ValueError):
+        return None
+
+
+def _open_reference(pid, cpu):
+    """
+    Open a software clock that runs whenever the measured task (or CPU) could
+    be counted. Return None if it can't be opened.
+    """
+    config = PERF_COUNT_SW_CPU_CLOCK if pid == -1 else PERF_COUNT_SW_TASK_CLOCK
+    return _open_event(PerfEventAttr(type=PERF_TYPE_SOFTWARE, config=config, disabled=1), pid, cpu)
+
+
+def pmu_counters(attr, pid=0, cpu=-1, max_counters=32):
+    """
+    Find how many copies of an event can be counted together in one group.
+
+    sysfs tells us which PMUs there are, but not how many counters they
+    have. The kernel checks that a group can be scheduled on the PMU when
+    each event is added to it, so we add events until it refuses.
+    Counters used by other agents (e.g. the NMI watchdog) aren't allowed for.
+    Return 0 if the event can't be opened at all.
+    """
+    attr = copy.copy(_event_attr(attr))
+    attr.update(disabled=1, read_format=_read_format)
+    leader = _open_event(attr, pid, cpu)
+    if leader is None:
+        return 0
+    members = []
+    while len(members) + 1 < max_counters:
+        m = _open_event(attr, pid, cpu, group=leader)
+        if m is None:
+            break
+        members.append(m)
+    n = len(members) + 1
+    for m in members:
+        m.close()
+    leader.close()
+    return n
+
+
+class Estimate:
+    """
+    Estimated total for one event, with a bound on the error.
+    The bound is about 95% confidence, assuming the event's rate in the
+    unobserved time is like its rate in the slices we saw.
+    It is None if there were too few slices to estimate the variation.
+    """
+    def __init__(self, attr, value, error, count, time_running, time_total, n_slices):
+        self.attr = attr
+        self.value = value                # estimated total
+        self.error = error                # +/- bound on the estimate, or None
+        self.count = count                # actually counted
+        self.time_running = time_running  # time the event was counting (ns)
+        self.time_total = time_total      # time the estimate covers (ns)
+        self.n_slices = n_slices
+
+    @property
+    def fraction_running(self):
+        return float(self.time_running) / self.time_total if self.time_total else 0.0
+
+    def __str__(self):
+        if self.error is None:
+            return "%.0f (?)" % self.value
+        return "%.0f +/- %.0f" % (self.value, self.error)
+
+
+class _Group:
+    """
+    A group of events that can be scheduled on the PMU at the same time,
+    and the counts taken in each of its slices.
+    """
+    def __init__(self, indexes, events):
+        self.indexes = indexes      # positions of the events in the caller's list
+        self.events = events        # perf_events.Event objects; the first is the leader
+        self.last = None            # last (enabled, running, values)
+        self.slices = []            # (d_enabled, d_running, [d_value...]) per slice
+
+    def read(self):
+        r = self.events[0].read()
+        return (r.time_enabled_ns, r.time_running_ns, [v.raw_value for v in r])
+
+    def account(self):
+        now = self.read()
+        if self.last is not None:
+            (e0, r0, v0) = self.last
+            (e1, r1, v1) = now
+            self.slices.append((e1-e0, r1-r0, [b-a for (a, b) in zip(v0, v1)]))
+        self.last = now
+
+
+class Multiplexer:
+    """
+    Count a list of events, multiplexing them in userspace.
+
+    The events are packed into groups of at most 'counters' events.
+    If 'counters' isn't given, it's found with pmu_counters().
+    Call run() to rotate the groups for a time, or start() and stop()
+    to rotate them in a background thread while the workload runs in
+    the foreground.
+    """
+    def __init__(self, events, pid=0, cpu=-1, counters=None, quantum=0.002, verbose=0):
+        self.attrs = [_event_attr(e) for e in events]
+        self.pid = pid
+        self.cpu = cpu
+        self.quantum = quantum
+        self.verbose = verbose
+        if counters is None:
+            counters = max(1, pmu_counters(self.attrs[0], pid=pid, cpu=cpu))
+        self.counters = counters
+        self.groups = []
+        self.reference = _open_reference(pid, cpu)
+        self._thread = None
+        self._stop = None
+        self._open()
+
+    def _open(self):
+        for base in range(0, len(self.attrs), self.counters):
+            indexes = list(range(base, min(base+self.counters, len(self.attrs))))
+            events = []
+            for ix in indexes:
+                attr = copy.copy(self.attrs[ix])
+                attr.update(read_format=_read_format, disabled=(not events))
+                leader = events[0] if events else None
+                try:
+                    e = perf_events.Event(attr, pid=self.pid, cpu=self.cpu, group=leader, enabled=bool(leader))
+                except OSError:
+                    # Follow open_event in retrying as userspace-only
+                    attr.update(exclude_kernel=True)
+                    e = perf_events.Event(attr, pid=self.pid, cpu=self.cpu, group=leader, enabled=bool(leader))
+                events.append(e)
+            g = _Group(indexes, events)
+            g.account()
+            self.groups.append(g)
+        if self.verbose:
+            print("perf_mux: %u events in %u groups of up to %u" % (len(self.attrs), len(self.groups), self.counters), file=sys.stderr)
+
+    def _slice(self, g):
+        g.events[0].enable()
+        time.sleep(self.quantum)
+        g.events[0].disable()
+        g.account()
+
+    def _rotate(self, until):
+        if self.reference is not None:
+            self.reference.enable()
+        while not until():
+            for g in self.groups:
+                self._slice(g)
+        if self.reference is not None:
+            self.reference.disable()
+
+    @property
+    def time_total(self):
+        """
+        Time the measured task (or CPU) could have been counted, while the groups were rotated (ns).
+        Without the reference clock, this is the sum of the groups' enabled times,
+        which misses only the gaps between slices.
+        """
+        if self.reference is not None:
+            return self.reference.read().raw_value
+        return sum([de for g in self.groups for (de, dr, vs) in g.slices])
+
+    def run(self, duration):
+        """
+        Rotate the groups for a given time, in seconds. Each group gets at least one slice.
+        """
+        t_end = time.time() + duration
+        self._rotate(lambda: time.time() >= t_end)
+
+    def start(self):
+        """
+        Start rotating the groups in a background thread.
+        """
+        assert self._thread is None
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._rotate, args=(self._stop.is_set,))
+        self._thread.daemon = True
+        self._thread.start()
+        return self
+
+    def stop(self):
+        self._stop.set()
+        self._thread.join()
+        self._thread = None
+        return self
+
+    def estimate(self, ix):
+        """
+        Estimate the total for the ix'th event, over the time the groups were rotated.
+        """
+        for g in self.groups:
+            if ix in g.indexes:
+                break
+        j = g.indexes.index(ix)
+        slices = [(dr, vs[j]) for (de, dr, vs) in g.slices if dr > 0]
+        running = sum([dr for (dr, dv) in slices])
+        count = sum([dv for (dr, dv) in slices])
+        total = max(self.time_total, running)   # on-CPU time, not wall time
+        if running == 0:
+            return Estimate(self.attrs[ix], 0.0, None, 0, 0, total, 0)
+        rate = float(count) / running
+        value = rate * total
+        error = None
+        n = len(slices)
+        if running >= total:
+            error = 0.0
+        elif n >= 2:
+            # Time-weighted variance of the rate, between slices
+            var = sum([dr * (float(dv)/dr - rate)**2 for (dr, dv) in slices]) / running * n / (n-1)
+            error = 1.96 * math.sqrt(var / n) * (total - running)
+        return Estimate(self.attrs[ix], value, error, count, running, total, n)
+
+    def estimates(self):
+        return [self.estimate(ix) for ix in range(len(self.attrs))]
+
+    def close(self):
+        for g in self.groups:
+            for e in reversed(g.events):
+                e.close()
+        self.groups = []
+        if self.reference is not None:
+            self.reference.close()
+            self.reference = None
+
+
+if __name__ == "__main__":
+    import argparse
+    parser = argparse.ArgumentParser(description="count raw events, multiplexed in userspace")
+    parser.add_argument("--counters", type=int, help="events per group (default: probe the PMU)")
+    parser.add_argument("--quantum", type=float, default=0.002, help="time each group is enabled for")
+    parser.add_argument("--time", type=float, default=1.0, help="time to count for")
+    parser.add_argument("-a", "--all-cpus", action="store_true", help="count on all CPUs, rather than this process")
+    parser.add_argument("-v", "--verbose", action="count", default=0, help="increase verbosity level")
+    parser.add_argument("event", nargs="+", help="raw event codes, in hex")
+    opts = parser.parse_args()
+    codes = [int(s, 16) for s in opts.event]
+    (pid, cpu) = (-1, 0) if opts.all_cpus else (0, -1)
+    mux = Multiplexer(codes, pid=pid, cpu=cpu, counters=opts.counters, quantum=opts.quantum, verbose=opts.verbose)
+    mux.run(opts.time)
+    for (code, est) in zip(codes, mux.estimates()):
+        print("%04x: %s  (%.1f%% counted, %u slices)" % (code, est, est.fraction_running*100.0, est.n_slices))
+    mux.close()
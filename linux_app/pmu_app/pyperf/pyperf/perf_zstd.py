@@ -18,11 +18,21 @@ Wrap libzstd to decode compressed perf.data files.
 
 We tried the zstd and zstandard modules, and neither handled the compressed
 records in perf.data files.
+
+"perf record -z" compresses the records from the ring buffers with one
+zstd stream for the whole session, writing its output in PERF_RECORD_COMPRESSED
+records. A record's data isn't necessarily a complete frame, and an inner
+record can be split between two PERF_RECORD_COMPRESSED records. So to read
+the file we need a Decompressor that keeps its stream context from one
+PERF_RECORD_COMPRESSED to the next, and a RecordSplitter that keeps any
+incomplete record until the rest of it arrives.
 """
 
 from __future__ import print_function
 
+import struct
 from ctypes import *
+from ctypes.util import find_library
 
 
 class ZSTD_inBuffer(Structure):
@@ -74,10 +84,20 @@ class ZSTD:
     Wrap selected functions from the libzstd library
     """
     def __init__(self):
-        self.Z = CDLL("libzstd.so")
+        try:
+            self.Z = CDLL("libzstd.so")
+        except OSError:
+            # Without the development package there's no libzstd.so, only e.g. libzstd.so.1
+            lib = find_library("zstd")
+            if lib is None:
+                raise
+            self.Z = CDLL(lib)
         self.isError = self.Z.ZSTD_isError
         self.isError.argtypes = [c_size_t]
         self.isError.restype = c_int
+        self.getErrorName = self.Z.ZSTD_getErrorName
+        self.getErrorName.argtypes = [c_size_t]
+        self.getErrorName.restype = c_char_p
         self.createCStream = self.Z.ZSTD_createCStream
         self.createCStream.restype = c_void_p
         self.createDStream = self.Z.ZSTD_createDStream
@@ -101,6 +121,8 @@ class ZSTD:
         self.freeDStream.argtypes = [c_void_p]
 
     def decompress(self, src, ratio=10, compress=False):
+        if not compress:
+            return Decompressor(self, out_size=len(src)*ratio).decompress(src)
         src_buf = create_string_buffer(src)
         input = ZSTD_inBuffer()
         input.src = addressof(src_buf)
@@ -112,10 +134,7 @@ class ZSTD:
         output.dst = addressof(dst)
         output.size = dst_size
         output.pos = 0
-        if compress:
-            s = ZCS(self)
-        else:
-            s = ZDS(self)
+        s = ZCS(self)
         while input.pos < input.size:
             rc = s.processStream(output, input)
             if self.isError(rc):
@@ -129,6 +148,83 @@ class ZSTD:
         return self.decompress(src, ratio=1.1, compress=True) 
 
 
+class Decompressor:
+    """
+    Decompress a zstd stream that arrives in pieces, keeping the stream
+    context from one piece to the next. The output buffer starts at out_size
+    bytes (e.g. perf's mmap buffer size) and doubles whenever it fills,
+    so any compression ratio is handled.
+    """
+    def __init__(self, Z=None, out_size=0x10000):
+        self.Z = Z if Z is not None else g_ZSTD
+        self.zds = ZDS(self.Z)
+        self.out_size = max(64, out_size)
+        self.out_buf = create_string_buffer(self.out_size)
+        self.n_in = 0
+        self.n_out = 0
+
+    def decompress(self, src):
+        """
+        Decompress the next piece of the stream, returning as much output as it completes.
+        src can be any buffer, e.g. a memoryview of a mapped file.
+        """
+        n = len(src)
+        src_buf = (c_char * n).from_buffer_copy(src)
+        input = ZSTD_inBuffer()
+        input.src = addressof(src_buf)
+        input.size = n
+        input.pos = 0
+        output = ZSTD_outBuffer()
+        chunks = []
+        while True:
+            output.dst = addressof(self.out_buf)
+            output.size = self.out_size
+            output.pos = 0
+            rc = self.zds.processStream(output, input)
+            if self.Z.isError(rc):
+                raise ValueError("zstd decompression failed after %u bytes: %s" % (self.n_in + input.pos, self.Z.getErrorName(rc).decode()))
+            chunks.append(string_at(addressof(self.out_buf), output.pos))
+            if output.pos < output.size and input.pos == input.size:
+                # All the input is consumed, and zstd has nothing more buffered
+                break
+            if output.pos == output.size:
+                self.out_size *= 2
+                self.out_buf = create_string_buffer(self.out_size)
+        self.n_in += n
+        d = b"".join(chunks)
+        self.n_out += len(d)
+        return d
+
+
+class RecordSplitter:
+    """
+    Split a stream of perf records, arriving in pieces, into records.
+    A record split between pieces is kept until the rest of it arrives.
+    """
+    def __init__(self):
+        self.carry = b""
+
+    def split(self, d):
+        """
+        Yield the complete records (as bytes) in the next piece of the stream.
+        """
+        if self.carry:
+            d = self.carry + d
+        pos = 0
+        n = len(d)
+        while pos + 8 <= n:
+            size = struct.unpack_from("H", d, pos+6)[0]
+            assert size >= 8, "invalid compressed perf record (type=0x%x, size=%d)" % (struct.unpack_from("I", d, pos)[0], size)
+            if pos + size > n:
+                break
+            yield d[pos:pos+size]
+            pos += size
+        self.carry = d[pos:]
+
+    def is_empty(self):
+        return not self.carry
+
+
 g_ZSTD = ZSTD()
 
 def decompress(src, ratio=10):
@@ -52,6 +52,10 @@
 #include <sys/mman.h>
 #include <sys/personality.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 /*
 Include the system header that defines the layout of the structure passed
@@ -64,6 +68,10 @@ to perf_event_open.  This must match the kernel version!
 #ifndef PERF_AUX_FLAG_COLLISION
 #define PERF_AUX_FLAG_COLLISION 0x08
 #endif /* !PERF_AUX_FLAG_COLLISION */
+/* An enum, not a macro, where the header has it; so #ifdef can't test for it */
+#ifndef PERF_FORMAT_LOST
+#define PERF_FORMAT_LOST (1U << 4)
+#endif /* !PERF_FORMAT_LOST */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -88,6 +96,7 @@ static int perf_event_open(struct perf_event_attr *attr,
 #define PERF_FLAG_READ_USERSPACE     0x80000000    /* Read counters from userspace when possible */
 #define PERF_FLAG_NO_READ_USERSPACE  0x40000000    /* Never read counters from userspace */
 #define PERF_FLAG_WEAK_GROUP         0x20000000    /* Fall back to non-membership */
+#define PERF_FLAG_OVERWRITE          0x10000000    /* Buffers are overwritten: see event_snapshot */
 
 
 /*
@@ -112,6 +121,26 @@ const unsigned int _cap_user_time       = 0x08;
 const unsigned int _cap_user_time_zero  = 0x10;
 
 
+/*
+ * Accounting for the data delivered through the AUX buffer.
+ * Occupancy is the amount of AUX data waiting to be consumed, sampled
+ * when we consume a PERF_RECORD_AUX. We count ourselves as "behind"
+ * while the AUX buffer is more than half full.
+ */
+typedef struct {
+    unsigned long long bytes;          /* AUX data delivered */
+    unsigned long long records;        /* PERF_RECORD_AUX records */
+    unsigned long long truncated;      /* records with PERF_AUX_FLAG_TRUNCATED */
+    unsigned long long partial;
+    unsigned long long collision;
+    unsigned long long overwrite;
+    unsigned long long mismatch;       /* records that didn't match the AUX tail */
+    unsigned long long max_occupancy;
+    unsigned long long behind_ns;      /* total time spent behind */
+    unsigned long long behind_since;   /* when we got behind, or 0 */
+} event_aux_stats_t;
+
+
 /*
  * Python object corresponding to a perf event source - i.e. something
  * that we've got as a result of a perf_event_open call.
@@ -129,6 +158,7 @@ struct event_object_s {
     EventObject *group_leader;     /* group leader, or NULL */
     EventObject *buffer_owner;     /* buffer owner (even if we're not in a group) */
     EventObject *next_sub;         /* subordinate event, or NULL */
+    EventObject *next_member;      /* next event in the group, in creation order, or NULL */
     unsigned short sample_id_bytes; /* in sample records, no. of trailing bytes for the sample_id */
     /* Data to support collecting individual perf events */
     struct perf_event_mmap_page *mmap_page;
@@ -138,9 +168,16 @@ struct event_object_s {
     unsigned char *mmap_data_start;   /* start of data in the allocated area */
     unsigned char *mmap_data_end;     /* end of the allocated area */
     unsigned char *mmap_cursor;       /* current position in the area */
+    unsigned long mmap_spill_size;    /* anonymous area after the data, for records that wrap */
+    int batch_pending;                /* a RecordBatch has been drained but not released */
+    int collector_running;            /* buffers are being drained by a Collector */
+    int samplers_running;             /* running CounterSamplers that read this event */
+    int output_paused;                /* output was paused by pause(), or snapshot(resume=False) */
+    int overwrite;                    /* buffers are mapped read-only, for snapshots */
     int need_aux;                     /* set if event type needs AUX area */
     void *aux_area;                   /* AUX area e.g. for h/w trace */
     unsigned long aux_size;           /* total size of aux area (or 0) */
+    event_aux_stats_t aux_stats;
     /* We want reset() to start a new measurement window, after which we
        can read the event's value and also find out what percentage of
        time it was running for. But PERF_EVENT_IOC_RESET doesn't reset
@@ -201,33 +238,168 @@ static PyTypeObject TimeConvType;
 
 
 /*
- * Map from fileno to Event object - useful when using select, poll etc.
- * We don't use a Python dict as we don't want this to act as a reference.
+ * Maps from fileno, and from sample id, to Event object. The fileno map is
+ * useful when using select, poll etc. The id map lets us find the event
+ * that generated a sample, when several events write to one buffer.
+ * There might be thousands of events open (per CPU, per PMU, per counter),
+ * so these are hash tables (open addressing with linear probing), not lists.
+ * We don't use a Python dict as we don't want these to act as references.
+ */
+typedef struct {
+    unsigned long long key;
+    EventObject *event;                 /* NULL for an empty slot */
+} event_map_entry_t;
+
+typedef struct {
+    event_map_entry_t *slots;
+    unsigned int n_slots;               /* power of 2, or 0 */
+    unsigned int n_used;
+} event_map_t;
+
+static event_map_t fileno_map;
+static event_map_t id_map;
+
+#define EVENT_MAP_MIN_SLOTS 32
+
+static unsigned int event_map_hash(event_map_t const *m, unsigned long long key)
+{
+    /* Fibonacci hashing: fds are small and dense, ids are sequential */
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (m->n_slots - 1);
+}
+
+
+static EventObject *event_map_find(event_map_t const *m, unsigned long long key)
+{
+    unsigned int i;
+    if (m->n_used == 0) {
+        return NULL;
+    }
+    for (i = event_map_hash(m, key); m->slots[i].event != NULL; i = (i + 1) & (m->n_slots - 1)) {
+        if (m->slots[i].key == key) {
+            return m->slots[i].event;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Rehash into a table of n_slots. Return 0, or ENOMEM if we can't
+ * allocate the new table, in which case the old one is kept.
  */
-static PyObject **fileno_events = NULL;
-static unsigned int n_fileno_events = 0;
+static int event_map_resize(event_map_t *m, unsigned int n_slots)
+{
+    event_map_entry_t *old = m->slots;
+    unsigned int const n_old = m->n_slots;
+    unsigned int i;
+    event_map_entry_t *slots = (event_map_entry_t *)calloc(n_slots, sizeof(event_map_entry_t));
+    if (!slots) {
+        return ENOMEM;
+    }
+    m->slots = slots;
+    m->n_slots = n_slots;
+    for (i = 0; i < n_old; ++i) {
+        if (old[i].event != NULL) {
+            unsigned int j = event_map_hash(m, old[i].key);
+            while (m->slots[j].event != NULL) {
+                j = (j + 1) & (n_slots - 1);
+            }
+            m->slots[j] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
 
 /*
- * Insert a file handle into the array.
- * We assume file handles are small integers and we can directly index into an array.
+ * Insert or replace a key. Return 0, or ENOMEM if the table is full and can't grow.
  */
-static void fileno_event_insert(int fd, EventObject *e)
+static int event_map_insert(event_map_t *m, unsigned long long key, EventObject *e)
 {
+    unsigned int i;
     assert(e != NULL);
-    assert(fd >= 0);
-    if ((unsigned int)fd >= n_fileno_events) {
-        if (n_fileno_events == 0) {
-            n_fileno_events = 32;
-            fileno_events = (PyObject **)calloc(n_fileno_events, sizeof(PyObject *));
-        } else {
-            unsigned int nn = n_fileno_events * 4;
-            fileno_events = (PyObject **)realloc(fileno_events, nn*sizeof(PyObject *));
-            memset(fileno_events + n_fileno_events, 0, (nn-n_fileno_events)*sizeof(PyObject *));
-            n_fileno_events = nn;
+    /* Keep the load factor at most 1/2, or failing that, keep a slot empty to end probes */
+    if ((m->n_used + 1) * 2 > m->n_slots) {
+        if (event_map_resize(m, m->n_slots ? m->n_slots * 2 : EVENT_MAP_MIN_SLOTS) != 0 &&
+            m->n_used + 1 >= m->n_slots) {
+            return ENOMEM;
+        }
+    }
+    for (i = event_map_hash(m, key); m->slots[i].event != NULL; i = (i + 1) & (m->n_slots - 1)) {
+        if (m->slots[i].key == key) {
+            m->slots[i].event = e;
+            return 0;
+        }
+    }
+    m->slots[i].key = key;
+    m->slots[i].event = e;
+    m->n_used++;
+    return 0;
+}
+
+
+/*
+ * Remove a key, if it maps to the given event. Following entries are
+ * shifted back to fill the gap, so we don't need tombstones.
+ */
+static void event_map_remove(event_map_t *m, unsigned long long key, EventObject const *e)
+{
+    unsigned int const mask = m->n_slots - 1;
+    unsigned int i, j;
+    if (m->n_used == 0) {
+        return;
+    }
+    for (i = event_map_hash(m, key); m->slots[i].event != NULL; i = (i + 1) & mask) {
+        if (m->slots[i].key == key) {
+            break;
+        }
+    }
+    if (m->slots[i].event != e) {
+        return;
+    }
+    for (j = (i + 1) & mask; m->slots[j].event != NULL; j = (j + 1) & mask) {
+        unsigned int const h = event_map_hash(m, m->slots[j].key);
+        /* Move entry j into the gap at i, unless its home slot is cyclically in (i, j] */
+        if (((j - h) & mask) >= ((j - i) & mask)) {
+            m->slots[i] = m->slots[j];
+            i = j;
         }
     }
-    assert(fileno_events[fd] == NULL);
-    fileno_events[fd] = (PyObject *)e;
+    m->slots[i].event = NULL;
+    m->n_used--;
+    /* Keep memory proportional to the number of open events */
+    if (m->n_slots > EVENT_MAP_MIN_SLOTS && m->n_used * 8 < m->n_slots) {
+        /* If we can't shrink, the old table is still good */
+        (void)event_map_resize(m, m->n_slots / 2);
+    }
+}
+
+
+/*
+ * Find the event with a given sample id, as found in PERF_SAMPLE_ID or
+ * PERF_SAMPLE_IDENTIFIER, or in a group reading. We might do this for
+ * every record we read from a buffer, so it needs to be fast.
+ * The id is only known once we've asked for it (event_get_id), which we
+ * do when the event is opened if it samples or has PERF_FORMAT_ID.
+ */
+static EventObject *event_find_by_id(unsigned long long id)
+{
+    return event_map_find(&id_map, id);
+}
+
+
+/*
+ * Check if events of a given type write bulk data to an AUX area (e.g. SPE or ETE).
+ */
+static int event_type_needs_aux(unsigned int type)
+{
+    return !(type == PERF_TYPE_HARDWARE ||
+             type == PERF_TYPE_HW_CACHE ||
+             type == PERF_TYPE_RAW ||
+             type == PERF_TYPE_TRACEPOINT ||
+             type == PERF_TYPE_BREAKPOINT ||
+             type == PERF_TYPE_SOFTWARE);   /* TBD should test event type */
 }
 
 
@@ -244,6 +416,7 @@ static PyObject *event_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
     e->group_leader = NULL;
     e->buffer_owner = NULL;
     e->next_sub = NULL;
+    e->next_member = NULL;
     e->aux_size = MMAP_DATA_SIZE_DEFAULT;
     e->datasnap = NULL;
     return (PyObject *)e;
@@ -322,17 +495,8 @@ static unsigned int sample_offset_to_read(struct perf_event_attr const *e)
     if (e->sample_type & PERF_SAMPLE_PERIOD) {
         rdata_calc += 8;
     }
-#if defined(PERF_SAMPLE_DATA_SRC) || !defined(PERF_RECORD_MMAP)
-    if (e->sample_type & PERF_SAMPLE_DATA_SRC) {
-        rdata_calc += 8;
-    }
-#endif
-#if defined(PERF_SAMPLE_PHYS_ADDR) || !defined(PERF_RECORD_MMAP)
-    if (e->sample_type & PERF_SAMPLE_PHYS_ADDR) {
-        rdata_calc += 8;
-    }
-#endif
-    /* PERF_DATA_READ data follows. Other data types (CALLCHAIN, TRANSACTION etc.) may follow that. */
+    /* PERF_DATA_READ data follows. Other data types (CALLCHAIN, DATA_SRC,
+       PHYS_ADDR etc.) may follow that. */
     return rdata_calc;
 }
 
@@ -531,6 +695,8 @@ static void fprint_perf_event_attr(FILE *fd, struct perf_event_attr const *a)
 /* Forward declarations */
 static PyTypeObject EventType;
 static PyTypeObject RecordType;
+static PyTypeObject RecordBatchType;
+static PyTypeObject SampleColumnsType;
 
 static int event_setup_buffer(EventObject *);
 static int event_setup_buffer_aux(EventObject *, int);
@@ -638,8 +804,12 @@ static int event_init(PyObject *x, PyObject *args, PyObject *kwds)
     if (e->attr.read_format & PERF_FORMAT_GROUP) {
         /* If we want all the counters read at the same time, then it doesn't
            make sense to read 'live' values from userspace - unless those
-           counters have been simultaneously frozen */
-        e->try_userspace_read = 0;
+           counters have been simultaneously frozen. But if explicitly asked,
+           we read all the group's counters in one pass - see
+           perf_read_group_userspace. */
+        if (!(e_custom_flags & PERF_FLAG_READ_USERSPACE)) {
+            e->try_userspace_read = 0;
+        }
     }
 
     {
@@ -798,6 +968,19 @@ static int event_init(PyObject *x, PyObject *args, PyObject *kwds)
         /* e_flags |= PERF_FLAG_FD_OUTPUT; "broken since Linux 2.6.35 " */
         /* is that equivalent to PERF_SAMPLE_READ? */
     }    
+    if (e_custom_flags & PERF_FLAG_OVERWRITE) {
+        /* We'll map the buffers read-only, so the kernel overwrites old data.
+           Write the data ring backwards, so that we can find the newest record.
+           An AUX event's data ring stays forwards - see event_snapshot. */
+        e->overwrite = 1;
+        if (!event_type_needs_aux(e->attr.type)) {
+            e->attr.write_backward = 1;
+        }
+    }
+    if (e_buffer_owner != NULL) {
+        /* The kernel won't redirect output to a buffer written the other way */
+        e->attr.write_backward = e_buffer_owner->attr.write_backward;
+    }
 retry:;
     if (n_tries == 1 && !e_retry) {
         PyErr_SetString(PyExc_ValueError, "perf_event_open: invalid descriptor");
@@ -925,34 +1108,35 @@ event_created:
      */
     e->cpu = e_cpu;
     e->fd = fd;
+    if (e_group_obj != NULL) {
+        /* Add this event to the end of the group's member list, as the kernel does */
+        EventObject **pp;
+        e->group_leader = (EventObject *)e_group_obj;
+        Py_INCREF(e->group_leader);
+        for (pp = &e->group_leader->next_member; *pp != NULL; pp = &(*pp)->next_member)
+            ;
+        *pp = e;
+    }
 
     /*
      * Insert the event into our fileno->event map.
      * We don't want this map to act as a retainer for otherwise freed events,
      * so we ensure it doesn't contribute to the reference count.
      */
-    fileno_event_insert(fd, e);
+    if (event_map_insert(&fileno_map, fd, e) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
     /* Set need_aux to indicate that if we allocate a mmap buffer for events,
        we should also allocate an 'aux' buffer for bulk data. */
-    if (e->attr.type == PERF_TYPE_HARDWARE ||
-        e->attr.type == PERF_TYPE_HW_CACHE ||
-        e->attr.type == PERF_TYPE_RAW ||
-        e->attr.type == PERF_TYPE_TRACEPOINT ||
-        e->attr.type == PERF_TYPE_BREAKPOINT ||
-        e->attr.type == PERF_TYPE_SOFTWARE) {
-        e->need_aux = 0;
-    } else {
-        e->need_aux = 1;   /* TBD should test event type */
-    }
+    e->need_aux = event_type_needs_aux(e->attr.type);
     if (e_buffer_owner != NULL) {
         Py_INCREF(e_buffer_owner);
         e->buffer_owner = e_buffer_owner;
         /* Add this event to the group leader's list of subordinates. */
         e->next_sub = e->buffer_owner->next_sub;
         e->buffer_owner->next_sub = e;
-        /* TBD: what happens to this list when we delete events
-           (in some order?) */
     }
     if (is_sampling) {
         if (e->buffer_owner == NULL) {
@@ -1053,6 +1237,7 @@ static void fprint_mmap_page(FILE *fd, struct perf_event_mmap_page const *mp)
 static int event_setup_buffer_aux(EventObject *e, int quiet)
 {
     void *pmap;
+    void *reserve;
     unsigned int const page_size = sysconf(_SC_PAGESIZE);
     /* There's a limit on how much memory we can map, and our various mmap
        buffers (main, aux etc.) have to come out of that. So we adjust the
@@ -1071,13 +1256,23 @@ static int event_setup_buffer_aux(EventObject *e, int quiet)
     }
     /* Size actually mapped should be 1 + 2^n pages, to allow for the header */
     e->mmap_size = page_size + e->mmap_data_size;
+    /* Reserve some private memory after the data area. When we drain records
+       in bulk, we copy the wrapped part of a record there, so that all
+       records are contiguous. A record is at most 64K. */
+    e->mmap_spill_size = (page_size > 0x10000) ? page_size : 0x10000;
+    reserve = mmap(NULL, e->mmap_size + e->mmap_spill_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (reserve == MAP_FAILED) {
+        reserve = NULL;
+        e->mmap_spill_size = 0;
+    }
     /* Provide the buffer to the file handle */
 #ifdef PRINTF_DIAGNOSTICS
     if (e->verbose >= 2) {
         fprintf(stderr, "mmap(size=%#lx,fd=%d)", e->mmap_size, e->fd);
     }
 #endif /* PRINTF_DIAGNOSTICS */
-    pmap = mmap(NULL, e->mmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, e->fd, 0);
+    /* If the data ring isn't writable, we can't update data_tail and the kernel overwrites old records */
+    pmap = mmap(reserve, e->mmap_size, (e->attr.write_backward ? PROT_READ : PROT_READ|PROT_WRITE), MAP_SHARED|(reserve ? MAP_FIXED : 0), e->fd, 0);
     int const mmap_errno = errno;
 #ifdef PRINTF_DIAGNOSTICS
     if (e->verbose >= 2) {
@@ -1085,6 +1280,10 @@ static int event_setup_buffer_aux(EventObject *e, int quiet)
     }
 #endif /* PRINTF_DIAGNOSTICS */
     if (pmap == MAP_FAILED) {
+        if (reserve) {
+            munmap(reserve, e->mmap_size + e->mmap_spill_size);
+            e->mmap_spill_size = 0;
+        }
         if (!quiet) {
             errno = mmap_errno;
             perror("mmap");
@@ -1136,7 +1335,8 @@ static int event_setup_buffer_aux(EventObject *e, int quiet)
             fprintf(stderr, "mmap(%#lx, fd=%d, %#llx) for aux buffer\n", e->aux_size, e->fd, (unsigned long long)aux_offset);
         }
 #endif /* PRINTF_DIAGNOSTICS */
-        paux = mmap(NULL, e->aux_size, PROT_READ|PROT_WRITE, MAP_SHARED, e->fd, aux_offset);
+        /* Likewise, a read-only AUX area is in overwrite (snapshot) mode */
+        paux = mmap(NULL, e->aux_size, (e->overwrite ? PROT_READ : PROT_READ|PROT_WRITE), MAP_SHARED, e->fd, aux_offset);
         if (paux == MAP_FAILED) {
             perror("mmap(aux)");
             fprintf(stderr, "  failed to allocate AUX buffer: %lu/0x%lx, fd=%d, type=%d\n",
@@ -1178,37 +1378,6 @@ static PyObject *event_bind(PyObject *x, PyObject *args, PyObject *kwds)
 }
 
 
-/*
- * Given a leader event and an event id, find the event object.
- * We might do this every time we read a sample record from the memory buffer,
- * so it needs to be reasonably fast. Currently we scan a linked list of
- * the leader's subordinates. Typically we only call this when the id
- * is known to be a subordinate (or the leader itself) so we won't be doing
- * a lot of full-length scans unnecessarily.
- * Chaining lots of events together is likely to hit various other performance
- * issues so currently we don't focus on making the lookup quicker.
- */
-#if 0
-static EventObject *event_find_subordinate(EventObject const *e, unsigned long long id)
-{
-    assert(id != 0);
-    assert(e->buffer_owner == NULL);
-    while (e) {
-        /* As this is a frequently called routine, we shouldn't be
-           discovering the events' ids only now, we should have done
-           this as soon as we knew we might have to do this lookup. */
-        assert(e->id != 0);
-        if (e->id == id) {
-            break;
-        }
-        e = e->next_sub;
-    }
-    /* Generally this will not be NULL. */
-    return (EventObject *)e;
-}
-#endif
-
-
 /*
  * The __repr__ should be unambiguous.
  * So it should contain the full contents of the object. TBD.
@@ -1336,6 +1505,27 @@ static PyObject *event_capabilities(PyObject *x)
 }
 
 
+/*
+ * Take an event out of its group's member list. The kernel does this when
+ * the event is released, i.e. when it's closed and no longer mapped.
+ */
+static void event_leave_group(EventObject *e)
+{
+    if (e->group_leader) {
+        EventObject **pp = &e->group_leader->next_member;
+        while (*pp != NULL && *pp != e) {
+            pp = &(*pp)->next_member;
+        }
+        if (*pp == e) {
+            *pp = e->next_member;
+        }
+        e->next_member = NULL;
+        Py_DECREF(e->group_leader);
+        e->group_leader = NULL;
+    }
+}
+
+
 /*
  * Close the event's file descriptor. We may need to do this to cause events
  * to be flushed into the ring buffer.
@@ -1343,6 +1533,11 @@ static PyObject *event_capabilities(PyObject *x)
 static PyObject *event_close(PyObject *x)
 {
     EventObject *e = (EventObject *)x;
+    if (e->samplers_running) {
+        /* The sampler thread would read a closed, or reused, file descriptor */
+        PyErr_SetString(PyExc_ValueError, "event is being read by a CounterSampler: stop it first");
+        return NULL;
+    }
     if (e->fd != -1) {
 #ifdef PRINTF_DIAGNOSTICS
         if (e->verbose) {
@@ -1355,12 +1550,15 @@ static PyObject *event_close(PyObject *x)
             perror("close");
             return NULL;            
         }
-        /* Now delete the file handle from the map before it goes away. */
-        fileno_events[e->fd] = NULL;
+        /* Now delete the file handle, and the id, from the maps before they go away. */
+        event_map_remove(&fileno_map, e->fd, e);
+        if (e->id != 0) {
+            event_map_remove(&id_map, e->id, e);
+        }
         e->fd = -1;
-        if (e->group_leader) {
-            Py_DECREF(e->group_leader);
-            e->group_leader = NULL;
+        /* A mapping keeps the kernel event, and its group membership, alive */
+        if (e->mmap_page == NULL && e->aux_area == NULL) {
+            event_leave_group(e);
         }
     }
     Py_RETURN_NONE;
@@ -1371,7 +1569,7 @@ static void event_free_buffers(PyObject *x)
 {
     EventObject *e = (EventObject *)x;
     if (e->mmap_page != NULL) {
-        int rc = munmap(e->mmap_page, e->mmap_size);
+        int rc = munmap(e->mmap_page, e->mmap_size + e->mmap_spill_size);
         if (rc) {
             perror("munmap");
         }
@@ -1398,10 +1596,19 @@ static void event_dealloc(PyObject *x)
 #endif /* PRINTF_DIAGNOSTICS */
     (void)event_close(x);
     if (e->buffer_owner) {
+        /* Unlink this event from its buffer owner's list of subordinates */
+        EventObject **pp = &e->buffer_owner->next_sub;
+        while (*pp != NULL && *pp != e) {
+            pp = &(*pp)->next_sub;
+        }
+        if (*pp == e) {
+            *pp = e->next_sub;
+        }
         Py_DECREF(e->buffer_owner);
         e->buffer_owner = NULL;
     }
     event_free_buffers(x);
+    event_leave_group(e);
     if (e->datasnap) {
         Py_DECREF(e->datasnap);
     }
@@ -1770,6 +1977,111 @@ static int perf_read_count_userspace(event_sample_t *ed, EventObject *e)
 }
 
 
+/*
+ * Read all the counters in a group from userspace, into a GroupReading.
+ * Return 1 if successful, 0 if unsuccessful.
+ *
+ * We read the leader's and all the subordinates' counters in a single pass,
+ * and retry if any of their mmap pages changed while we were reading.
+ * The counters aren't frozen, so the values aren't exactly simultaneous,
+ * but the skew is only the time to read a few registers.
+ * The events are ordered as for read(): leader first, then subordinates
+ * in the order they were created.
+ */
+#define GROUP_USERSPACE_MAX 32
+static int perf_read_group_userspace(GroupReadingObject *g, EventObject *e)
+{
+    EventObject *m[GROUP_USERSPACE_MAX];
+    struct perf_event_mmap_page volatile *mp[GROUP_USERSPACE_MAX];
+    unsigned int seq[GROUP_USERSPACE_MAX];
+    unsigned int idx[GROUP_USERSPACE_MAX];
+    unsigned int width[GROUP_USERSPACE_MAX];
+    unsigned long long count_offset[GROUP_USERSPACE_MAX];
+    unsigned long long count_value[GROUP_USERSPACE_MAX];
+    unsigned long long enabled, running;
+    unsigned int time_mult, time_shift;
+    unsigned long long cyc, time_offset;
+    const unsigned int caps_needed = _cap_user_rdpmc|_cap_user_time;
+    unsigned int n = 0, i;
+    EventObject *s;
+    int changed;
+
+    m[n++] = e;
+    for (s = e->next_member; s != NULL; s = s->next_member) {
+        if (n == GROUP_USERSPACE_MAX) {
+            return 0;
+        }
+        m[n++] = s;
+    }
+    for (i = 0; i < n; ++i) {
+        if (!m[i]->mmap_page && !event_setup_buffer_aux(m[i], /*quiet=*/1)) {
+            return 0;
+        }
+        mp[i] = m[i]->mmap_page;
+        if ((mp[i]->capabilities & caps_needed) != caps_needed) {
+            return 0;
+        }
+    }
+    do {
+        for (i = 0; i < n; ++i) {
+            seq[i] = mp[i]->lock;
+        }
+        barrier();
+        /* The group is scheduled as a unit, so we take the times from the leader */
+        enabled = mp[0]->time_enabled;
+        running = mp[0]->time_running;
+        cyc = hardware_timestamp();
+        time_offset = mp[0]->time_offset;
+        time_mult = mp[0]->time_mult;
+        time_shift = mp[0]->time_shift;
+        for (i = 0; i < n; ++i) {
+            count_offset[i] = mp[i]->offset;
+            idx[i] = mp[i]->index;
+            if (idx[i] != 0) {
+                width[i] = mp[i]->pmc_width;
+                count_value[i] = rdpmc(idx[i] - 1);
+            }
+        }
+        barrier();
+        changed = 0;
+        for (i = 0; i < n; ++i) {
+            changed |= (mp[i]->lock != seq[i]);
+        }
+    } while (changed);
+    {
+        unsigned long long quot, rem, delta;
+        quot = (cyc >> time_shift);
+        rem = cyc & ((1ULL << time_shift) - 1);
+        delta = time_offset + quot*time_mult + ((rem*time_mult) >> time_shift);
+        enabled += delta;
+        if (idx[0] != 0) {
+            running += delta;
+        }
+    }
+    g->base.sample.value = 0;
+    g->base.sample.time_enabled = enabled;
+    g->base.sample.time_running = running;
+    g->base.sample.id = e->id;
+    if (g->n_values != n) {
+        g->samples = (event_sample_t *)realloc(g->samples, n * sizeof(event_sample_t));
+        g->n_values = n;
+    }
+    for (i = 0; i < n; ++i) {
+        event_sample_t *sed = &g->samples[i];
+        *sed = g->base.sample;
+        if (idx[i] != 0) {
+            /* The hardware counter value needs to be sign-extended before use. */
+            sed->value = (signed long long)(count_value[i] << (64-width[i])) >> (64-width[i]);
+            sed->value += count_offset[i];
+        } else {
+            sed->value = count_offset[i];
+        }
+        sed->id = (e->attr.read_format & PERF_FORMAT_ID) ? m[i]->id : 0xCCCCCCCC;
+    }
+    return 1;
+}
+
+
 /*
  * Read a counter event's value(s).
  * Use userspace if available, else use read().
@@ -1779,7 +2091,15 @@ static int perf_read_count(PyObject *x)
     int ok;
     BaseReadingObject *base = (BaseReadingObject *)x;
     EventObject *e = base->event;
-    if (e->try_userspace_read) {
+    if (e->try_userspace_read && (e->attr.read_format & PERF_FORMAT_GROUP)) {
+        if (perf_read_group_userspace((GroupReadingObject *)x, e)) {
+            if (e->datasnap != NULL) {
+                subtract_event_values(x, e->datasnap, e);
+            }
+            postprocess_reading(x);
+            return 1;
+        }
+    } else if (e->try_userspace_read) {
         ok = perf_read_count_userspace(&base->sample, e);
         if (ok) {
             if (0) {
@@ -1859,6 +2179,9 @@ static PyObject *event_pause(PyObject *x)
 {
     EventObject *e = (EventObject *)x;
     int rc = ioctl(e->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
+    if (rc == 0) {
+        e->output_paused = 1;
+    }
     return PyInt_FromLong(rc);
 }
 
@@ -1867,6 +2190,9 @@ static PyObject *event_resume(PyObject *x)
 {
     EventObject *e = (EventObject *)x;
     int rc = ioctl(e->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0);
+    if (rc == 0) {
+        e->output_paused = 0;
+    }
     return PyInt_FromLong(rc);
 }
 
@@ -1956,6 +2282,12 @@ static int event_get_id(EventObject *e)
     if (e->id == 0) {
         int rc = ioctl(e->fd, PERF_EVENT_IOC_ID, &e->id);
         if (rc != 0) {
+            e->id = 0;
+            return 0;
+        }
+        if (event_map_insert(&id_map, e->id, e) != 0) {
+            e->id = 0;
+            errno = ENOMEM;
             return 0;
         }
     }
@@ -1967,7 +2299,11 @@ static PyObject *event_id(PyObject *x)
 {
     EventObject *e = (EventObject *)x;
     if (!event_get_id(e)) {
-        PyErr_SetString(PyExc_ValueError, "bad ioctl");
+        if (errno == ENOMEM) {
+            PyErr_NoMemory();
+        } else {
+            PyErr_SetString(PyExc_ValueError, "bad ioctl");
+        }
         return NULL;
     }
     return PyLong_FromUnsignedLongLong(e->id);
@@ -2155,7 +2491,7 @@ static ReadingObject *reading_from_data(event_sample_t const *ed, EventObject co
     if (ed->id != 0 && ed->id != e->id) {
         /* A sampling event might have been written to its parent's buffer.
            Look up the actual event. */
-        re = event_find_subordinate(e, ed->id);
+        re = event_find_by_id(ed->id);
         if (!re) {
             fprintf(stderr, "perf event: unexpected event id: 0x%llX\n", ed->id);
             assert(0);
@@ -2251,7 +2587,7 @@ static PyObject *populate_reading_object_from_data(PyObject *x, void const *data
         g->n_values = (unsigned int)*p++;
         unsigned int i;
         p = read_data_to_sample(ed, p, e);
-        g->samples = (event_sample_t *)malloc(g->n_values * sizeof(event_sample_t));
+        g->samples = (event_sample_t *)realloc(g->samples, g->n_values * sizeof(event_sample_t));
         for (i = 0; i < g->n_values; ++i) {
             event_sample_t *sed = &g->samples[i];   /* array entry to write into */
             *sed = *ed;
@@ -2274,6 +2610,8 @@ static PyObject *create_reading_object_from_data(void const *data, EventObject *
 {
     PyObject *x = create_correct_reading_object(e);
     x = populate_reading_object_from_data(x, data, e);
+    /* Set the running fraction and adjusted value, as when we read the event */
+    postprocess_reading(x);
     return x;
 }
 
@@ -2443,6 +2781,43 @@ static char const *record_type_name(unsigned int type)
 
 
 
+/*
+ * Find the event that generated a sample. This is usually the event
+ * we read it from, but subordinate events write to their buffer owner's
+ * buffer, so we look up the sample's id. We locate the id using the
+ * buffer owner's sample_type: as with perf, events sharing a buffer
+ * should either have the same sample_type or use PERF_SAMPLE_IDENTIFIER.
+ */
+static EventObject *record_source_event(RecordObject const *s)
+{
+    unsigned long long const st = s->event->attr.sample_type;
+    unsigned char const *p = (unsigned char const *)s->data + sizeof(struct perf_event_header);
+    unsigned long long id;
+    EventObject *e;
+    if (s->head.type != PERF_RECORD_SAMPLE || !(st & (PERF_SAMPLE_ID|PERF_SAMPLE_IDENTIFIER))) {
+        return s->event;
+    }
+    if (!(st & PERF_SAMPLE_IDENTIFIER)) {
+        p += 8 * (!!(st & PERF_SAMPLE_IP) + !!(st & PERF_SAMPLE_TID) +
+                  !!(st & PERF_SAMPLE_TIME) + !!(st & PERF_SAMPLE_ADDR));
+    }
+    if (p + 8 > (unsigned char const *)s->data + s->data_size) {
+        return s->event;
+    }
+    memcpy(&id, p, 8);
+    e = event_find_by_id(id);
+    return e ? e : s->event;
+}
+
+
+static PyObject *record_sample_event(PyObject *x)
+{
+    PyObject *e = (PyObject *)record_source_event((RecordObject const *)x);
+    Py_INCREF(e);
+    return e;
+}
+
+
 /*
  * Create a Reading or GroupReading object from data in a record.
  */
@@ -2451,9 +2826,10 @@ static PyObject *record_reading(PyObject *x)
     RecordObject const *s = (RecordObject *)x;
     if (s->head.type == PERF_RECORD_SAMPLE &&
         s->event->attr.sample_type & PERF_SAMPLE_READ) {
-        /* Find the read object in the sample payload */
+        /* Find the read object in the sample payload, and interpret it
+           according to the read_format of the event that generated it. */
         unsigned int const offs = sample_offset_to_read(&s->event->attr);
-        return create_reading_object_from_data((unsigned char const *)s->data + offs, s->event);
+        return create_reading_object_from_data((unsigned char const *)s->data + sizeof(struct perf_event_header) + offs, record_source_event(s));
     } else {
         /* Presence/absence of a read object is a property of the sample type and configuration.
            It's reasonable to throw an exception if we ask for one invalidly. */
@@ -2495,6 +2871,7 @@ static void record_dealloc(PyObject *x)
 static struct PyMethodDef Record_methods[] = {
     {"data", (PyCFunction)&record_data, METH_NOARGS, "string: raw data"},
     {"reading", (PyCFunction)&record_reading, METH_NOARGS, "Reading: event value reading"},
+    {"sample_event", (PyCFunction)&record_sample_event, METH_NOARGS, "Event: event that generated a sample"},
     {"is_sample", (PyCFunction)&record_is_sample, METH_NOARGS, "bool: record is a sample"},
     {"__bytes__", (PyCFunction)&record_data, METH_NOARGS, "string: raw data"}, 
     {NULL}
@@ -2614,8 +2991,17 @@ static PyObject *event_get_aux(PyObject *x)
 {
 #if defined(PERF_RECORD_AUX) || !defined(PERF_RECORD_MMAP)
     EventObject *e = (EventObject *)x;
+    unsigned int len;
+    if (e->collector_running) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is being drained by a Collector");
+        return NULL;
+    }
+    if (e->overwrite) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is in overwrite mode: use snapshot()");
+        return NULL;
+    }
     /* Make sure to read aux_head just once, in case it moves on while we're consuming the tail */
-    unsigned int len = e->mmap_page->aux_head - e->mmap_page->aux_tail;
+    len = e->mmap_page->aux_head - e->mmap_page->aux_tail;
     return get_aux_data(e, len);
 #else /* !PERF_RECORD_AUX */
     Py_RETURN_NONE;
@@ -2623,6 +3009,154 @@ static PyObject *event_get_aux(PyObject *x)
 }
 
 
+static unsigned long long aux_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Update the AUX accounting for a PERF_RECORD_AUX that we are about to consume.
+ */
+static void event_aux_account(EventObject *e, unsigned long long size, unsigned long long flags)
+{
+    event_aux_stats_t *s = &e->aux_stats;
+    unsigned long long const occupancy = e->mmap_page->aux_head - e->mmap_page->aux_tail;
+    s->records++;
+    s->bytes += size;
+    s->truncated += !!(flags & PERF_AUX_FLAG_TRUNCATED);
+    s->partial += !!(flags & PERF_AUX_FLAG_PARTIAL);
+    s->collision += !!(flags & PERF_AUX_FLAG_COLLISION);
+    s->overwrite += !!(flags & PERF_AUX_FLAG_OVERWRITE);
+    if (occupancy > s->max_occupancy) {
+        s->max_occupancy = occupancy;
+    }
+    if (occupancy > e->aux_size / 2) {
+        if (!s->behind_since) {
+            s->behind_since = aux_stats_now();
+        }
+    } else if (s->behind_since) {
+        s->behind_ns += aux_stats_now() - s->behind_since;
+        s->behind_since = 0;
+    }
+}
+
+
+/*
+ * Return the AUX accounting counters as a dictionary.
+ * With reset=True, the counters are cleared after reading.
+ */
+static PyObject *event_aux_stats(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"reset", NULL};
+    EventObject *e = (EventObject *)x;
+    event_aux_stats_t *s = &e->aux_stats;
+    int reset = 0;
+    unsigned long long behind_ns;
+    PyObject *d;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset)) {
+        return NULL;
+    }
+    behind_ns = s->behind_ns;
+    if (s->behind_since) {
+        /* Still behind: include the time so far */
+        unsigned long long const now = aux_stats_now();
+        behind_ns += now - s->behind_since;
+        if (reset) {
+            s->behind_since = now;
+        }
+    }
+    d = PyDict_New();
+#define AUX_STAT(name, v) do { PyObject *vo = PyLong_FromUnsignedLongLong(v); \
+        PyDict_SetItemString(d, name, vo); Py_DECREF(vo); } while (0)
+    AUX_STAT("bytes", s->bytes);
+    AUX_STAT("records", s->records);
+    AUX_STAT("truncated", s->truncated);
+    AUX_STAT("partial", s->partial);
+    AUX_STAT("collision", s->collision);
+    AUX_STAT("overwrite", s->overwrite);
+    AUX_STAT("mismatch", s->mismatch);
+    AUX_STAT("max_occupancy", s->max_occupancy);
+    AUX_STAT("behind_ns", behind_ns);
+#undef AUX_STAT
+    if (reset) {
+        unsigned long long const since = s->behind_since;
+        memset(s, 0, sizeof *s);
+        s->behind_since = since;
+    }
+    return d;
+}
+
+
+/*
+ * We've got a PERF_RECORD_AUX from the main mmap buffer. Consume the
+ * AUX data it describes, and return it as a new reference (or None).
+ */
+static PyObject *event_consume_aux_record(EventObject *e, void const *rec)
+{
+    PyObject *aux = NULL;
+#if defined(PERF_RECORD_AUX) || !defined(PERF_RECORD_MMAP)
+    typedef struct {
+        struct perf_event_header header;
+        unsigned long long aux_offset;
+        unsigned long long aux_size;
+        unsigned long long flags;
+    } aux_header_t;
+    aux_header_t const *ah = (aux_header_t const *)rec;
+    event_aux_account(e, ah->aux_size, ah->flags);
+    if (e->verbose) {
+        /* Show this PERF_RECORD_AUX segment in relation to the AUX ring buffer.
+           The offset, tail and head pointers are "infinite". */
+        fprintf(stderr, "[%d] AUX flags=0x%lx offset 0x%lx size 0x%lx, current AUX tail 0x%lx head 0x%lx size 0x%lx",
+            e->fd,
+            (unsigned long)ah->flags,
+            (unsigned long)ah->aux_offset, (unsigned long)ah->aux_size,
+            (unsigned long)e->mmap_page->aux_tail,
+            (unsigned long)e->mmap_page->aux_head,
+            (unsigned long)e->mmap_page->aux_size);
+        if (ah->flags & PERF_AUX_FLAG_TRUNCATED) {
+            fprintf(stderr, " TRUNCATED");
+        }
+        if (ah->flags & PERF_AUX_FLAG_OVERWRITE) {
+            fprintf(stderr, " OVERWRITE");
+        }
+        if (ah->flags & PERF_AUX_FLAG_PARTIAL) {
+            fprintf(stderr, " PARTIAL");
+        }
+        if (ah->flags & PERF_AUX_FLAG_COLLISION) {
+            fprintf(stderr, " COLLISION");
+        }
+        fprintf(stderr, "\n");
+    }
+    /* Guard in case AUX chunk was already consumed by get_aux() */
+    if (ah->aux_size == 0) {
+        /* No data - possibly a TRUNCATED indication */
+        event_update_aux_tail(e, ah->aux_offset);
+    } else if (ah->aux_offset == e->mmap_page->aux_tail) {
+        /* This AUX record describes the next segment available in the AUX buffer. */
+#ifndef NDEBUG
+        unsigned long available = e->mmap_page->aux_head - e->mmap_page->aux_tail;
+#endif
+        assert(available >= ah->aux_size);
+        aux = get_aux_data(e, ah->aux_size);
+    } else {
+        /* Mismatch */
+        e->aux_stats.mismatch++;
+        if (e->verbose) {
+            fprintf(stderr, "** AUX record mismatch\n");
+        }
+    }
+#endif /* PERF_RECORD_AUX */
+    if (!aux) {
+        aux = Py_None;
+        Py_INCREF(aux);
+    }
+    return aux;
+}
+
+
 /*
  * Collect one record from the mmap buffer - return a Record event if
  * an event is available, otherwise return None.
@@ -2636,6 +3170,18 @@ static PyObject *event_get_record(PyObject *x)
            should we raise an exception? */
         Py_RETURN_NONE;
     }        
+    if (e->batch_pending) {
+        PyErr_SetString(PyExc_ValueError, "record batch has not been released");
+        return NULL;
+    }
+    if (e->collector_running) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is being drained by a Collector");
+        return NULL;
+    }
+    if (e->overwrite) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is in overwrite mode: use snapshot()");
+        return NULL;
+    }
     if (!event_available(e)) {
         Py_RETURN_NONE;
     }
@@ -2684,54 +3230,8 @@ static PyObject *event_get_record(PyObject *x)
     }
     if (head.type == PERF_RECORD_AUX) {
         /* Get the AUX data now */
-        typedef struct {
-            struct perf_event_header header;
-            unsigned long long aux_offset;
-            unsigned long long aux_size;
-            unsigned long long flags;
-        } aux_header_t;
-        aux_header_t const *ah = (aux_header_t const *)s->data;
-        if (1 || e->verbose) {
-            /* Show this PERF_RECORD_AUX segment in relation to the AUX ring buffer.
-               The offset, tail and head pointers are "infinite". */
-            fprintf(stderr, "[%d] AUX flags=0x%lx offset 0x%lx size 0x%lx, current AUX tail 0x%lx head 0x%lx size 0x%lx",
-                e->fd,
-                (unsigned long)ah->flags,
-                (unsigned long)ah->aux_offset, (unsigned long)ah->aux_size,
-                (unsigned long)e->mmap_page->aux_tail,
-                (unsigned long)e->mmap_page->aux_head,
-                (unsigned long)e->mmap_page->aux_size);
-            if (ah->flags & PERF_AUX_FLAG_TRUNCATED) {
-                fprintf(stderr, " TRUNCATED");
-            }
-            if (ah->flags & PERF_AUX_FLAG_OVERWRITE) {
-                fprintf(stderr, " OVERWRITE");
-            }
-            if (ah->flags & PERF_AUX_FLAG_PARTIAL) {
-                fprintf(stderr, " PARTIAL");
-            }
-            if (ah->flags & PERF_AUX_FLAG_COLLISION) {
-                fprintf(stderr, " COLLISION");
-            }
-            fprintf(stderr, "\n");
-        }
-        /* Guard in case AUX chunk was already consumed by get_aux() */
-        if (ah->aux_size == 0) {
-            /* No data - possibly a TRUNCATED indication */
-            event_update_aux_tail(e, ah->aux_offset);
-        } else if (ah->aux_offset == e->mmap_page->aux_tail) {
-            /* This AUX record describes the next segment available in the AUX buffer. */
-#ifndef NDEBUG
-            unsigned long available = e->mmap_page->aux_head - e->mmap_page->aux_tail;
-#endif
-            assert(available >= ah->aux_size);
-            Py_DECREF(s->aux);    /* it was None */
-            s->aux = get_aux_data(e, ah->aux_size);
-            Py_INCREF(s->aux);
-        } else {
-            /* Mismatch */
-            fprintf(stderr, "** AUX record mismatch\n");
-        }
+        Py_DECREF(s->aux);    /* it was None */
+        s->aux = event_consume_aux_record(e, s->data);
     }
     /* the Record has a back-pointer to the buffer-owning Event */
     Py_INCREF(e);
@@ -2740,262 +3240,3984 @@ static PyObject *event_get_record(PyObject *x)
 }
 
 
-static PyMethodDef Event_methods[] = {
-    {"attr_struct", (PyCFunction)&event_attr_struct, METH_NOARGS, "string: event attributes as raw string"},
-    {"fileno", (PyCFunction)&event_fileno, METH_NOARGS, "int: file handle - not for general use"},  /* this makes it a "waitable object" */
-    {"id", (PyCFunction)&event_id, METH_NOARGS, "int: unique id"},
-    {"close", (PyCFunction)&event_close, METH_NOARGS, "close the event"},
-    {"capabilities", (PyCFunction)&event_capabilities, METH_NOARGS, "int: get capability flags"},
-    {"bind", (PyCFunction)&event_bind, METH_VARARGS|METH_KEYWORDS, "int, int -> start collecting an event"},
-    {"set_filter", (PyCFunction)&event_set_filter, METH_O, "str: set filter on event"},
-    {"reset", (PyCFunction)&event_reset, METH_NOARGS, "int: reset the event count"},
-    {"enable", (PyCFunction)&event_enable, METH_NOARGS, "int: enable the event"},
-    {"disable", (PyCFunction)&event_disable, METH_NOARGS, "int: disable the event"},
-    {"refresh", (PyCFunction)&event_refresh, METH_O, "int -> refresh the wakeup counter"},
-    {"pause", (PyCFunction)&event_pause, METH_NOARGS, "pause a sampling event"},
-    {"resume", (PyCFunction)&event_resume, METH_NOARGS, "resume a sampling event"},
-    {"read", (PyCFunction)&event_read, METH_NOARGS, "Reading: read the current value of a counting event"},
-    {"poll", (PyCFunction)&event_poll, METH_NOARGS, "bool: test if event record is available"},
-    {"is_active", (PyCFunction)&event_is_active, METH_NOARGS, "bool: test if event was closed by kernel"},
-    {"get_record", (PyCFunction)&event_get_record, METH_NOARGS, "Record: get next record from a sampling event"},
-    {"get_aux", (PyCFunction)&event_get_aux, METH_NOARGS, "string: get AUX data"},
+/*
+ * Take a snapshot of an event's buffers, when the event was opened with
+ * PERF_FLAG_OVERWRITE - a "flight recorder", where the kernel continually
+ * overwrites the oldest data and we look at the newest data when something
+ * interesting happens. Nothing is consumed while the event is running.
+ *
+ * The data ring is mapped read-only and written backwards (write_backward),
+ * so data_head points at the newest record and the older records follow it
+ * in memory. We pause output while we walk forwards from data_head, and
+ * return the records in time order (oldest first), unwrapped, as they
+ * would appear in perf.data.
+ *
+ * For an AUX event, the AUX area is mapped read-only (snapshot mode) and
+ * we return the newest aux_size bytes before aux_head. The data ring must
+ * stay writable (to set up the AUX area from the user page) and so stays in
+ * forward mode: we return and consume whatever records are in it. We disable
+ * the event while we copy the AUX data, so that the PMU driver flushes it.
+ *
+ * Return a tuple (records, aux), where aux is None for a non-AUX event.
+ */
+static PyObject *event_snapshot(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"resume", NULL};
+    EventObject *e = (EventObject *)x;
+    int resume = 1;
+    int paused = 0, disabled = 0;   /* what we did, and so must undo */
+    PyObject *recs = NULL, *aux = NULL;
+    unsigned char *p;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &resume)) {
+        return NULL;
+    }
+    if (!e->overwrite) {
+        PyErr_SetString(PyExc_ValueError, "event was not opened with PERF_FLAG_OVERWRITE");
+        return NULL;
+    }
+    if (!e->mmap_page && !event_setup_buffer(e)) {
+        PyErr_SetString(PyExc_ValueError, "no buffer allocated");
+        return NULL;
+    }
+    if (!e->attr.write_backward) {
+        /* Forward data ring, alongside an AUX area in snapshot mode */
+        unsigned long long const head = e->mmap_page->data_head;
+        unsigned long long const tail = e->mmap_page->data_tail;
+        __sync_synchronize();
+        recs = MyBytes_FromStringAndSize(NULL, head - tail);
+        if (!recs) {
+            goto fail;
+        }
+        copy_from_wrapped_buffer(MyBytes_AsString(recs), e->mmap_data_start, e->mmap_data_size, tail, head - tail);
+        __sync_synchronize();
+        e->mmap_page->data_tail = head;
+    } else {
+        unsigned long long head, pos;
+        unsigned long limit, *offs = NULL;
+        unsigned int n = 0, n_alloc = 0;
+        if (!e->output_paused) {
+            (void)ioctl(e->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1);
+            paused = 1;
+        }
+        head = e->mmap_page->data_head;
+        __sync_synchronize();
+        /* The head counts down from zero, so -head bytes have been written */
+        limit = (-head < e->mmap_data_size) ? (unsigned long)-head : e->mmap_data_size;
+        for (pos = head; pos - head < limit; ) {
+            struct perf_event_header const *h = (struct perf_event_header const *)(e->mmap_data_start + (pos % e->mmap_data_size));
+            if (h->size < sizeof *h || (pos - head) + h->size > limit) {
+                /* Never written, or partly overwritten by the newest records */
+                break;
+            }
+            if (n == n_alloc) {
+                unsigned long *noffs;
+                n_alloc = n_alloc ? n_alloc * 2 : 256;
+                noffs = (unsigned long *)realloc(offs, n_alloc * sizeof *offs);
+                if (!noffs) {
+                    free(offs);
+                    PyErr_NoMemory();
+                    goto fail;
+                }
+                offs = noffs;
+            }
+            offs[n++] = pos - head;
+            pos += h->size;
+        }
+        recs = MyBytes_FromStringAndSize(NULL, pos - head);
+        if (!recs) {
+            free(offs);
+            goto fail;
+        }
+        p = (unsigned char *)MyBytes_AsString(recs);
+        while (n > 0) {
+            unsigned long const off = offs[--n];
+            unsigned int const size = ((struct perf_event_header const *)(e->mmap_data_start + ((head + off) % e->mmap_data_size)))->size;
+            copy_from_wrapped_buffer(p, e->mmap_data_start, e->mmap_data_size, head + off, size);
+            p += size;
+        }
+        free(offs);
+    }
+#if defined(PERF_RECORD_AUX) || !defined(PERF_RECORD_MMAP)
+    if (e->aux_area) {
+        unsigned long long head;
+        unsigned long len;
+        if (!e->attr.disabled) {
+            (void)ioctl(e->fd, PERF_EVENT_IOC_DISABLE, 0);
+            disabled = 1;
+        }
+        head = e->mmap_page->aux_head;
+        __sync_synchronize();
+        len = (head < e->aux_size) ? (unsigned long)head : e->aux_size;
+        aux = MyBytes_FromStringAndSize(NULL, len);
+        if (!aux) {
+            goto fail;
+        }
+        copy_from_wrapped_buffer(MyBytes_AsString(aux), e->aux_area, e->aux_size, head - len, len);
+    } else
+#endif /* PERF_RECORD_AUX */
+    {
+        aux = Py_None;
+        Py_INCREF(aux);
+    }
+    if (!resume) {
+        /* Leave the event as we've made it, and remember that */
+        e->output_paused |= paused;
+        e->attr.disabled |= disabled;
+        paused = disabled = 0;
+    }
+fail:
+    /* Only undo what we did: the event may have been paused or disabled already */
+    if (disabled) {
+        (void)ioctl(e->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (paused) {
+        (void)ioctl(e->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0);
+    }
+    if (!aux) {
+        Py_XDECREF(recs);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", recs, aux);
+}
+
+
+/*
+ * A batch of records drained from the mmap buffer in one operation.
+ *
+ * The records stay in the mmap buffer, and the batch exports them
+ * through the buffer protocol, with an index of their offsets.
+ * Only a record that wraps round the end of the ring buffer is copied
+ * (in part) - into a spill area that we mapped after the end of the
+ * buffer. The kernel can't overwrite the records until we advance
+ * the tail pointer, which we do once, when the batch is released.
+ */
+typedef struct {
+    PyObject_HEAD
+    EventObject *event;             /* buffer-owning event */
+    unsigned long long tail;        /* data_tail when the batch was drained */
+    unsigned long long head;        /* end of the last record in the batch */
+    unsigned int n_records;
+    unsigned long *offsets;         /* offset of each record, from the start of the data area */
+    unsigned long size;             /* size of exported data: more than the data area if a record wrapped */
+    PyObject *aux;                  /* dict: record index -> AUX data, or NULL */
+    unsigned int n_exports;         /* buffer views currently exported */
+    int released;                   /* tail pointer has been advanced */
+} RecordBatchObject;
+
+
+static PyObject *recordbatch_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    RecordBatchObject *b = (RecordBatchObject *)t->tp_alloc(t, 0);
+    assert(b != NULL);
+    b->event = NULL;
+    b->offsets = NULL;
+    b->aux = NULL;
+    b->released = 1;
+    return (PyObject *)b;
+}
+
+
+/*
+ * Advance the tail pointer past the records in the batch, so that
+ * the kernel can reuse the space.
+ */
+static int recordbatch_do_release(RecordBatchObject *b)
+{
+    if (!b->released) {
+        EventObject *e = b->event;
+        if (b->n_exports > 0) {
+            PyErr_SetString(PyExc_BufferError, "record batch data is still in use");
+            return 0;
+        }
+        assert(e->mmap_page->data_tail == b->tail);
+        /* Make sure we've finished reading before the kernel can overwrite */
+        __sync_synchronize();
+        e->mmap_page->data_tail = b->head;
+        e->batch_pending = 0;
+        b->released = 1;
+    }
+    return 1;
+}
+
+
+static PyObject *recordbatch_release(PyObject *x)
+{
+    if (!recordbatch_do_release((RecordBatchObject *)x)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *recordbatch_enter(PyObject *x)
+{
+    Py_INCREF(x);
+    return x;
+}
+
+
+static PyObject *recordbatch_exit(PyObject *x, PyObject *args)
+{
+    return recordbatch_release(x);
+}
+
+
+static void recordbatch_dealloc(PyObject *x)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    if (b->event) {
+        /* There can't be any exports, as they would hold a reference to us */
+        (void)recordbatch_do_release(b);
+        Py_DECREF(b->event);
+    }
+    free(b->offsets);
+    Py_XDECREF(b->aux);
+    x->ob_type->tp_free(x);
+}
+
+
+static int recordbatch_getbuffer(PyObject *x, Py_buffer *view, int flags)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    if (b->released) {
+        PyErr_SetString(PyExc_BufferError, "record batch has been released");
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, x, b->event->mmap_data_start, b->size, /*readonly=*/1, flags) < 0) {
+        return -1;
+    }
+    b->n_exports++;
+    return 0;
+}
+
+
+static void recordbatch_releasebuffer(PyObject *x, Py_buffer *view)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    assert(b->n_exports > 0);
+    b->n_exports--;
+}
+
+
+static Py_ssize_t recordbatch_seq_length(PyObject *x)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    return b->n_records;
+}
+
+
+/*
+ * Get one record from the batch, as a memoryview on to the mmap buffer.
+ * This includes the header, as for Record.data().
+ */
+static PyObject *recordbatch_seq_item(PyObject *x, Py_ssize_t i)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    PyObject *mv, *start, *stop, *slice, *r;
+    unsigned long offset;
+    if (i < 0 || i >= b->n_records) {
+        PyErr_SetString(PyExc_IndexError, "record index out of range");
+        return NULL;
+    }
+    mv = PyMemoryView_FromObject(x);
+    if (!mv) {
+        return NULL;
+    }
+    offset = b->offsets[i];
+    start = PyLong_FromUnsignedLong(offset);
+    stop = PyLong_FromUnsignedLong(offset + ((struct perf_event_header const *)(b->event->mmap_data_start + offset))->size);
+    slice = PySlice_New(start, stop, NULL);
+    r = PyObject_GetItem(mv, slice);
+    Py_DECREF(slice);
+    Py_DECREF(stop);
+    Py_DECREF(start);
+    Py_DECREF(mv);
+    return r;
+}
+
+
+/*
+ * Return the offsets of the records, as an array of native unsigned longs.
+ */
+static PyObject *recordbatch_index(PyObject *x)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    return MyBytes_FromStringAndSize((char const *)b->offsets, b->n_records * sizeof(unsigned long));
+}
+
+
+/*
+ * Return the AUX data that was consumed for a PERF_RECORD_AUX in the batch.
+ */
+static PyObject *recordbatch_get_aux(PyObject *x, PyObject *io)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    PyObject *aux = b->aux ? PyDict_GetItem(b->aux, io) : NULL;
+    if (!aux) {
+        Py_RETURN_NONE;
+    }
+    Py_INCREF(aux);
+    return aux;
+}
+
+
+static PyObject *recordbatch_str(PyObject *x)
+{
+    RecordBatchObject *b = (RecordBatchObject *)x;
+    return PyString_FromFormat("RecordBatch(%u records,%lu bytes%s)",
+        b->n_records, (unsigned long)(b->head - b->tail), (b->released ? ",released" : ""));
+}
+
+
+static struct PyMethodDef RecordBatch_methods[] = {
+    {"index", (PyCFunction)&recordbatch_index, METH_NOARGS, "bytes: record offsets, as native unsigned longs"},
+    {"aux", (PyCFunction)&recordbatch_get_aux, METH_O, "int -> bytes: AUX data for a PERF_RECORD_AUX record"},
+    {"release", (PyCFunction)&recordbatch_release, METH_NOARGS, "release the records back to the kernel"},
+    {"__enter__", (PyCFunction)&recordbatch_enter, METH_NOARGS, "context manager: release on exit"},
+    {"__exit__", (PyCFunction)&recordbatch_exit, METH_VARARGS, "context manager: release on exit"},
+    {NULL}
+};
+
+static struct PyMemberDef RecordBatch_members[] = {
+    {"event", T_OBJECT, offsetof(RecordBatchObject, event), READONLY, "event that records were drained from"},
+    {"tail", T_ULONGLONG, offsetof(RecordBatchObject, tail), READONLY, "buffer position of first record"},
+    {"head", T_ULONGLONG, offsetof(RecordBatchObject, head), READONLY, "buffer position after last record"},
     {NULL}
 };
 
+static PySequenceMethods RecordBatch_seqmethods = {
+    .sq_length = &recordbatch_seq_length,
+    .sq_item = &recordbatch_seq_item
+};
+
+static PyBufferProcs RecordBatch_bufmethods = {
+    .bf_getbuffer = &recordbatch_getbuffer,
+    .bf_releasebuffer = &recordbatch_releasebuffer
+};
+
+#ifndef Py_TPFLAGS_HAVE_NEWBUFFER
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
+#endif
+
+static PyTypeObject RecordBatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_basicsize = sizeof(RecordBatchObject),
+    .tp_name = "perf_events.RecordBatch",
+    .tp_doc = "batch of records drained from a perf event buffer",
+    .tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_NEWBUFFER,
+    .tp_methods = RecordBatch_methods,
+    .tp_members = RecordBatch_members,
+    .tp_as_sequence = &RecordBatch_seqmethods,
+    .tp_as_buffer = &RecordBatch_bufmethods,
+    .tp_str = recordbatch_str,
+    .tp_new = recordbatch_new,
+    .tp_dealloc = recordbatch_dealloc
+};
+
+
+/*
+ * Drain all the records currently available in the mmap buffer, as a
+ * RecordBatch. Return None if there are no records. The records must be
+ * released, by calling release() or by discarding the batch, before
+ * we can get any more.
+ */
+static PyObject *event_drain(PyObject *x)
+{
+    EventObject *e = (EventObject *)x;
+    RecordBatchObject *b;
+    unsigned long long head, pos;
+    unsigned int n_alloc = 64;
+    if (!e->mmap_page) {
+        Py_RETURN_NONE;
+    }
+    if (e->batch_pending) {
+        PyErr_SetString(PyExc_ValueError, "record batch has not been released");
+        return NULL;
+    }
+    if (e->collector_running) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is being drained by a Collector");
+        return NULL;
+    }
+    if (e->overwrite) {
+        PyErr_SetString(PyExc_ValueError, "event buffer is in overwrite mode: use snapshot()");
+        return NULL;
+    }
+    head = e->mmap_page->data_head;
+    /* Make sure we see the records the kernel wrote before updating the head */
+    __sync_synchronize();
+    if (head == e->mmap_page->data_tail) {
+        Py_RETURN_NONE;
+    }
+    b = (RecordBatchObject *)PyObject_CallObject((PyObject *)&RecordBatchType, NULL);
+    if (!b) {
+        return NULL;
+    }
+    Py_INCREF(e);
+    b->event = e;
+    b->tail = e->mmap_page->data_tail;
+    b->size = e->mmap_data_size;
+    b->offsets = (unsigned long *)malloc(n_alloc * sizeof(unsigned long));
+    if (!b->offsets) {
+        Py_DECREF(b);
+        return PyErr_NoMemory();
+    }
+    for (pos = b->tail; pos < head; ) {
+        unsigned long const offset = pos % e->mmap_data_size;
+        unsigned long const room = e->mmap_data_size - offset;
+        /* Records are 8-byte aligned, so the header itself can't wrap */
+        struct perf_event_header const *h = (struct perf_event_header const *)(e->mmap_data_start + offset);
+        if (h->size < sizeof(struct perf_event_header) || h->size > head - pos) {
+            /* We can't find the next record, so discard the rest of the data */
+            fprintf(stderr, "sample corrupt: length = %ld\n", (long)h->size);
+            pos = head;
+            break;
+        }
+        if (h->size > room) {
+            /* The record wraps. There can be at most one such record in the batch. */
+            if (!e->mmap_spill_size) {
+                /* No spill area, so stop before this record. The caller can
+                   get it with get_record() after releasing the batch. */
+                break;
+            }
+            assert(b->size == e->mmap_data_size);
+            memcpy(e->mmap_data_end, e->mmap_data_start, h->size - room);
+            b->size = e->mmap_data_size + (h->size - room);
+        }
+        if (b->n_records == n_alloc) {
+            unsigned long *offsets = (unsigned long *)realloc(b->offsets, 2 * n_alloc * sizeof(unsigned long));
+            if (!offsets) {
+                Py_DECREF(b);
+                return PyErr_NoMemory();
+            }
+            b->offsets = offsets;
+            n_alloc *= 2;
+        }
+        b->offsets[b->n_records] = offset;
+        if (h->type == PERF_RECORD_AUX) {
+            PyObject *aux = event_consume_aux_record(e, h);
+            if (aux != Py_None) {
+                PyObject *io = PyInt_FromLong(b->n_records);
+                int rc = -1;
+                if (io && !b->aux) {
+                    b->aux = PyDict_New();
+                }
+                if (io && b->aux) {
+                    rc = PyDict_SetItem(b->aux, io, aux);
+                }
+                Py_XDECREF(io);
+                if (rc < 0) {
+                    Py_DECREF(aux);
+                    Py_DECREF(b);
+                    return NULL;
+                }
+            }
+            Py_DECREF(aux);
+        }
+        b->n_records++;
+        pos += h->size;
+    }
+    b->head = pos;
+    if (b->n_records == 0) {
+        /* Only a wrapped record, which we couldn't batch, or corrupt data, which we skip */
+        if (pos != b->tail) {
+            __sync_synchronize();
+            e->mmap_page->data_tail = pos;
+        }
+        Py_DECREF(b);
+        Py_RETURN_NONE;
+    }
+    b->released = 0;
+    e->batch_pending = 1;
+#ifdef PRINTF_DIAGNOSTICS
+    if (e->verbose) {
+        fprintf(stderr, "[%d] drained %u records, 0x%llx..0x%llx\n", e->fd, b->n_records, b->tail, b->head);
+    }
+#endif /* PRINTF_DIAGNOSTICS */
+    return (PyObject *)b;
+}
+
+
+/*
+ * Sample columns: the fields of a sequence of PERF_RECORD_SAMPLE records,
+ * decoded into one array per field. Each array is a bytes object of native
+ * integers, so that analysis code can process it without creating a
+ * Python object per sample.
+ */
+enum {
+    SCOL_IP,
+    SCOL_PID,
+    SCOL_TID,
+    SCOL_TIME,
+    SCOL_ADDR,
+    SCOL_ID,
+    SCOL_STREAM_ID,
+    SCOL_CPU,
+    SCOL_PERIOD,
+    SCOL_TIME_ENABLED,
+    SCOL_TIME_RUNNING,
+    SCOL_VALUE,
+    SCOL_WEIGHT,
+    SCOL_DATA_SRC,
+    SCOL_PHYS_ADDR,
+    N_SAMPLE_COLUMNS
+};
+
+static struct {
+    char const *name;
+    char const *format;     /* struct/memoryview format of each element */
+    unsigned int size;      /* size of each element */
+} const sample_columns[N_SAMPLE_COLUMNS] = {
+    { "ip",           "Q", 8 },
+    { "pid",          "I", 4 },
+    { "tid",          "I", 4 },
+    { "time",         "Q", 8 },
+    { "addr",         "Q", 8 },
+    { "id",           "Q", 8 },
+    { "stream_id",    "Q", 8 },
+    { "cpu",          "I", 4 },
+    { "period",       "Q", 8 },
+    { "time_enabled", "Q", 8 },
+    { "time_running", "Q", 8 },
+    { "value",        "Q", 8 },
+    { "weight",       "Q", 8 },
+    { "data_src",     "Q", 8 },
+    { "phys_addr",    "Q", 8 },
+};
+
+typedef struct {
+    PyObject_HEAD
+    unsigned long long sample_type;
+    unsigned long long read_format;
+    unsigned int n_samples;
+    unsigned int n_values;          /* values per sample in the 'value' column */
+    unsigned int n_other;           /* records that were not samples */
+    PyObject *col[N_SAMPLE_COLUMNS];
+} SampleColumnsObject;
+
+
+static PyObject *samplecolumns_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    SampleColumnsObject *s = (SampleColumnsObject *)t->tp_alloc(t, 0);
+    assert(s != NULL);
+    return (PyObject *)s;
+}
+
+
+static void samplecolumns_dealloc(PyObject *x)
+{
+    SampleColumnsObject *s = (SampleColumnsObject *)x;
+    unsigned int i;
+    for (i = 0; i < N_SAMPLE_COLUMNS; ++i) {
+        Py_XDECREF(s->col[i]);
+    }
+    x->ob_type->tp_free(x);
+}
+
+
+static int samplecolumns_find(char const *name)
+{
+    unsigned int i;
+    for (i = 0; i < N_SAMPLE_COLUMNS; ++i) {
+        if (!strcmp(sample_columns[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Return a column as a memoryview of native integers. The 'value' column
+ * is two-dimensional when there is more than one value per sample.
+ */
+static PyObject *samplecolumns_view(SampleColumnsObject *s, unsigned int c)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject *mv, *r;
+    if (!s->col[c]) {
+        Py_RETURN_NONE;
+    }
+    mv = PyMemoryView_FromObject(s->col[c]);
+    if (!mv) {
+        return NULL;
+    }
+    if (c == SCOL_VALUE && s->n_values > 1) {
+        r = PyObject_CallMethod(mv, "cast", "s[II]", sample_columns[c].format, s->n_samples, s->n_values);
+    } else {
+        r = PyObject_CallMethod(mv, "cast", "s", sample_columns[c].format);
+    }
+    Py_DECREF(mv);
+    return r;
+#else
+    /* No memoryview.cast: return the raw array */
+    PyObject *r = s->col[c] ? s->col[c] : Py_None;
+    Py_INCREF(r);
+    return r;
+#endif
+}
+
+
+static PyObject *samplecolumns_column(PyObject *x, PyObject *args)
+{
+    char const *name;
+    int c;
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    c = samplecolumns_find(name);
+    if (c < 0) {
+        PyErr_Format(PyExc_KeyError, "no sample column '%s'", name);
+        return NULL;
+    }
+    return samplecolumns_view((SampleColumnsObject *)x, c);
+}
+
+
+/*
+ * Return a dictionary of the columns that were present in the samples.
+ */
+static PyObject *samplecolumns_columns(PyObject *x)
+{
+    SampleColumnsObject *s = (SampleColumnsObject *)x;
+    PyObject *d = PyDict_New();
+    unsigned int i;
+    for (i = 0; i < N_SAMPLE_COLUMNS; ++i) {
+        if (s->col[i]) {
+            PyObject *v = samplecolumns_view(s, i);
+            if (!v) {
+                Py_DECREF(d);
+                return NULL;
+            }
+            PyDict_SetItemString(d, sample_columns[i].name, v);
+            Py_DECREF(v);
+        }
+    }
+    return d;
+}
+
+
+static Py_ssize_t samplecolumns_seq_length(PyObject *x)
+{
+    return ((SampleColumnsObject *)x)->n_samples;
+}
+
+
+static PyObject *samplecolumns_str(PyObject *x)
+{
+    SampleColumnsObject *s = (SampleColumnsObject *)x;
+    return PyString_FromFormat("SampleColumns(%u samples)", s->n_samples);
+}
+
+
+static struct PyMethodDef SampleColumns_methods[] = {
+    {"column", (PyCFunction)&samplecolumns_column, METH_VARARGS, "str -> memoryview: one decoded field, or None if not sampled"},
+    {"columns", (PyCFunction)&samplecolumns_columns, METH_NOARGS, "dict: all the decoded fields"},
+    {NULL}
+};
+
+static struct PyMemberDef SampleColumns_members[] = {
+    {"sample_type", T_ULONGLONG, offsetof(SampleColumnsObject, sample_type), READONLY, "sample_type used to decode the samples"},
+    {"read_format", T_ULONGLONG, offsetof(SampleColumnsObject, read_format), READONLY, "read_format used to decode the samples"},
+    {"n_values", T_UINT, offsetof(SampleColumnsObject, n_values), READONLY, "number of values per sample"},
+    {"n_other", T_UINT, offsetof(SampleColumnsObject, n_other), READONLY, "number of records that were not samples"},
+    {NULL}
+};
+
+static PySequenceMethods SampleColumns_seqmethods = {
+    .sq_length = &samplecolumns_seq_length
+};
+
+static PyTypeObject SampleColumnsType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_basicsize = sizeof(SampleColumnsObject),
+    .tp_name = "perf_events.SampleColumns",
+    .tp_doc = "fields of a sequence of sample records, as arrays",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = SampleColumns_methods,
+    .tp_members = SampleColumns_members,
+    .tp_as_sequence = &SampleColumns_seqmethods,
+    .tp_str = samplecolumns_str,
+    .tp_new = samplecolumns_new,
+    .tp_dealloc = samplecolumns_dealloc
+};
+
+
+static unsigned long long sample_get_u64(unsigned char const *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+static unsigned int sample_get_u32(unsigned char const *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+/*
+ * Decode one PERF_RECORD_SAMPLE payload into row i of the columns.
+ * The layout is described in linux/perf_event.h. We walk over the
+ * variable-length items (callchain, raw data, branch stack, registers,
+ * user stack) to get to the fixed items that follow them.
+ * Return 0 if the record is too short for the sample_type.
+ */
+static int sample_decode_one(SampleColumnsObject *s, struct perf_event_attr const *a,
+                             unsigned int i, unsigned char const *p, unsigned char const *end)
+{
+    unsigned long long const st = a->sample_type;
+#define SCOL(c) ((unsigned char *)MyBytes_AsString(s->col[c]))
+#define NEED(n) do { if ((unsigned long)(end - p) < (unsigned long)(n)) return 0; } while (0)
+#define PUT64(c) do { NEED(8); memcpy(SCOL(c) + i*8, p, 8); p += 8; } while (0)
+#define PUT32(c) do { NEED(4); memcpy(SCOL(c) + i*4, p, 4); p += 4; } while (0)
+#define SKIP(n) do { NEED(n); p += (n); } while (0)
+    if (st & PERF_SAMPLE_IDENTIFIER) {
+        PUT64(SCOL_ID);
+    }
+    if (st & PERF_SAMPLE_IP) {
+        PUT64(SCOL_IP);
+    }
+    if (st & PERF_SAMPLE_TID) {
+        PUT32(SCOL_PID);
+        PUT32(SCOL_TID);
+    }
+    if (st & PERF_SAMPLE_TIME) {
+        PUT64(SCOL_TIME);
+    }
+    if (st & PERF_SAMPLE_ADDR) {
+        PUT64(SCOL_ADDR);
+    }
+    if (st & PERF_SAMPLE_ID) {
+        /* Same as the identifier, if both are present */
+        PUT64(SCOL_ID);
+    }
+    if (st & PERF_SAMPLE_STREAM_ID) {
+        PUT64(SCOL_STREAM_ID);
+    }
+    if (st & PERF_SAMPLE_CPU) {
+        PUT32(SCOL_CPU);
+        SKIP(4);
+    }
+    if (st & PERF_SAMPLE_PERIOD) {
+        PUT64(SCOL_PERIOD);
+    }
+    if (st & PERF_SAMPLE_READ) {
+        unsigned long long const rf = a->read_format;
+        /* Each value may be followed by its id and lost count */
+        unsigned int vsize = 8;
+        if (rf & PERF_FORMAT_ID) {
+            vsize += 8;
+        }
+        if (rf & PERF_FORMAT_LOST) {
+            vsize += 8;
+        }
+        if (rf & PERF_FORMAT_GROUP) {
+            /* { nr, time_enabled, time_running, { value, id, lost }[nr] } */
+            unsigned int j;
+            NEED(8);
+            if (sample_get_u64(p) != s->n_values) {
+                return 0;
+            }
+            p += 8;
+            if (rf & PERF_FORMAT_TOTAL_TIME_ENABLED) {
+                PUT64(SCOL_TIME_ENABLED);
+            }
+            if (rf & PERF_FORMAT_TOTAL_TIME_RUNNING) {
+                PUT64(SCOL_TIME_RUNNING);
+            }
+            NEED(s->n_values * vsize);
+            for (j = 0; j < s->n_values; ++j) {
+                memcpy(SCOL(SCOL_VALUE) + (i*s->n_values + j)*8, p, 8);
+                p += vsize;
+            }
+        } else {
+            /* { value, time_enabled, time_running, id, lost } */
+            PUT64(SCOL_VALUE);
+            if (rf & PERF_FORMAT_TOTAL_TIME_ENABLED) {
+                PUT64(SCOL_TIME_ENABLED);
+            }
+            if (rf & PERF_FORMAT_TOTAL_TIME_RUNNING) {
+                PUT64(SCOL_TIME_RUNNING);
+            }
+            SKIP(vsize - 8);
+        }
+    }
+    if (st & PERF_SAMPLE_CALLCHAIN) {
+        NEED(8);
+        SKIP(8 + sample_get_u64(p) * 8);
+    }
+    if (st & PERF_SAMPLE_RAW) {
+        NEED(4);
+        SKIP(4 + sample_get_u32(p));
+    }
+    if (st & PERF_SAMPLE_BRANCH_STACK) {
+        unsigned long long nr;
+        NEED(8);
+        nr = sample_get_u64(p);
+        p += 8;
+#if defined(PERF_SAMPLE_BRANCH_HW_INDEX) || !defined(PERF_RECORD_MMAP)
+        if (a->branch_sample_type & PERF_SAMPLE_BRANCH_HW_INDEX) {
+            SKIP(8);
+        }
+#endif
+        SKIP(nr * sizeof(struct perf_branch_entry));
+    }
+    if (st & PERF_SAMPLE_REGS_USER) {
+        NEED(8);
+        if (sample_get_u64(p) != PERF_SAMPLE_REGS_ABI_NONE) {
+            p += 8;
+            SKIP(__builtin_popcountll(a->sample_regs_user) * 8);
+        } else {
+            p += 8;
+        }
+    }
+    if (st & PERF_SAMPLE_STACK_USER) {
+        unsigned long long size;
+        NEED(8);
+        size = sample_get_u64(p);
+        p += 8;
+        if (size) {
+            /* Stack data, then dyn_size */
+            SKIP(size + 8);
+        }
+    }
+#if defined(PERF_SAMPLE_WEIGHT_STRUCT) || !defined(PERF_RECORD_MMAP)
+    if (st & (PERF_SAMPLE_WEIGHT|PERF_SAMPLE_WEIGHT_STRUCT)) {
+#else
+    if (st & PERF_SAMPLE_WEIGHT) {
+#endif
+        PUT64(SCOL_WEIGHT);
+    }
+    if (st & PERF_SAMPLE_DATA_SRC) {
+        PUT64(SCOL_DATA_SRC);
+    }
+    if (st & PERF_SAMPLE_TRANSACTION) {
+        SKIP(8);
+    }
+    if (st & PERF_SAMPLE_REGS_INTR) {
+        NEED(8);
+        if (sample_get_u64(p) != PERF_SAMPLE_REGS_ABI_NONE) {
+            p += 8;
+            SKIP(__builtin_popcountll(a->sample_regs_intr) * 8);
+        } else {
+            p += 8;
+        }
+    }
+    if (st & PERF_SAMPLE_PHYS_ADDR) {
+        PUT64(SCOL_PHYS_ADDR);
+    }
+    /* Anything after this (cgroup, page sizes, AUX data) isn't decoded */
+#undef SKIP
+#undef PUT32
+#undef PUT64
+#undef NEED
+#undef SCOL
+    return 1;
+}
+
+
+/*
+ * Decode the PERF_RECORD_SAMPLE records in a RecordBatch, or in a buffer
+ * of consecutive records (e.g. from a perf.data file), into a SampleColumns
+ * object. Samples are decoded using this event's sample_type and
+ * read_format, so the records should all come from this event, or from
+ * events with the same sampling configuration. Other record types are
+ * counted and skipped.
+ */
+static PyObject *event_decode_samples(PyObject *x, PyObject *arg)
+{
+    EventObject *e = (EventObject *)x;
+    struct perf_event_attr const *a = &e->attr;
+    SampleColumnsObject *s;
+    Py_buffer view;
+    unsigned char const *base;
+    unsigned char const **recs;
+    unsigned int n_recs = 0, n_alloc = 64, i, c;
+    int ok = 1;
+
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    base = (unsigned char const *)view.buf;
+    recs = (unsigned char const **)malloc(n_alloc * sizeof *recs);
+    /* Pass 1: find the records */
+    if (PyObject_TypeCheck(arg, &RecordBatchType)) {
+        RecordBatchObject *b = (RecordBatchObject *)arg;
+        recs = (unsigned char const **)realloc(recs, (b->n_records + 1) * sizeof *recs);
+        for (i = 0; i < b->n_records; ++i) {
+            recs[n_recs++] = base + b->offsets[i];
+        }
+    } else {
+        unsigned long pos = 0;
+        while (pos + sizeof(struct perf_event_header) <= (unsigned long)view.len) {
+            struct perf_event_header const *h = (struct perf_event_header const *)(base + pos);
+            if (h->size < sizeof(struct perf_event_header) || h->size > view.len - pos) {
+                ok = 0;
+                break;
+            }
+            if (n_recs == n_alloc) {
+                n_alloc *= 2;
+                recs = (unsigned char const **)realloc(recs, n_alloc * sizeof *recs);
+            }
+            recs[n_recs++] = base + pos;
+            pos += h->size;
+            if (h->type == 71 /* PERF_RECORD_AUXTRACE */ && h->size >= 16) {
+                /* AUX data follows the record, as in perf.data */
+                pos += sample_get_u64(base + pos - h->size + 8);
+            }
+        }
+    }
+    s = (SampleColumnsObject *)PyObject_CallObject((PyObject *)&SampleColumnsType, NULL);
+    s->sample_type = a->sample_type;
+    s->read_format = a->read_format;
+    for (i = 0; i < n_recs; ++i) {
+        if (((struct perf_event_header const *)recs[i])->type == PERF_RECORD_SAMPLE) {
+            s->n_samples++;
+        } else {
+            s->n_other++;
+        }
+    }
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "corrupt record in sample data");
+        goto fail;
+    }
+    /* The number of values per sample is fixed by the group configuration.
+       Get it from the first sample. */
+    s->n_values = 0;
+    if (a->sample_type & PERF_SAMPLE_READ) {
+        s->n_values = 1;
+        if (a->read_format & PERF_FORMAT_GROUP) {
+            unsigned int const off = sizeof(struct perf_event_header) + sample_offset_to_read(a);
+            s->n_values = 0;
+            for (i = 0; i < n_recs; ++i) {
+                struct perf_event_header const *h = (struct perf_event_header const *)recs[i];
+                if (h->type == PERF_RECORD_SAMPLE) {
+                    if (h->size >= off + 8) {
+                        s->n_values = sample_get_u64(recs[i] + off);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    /* Allocate the columns for the sampled fields */
+    {
+        unsigned long long const st = a->sample_type;
+        unsigned long long const rf = a->read_format;
+        int const present[N_SAMPLE_COLUMNS] = {
+            [SCOL_IP] = !!(st & PERF_SAMPLE_IP),
+            [SCOL_PID] = !!(st & PERF_SAMPLE_TID),
+            [SCOL_TID] = !!(st & PERF_SAMPLE_TID),
+            [SCOL_TIME] = !!(st & PERF_SAMPLE_TIME),
+            [SCOL_ADDR] = !!(st & PERF_SAMPLE_ADDR),
+            [SCOL_ID] = !!(st & (PERF_SAMPLE_ID|PERF_SAMPLE_IDENTIFIER)),
+            [SCOL_STREAM_ID] = !!(st & PERF_SAMPLE_STREAM_ID),
+            [SCOL_CPU] = !!(st & PERF_SAMPLE_CPU),
+            [SCOL_PERIOD] = !!(st & PERF_SAMPLE_PERIOD),
+            [SCOL_TIME_ENABLED] = (st & PERF_SAMPLE_READ) && (rf & PERF_FORMAT_TOTAL_TIME_ENABLED),
+            [SCOL_TIME_RUNNING] = (st & PERF_SAMPLE_READ) && (rf & PERF_FORMAT_TOTAL_TIME_RUNNING),
+            [SCOL_VALUE] = !!(st & PERF_SAMPLE_READ),
+#if defined(PERF_SAMPLE_WEIGHT_STRUCT) || !defined(PERF_RECORD_MMAP)
+            [SCOL_WEIGHT] = !!(st & (PERF_SAMPLE_WEIGHT|PERF_SAMPLE_WEIGHT_STRUCT)),
+#else
+            [SCOL_WEIGHT] = !!(st & PERF_SAMPLE_WEIGHT),
+#endif
+            [SCOL_DATA_SRC] = !!(st & PERF_SAMPLE_DATA_SRC),
+            [SCOL_PHYS_ADDR] = !!(st & PERF_SAMPLE_PHYS_ADDR),
+        };
+        for (c = 0; c < N_SAMPLE_COLUMNS; ++c) {
+            if (present[c]) {
+                unsigned long size = (unsigned long)s->n_samples * sample_columns[c].size;
+                if (c == SCOL_VALUE) {
+                    size *= s->n_values;
+                }
+                s->col[c] = MyBytes_FromStringAndSize(NULL, size);
+                if (!s->col[c]) {
+                    goto fail;
+                }
+            }
+        }
+    }
+    /* Pass 2: decode the samples */
+    {
+        unsigned int row = 0;
+        for (i = 0; i < n_recs; ++i) {
+            struct perf_event_header const *h = (struct perf_event_header const *)recs[i];
+            if (h->type != PERF_RECORD_SAMPLE) {
+                continue;
+            }
+            if (!sample_decode_one(s, a, row, recs[i] + sizeof(struct perf_event_header), recs[i] + h->size)) {
+                PyErr_Format(PyExc_ValueError, "sample %u does not match sample_type 0x%x", row, (unsigned int)a->sample_type);
+                goto fail;
+            }
+            ++row;
+        }
+    }
+    free(recs);
+    PyBuffer_Release(&view);
+    return (PyObject *)s;
+
+fail:
+    Py_DECREF(s);
+    free(recs);
+    PyBuffer_Release(&view);
+    return NULL;
+}
+
+
+static PyMethodDef Event_methods[] = {
+    {"attr_struct", (PyCFunction)&event_attr_struct, METH_NOARGS, "string: event attributes as raw string"},
+    {"fileno", (PyCFunction)&event_fileno, METH_NOARGS, "int: file handle - not for general use"},  /* this makes it a "waitable object" */
+    {"id", (PyCFunction)&event_id, METH_NOARGS, "int: unique id"},
+    {"close", (PyCFunction)&event_close, METH_NOARGS, "close the event"},
+    {"capabilities", (PyCFunction)&event_capabilities, METH_NOARGS, "int: get capability flags"},
+    {"bind", (PyCFunction)&event_bind, METH_VARARGS|METH_KEYWORDS, "int, int -> start collecting an event"},
+    {"set_filter", (PyCFunction)&event_set_filter, METH_O, "str: set filter on event"},
+    {"reset", (PyCFunction)&event_reset, METH_NOARGS, "int: reset the event count"},
+    {"enable", (PyCFunction)&event_enable, METH_NOARGS, "int: enable the event"},
+    {"disable", (PyCFunction)&event_disable, METH_NOARGS, "int: disable the event"},
+    {"refresh", (PyCFunction)&event_refresh, METH_O, "int -> refresh the wakeup counter"},
+    {"pause", (PyCFunction)&event_pause, METH_NOARGS, "pause a sampling event"},
+    {"resume", (PyCFunction)&event_resume, METH_NOARGS, "resume a sampling event"},
+    {"snapshot", (PyCFunction)&event_snapshot, METH_VARARGS|METH_KEYWORDS, "(bytes, bytes): newest records and AUX data, for an overwrite-mode event"},
+    {"read", (PyCFunction)&event_read, METH_NOARGS, "Reading: read the current value of a counting event"},
+    {"poll", (PyCFunction)&event_poll, METH_NOARGS, "bool: test if event record is available"},
+    {"is_active", (PyCFunction)&event_is_active, METH_NOARGS, "bool: test if event was closed by kernel"},
+    {"get_record", (PyCFunction)&event_get_record, METH_NOARGS, "Record: get next record from a sampling event"},
+    {"drain", (PyCFunction)&event_drain, METH_NOARGS, "RecordBatch: get all available records from a sampling event"},
+    {"decode_samples", (PyCFunction)&event_decode_samples, METH_O, "RecordBatch|bytes -> SampleColumns: decode sample records into arrays"},
+    {"get_aux", (PyCFunction)&event_get_aux, METH_NOARGS, "string: get AUX data"},
+    {"aux_stats", (PyCFunction)&event_aux_stats, METH_VARARGS|METH_KEYWORDS, "dict: AUX data accounting; reset=True to clear"},
+    {NULL}
+};
+
+
+/*
+ * Need to explicitly include structmember.h for this?
+ */
+static struct PyMemberDef Event_members[] = {
+    {"type", T_INT, offsetof(EventObject, attr.type), 0, "perf event type"},
+    {"code", T_INT, offsetof(EventObject, attr.config), 0, "perf event code"},
+    {"sample_type", T_ULONGLONG, offsetof(EventObject, attr.sample_type), 0, "mask of data in sample records"},
+    {"cpu", T_INT, offsetof(EventObject, cpu), 0, "cpu that this event is bound to, or -1"},
+    {"verbose", T_INT, offsetof(EventObject, verbose), 0, "verbosity level"}, 
+    {NULL}
+};
+
+
+static PyTypeObject EventType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_basicsize = sizeof(EventObject),
+    .tp_name = "perf_events.Event",
+    .tp_doc = "perf event",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = Event_methods,
+    .tp_members = Event_members,
+    .tp_repr = event_repr,
+    .tp_str = event_str,
+    .tp_alloc = 0,
+    .tp_new = event_new,
+    .tp_init = event_init,
+    .tp_dealloc = event_dealloc
+};
+
+
+static PyMethodDef BaseReading_methods[] = {
+    {"is_incomplete", (PyCFunction)&reading_is_incomplete, METH_NOARGS, "bool: only partial data is available"},
+    {"is_missing", (PyCFunction)&reading_is_missing, METH_NOARGS, "bool: no data is available"},
+    {"update", (PyCFunction)&reading_update, METH_NOARGS, "take another reading"},
+    {NULL}
+};
+
+
+static struct PyMemberDef BaseReading_members[] = {
+    {"time_enabled_ns", T_LONGLONG, offsetof(BaseReadingObject, sample.time_enabled), 0, "time enabled (ns)"},
+    {"time_running_ns", T_LONGLONG, offsetof(BaseReadingObject, sample.time_running), 0, "time running (ns)"},
+    {"fraction_running", T_DOUBLE, offsetof(BaseReadingObject, fraction_running), 0, "float: fraction of time event was running"},
+    {"event", T_OBJECT, offsetof(BaseReadingObject, event), 0, "Event object this reading was taken from"},
+    {"id", T_LONGLONG, offsetof(ReadingObject, base.sample.id), 0, "event id"},
+    {NULL}
+};
+
+
+static PyMethodDef Reading_methods[] = {
+    {NULL}
+};
+
+
+static struct PyMemberDef Reading_members[] = {
+    {"raw_value", T_LONGLONG, offsetof(ReadingObject, base.sample.value), 0, "raw count"},
+    {"value", T_OBJECT, offsetof(ReadingObject, adjusted_value), 0, "adjusted count - None if event was never scheduled"},
+    {NULL}
+};
+
+
+static PyMethodDef GroupReading_methods[] = {
+    {NULL}
+};
+
+
+static PySequenceMethods GroupReading_seqmethods = {
+    .sq_length = &groupreading_seq_length,
+    .sq_item = &groupreading_seq_item
+};
+
+
+static struct PyMemberDef GroupReading_members[] = {
+    {NULL}
+};
+
+
+static PyTypeObject BaseReadingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_basicsize = sizeof(BaseReadingObject),
+    .tp_name = "perf_events.BaseReading",
+    .tp_doc = "Base reading class",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = BaseReading_methods,
+    .tp_members = BaseReading_members,
+    //.tp_str = basereading_str,
+    .tp_new = basereading_new,   /* should not be called */
+    .tp_dealloc = basereading_dealloc
+};
+
+
+static PyTypeObject ReadingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_base = &BaseReadingType,
+    .tp_basicsize = sizeof(ReadingObject),
+    .tp_name = "perf_events.Reading",
+    .tp_doc = "A reading taken from a counting perf event",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = Reading_methods,
+    .tp_members = Reading_members,
+    .tp_str = reading_str,
+    .tp_new = reading_new,
+    .tp_dealloc = reading_dealloc
+};
+
+
+static PyTypeObject GroupReadingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_base = &BaseReadingType,
+    .tp_basicsize = sizeof(GroupReadingObject),
+    .tp_name = "perf_events.GroupReading",
+    .tp_doc = "A reading taken from a counting perf event group",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = GroupReading_methods,
+    .tp_members = GroupReading_members,
+    .tp_as_sequence = &GroupReading_seqmethods,
+    .tp_str = groupreading_str,
+    .tp_new = groupreading_new,
+    .tp_dealloc = groupreading_dealloc
+};
+
+
+/*
+ * Convert a hardware timestamp to a kernel timestamp as found in perf.data.
+ */
+static unsigned long long timeconv_convert(TimeConvObject const *c, unsigned long long cyc)
+{
+    unsigned long long quot, rem;
+    quot = (cyc >> c->time_shift);
+    rem = cyc & ((1ULL << c->time_shift) - 1);
+    return c->time_zero + quot*c->time_mult + ((rem*c->time_mult) >> c->time_shift);
+}
+
+
+static PyObject *timeconv_to_time(PyObject *x, PyObject *v)
+{
+    TimeConvObject *c = (TimeConvObject *)x;
+    unsigned long long cyc = PyLong_AsUnsignedLongLongMask(v);
+    return PyLong_FromUnsignedLongLong(timeconv_convert(c, cyc));
+}
+
+
+static int timeconv_from_mmap(TimeConvObject *c, struct perf_event_mmap_page volatile *mp)
+{ 
+    if (!(mp->capabilities & _cap_user_time_zero)) {
+        /* Can't read timebase from userspace */
+        return 0;
+    }
+    unsigned int seq;
+    do {
+        seq = mp->lock;
+        barrier();
+        if (mp->capabilities & _cap_user_time_zero) {
+            //cyc = hardware_timestamp();
+            c->time_zero = mp->time_zero;
+            c->time_mult = mp->time_mult;
+            c->time_shift = mp->time_shift;
+        }
+        barrier();
+    } while (mp->lock != seq);
+    return 1;
+}
+
+
+/*
+ * Get the time conversion parameters - these are global, but if we don't
+ * already have an event we need to open a dummy event to get them.
+ */
+static int timeconv_from_dummy(TimeConvObject *c)
+{
+    int ok = 0;
+    struct perf_event_attr pa;
+    memset(&pa, 0, sizeof pa);
+    pa.size = sizeof pa;
+    pa.type = PERF_TYPE_SOFTWARE;
+    pa.config = PERF_COUNT_SW_DUMMY;
+    /* Open a temporary dummy event, which we will close before returning. */
+    int e_fd = perf_event_open(&pa, /*pid=*/0, -1, -1, 0);
+    if (e_fd < 0) {
+        perror("dummy event");
+        return 0;
+    }
+    unsigned int size = sysconf(_SC_PAGESIZE);
+    void *pmap = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, e_fd, 0);
+    if (pmap != MAP_FAILED) {
+        ok = timeconv_from_mmap(c, (struct perf_event_mmap_page *)pmap);
+        if (!ok) {
+            PyErr_SetString(PyExc_ValueError, "mmap buffer doesn't contain system time base");
+        }
+        munmap(pmap, size);
+    } else {
+        perror("mmap");
+    }
+    close(e_fd);    /* Close the temporary dummy event. */
+    return ok;
+}
+
+
+/*
+ * TimeConv() gets the parameters for the running system.
+ * TimeConv(time_zero=, time_mult=, time_shift=) uses given parameters,
+ * e.g. from a PERF_RECORD_TIME_CONV record in a perf.data file.
+ */
+static PyObject *timeconv_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"time_zero", "time_mult", "time_shift", NULL};
+    unsigned long long zero = 0, mult = 0, shift = 0;
+    TimeConvObject *c;
+    int ok;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KKK", kwlist, &zero, &mult, &shift)) {
+        return NULL;
+    }
+    c = (TimeConvObject *)t->tp_alloc(t, 0);
+    if (mult) {
+        c->time_zero = zero;
+        c->time_mult = mult;
+        c->time_shift = shift;
+        ok = 1;
+    } else {
+        ok = timeconv_from_dummy(c);
+    }
+    if (!ok) {
+        t->tp_free(c);
+        return NULL;
+    }
+    return (PyObject *)c;
+}
+
+
+static void timeconv_dealloc(PyObject *x)
+{
+    x->ob_type->tp_free(x);
+}
+
+
+static PyMethodDef TimeConv_methods[] = {
+    {"to_time", (PyCFunction)&timeconv_to_time, METH_O, "convert hardware timestamp to user time"},
+    {NULL}
+};
+
+static struct PyMemberDef TimeConv_members[] = {
+    {"time_zero", T_LONG, offsetof(TimeConvObject, time_zero), 0, "time zero"},
+    {"time_mult", T_LONG, offsetof(TimeConvObject, time_mult), 0, "time multiplier"},
+    {"time_shift", T_LONG, offsetof(TimeConvObject, time_shift), 0, "time shift"},
+    {NULL}
+};
+
+static PyTypeObject TimeConvType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_basicsize = sizeof(TimeConvObject),
+    .tp_name = "perf_events.TimeConv",
+    .tp_doc = "time conversion parameters",
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = TimeConv_methods,
+    .tp_members = TimeConv_members,
+    //.tp_str = timeconv_str,
+    .tp_new = timeconv_new,
+    .tp_dealloc = timeconv_dealloc
+};
+
+
+/*
+ * Decoding of Arm Statistical Profiling Extension (SPE) data, as found in
+ * an AUX buffer.
+ *
+ * An SPE buffer is a sequence of records, each a sequence of packets and
+ * ended by an End or Timestamp packet. Each packet has a one-byte header
+ * (or a two-byte header, for "extended" packets with a larger index) and
+ * a payload of 1, 2, 4 or 8 bytes, the size being given by header bits [5:4].
+ * The layout follows the Arm ARM (chapter "Statistical Profiling Extension")
+ * and Linux tools/perf/util/arm-spe-decoder.
+ *
+ * We decode a whole buffer into columns, one entry per record, rather than
+ * making a Python object per record or packet.
+ */
+enum {
+    SPECOL_PC,              /* instruction virtual address */
+    SPECOL_EL,              /* exception level of the instruction */
+    SPECOL_NS,              /* non-secure state of the instruction */
+    SPECOL_TARGET,          /* branch target address */
+    SPECOL_VADDR,           /* data virtual address */
+    SPECOL_PADDR,           /* data physical address */
+    SPECOL_TOTAL_LAT,       /* total latency, in cycles */
+    SPECOL_ISSUE_LAT,       /* issue latency */
+    SPECOL_XLAT_LAT,        /* translation latency */
+    SPECOL_EVENTS,          /* event bitmask */
+    SPECOL_OP_CLASS,        /* operation class: 0 other, 1 load/store/atomic, 2 branch */
+    SPECOL_OP_SUBCLASS,     /* operation subclass, e.g. bit 0 set for a store */
+    SPECOL_DATA_SOURCE,
+    SPECOL_CONTEXT,         /* CONTEXTIDR_EL1 (often the pid) */
+    SPECOL_TIMESTAMP,       /* hardware timestamp */
+    SPECOL_TIME,            /* timestamp converted to perf time, if we have a TimeConv */
+    N_SPE_COLUMNS
+};
+
+static struct {
+    char const *name;
+    char const *format;     /* struct/memoryview format */
+    unsigned char size;
+} const spe_columns[N_SPE_COLUMNS] = {
+    {"pc", "Q", 8},
+    {"el", "B", 1},
+    {"ns", "B", 1},
+    {"target", "Q", 8},
+    {"vaddr", "Q", 8},
+    {"paddr", "Q", 8},
+    {"total_lat", "H", 2},
+    {"issue_lat", "H", 2},
+    {"xlat_lat", "H", 2},
+    {"events", "Q", 8},
+    {"op_class", "B", 1},
+    {"op_subclass", "B", 1},
+    {"data_source", "H", 2},
+    {"context", "I", 4},
+    {"timestamp", "Q", 8},
+    {"time", "Q", 8},
+};
+
+#define SPE_HEADER0_PAD         0x00
+#define SPE_HEADER0_END         0x01
+#define SPE_HEADER0_TIMESTAMP   0x71
+#define SPE_HEADER0_EVENTS      0x42    /* with mask 0xcf */
+#define SPE_HEADER0_SOURCE      0x43    /* with mask 0xcf */
+#define SPE_HEADER0_CONTEXT     0x64    /* with mask 0xfc */
+#define SPE_HEADER0_OP_TYPE     0x48    /* with mask 0xfc */
+#define SPE_HEADER0_EXTENDED    0x20    /* with mask 0xfc */
+#define SPE_HEADER0_ADDRESS     0xb0    /* with mask 0xf8 */
+#define SPE_HEADER0_COUNTER     0x98    /* with mask 0xf8 */
+
+/* One record being decoded */
+typedef struct {
+    unsigned long long pc, target, vaddr, paddr, events, timestamp;
+    unsigned int context;
+    unsigned short total_lat, issue_lat, xlat_lat, data_source;
+    unsigned char el, ns, op_class, op_subclass;
+} spe_record_t;
+
+
+/*
+ * Add a record to the columns, growing them as needed.
+ */
+static void spe_emit(unsigned char **cols, unsigned long *n, unsigned long *n_alloc, spe_record_t const *r, TimeConvObject const *tc)
+{
+    unsigned int c;
+    unsigned long long v[N_SPE_COLUMNS];
+    if (*n == *n_alloc) {
+        *n_alloc = *n_alloc ? *n_alloc * 2 : 1024;
+        for (c = 0; c < N_SPE_COLUMNS; ++c) {
+            cols[c] = (unsigned char *)realloc(cols[c], *n_alloc * spe_columns[c].size);
+        }
+    }
+    v[SPECOL_PC] = r->pc;
+    v[SPECOL_EL] = r->el;
+    v[SPECOL_NS] = r->ns;
+    v[SPECOL_TARGET] = r->target;
+    v[SPECOL_VADDR] = r->vaddr;
+    v[SPECOL_PADDR] = r->paddr;
+    v[SPECOL_TOTAL_LAT] = r->total_lat;
+    v[SPECOL_ISSUE_LAT] = r->issue_lat;
+    v[SPECOL_XLAT_LAT] = r->xlat_lat;
+    v[SPECOL_EVENTS] = r->events;
+    v[SPECOL_OP_CLASS] = r->op_class;
+    v[SPECOL_OP_SUBCLASS] = r->op_subclass;
+    v[SPECOL_DATA_SOURCE] = r->data_source;
+    v[SPECOL_CONTEXT] = r->context;
+    v[SPECOL_TIMESTAMP] = r->timestamp;
+    v[SPECOL_TIME] = tc ? timeconv_convert(tc, r->timestamp) : 0;
+    for (c = 0; c < N_SPE_COLUMNS; ++c) {
+        unsigned char *p = cols[c] + *n * spe_columns[c].size;
+        switch (spe_columns[c].size) {
+        case 1: *p = (unsigned char)v[c]; break;
+        case 2: *(unsigned short *)p = (unsigned short)v[c]; break;
+        case 4: *(unsigned int *)p = (unsigned int)v[c]; break;
+        default: *(unsigned long long *)p = v[c]; break;
+        }
+    }
+    ++*n;
+}
+
+
+/*
+ * Decode an address packet payload, as Linux's arm_spe_calc_ip().
+ */
+static void spe_address(spe_record_t *r, unsigned int index, unsigned long long payload)
+{
+    unsigned long long const addr = payload & 0x00ffffffffffffffULL;
+    switch (index) {
+    case 0:     /* instruction virtual address */
+    case 1:     /* branch target */
+        {
+            unsigned int const ns = (payload >> 63) & 1;
+            unsigned int const el = (payload >> 61) & 3;
+            unsigned long long a = addr;
+            if (ns && (el == 1 || el == 2)) {
+                a |= 0xffULL << 56;
+            }
+            if (index == 0) {
+                r->pc = a;
+                r->el = el;
+                r->ns = ns;
+            } else {
+                r->target = a;
+            }
+        }
+        break;
+    case 2:     /* data virtual address: bits [63:56] may be a tag */
+        r->vaddr = addr;
+        /* As the kernel does: bits [55:48] all set means a kernel address */
+        if (((addr >> 48) & 0xff) == 0xff) {
+            r->vaddr |= 0xffULL << 56;
+        }
+        break;
+    case 3:     /* data physical address */
+        r->paddr = addr;
+        break;
+    }
+}
+
+
+/*
+ * decode_spe(buffer, timeconv=None) -> dict of columns
+ */
+static PyObject *perf_decode_spe(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"buffer", "timeconv", NULL};
+    PyObject *bo, *tco = Py_None;
+    Py_buffer view;
+    TimeConvObject const *tc = NULL;
+    unsigned char const *p, *end;
+    unsigned char *cols[N_SPE_COLUMNS];
+    unsigned long n = 0, n_alloc = 0, n_bad = 0;
+    spe_record_t rec;
+    int in_record = 0;
+    unsigned int c;
+    PyObject *d;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &bo, &tco)) {
+        return NULL;
+    }
+    if (tco != Py_None) {
+        if (!PyObject_TypeCheck(tco, &TimeConvType)) {
+            PyErr_SetString(PyExc_TypeError, "timeconv must be a TimeConv object");
+            return NULL;
+        }
+        tc = (TimeConvObject const *)tco;
+    }
+    if (PyObject_GetBuffer(bo, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    memset(cols, 0, sizeof cols);
+    memset(&rec, 0, sizeof rec);
+    p = (unsigned char const *)view.buf;
+    end = p + view.len;
+    Py_BEGIN_ALLOW_THREADS
+    while (p < end) {
+        unsigned int h = *p++;
+        unsigned int index;
+        unsigned int size;
+        unsigned long long payload = 0;
+        if (h == SPE_HEADER0_PAD) {
+            continue;
+        }
+        if (h == SPE_HEADER0_END) {
+            if (in_record) {
+                spe_emit(cols, &n, &n_alloc, &rec, tc);
+                memset(&rec, 0, sizeof rec);
+                in_record = 0;
+            }
+            continue;
+        }
+        if ((h & 0xfc) == SPE_HEADER0_EXTENDED) {
+            /* Two-byte header: the index has two more bits, from the first byte */
+            if (p >= end) {
+                break;
+            }
+            index = (h & 3) << 3;
+            h = *p++;
+            index |= h & 7;
+        } else {
+            index = h & 7;
+        }
+        size = 1U << ((h >> 4) & 3);
+        if (p + size > end) {
+            break;
+        }
+        memcpy(&payload, p, size);
+        p += size;
+        if (h == SPE_HEADER0_TIMESTAMP) {
+            /* The timestamp ends the record */
+            rec.timestamp = payload;
+            spe_emit(cols, &n, &n_alloc, &rec, tc);
+            memset(&rec, 0, sizeof rec);
+            in_record = 0;
+            continue;
+        }
+        in_record = 1;
+        if ((h & 0xcf) == SPE_HEADER0_EVENTS) {
+            rec.events = payload;
+        } else if ((h & 0xcf) == SPE_HEADER0_SOURCE) {
+            rec.data_source = (unsigned short)payload;
+        } else if ((h & 0xfc) == SPE_HEADER0_CONTEXT) {
+            if ((h & 3) == 0) {
+                rec.context = (unsigned int)payload;
+            }
+        } else if ((h & 0xfc) == SPE_HEADER0_OP_TYPE) {
+            rec.op_class = h & 3;
+            rec.op_subclass = (unsigned char)payload;
+        } else if ((h & 0xf8) == SPE_HEADER0_ADDRESS) {
+            spe_address(&rec, index, payload);
+        } else if ((h & 0xf8) == SPE_HEADER0_COUNTER) {
+            if (index == 0) {
+                rec.total_lat = (unsigned short)payload;
+            } else if (index == 1) {
+                rec.issue_lat = (unsigned short)payload;
+            } else if (index == 2) {
+                rec.xlat_lat = (unsigned short)payload;
+            }
+        } else {
+            ++n_bad;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    d = PyDict_New();
+    for (c = 0; c < N_SPE_COLUMNS; ++c) {
+        PyObject *b, *col;
+        if (c == SPECOL_TIME && !tc) {
+            free(cols[c]);
+            continue;
+        }
+        b = MyBytes_FromStringAndSize((char const *)cols[c], n * spe_columns[c].size);
+        free(cols[c]);
+#if PY_MAJOR_VERSION >= 3
+        {
+            PyObject *mv = PyMemoryView_FromObject(b);
+            Py_DECREF(b);
+            col = PyObject_CallMethod(mv, "cast", "s", spe_columns[c].format);
+            Py_DECREF(mv);
+        }
+#else
+        /* No memoryview.cast: return the raw array */
+        col = b;
+#endif
+        PyDict_SetItemString(d, spe_columns[c].name, col);
+        Py_DECREF(col);
+    }
+    {
+        PyObject *nb = PyLong_FromUnsignedLong(n_bad);
+        PyDict_SetItemString(d, "unknown_packets", nb);
+        Py_DECREF(nb);
+    }
+    return d;
+}
+
+
+/*
+ * Decoding of Arm ETE and ETMv4 instruction trace.
+ *
+ * The trace is a byte stream of packets (see the ETMv4 architecture
+ * specification, IHI0064, and the ETE specification, IHI0065). Packets
+ * tell us about "P0 elements" - branches, exceptions etc. - as atoms
+ * (taken/not taken), and give addresses only when they can't be inferred.
+ * To reconstruct the executed instruction ranges we walk the code from
+ * the last known address to the next branch, for each atom, which needs
+ * the code images. Only A64 code can be walked; for other code we just
+ * report the addresses we see.
+ *
+ * We assume non-speculative trace, as from current A-profile cores,
+ * i.e. atoms are committed as they are traced. Conditional instruction
+ * tracing (ETMv4 only) isn't supported: we resynchronize at the next
+ * A-sync.
+ *
+ * The decoder can start anywhere in a buffer: it skips to the first
+ * A-sync packet. So a large buffer can be decoded in pieces, in parallel,
+ * by splitting it at the offsets found by etm_sync_points().
+ */
+enum {
+    ETMEL_RANGE = 1,            /* instructions executed: [addr, end) */
+    ETMEL_TRACE_ON,             /* trace (re)started, e.g. after a filter or a gap */
+    ETMEL_EXCEPTION,            /* exception: addr is the preferred return address, count is the type */
+    ETMEL_EXCEPTION_RETURN,
+    ETMEL_TIMESTAMP,
+    ETMEL_CONTEXT,              /* context changed: see el, ns, context, vmid */
+    ETMEL_ADDR_NACC,            /* can't walk the code at addr: no image, or not A64 */
+    ETMEL_OVERFLOW,             /* trace was lost */
+    ETMEL_DISCARD,              /* speculative trace was discarded */
+    ETMEL_EVENT,                /* count is the event bitmask */
+    ETMEL_INSTRUCTION_COUNT,    /* Q element: count instructions from addr */
+    ETMEL_TRACE_INFO,           /* start of trace, after an A-sync */
+};
+
+/* Class of the last instruction in a range */
+enum {
+    ETM_INSN_OTHER,
+    ETM_INSN_BRANCH,            /* direct branch */
+    ETM_INSN_BRANCH_LINK,       /* direct branch with link, i.e. call */
+    ETM_INSN_INDIRECT,          /* indirect branch */
+    ETM_INSN_INDIRECT_LINK,     /* indirect call */
+    ETM_INSN_RETURN,            /* RET, ERET */
+    ETM_INSN_WFX,               /* WFI/WFE, when traced as P0 elements */
+};
+
+enum {
+    ETMCOL_KIND,
+    ETMCOL_OFFSET,              /* offset in the buffer of the packet that generated the element */
+    ETMCOL_ADDR,
+    ETMCOL_END,
+    ETMCOL_COUNT,
+    ETMCOL_LAST,                /* ETM_INSN_xxx for a range */
+    ETMCOL_TAKEN,
+    ETMCOL_EL,
+    ETMCOL_NS,
+    ETMCOL_CONTEXT,
+    ETMCOL_VMID,
+    ETMCOL_TIMESTAMP,
+    ETMCOL_CYCLES,              /* cycle count accumulated since the start of decode */
+    N_ETM_COLUMNS
+};
+
+static struct {
+    char const *name;
+    char const *format;
+    unsigned char size;
+} const etm_columns[N_ETM_COLUMNS] = {
+    {"kind", "B", 1},
+    {"offset", "Q", 8},
+    {"addr", "Q", 8},
+    {"end", "Q", 8},
+    {"count", "I", 4},
+    {"last", "B", 1},
+    {"taken", "B", 1},
+    {"el", "B", 1},
+    {"ns", "B", 1},
+    {"context", "I", 4},
+    {"vmid", "I", 4},
+    {"timestamp", "Q", 8},
+    {"cycles", "Q", 8},
+};
+
+/* A code image, in which we can walk instructions */
+typedef struct {
+    unsigned long long base;
+    unsigned long long end;
+    unsigned char const *data;
+} etm_image_t;
+
+typedef struct {
+    unsigned char const *buf;
+    unsigned long len;
+    unsigned long pos;
+    /* Configuration, from TRCIDRn */
+    unsigned int commit_opt;        /* TRCIDR0.COMMOPT: cycle count format 1 has no commit field */
+    unsigned int vmid_bytes;        /* from TRCIDR2.VMIDSIZE */
+    unsigned int cid_bytes;         /* from TRCIDR2.CIDSIZE */
+    unsigned int wfx_branch;        /* TRCIDR2.WFXMODE: WFI/WFE are P0 elements */
+    etm_image_t const *images;
+    unsigned int n_images;
+    /* Decode state */
+    int synced;
+    unsigned long long addr_hist[3];
+    int addr_valid;
+    int sf;                         /* from the context: 64-bit (AArch64) state */
+    int is;                         /* from the last address packet: instruction set (IS1 is T32) */
+    int a64;                        /* sf && !is: walk A64 code */
+    unsigned int el, ns;
+    unsigned int cid, vmid;
+    unsigned long long timestamp;
+    unsigned long long cycles;
+    unsigned long long offset_base;     /* offset of this buffer in the whole trace */
+    int exception_pending;
+    unsigned int exception_type;
+    unsigned long pkt_offset;
+    /* Output */
+    unsigned char *cols[N_ETM_COLUMNS];
+    unsigned long n, n_alloc;
+    unsigned long n_unknown;
+    unsigned long n_lost_atoms;
+} etm_decoder_t;
+
+
+static void etm_emit(etm_decoder_t *d, unsigned int kind, unsigned long long addr, unsigned long long end, unsigned int count, unsigned int last, unsigned int taken)
+{
+    unsigned int c;
+    unsigned long long v[N_ETM_COLUMNS];
+    if (d->n == d->n_alloc) {
+        d->n_alloc = d->n_alloc ? d->n_alloc * 2 : 1024;
+        for (c = 0; c < N_ETM_COLUMNS; ++c) {
+            d->cols[c] = (unsigned char *)realloc(d->cols[c], d->n_alloc * etm_columns[c].size);
+        }
+    }
+    v[ETMCOL_KIND] = kind;
+    v[ETMCOL_OFFSET] = d->offset_base + d->pkt_offset;
+    v[ETMCOL_ADDR] = addr;
+    v[ETMCOL_END] = end;
+    v[ETMCOL_COUNT] = count;
+    v[ETMCOL_LAST] = last;
+    v[ETMCOL_TAKEN] = taken;
+    v[ETMCOL_EL] = d->el;
+    v[ETMCOL_NS] = d->ns;
+    v[ETMCOL_CONTEXT] = d->cid;
+    v[ETMCOL_VMID] = d->vmid;
+    v[ETMCOL_TIMESTAMP] = d->timestamp;
+    v[ETMCOL_CYCLES] = d->cycles;
+    for (c = 0; c < N_ETM_COLUMNS; ++c) {
+        unsigned char *p = d->cols[c] + d->n * etm_columns[c].size;
+        switch (etm_columns[c].size) {
+        case 1: *p = (unsigned char)v[c]; break;
+        case 2: *(unsigned short *)p = (unsigned short)v[c]; break;
+        case 4: *(unsigned int *)p = (unsigned int)v[c]; break;
+        default: *(unsigned long long *)p = v[c]; break;
+        }
+    }
+    ++d->n;
+}
+
+
+/*
+ * Find the image containing an address, or NULL. The images are sorted by address.
+ */
+static etm_image_t const *etm_find_image(etm_decoder_t const *d, unsigned long long addr)
+{
+    unsigned int lo = 0, hi = d->n_images;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (addr < d->images[mid].base) {
+            hi = mid;
+        } else if (addr >= d->images[mid].end) {
+            lo = mid + 1;
+        } else {
+            return &d->images[mid];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Classify an A64 instruction as a P0 element or not, and get the target of a direct branch.
+ */
+static unsigned int etm_a64_branch(etm_decoder_t const *d, unsigned int insn, unsigned long long pc, unsigned long long *target)
+{
+    long long off;
+    if ((insn & 0x7c000000) == 0x14000000) {
+        /* B, BL: imm26 */
+        off = (int)(insn << 6) >> 4;
+        *target = pc + off;
+        return (insn & 0x80000000) ? ETM_INSN_BRANCH_LINK : ETM_INSN_BRANCH;
+    }
+    if ((insn & 0xff000000) == 0x54000000 || (insn & 0x7e000000) == 0x34000000) {
+        /* B.cond, BC.cond, CBZ, CBNZ: imm19 */
+        off = (int)((insn & 0x00ffffe0) << 8) >> 11;
+        *target = pc + off;
+        return ETM_INSN_BRANCH;
+    }
+    if ((insn & 0x7e000000) == 0x36000000) {
+        /* TBZ, TBNZ: imm14 */
+        off = (int)((insn & 0x0007ffe0) << 13) >> 16;
+        *target = pc + off;
+        return ETM_INSN_BRANCH;
+    }
+    if ((insn & 0xfe000000) == 0xd6000000) {
+        /* Unconditional branch (register): BR, BLR, RET, ERET and the pointer authentication forms */
+        unsigned int opc = (insn >> 21) & 0xf;
+        if (opc == 1 || opc == 9) {
+            return ETM_INSN_INDIRECT_LINK;
+        } else if (opc == 2 || opc == 4) {
+            return ETM_INSN_RETURN;
+        }
+        return ETM_INSN_INDIRECT;
+    }
+    if (d->wfx_branch && (insn == 0xd503207f || insn == 0xd503205f)) {
+        return ETM_INSN_WFX;
+    }
+    return ETM_INSN_OTHER;
+}
+
+
+/*
+ * Process an atom: walk from the current address to the next P0 instruction,
+ * and emit the range.
+ */
+static void etm_atom(etm_decoder_t *d, int taken)
+{
+    unsigned long long const start = d->addr_hist[0];
+    unsigned long long pc = start;
+    unsigned long long target = 0;
+    etm_image_t const *im;
+    unsigned int cls = ETM_INSN_OTHER;
+    unsigned int n = 0;
+    if (!d->addr_valid) {
+        ++d->n_lost_atoms;
+        return;
+    }
+    im = etm_find_image(d, pc);
+    if (!d->a64 || !im) {
+        etm_emit(d, ETMEL_ADDR_NACC, pc, 0, 0, 0, taken);
+        d->addr_valid = 0;
+        ++d->n_lost_atoms;
+        return;
+    }
+    for (;;) {
+        unsigned int insn;
+        if (pc + 4 > im->end) {
+            im = etm_find_image(d, pc);
+            if (!im || pc + 4 > im->end) {
+                break;
+            }
+        }
+        memcpy(&insn, im->data + (pc - im->base), 4);
+        ++n;
+        cls = etm_a64_branch(d, insn, pc, &target);
+        if (cls != ETM_INSN_OTHER) {
+            break;
+        }
+        pc += 4;
+    }
+    if (cls == ETM_INSN_OTHER) {
+        /* Ran off the end of the code */
+        etm_emit(d, ETMEL_ADDR_NACC, pc, 0, 0, 0, taken);
+        d->addr_valid = 0;
+        ++d->n_lost_atoms;
+        return;
+    }
+    etm_emit(d, ETMEL_RANGE, start, pc + 4, n, cls, taken);
+    if (!taken || cls == ETM_INSN_WFX) {
+        d->addr_hist[0] = pc + 4;
+    } else if (cls == ETM_INSN_BRANCH || cls == ETM_INSN_BRANCH_LINK) {
+        d->addr_hist[0] = target;
+    } else {
+        /* Indirect branch: the target will be in an address packet */
+        d->addr_valid = 0;
+    }
+}
+
+
+/*
+ * Read a field of up to 'max' bytes, each with 7 bits of value and a continuation bit.
+ * Return -1 if the buffer ends first.
+ */
+static int etm_read_cont(etm_decoder_t *d, unsigned long long *v, unsigned int max)
+{
+    unsigned int i;
+    *v = 0;
+    for (i = 0; i < max; ++i) {
+        unsigned int b;
+        if (d->pos >= d->len) {
+            return -1;
+        }
+        b = d->buf[d->pos++];
+        if (i == 8) {
+            /* Ninth byte of a timestamp has 8 bits */
+            *v |= (unsigned long long)b << 56;
+            return i + 1;
+        }
+        *v |= (unsigned long long)(b & 0x7f) << (7*i);
+        if (!(b & 0x80)) {
+            return i + 1;
+        }
+    }
+    return i;
+}
+
+
+static int etm_read_bytes(etm_decoder_t *d, unsigned long long *v, unsigned int n)
+{
+    if (d->pos + n > d->len) {
+        return -1;
+    }
+    *v = 0;
+    memcpy(v, d->buf + d->pos, n);
+    d->pos += n;
+    return n;
+}
+
+
+/*
+ * A new address, from an address packet: push it into the address history.
+ */
+static void etm_set_address(etm_decoder_t *d, unsigned long long addr)
+{
+    d->addr_hist[2] = d->addr_hist[1];
+    d->addr_hist[1] = d->addr_hist[0];
+    d->addr_hist[0] = addr;
+    if (d->exception_pending) {
+        /* The address after an Exception packet is the preferred return address.
+           The instructions up to there were executed. */
+        if (d->addr_valid && d->a64 && addr > d->addr_hist[1]) {
+            etm_emit(d, ETMEL_RANGE, d->addr_hist[1], addr, (addr - d->addr_hist[1]) / 4, ETM_INSN_OTHER, 0);
+        }
+        etm_emit(d, ETMEL_EXCEPTION, addr, 0, d->exception_type, 0, 0);
+        d->exception_pending = 0;
+        /* The exception vector will be in the next address packet */
+        d->addr_valid = 0;
+    } else {
+        d->addr_valid = 1;
+    }
+}
+
+
+/*
+ * Context information, following a Context packet header or an address with context.
+ */
+static int etm_context(etm_decoder_t *d)
+{
+    unsigned int info;
+    unsigned long long v;
+    unsigned int const old_el = d->el, old_ns = d->ns, old_cid = d->cid, old_vmid = d->vmid;
+    if (d->pos >= d->len) {
+        return -1;
+    }
+    info = d->buf[d->pos++];
+    d->el = info & 3;
+    d->sf = (info >> 4) & 1;
+    d->a64 = d->sf && !d->is;
+    d->ns = (info >> 5) & 1;
+    if ((info & 0x40) && d->vmid_bytes) {
+        if (etm_read_bytes(d, &v, d->vmid_bytes) < 0) {
+            return -1;
+        }
+        d->vmid = (unsigned int)v;
+    }
+    if ((info & 0x80) && d->cid_bytes) {
+        if (etm_read_bytes(d, &v, d->cid_bytes) < 0) {
+            return -1;
+        }
+        d->cid = (unsigned int)v;
+    }
+    if (d->el != old_el || d->ns != old_ns || d->cid != old_cid || d->vmid != old_vmid) {
+        etm_emit(d, ETMEL_CONTEXT, 0, 0, 0, 0, 0);
+    }
+    return 0;
+}
+
+
+/*
+ * Address packet payloads. 'is' is the instruction set bit from the header.
+ * The low two bytes are packed differently for IS0 (A64/A32) and IS1 (T32).
+ */
+static int etm_long_address(etm_decoder_t *d, unsigned int is, unsigned int nbytes)
+{
+    unsigned long long v, addr;
+    if (etm_read_bytes(d, &v, nbytes) < 0) {
+        return -1;
+    }
+    if (!is) {
+        addr = ((v & 0x7f) << 2) | (((v >> 8) & 0x7f) << 9);
+    } else {
+        addr = ((v & 0x7f) << 1) | (((v >> 8) & 0xff) << 8);
+    }
+    addr |= (v >> 16) << 16;
+    if (nbytes == 4) {
+        addr |= d->addr_hist[0] & 0xffffffff00000000ULL;
+    }
+    /* A 32-bit IS0 address is legal in AArch64, when the upper bits are unchanged:
+       the execution state is from the context, not the packet size. */
+    d->is = is;
+    d->a64 = d->sf && !is;
+    etm_set_address(d, addr);
+    return 0;
+}
+
+static int etm_short_address(etm_decoder_t *d, unsigned int is)
+{
+    unsigned int const shift = is ? 1 : 2;
+    unsigned int b, bits = 7;
+    unsigned long long v;
+    unsigned long long mask;
+    if (d->pos >= d->len) {
+        return -1;
+    }
+    b = d->buf[d->pos++];
+    v = (unsigned long long)(b & 0x7f) << shift;
+    if (b & 0x80) {
+        if (d->pos >= d->len) {
+            return -1;
+        }
+        v |= (unsigned long long)d->buf[d->pos++] << (7 + shift);
+        bits += 8;
+    }
+    mask = ((1ULL << bits) - 1) << shift;
+    d->is = is;
+    d->a64 = d->sf && !is;
+    etm_set_address(d, (d->addr_hist[0] & ~mask & ~((1ULL << shift) - 1)) | v);
+    return 0;
+}
+
+
+/*
+ * Find the next A-sync: at least 11 zero bytes followed by 0x80.
+ * Return its offset, or the buffer length if there isn't one.
+ */
+static unsigned long etm_find_async(unsigned char const *buf, unsigned long len, unsigned long pos)
+{
+    unsigned int zeroes = 0;
+    for (; pos < len; ++pos) {
+        if (buf[pos] == 0x00) {
+            ++zeroes;
+        } else if (buf[pos] == 0x80 && zeroes >= 11) {
+            return pos - 11;
+        } else {
+            zeroes = 0;
+        }
+    }
+    return len;
+}
+
+
+/*
+ * At an A-sync, the compression state is reset: addresses and timestamps
+ * will be sent in full, and context will be sent again. Forgetting the old
+ * state means decoding from an A-sync gives the same result whether or not
+ * we decoded the trace before it.
+ */
+static void etm_reset_state(etm_decoder_t *d)
+{
+    memset(d->addr_hist, 0, sizeof d->addr_hist);
+    d->addr_valid = 0;
+    d->exception_pending = 0;
+    d->timestamp = 0;
+    d->el = d->ns = 0;
+    d->cid = d->vmid = 0;
+    d->sf = 1;
+    d->is = 0;
+    d->a64 = 1;
+}
+
+
+/*
+ * Decode one packet. Return -1 at the end of the buffer.
+ */
+static int etm_decode_packet(etm_decoder_t *d)
+{
+    unsigned int h;
+    unsigned long long v;
+    if (!d->synced) {
+        unsigned long p = etm_find_async(d->buf, d->len, d->pos);
+        if (p >= d->len) {
+            d->pos = d->len;
+            return -1;
+        }
+        d->pos = p;
+        d->synced = 1;
+    }
+    d->pkt_offset = d->pos;
+    if (d->pos >= d->len) {
+        return -1;
+    }
+    h = d->buf[d->pos++];
+    if (h == 0x00) {
+        /* Extension: A-sync, Discard or Overflow */
+        if (d->pos >= d->len) {
+            return -1;
+        }
+        h = d->buf[d->pos++];
+        if (h == 0x00) {
+            while (d->pos < d->len && d->buf[d->pos] == 0x00) {
+                ++d->pos;
+            }
+            if (d->pos >= d->len) {
+                return -1;
+            }
+            ++d->pos;       /* the 0x80 */
+            etm_reset_state(d);
+        } else if (h == 0x03) {
+            etm_emit(d, ETMEL_DISCARD, 0, 0, 0, 0, 0);
+            d->addr_valid = 0;
+        } else if (h == 0x05) {
+            etm_emit(d, ETMEL_OVERFLOW, 0, 0, 0, 0, 0);
+            d->addr_valid = 0;
+        } else {
+            goto unknown;
+        }
+    } else if (h == 0x01) {
+        /* Trace Info: PLCTL says which of INFO, KEY, SPEC, CYCT follow */
+        unsigned long long plctl;
+        unsigned int i;
+        if (etm_read_cont(d, &plctl, 1) < 0) {
+            return -1;
+        }
+        for (i = 0; i < 4; ++i) {
+            if ((plctl & (1U << i)) && etm_read_cont(d, &v, 4) < 0) {
+                return -1;
+            }
+        }
+        d->addr_valid = 0;
+        etm_emit(d, ETMEL_TRACE_INFO, 0, 0, 0, 0, 0);
+    } else if (h == 0x02 || h == 0x03) {
+        /* Timestamp, which updates the low-order bits of the previous timestamp */
+        int n = etm_read_cont(d, &v, 9);
+        if (n < 0) {
+            return -1;
+        }
+        if (n < 9) {
+            unsigned long long const mask = (1ULL << (7*n)) - 1;
+            d->timestamp = (d->timestamp & ~mask) | v;
+        } else {
+            d->timestamp = v;
+        }
+        if (h & 1) {
+            if (etm_read_cont(d, &v, 3) < 0) {
+                return -1;
+            }
+            d->cycles += v;
+        }
+        etm_emit(d, ETMEL_TIMESTAMP, 0, 0, 0, 0, 0);
+    } else if (h == 0x04) {
+        d->addr_valid = 0;
+        etm_emit(d, ETMEL_TRACE_ON, 0, 0, 0, 0, 0);
+    } else if (h == 0x06) {
+        /* Exception: type, then an address packet follows */
+        unsigned int b;
+        if (d->pos >= d->len) {
+            return -1;
+        }
+        b = d->buf[d->pos++];
+        d->exception_type = (b >> 1) & 0x1f;
+        if (b & 0x80) {
+            if (d->pos >= d->len) {
+                return -1;
+            }
+            d->exception_type |= (d->buf[d->pos++] & 0x1f) << 5;
+        }
+        d->exception_pending = 1;
+    } else if (h == 0x07) {
+        etm_emit(d, ETMEL_EXCEPTION_RETURN, 0, 0, 0, 0, 0);
+    } else if (h == 0x0a || h == 0x0b || h == 0x88) {
+        /* ETE transaction start/commit, timestamp marker */
+    } else if (h == 0x0c || h == 0x0d) {
+        /* Cycle count format 2: one byte */
+        if (etm_read_bytes(d, &v, 1) < 0) {
+            return -1;
+        }
+        d->cycles += (v & 0xf);
+    } else if (h == 0x0e || h == 0x0f) {
+        /* Cycle count format 1 */
+        if (!d->commit_opt && etm_read_cont(d, &v, 5) < 0) {
+            return -1;
+        }
+        if (!(h & 1)) {
+            if (etm_read_cont(d, &v, 3) < 0) {
+                return -1;
+            }
+            d->cycles += v;
+        }
+    } else if ((h & 0xf0) == 0x10) {
+        /* Cycle count format 3 */
+        d->cycles += (h & 3) + 1;
+    } else if (h >= 0x20 && h <= 0x2c) {
+        /* Data synchronization markers */
+    } else if (h == 0x2d || h == 0x2e || h == 0x2f) {
+        /* Commit, Cancel format 1 */
+        if (etm_read_cont(d, &v, 5) < 0) {
+            return -1;
+        }
+    } else if (h >= 0x30 && h <= 0x3f) {
+        /* Mispredict, Cancel formats 2 and 3 */
+    } else if (h == 0x70) {
+        /* Ignore */
+    } else if (h >= 0x71 && h <= 0x7f) {
+        etm_emit(d, ETMEL_EVENT, 0, 0, h & 0xf, 0, 0);
+    } else if (h == 0x80) {
+        /* Context unchanged */
+    } else if (h == 0x81) {
+        if (etm_context(d) < 0) {
+            return -1;
+        }
+    } else if (h == 0x82 || h == 0x83 || h == 0x85 || h == 0x86) {
+        /* Address with context */
+        unsigned int const is = (h == 0x83 || h == 0x86);
+        if (etm_long_address(d, is, (h >= 0x85) ? 8 : 4) < 0 || etm_context(d) < 0) {
+            return -1;
+        }
+    } else if (h >= 0x90 && h <= 0x92) {
+        /* Exact match with an address in the history */
+        etm_set_address(d, d->addr_hist[h & 3]);
+    } else if (h == 0x95 || h == 0x96) {
+        if (etm_short_address(d, h == 0x96) < 0) {
+            return -1;
+        }
+    } else if (h == 0x9a || h == 0x9b || h == 0x9d || h == 0x9e) {
+        unsigned int const is = (h == 0x9b || h == 0x9e);
+        if (etm_long_address(d, is, (h >= 0x9d) ? 8 : 4) < 0) {
+            return -1;
+        }
+    } else if ((h & 0xf0) == 0xa0) {
+        /* Q element: an instruction count, maybe with a new address */
+        unsigned int const type = h & 0xf;
+        unsigned long long const start = d->addr_hist[0];
+        int const valid = d->addr_valid;
+        unsigned long long count = 0;
+        if (type <= 2) {
+            etm_set_address(d, d->addr_hist[type]);
+        } else if (type == 5 || type == 6) {
+            if (etm_short_address(d, type == 6) < 0) {
+                return -1;
+            }
+        } else if (type == 0xa || type == 0xb) {
+            if (etm_long_address(d, type == 0xb, 4) < 0) {
+                return -1;
+            }
+        } else if (type != 0xc && type != 0xf) {
+            goto unknown;
+        }
+        if (type != 0xf && etm_read_cont(d, &count, 5) < 0) {
+            return -1;
+        }
+        etm_emit(d, ETMEL_INSTRUCTION_COUNT, valid ? start : 0, 0, (unsigned int)count, 0, 0);
+        d->addr_valid = 0;
+    } else if (h >= 0xb0 && h <= 0xb9) {
+        /* ETE source address: we don't use these, but they update the address history */
+        if (h <= 0xb2) {
+            etm_set_address(d, d->addr_hist[h & 3]);
+        } else if (h == 0xb4 || h == 0xb5) {
+            if (etm_short_address(d, h == 0xb5) < 0) {
+                return -1;
+            }
+        } else if (h >= 0xb6) {
+            if (etm_long_address(d, (h & 1), (h >= 0xb8) ? 8 : 4) < 0) {
+                return -1;
+            }
+        } else {
+            goto unknown;
+        }
+        d->addr_valid = 0;
+    } else if (h >= 0xc0) {
+        /* Atoms: E is 1, N is 0, oldest in bit 0 */
+        unsigned int pattern, n, i;
+        if (h == 0xf6 || h == 0xf7) {
+            pattern = h & 1;  n = 1;
+        } else if ((h & 0xfc) == 0xd8) {
+            pattern = h & 3;  n = 2;
+        } else if (h >= 0xf8) {
+            pattern = h & 7;  n = 3;
+        } else if ((h & 0xfc) == 0xdc) {
+            static unsigned char const f4[4] = {0xe, 0x0, 0xa, 0x5};
+            pattern = f4[h & 3];  n = 4;
+        } else if (h == 0xd5 || h == 0xd6 || h == 0xd7 || h == 0xf5) {
+            unsigned int const ix = ((h >> 3) & 4) | (h & 3);
+            pattern = (ix == 5) ? 0x1e : (ix == 1) ? 0x00 : (ix == 2) ? 0x0a : 0x15;
+            n = 5;
+        } else {
+            /* Format 6: count+3 E atoms, then a final atom which is N if bit 5 is set.
+               That's up to 35 atoms, too many for the pattern. */
+            n = (h & 0x1f) + 3;
+            for (i = 0; i < n; ++i) {
+                etm_atom(d, 1);
+            }
+            pattern = !(h & 0x20);
+            n = 1;
+        }
+        for (i = 0; i < n; ++i) {
+            etm_atom(d, (pattern >> i) & 1);
+        }
+    } else {
+        goto unknown;
+    }
+    return 0;
+unknown:
+    /* Unknown or unsupported packet: skip to the next A-sync */
+    ++d->n_unknown;
+    d->synced = 0;
+    return 0;
+}
+
+
+/*
+ * Get the images for the decoder from a sequence of (base address, buffer).
+ */
+static int etm_get_images(PyObject *imo, etm_image_t **images, Py_buffer **views, unsigned int *n_images)
+{
+    PyObject *seq;
+    Py_ssize_t i, n;
+    *images = NULL;
+    *views = NULL;
+    *n_images = 0;
+    if (imo == Py_None) {
+        return 0;
+    }
+    seq = PySequence_Fast(imo, "images must be a sequence of (address, buffer)");
+    if (!seq) {
+        return -1;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    *images = (etm_image_t *)calloc(n ? n : 1, sizeof(etm_image_t));
+    *views = (Py_buffer *)calloc(n ? n : 1, sizeof(Py_buffer));
+    for (i = 0; i < n; ++i) {
+        unsigned long long base;
+        PyObject *bo;
+        etm_image_t *im;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "KO", &base, &bo) ||
+            PyObject_GetBuffer(bo, &(*views)[*n_images], PyBUF_SIMPLE) < 0) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        /* Insertion sort by address */
+        for (im = *images + *n_images; im > *images && im[-1].base > base; --im) {
+            im[0] = im[-1];
+        }
+        im->base = base;
+        im->end = base + (*views)[*n_images].len;
+        im->data = (unsigned char const *)(*views)[*n_images].buf;
+        ++*n_images;
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+
+/*
+ * decode_etm(buffer, images=None, trcidr0=0, trcidr2=0, offset=0, cycles=0) -> dict of columns
+ *   offset    offset of the buffer in the whole trace, added to the 'offset' column
+ *   cycles    cycle count at the start of the buffer
+ * When the trace is decoded in pieces, these make the columns the same as
+ * for a single decode. The final cycle count is returned as 'total_cycles'.
+ */
+static PyObject *perf_decode_etm(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"buffer", "images", "trcidr0", "trcidr2", "offset", "cycles", NULL};
+    PyObject *bo, *imo = Py_None;
+    unsigned long long trcidr0 = 0, trcidr2 = 0;
+    unsigned long long offset = 0, cycles = 0;
+    Py_buffer view;
+    Py_buffer *image_views;
+    etm_image_t *images;
+    unsigned int n_images, i;
+    etm_decoder_t *d;
+    PyObject *res;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OKKKK", kwlist, &bo, &imo, &trcidr0, &trcidr2, &offset, &cycles)) {
+        return NULL;
+    }
+    if (etm_get_images(imo, &images, &image_views, &n_images) < 0) {
+        for (i = 0; i < n_images; ++i) {
+            PyBuffer_Release(&image_views[i]);
+        }
+        free(images);
+        free(image_views);
+        return NULL;
+    }
+    if (PyObject_GetBuffer(bo, &view, PyBUF_SIMPLE) < 0) {
+        for (i = 0; i < n_images; ++i) {
+            PyBuffer_Release(&image_views[i]);
+        }
+        free(images);
+        free(image_views);
+        return NULL;
+    }
+    d = (etm_decoder_t *)calloc(1, sizeof(etm_decoder_t));
+    d->buf = (unsigned char const *)view.buf;
+    d->len = view.len;
+    d->commit_opt = (trcidr0 >> 29) & 1;
+    d->cid_bytes = ((trcidr2 >> 5) & 0x1f) ? 4 : 0;
+    d->vmid_bytes = ((trcidr2 >> 10) & 0x1f);      /* 0, 1, 2 or 4 bytes */
+    d->wfx_branch = (trcidr2 >> 31) & 1;
+    d->offset_base = offset;
+    d->cycles = cycles;
+    d->images = images;
+    d->n_images = n_images;
+    d->sf = 1;
+    d->is = 0;
+    d->a64 = 1;
+    Py_BEGIN_ALLOW_THREADS
+    while (etm_decode_packet(d) == 0) {
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    for (i = 0; i < n_images; ++i) {
+        PyBuffer_Release(&image_views[i]);
+    }
+    free(images);
+    free(image_views);
+    res = PyDict_New();
+    for (i = 0; i < N_ETM_COLUMNS; ++i) {
+        PyObject *col = MyBytes_FromStringAndSize((char const *)d->cols[i], d->n * etm_columns[i].size);
+        free(d->cols[i]);
+#if PY_MAJOR_VERSION >= 3
+        {
+            PyObject *mv = PyMemoryView_FromObject(col);
+            Py_DECREF(col);
+            col = PyObject_CallMethod(mv, "cast", "s", etm_columns[i].format);
+            Py_DECREF(mv);
+        }
+#endif
+        PyDict_SetItemString(res, etm_columns[i].name, col);
+        Py_DECREF(col);
+    }
+    {
+        PyObject *nb = PyLong_FromUnsignedLong(d->n_unknown);
+        PyDict_SetItemString(res, "unknown_packets", nb);
+        Py_DECREF(nb);
+        nb = PyLong_FromUnsignedLong(d->n_lost_atoms);
+        PyDict_SetItemString(res, "lost_atoms", nb);
+        Py_DECREF(nb);
+        nb = PyLong_FromUnsignedLongLong(d->cycles);
+        PyDict_SetItemString(res, "total_cycles", nb);
+        Py_DECREF(nb);
+    }
+    free(d);
+    return res;
+}
+
+
+/*
+ * etm_sync_points(buffer) -> list of offsets of A-sync packets
+ */
+static PyObject *perf_etm_sync_points(PyObject *x, PyObject *bo)
+{
+    Py_buffer view;
+    unsigned long pos = 0;
+    PyObject *list;
+    if (PyObject_GetBuffer(bo, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    list = PyList_New(0);
+    for (;;) {
+        PyObject *o;
+        pos = etm_find_async((unsigned char const *)view.buf, view.len, pos);
+        if (pos >= (unsigned long)view.len) {
+            break;
+        }
+        o = PyLong_FromUnsignedLong(pos);
+        PyList_Append(list, o);
+        Py_DECREF(o);
+        /* Skip the rest of this A-sync, which may have extra zeroes */
+        while (((unsigned char const *)view.buf)[pos] == 0x00) {
+            ++pos;
+        }
+        ++pos;
+    }
+    PyBuffer_Release(&view);
+    return list;
+}
+
+
+/*
+ * etm_deformat(buffer) -> {trace_id: bytes}
+ *
+ * Split CoreSight formatted trace (16-byte frames, as from an ETR or a TPIU)
+ * into the streams for each trace source. In each frame, the even bytes
+ * are either a data byte (bit 0 clear, with the real bit 0 in byte 15) or
+ * a change of trace id (bit 0 set). The odd bytes are data. An id change
+ * takes effect after the next byte if its bit in byte 15 is set.
+ * Frame synchronization packets (ff ff ff 7f) are skipped.
+ */
+typedef struct {
+    unsigned char *data;
+    unsigned long n, n_alloc;
+} etm_stream_t;
+
+static void etm_stream_add(etm_stream_t *streams, unsigned int id, unsigned char b)
+{
+    etm_stream_t *s = &streams[id];
+    if (id == 0 || id >= 0x70) {
+        /* null or reserved trace id */
+        return;
+    }
+    if (s->n == s->n_alloc) {
+        s->n_alloc = s->n_alloc ? s->n_alloc * 2 : 4096;
+        s->data = (unsigned char *)realloc(s->data, s->n_alloc);
+    }
+    s->data[s->n++] = b;
+}
+
+static PyObject *perf_etm_deformat(PyObject *x, PyObject *bo)
+{
+    Py_buffer view;
+    unsigned char const *p, *end;
+    etm_stream_t *streams;
+    unsigned int id = 0;
+    unsigned int i;
+    PyObject *d;
+    if (PyObject_GetBuffer(bo, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    streams = (etm_stream_t *)calloc(128, sizeof(etm_stream_t));
+    p = (unsigned char const *)view.buf;
+    end = p + view.len;
+    Py_BEGIN_ALLOW_THREADS
+    while (p + 16 <= end) {
+        unsigned int const aux = p[15];
+        if (p[0] == 0xff && p[1] == 0xff && p[2] == 0xff && p[3] == 0x7f) {
+            p += 4;
+            continue;
+        }
+        for (i = 0; i < 16; i += 2) {
+            unsigned int const b = p[i];
+            unsigned int const flag = (aux >> (i/2)) & 1;
+            if (b & 1) {
+                unsigned int const new_id = (b >> 1) & 0x7f;
+                if (i == 14) {
+                    id = new_id;
+                } else if (flag) {
+                    etm_stream_add(streams, id, p[i+1]);
+                    id = new_id;
+                } else {
+                    id = new_id;
+                    etm_stream_add(streams, id, p[i+1]);
+                }
+            } else {
+                etm_stream_add(streams, id, (b & 0xfe) | flag);
+                if (i < 14) {
+                    etm_stream_add(streams, id, p[i+1]);
+                }
+            }
+        }
+        p += 16;
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    d = PyDict_New();
+    for (i = 0; i < 128; ++i) {
+        if (streams[i].n) {
+            PyObject *k = PyLong_FromUnsignedLong(i);
+            PyObject *b = MyBytes_FromStringAndSize((char const *)streams[i].data, streams[i].n);
+            PyDict_SetItem(d, k, b);
+            Py_DECREF(k);
+            Py_DECREF(b);
+        }
+        free(streams[i].data);
+    }
+    free(streams);
+    return d;
+}
+
+
+/*
+ * A set of events that we can wait on together, using epoll.
+ * This saves polling each event (or building a select() list) when
+ * there are many sampling events, e.g. one per CPU.
+ */
+typedef struct {
+    PyObject_HEAD
+    int epfd;
+    PyObject *events;               /* dict: fd -> Event, to keep the events alive */
+} EventSetObject;
+
+
+static PyObject *eventset_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    EventSetObject *s = (EventSetObject *)t->tp_alloc(t, 0);
+    assert(s != NULL);
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(s);
+        return NULL;
+    }
+    s->events = PyDict_New();
+    return (PyObject *)s;
+}
+
+
+static PyObject *eventset_close(PyObject *x)
+{
+    EventSetObject *s = (EventSetObject *)x;
+    if (s->epfd >= 0) {
+        close(s->epfd);
+        s->epfd = -1;
+    }
+    PyDict_Clear(s->events);
+    Py_RETURN_NONE;
+}
+
+
+static void eventset_dealloc(PyObject *x)
+{
+    EventSetObject *s = (EventSetObject *)x;
+    if (s->epfd >= 0) {
+        close(s->epfd);
+    }
+    Py_XDECREF(s->events);
+    x->ob_type->tp_free(x);
+}
+
+
+/*
+ * Add an open event to the set. It must have (or be given) a buffer.
+ */
+static PyObject *eventset_add(PyObject *x, PyObject *eo)
+{
+    EventSetObject *s = (EventSetObject *)x;
+    EventObject *e;
+    struct epoll_event ev;
+    PyObject *fdo;
+    if (!PyObject_TypeCheck(eo, &EventType)) {
+        PyErr_SetString(PyExc_TypeError, "EventSet member must be an Event");
+        return NULL;
+    }
+    e = (EventObject *)eo;
+    if (e->fd < 0 || s->epfd < 0) {
+        PyErr_SetString(PyExc_ValueError, "event or event set is closed");
+        return NULL;
+    }
+    if (!e->mmap_page && !event_setup_buffer(e)) {
+        PyErr_SetString(PyExc_ValueError, "no buffer allocated");
+        return NULL;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = e->fd;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    fdo = PyInt_FromLong(e->fd);
+    PyDict_SetItem(s->events, fdo, eo);
+    Py_DECREF(fdo);
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Remove an event from the set. The event may have been closed since it
+ * was added, so we find it by object rather than by its current fd.
+ */
+static PyObject *eventset_remove(PyObject *x, PyObject *eo)
+{
+    EventSetObject *s = (EventSetObject *)x;
+    EventObject *e;
+    PyObject *fdo, *vo;
+    Py_ssize_t pos = 0;
+    if (!PyObject_TypeCheck(eo, &EventType)) {
+        PyErr_SetString(PyExc_TypeError, "EventSet member must be an Event");
+        return NULL;
+    }
+    e = (EventObject *)eo;
+    while (PyDict_Next(s->events, &pos, &fdo, &vo)) {
+        if (vo == eo) {
+            /* The kernel removes closed descriptors from the epoll set itself */
+            if (e->fd >= 0 && s->epfd >= 0) {
+                (void)epoll_ctl(s->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+            }
+            if (PyDict_DelItem(s->events, fdo) < 0) {
+                return NULL;
+            }
+            Py_RETURN_NONE;
+        }
+    }
+    PyErr_SetString(PyExc_KeyError, "event is not in the set");
+    return NULL;
+}
+
 
 /*
- * Need to explicitly include structmember.h for this?
+ * Open a new event, and add it to the set. Arguments are as for Event(),
+ * plus the wakeup settings, which can only be set when the event is opened:
+ *   wakeup_events      wake up after this many samples
+ *   wakeup_watermark   wake up when this many bytes are in the buffer
+ * Larger values mean fewer wakeups, at the cost of latency and more
+ * risk of the buffer filling.
  */
-static struct PyMemberDef Event_members[] = {
-    {"type", T_INT, offsetof(EventObject, attr.type), 0, "perf event type"},
-    {"code", T_INT, offsetof(EventObject, attr.config), 0, "perf event code"},
-    {"sample_type", T_ULONGLONG, offsetof(EventObject, attr.sample_type), 0, "mask of data in sample records"},
-    {"cpu", T_INT, offsetof(EventObject, cpu), 0, "cpu that this event is bound to, or -1"},
-    {"verbose", T_INT, offsetof(EventObject, verbose), 0, "verbosity level"}, 
+static PyObject *eventset_open(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    PyObject *attro, *raw, *nargs, *nkwds, *e, *r;
+    PyObject *wo;
+    struct perf_event_attr a;
+    Py_ssize_t size;
+    if (!PyArg_ParseTuple(args, "O", &attro)) {
+        return NULL;
+    }
+    raw = PyObject_Bytes(attro);
+    if (!raw) {
+        return NULL;
+    }
+    size = PyBytes_Size(raw);
+    if (size < PERF_ATTR_SIZE_VER0 || (size_t)size > sizeof a) {
+        Py_DECREF(raw);
+        PyErr_SetString(PyExc_ValueError, "bad perf_event_attr size");
+        return NULL;
+    }
+    memset(&a, 0, sizeof a);
+    memcpy(&a, PyBytes_AsString(raw), size);
+    Py_DECREF(raw);
+    nkwds = kwds ? PyDict_Copy(kwds) : PyDict_New();
+    if ((wo = PyDict_GetItemString(nkwds, "wakeup_watermark")) != NULL) {
+        a.watermark = 1;
+        a.wakeup_watermark = PyLong_AsUnsignedLong(wo);
+        PyDict_DelItemString(nkwds, "wakeup_watermark");
+    } else if ((wo = PyDict_GetItemString(nkwds, "wakeup_events")) != NULL) {
+        a.watermark = 0;
+        a.wakeup_events = PyLong_AsUnsignedLong(wo);
+        PyDict_DelItemString(nkwds, "wakeup_events");
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(nkwds);
+        return NULL;
+    }
+    nargs = Py_BuildValue("(N)", MyBytes_FromStringAndSize((char const *)&a, size));
+    e = PyObject_Call((PyObject *)&EventType, nargs, nkwds);
+    Py_DECREF(nargs);
+    Py_DECREF(nkwds);
+    if (!e) {
+        return NULL;
+    }
+    r = eventset_add(x, e);
+    if (!r) {
+        Py_DECREF(e);
+        return NULL;
+    }
+    Py_DECREF(r);
+    return e;
+}
+
+
+/*
+ * Wait until some events are ready, and return a list of them.
+ * An event is ready if it has records in its buffer, or if it has hung up
+ * (e.g. the monitored process has exited). The timeout is in seconds;
+ * None waits indefinitely. Returns an empty list on timeout.
+ *
+ * perf only reports an event as ready to epoll when the kernel has woken
+ * us up, which depends on the wakeup settings, and the readiness is
+ * cleared by the next poll. So we also check the buffers directly, and
+ * don't block if any of them already has records.
+ */
+static PyObject *eventset_wait(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    EventSetObject *s = (EventSetObject *)x;
+    PyObject *timeouto = Py_None;
+    PyObject *ready, *seen;
+    PyObject *fdo, *eo;
+    Py_ssize_t pos = 0;
+    struct epoll_event evs[256];
+    int timeout_ms = -1;
+    int n, i;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeouto)) {
+        return NULL;
+    }
+    if (timeouto != Py_None) {
+        double t = PyFloat_AsDouble(timeouto);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        timeout_ms = (t <= 0.0) ? 0 : (int)(t * 1000.0 + 0.999);
+    }
+    if (s->epfd < 0) {
+        PyErr_SetString(PyExc_ValueError, "event set is closed");
+        return NULL;
+    }
+    ready = PyList_New(0);
+    seen = PySet_New(NULL);
+    while (PyDict_Next(s->events, &pos, &fdo, &eo)) {
+        EventObject *e = (EventObject *)eo;
+        if (e->mmap_page && event_available(e)) {
+            PyList_Append(ready, eo);
+            PySet_Add(seen, fdo);
+        }
+    }
+    if (PyList_GET_SIZE(ready) > 0) {
+        timeout_ms = 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    n = epoll_wait(s->epfd, evs, sizeof evs / sizeof evs[0], timeout_ms);
+    Py_END_ALLOW_THREADS
+    if (n < 0) {
+        Py_DECREF(seen);
+        if (errno == EINTR && PyList_GET_SIZE(ready) == 0) {
+            /* Let the caller handle the signal, e.g. KeyboardInterrupt */
+            if (PyErr_CheckSignals() < 0) {
+                Py_DECREF(ready);
+                return NULL;
+            }
+            return ready;
+        } else if (errno != EINTR) {
+            Py_DECREF(ready);
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+        return ready;
+    }
+    for (i = 0; i < n; ++i) {
+        fdo = PyInt_FromLong(evs[i].data.fd);
+        eo = PyDict_GetItem(s->events, fdo);
+        if (eo && !PySet_Contains(seen, fdo)) {
+            PyList_Append(ready, eo);
+            PySet_Add(seen, fdo);
+        }
+        Py_DECREF(fdo);
+    }
+    Py_DECREF(seen);
+    return ready;
+}
+
+
+static PyObject *eventset_events(PyObject *x)
+{
+    return PyDict_Values(((EventSetObject *)x)->events);
+}
+
+
+static PyObject *eventset_fileno(PyObject *x)
+{
+    return PyInt_FromLong(((EventSetObject *)x)->epfd);
+}
+
+
+static Py_ssize_t eventset_seq_length(PyObject *x)
+{
+    return PyDict_Size(((EventSetObject *)x)->events);
+}
+
+
+static struct PyMethodDef EventSet_methods[] = {
+    {"add", (PyCFunction)&eventset_add, METH_O, "Event -> add an event to the set"},
+    {"remove", (PyCFunction)&eventset_remove, METH_O, "Event -> remove an event from the set"},
+    {"open", (PyCFunction)&eventset_open, METH_VARARGS|METH_KEYWORDS, "Event: open an event and add it to the set"},
+    {"wait", (PyCFunction)&eventset_wait, METH_VARARGS|METH_KEYWORDS, "[Event]: wait for events to be ready, with optional timeout"},
+    {"events", (PyCFunction)&eventset_events, METH_NOARGS, "[Event]: all events in the set"},
+    {"fileno", (PyCFunction)&eventset_fileno, METH_NOARGS, "int: epoll file handle"},
+    {"close", (PyCFunction)&eventset_close, METH_NOARGS, "close the event set"},
     {NULL}
 };
 
+static PySequenceMethods EventSet_seqmethods = {
+    .sq_length = &eventset_seq_length
+};
 
-static PyTypeObject EventType = {
+static PyTypeObject EventSetType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_basicsize = sizeof(EventObject),
-    .tp_name = "perf_events.Event",
-    .tp_doc = "perf event",
+    .tp_basicsize = sizeof(EventSetObject),
+    .tp_name = "perf_events.EventSet",
+    .tp_doc = "set of events that can be waited on together",
     .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = Event_methods,
-    .tp_members = Event_members,
-    .tp_repr = event_repr,
-    .tp_str = event_str,
-    .tp_alloc = 0,
-    .tp_new = event_new,
-    .tp_init = event_init,
-    .tp_dealloc = event_dealloc
+    .tp_methods = EventSet_methods,
+    .tp_as_sequence = &EventSet_seqmethods,
+    .tp_new = eventset_new,
+    .tp_dealloc = eventset_dealloc
 };
 
 
-static PyMethodDef BaseReading_methods[] = {
-    {"is_incomplete", (PyCFunction)&reading_is_incomplete, METH_NOARGS, "bool: only partial data is available"},
-    {"is_missing", (PyCFunction)&reading_is_missing, METH_NOARGS, "bool: no data is available"},
-    {"update", (PyCFunction)&reading_update, METH_NOARGS, "take another reading"},
-    {NULL}
+/*
+ * Background collection of records from the mmap buffers.
+ *
+ * A Collector runs one thread per CPU (or per group of CPUs), draining
+ * records, and AUX data, from its events' buffers without holding the
+ * GIL. The records go into a bounded queue for each thread, which Python
+ * reads from at its own pace, or into a file. So the buffers keep being
+ * drained even when the Python thread is busy, e.g. decoding.
+ *
+ * The queues and the file hold a stream of records as in perf.data
+ * "pipe mode": AUX data is in PERF_RECORD_AUXTRACE records, which are
+ * followed by the data itself (not included in the record size).
+ * A file also starts with the pipe-mode header and a
+ * PERF_RECORD_HEADER_ATTR for each event, so it can be read by
+ * perf_data.py or 'perf report -i'.
+ */
+#ifndef PERF_RECORD_HEADER_ATTR
+#define PERF_RECORD_HEADER_ATTR 64
+#endif
+#ifndef PERF_RECORD_AUXTRACE
+#define PERF_RECORD_AUXTRACE 71
+#endif
+
+typedef struct {
+    struct perf_event_header header;
+    unsigned long long size;        /* size of the AUX data that follows */
+    unsigned long long offset;      /* offset of the data in the AUX buffer */
+    unsigned long long reference;
+    unsigned int idx;               /* index of the event's id in its HEADER_ATTR */
+    unsigned int tid;
+    unsigned int cpu;
+    unsigned int reserved__;
+} auxtrace_record_t;
+
+/*
+ * Single-producer, single-consumer byte queue. Records are added whole,
+ * so the consumer always finds complete records.
+ */
+typedef struct {
+    unsigned char *buf;
+    unsigned long size;
+    unsigned long head;             /* advanced by the producer */
+    unsigned long tail;             /* advanced by the consumer */
+} collector_queue_t;
+
+typedef struct collector_object_s CollectorObject;
+
+typedef struct {
+    CollectorObject *c;
+    pthread_t thread;
+    int started;
+    EventObject **events;
+    unsigned int *aux_idx;          /* for each event, its AUXTRACE idx */
+    unsigned int n_events;
+    int epfd;
+    collector_queue_t q;
+    unsigned long long records;
+    unsigned long long bytes;
+    unsigned long long dropped_records;
+    unsigned long long dropped_bytes;
+    unsigned long long aux_bytes;
+} collector_thread_t;
+
+struct collector_object_s {
+    PyObject_HEAD
+    PyObject *events;               /* list of the events, to keep them alive */
+    collector_thread_t *threads;
+    unsigned int n_threads;
+    int fd;                         /* file to write to, or -1 */
+    pthread_mutex_t file_lock;
+    int interval_ms;                /* how long to wait when there's nothing to drain */
+    int volatile stop;
+    int running;
 };
 
 
-static struct PyMemberDef BaseReading_members[] = {
-    {"time_enabled_ns", T_LONGLONG, offsetof(BaseReadingObject, sample.time_enabled), 0, "time enabled (ns)"},
-    {"time_running_ns", T_LONGLONG, offsetof(BaseReadingObject, sample.time_running), 0, "time running (ns)"},
-    {"fraction_running", T_DOUBLE, offsetof(BaseReadingObject, fraction_running), 0, "float: fraction of time event was running"},
-    {"event", T_OBJECT, offsetof(BaseReadingObject, event), 0, "Event object this reading was taken from"},
-    {"id", T_LONGLONG, offsetof(ReadingObject, base.sample.id), 0, "event id"},
-    {NULL}
-};
+static int collector_queue_put(collector_queue_t *q, struct iovec const *iov, unsigned int n)
+{
+    unsigned long const tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    unsigned long head = q->head;
+    unsigned long len = 0;
+    unsigned int i;
+    for (i = 0; i < n; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (len > q->size - (head - tail)) {
+        return 0;
+    }
+    for (i = 0; i < n; ++i) {
+        unsigned long const off = head % q->size;
+        unsigned long const room = q->size - off;
+        unsigned long const k = iov[i].iov_len;
+        if (k <= room) {
+            memcpy(q->buf + off, iov[i].iov_base, k);
+        } else {
+            memcpy(q->buf + off, iov[i].iov_base, room);
+            memcpy(q->buf, (unsigned char const *)iov[i].iov_base + room, k - room);
+        }
+        head += k;
+    }
+    __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/*
+ * Get the records in the queue, as up to two pieces. The caller must
+ * call collector_queue_consume() when it has finished with them.
+ */
+static unsigned long collector_queue_peek(collector_queue_t *q, struct iovec *iov)
+{
+    unsigned long const head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    unsigned long const tail = q->tail;
+    unsigned long const len = head - tail;
+    unsigned long const off = tail % q->size;
+    unsigned long const room = q->size - off;
+    iov[0].iov_base = q->buf + off;
+    iov[0].iov_len = (len <= room) ? len : room;
+    iov[1].iov_base = q->buf;
+    iov[1].iov_len = len - iov[0].iov_len;
+    return len;
+}
+
+
+static void collector_queue_consume(collector_queue_t *q, unsigned long len)
+{
+    __atomic_store_n(&q->tail, q->tail + len, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Write out the records a thread has queued, if we're writing to a file.
+ */
+static void collector_flush(collector_thread_t *t)
+{
+    struct iovec iov[2];
+    unsigned long len = collector_queue_peek(&t->q, iov);
+    if (len > 0) {
+        pthread_mutex_lock(&t->c->file_lock);
+        while (iov[0].iov_len + iov[1].iov_len > 0) {
+            ssize_t n = writev(t->c->fd, iov, 2);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("perf_events: collector write");
+                break;
+            }
+            if ((size_t)n >= iov[0].iov_len) {
+                n -= iov[0].iov_len;
+                iov[0] = iov[1];
+                iov[1].iov_len = 0;
+            }
+            iov[0].iov_base = (unsigned char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+        pthread_mutex_unlock(&t->c->file_lock);
+        collector_queue_consume(&t->q, len);
+    }
+}
+
+
+/*
+ * Queue the AUX data described by a PERF_RECORD_AUX, as a PERF_RECORD_AUXTRACE,
+ * and release it from the AUX buffer.
+ */
+static void collector_take_aux(collector_thread_t *t, unsigned int i, void const *rec)
+{
+#if defined(PERF_RECORD_AUX) || !defined(PERF_RECORD_MMAP)
+    EventObject *e = t->events[i];
+    struct {
+        struct perf_event_header header;
+        unsigned long long aux_offset;
+        unsigned long long aux_size;
+        unsigned long long flags;
+    } ah;
+    auxtrace_record_t ar;
+    struct iovec iov[3];
+    memcpy(&ah, rec, sizeof ah);
+    event_aux_account(e, ah.aux_size, ah.flags);
+    if (ah.aux_size == 0 || ah.aux_offset != e->mmap_page->aux_tail) {
+        if (ah.aux_size != 0) {
+            e->aux_stats.mismatch++;
+        }
+        return;
+    }
+    memset(&ar, 0, sizeof ar);
+    ar.header.type = PERF_RECORD_AUXTRACE;
+    ar.header.size = sizeof ar;
+    ar.size = ah.aux_size;
+    ar.offset = ah.aux_offset;
+    ar.idx = t->aux_idx[i];
+    ar.tid = (unsigned int)-1;
+    ar.cpu = (unsigned int)e->cpu;
+    iov[0].iov_base = &ar;
+    iov[0].iov_len = sizeof ar;
+    {
+        unsigned long const off = ah.aux_offset % e->aux_size;
+        unsigned long const room = e->aux_size - off;
+        iov[1].iov_base = (unsigned char *)e->aux_area + off;
+        iov[1].iov_len = (ah.aux_size <= room) ? ah.aux_size : room;
+        iov[2].iov_base = e->aux_area;
+        iov[2].iov_len = ah.aux_size - iov[1].iov_len;
+    }
+    if (collector_queue_put(&t->q, iov, 3)) {
+        t->aux_bytes += ah.aux_size;
+    } else {
+        t->dropped_records++;
+        t->dropped_bytes += sizeof ar + ah.aux_size;
+    }
+    event_update_aux_tail(e, ah.aux_offset + ah.aux_size);
+#endif /* PERF_RECORD_AUX */
+}
+
+
+/*
+ * Drain all the records currently in one event's buffer. Return the number of records.
+ */
+static unsigned int collector_drain_event(collector_thread_t *t, unsigned int i)
+{
+    EventObject *e = t->events[i];
+    unsigned long long const head = e->mmap_page->data_head;
+    unsigned long long tail = e->mmap_page->data_tail;
+    unsigned int n = 0;
+    /* Make sure we see the records the kernel wrote before updating the head */
+    __sync_synchronize();
+    while (tail < head) {
+        unsigned long const off = tail % e->mmap_data_size;
+        unsigned long const room = e->mmap_data_size - off;
+        /* Records are 8-byte aligned, so the header itself can't wrap */
+        struct perf_event_header const *h = (struct perf_event_header const *)(e->mmap_data_start + off);
+        unsigned int const size = h->size;
+        struct iovec iov[2];
+        unsigned char rec[64];
+        if (size < sizeof(struct perf_event_header) || size > head - tail) {
+            fprintf(stderr, "sample corrupt: length = %u\n", size);
+            tail = head;
+            break;
+        }
+        iov[0].iov_base = (void *)h;
+        iov[0].iov_len = (size <= room) ? size : room;
+        iov[1].iov_base = e->mmap_data_start;
+        iov[1].iov_len = size - iov[0].iov_len;
+        if (collector_queue_put(&t->q, iov, 2)) {
+            t->records++;
+            t->bytes += size;
+        } else {
+            t->dropped_records++;
+            t->dropped_bytes += size;
+        }
+        if (h->type == PERF_RECORD_AUX && e->aux_area && size <= sizeof rec) {
+            memcpy(rec, iov[0].iov_base, iov[0].iov_len);
+            memcpy(rec + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+            collector_take_aux(t, i, rec);
+        }
+        tail += size;
+        ++n;
+    }
+    /* Make sure we've finished reading before the kernel can overwrite */
+    __sync_synchronize();
+    e->mmap_page->data_tail = tail;
+    return n;
+}
+
+
+static void *collector_thread_main(void *arg)
+{
+    collector_thread_t *t = (collector_thread_t *)arg;
+    CollectorObject *c = t->c;
+    for (;;) {
+        int const stopping = c->stop;
+        unsigned int i, n = 0;
+        for (i = 0; i < t->n_events; ++i) {
+            n += collector_drain_event(t, i);
+        }
+        if (c->fd >= 0) {
+            collector_flush(t);
+        }
+        if (stopping) {
+            /* We've drained once more since being asked to stop */
+            break;
+        }
+        if (n == 0) {
+            struct epoll_event evs[16];
+            (void)epoll_wait(t->epfd, evs, sizeof evs / sizeof evs[0], c->interval_ms);
+        }
+    }
+    return NULL;
+}
+
+
+static PyObject *collector_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    CollectorObject *c = (CollectorObject *)t->tp_alloc(t, 0);
+    assert(c != NULL);
+    c->fd = -1;
+    pthread_mutex_init(&c->file_lock, NULL);
+    return (PyObject *)c;
+}
+
+
+/*
+ * Check if two events have the same attributes, as they appear in the file
+ * header. Events are grouped by this, both for the PERF_RECORD_HEADER_ATTR
+ * id lists and for the AUXTRACE idx.
+ */
+static int collector_same_attr(EventObject const *x, EventObject const *y)
+{
+    struct perf_event_attr a = x->attr;
+    struct perf_event_attr b = y->attr;
+    a.size = b.size = sizeof a;
+    a.disabled = b.disabled = 0;
+    return !memcmp(&a, &b, sizeof a);
+}
+
+
+/*
+ * Get an event's AUXTRACE idx: the position of its id in its attribute's
+ * id list, i.e. the number of preceding events with the same attributes.
+ */
+static unsigned int collector_attr_index(EventObject **evs, unsigned int k)
+{
+    unsigned int j, n = 0;
+    for (j = 0; j < k; ++j) {
+        n += collector_same_attr(evs[j], evs[k]);
+    }
+    return n;
+}
+
+
+/*
+ * Write the file header: the pipe-mode perf.data header, then a
+ * PERF_RECORD_HEADER_ATTR for each distinct perf_event_attr, with the ids
+ * of all the events (including subordinates) that use it.
+ */
+static int collector_write_header(CollectorObject *c, EventObject **evs, unsigned int n_evs)
+{
+    unsigned long long const magic_and_size[2] = { 0x32454c4946524550ULL /* "PERFILE2" */, 16 };
+    unsigned char *done = (unsigned char *)calloc(n_evs, 1);
+    unsigned long long *ids = (unsigned long long *)malloc(n_evs * sizeof *ids);
+    unsigned int i, j;
+    int ok;
+    if (!done || !ids) {
+        free(ids);
+        free(done);
+        errno = ENOMEM;
+        return 0;
+    }
+    ok = (write(c->fd, magic_and_size, sizeof magic_and_size) == sizeof magic_and_size);
+    for (i = 0; ok && i < n_evs; ++i) {
+        struct perf_event_attr a;
+        struct perf_event_header h;
+        unsigned int n_ids = 0;
+        if (done[i]) {
+            continue;
+        }
+        for (j = i; j < n_evs; ++j) {
+            if (!done[j] && collector_same_attr(evs[i], evs[j])) {
+                done[j] = 1;
+                ids[n_ids++] = evs[j]->id;
+            }
+        }
+        a = evs[i]->attr;
+        a.size = sizeof a;
+        a.disabled = 0;
+        h.type = PERF_RECORD_HEADER_ATTR;
+        h.misc = 0;
+        h.size = sizeof h + sizeof a + n_ids * sizeof ids[0];
+        ok = (write(c->fd, &h, sizeof h) == sizeof h) &&
+             (write(c->fd, &a, sizeof a) == sizeof a) &&
+             (write(c->fd, ids, n_ids * sizeof ids[0]) == (ssize_t)(n_ids * sizeof ids[0]));
+    }
+    free(ids);
+    free(done);
+    return ok;
+}
+
+
+/*
+ * Collector(events, threads=0, capacity=4M, path=None, interval=0.01)
+ *   events    sampling events: each buffer-owning event is drained
+ *   threads   number of threads; 0 for one per CPU
+ *   capacity  size of each thread's queue, in bytes
+ *   path      write the records to this file, rather than queueing them for read()
+ *   interval  how long a thread waits for a wakeup, when there's nothing to drain
+ *
+ * AUX events can't be written to a file, as we don't have the PMU-specific
+ * metadata for a PERF_RECORD_AUXTRACE_INFO.
+ */
+static int collector_init(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"events", "threads", "capacity", "path", "interval", NULL};
+    CollectorObject *c = (CollectorObject *)x;
+    PyObject *evo;
+    unsigned int n_threads = 0;
+    unsigned long capacity = 4*1024*1024;
+    char const *path = NULL;
+    double interval = 0.01;
+    EventObject **evs = NULL;
+    unsigned int *owners = NULL;    /* index in evs of each buffer-owning event */
+    int *cpus = NULL;
+    unsigned int n_evs, n_owners = 0, n_cpus = 0, i, j;
+    int rc = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ikzd", kwlist, &evo, &n_threads, &capacity, &path, &interval)) {
+        return -1;
+    }
+    if (capacity == 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return -1;
+    }
+    if (c->events) {
+        PyErr_SetString(PyExc_ValueError, "collector is already initialized");
+        return -1;
+    }
+    c->events = PySequence_List(evo);
+    if (!c->events) {
+        return -1;
+    }
+    n_evs = PyList_GET_SIZE(c->events);
+    if (n_evs == 0) {
+        PyErr_SetString(PyExc_ValueError, "no events to collect");
+        return -1;
+    }
+    evs = (EventObject **)malloc(n_evs * sizeof *evs);
+    owners = (unsigned int *)malloc(n_evs * sizeof *owners);
+    cpus = (int *)malloc(n_evs * sizeof *cpus);
+    if (!evs || !owners || !cpus) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    for (i = 0; i < n_evs; ++i) {
+        PyObject *eo = PyList_GET_ITEM(c->events, i);
+        if (!PyObject_TypeCheck(eo, &EventType)) {
+            PyErr_SetString(PyExc_TypeError, "Collector needs Event objects");
+            goto out;
+        }
+        evs[i] = (EventObject *)eo;
+        if (evs[i]->overwrite) {
+            PyErr_SetString(PyExc_ValueError, "event buffer is in overwrite mode: use snapshot()");
+            goto out;
+        }
+        if (evs[i]->id == 0) {
+            event_get_id(evs[i]);
+        }
+    }
+    /* Find the buffer-owning events, and the distinct CPUs */
+    for (i = 0; i < n_evs; ++i) {
+        EventObject *e = evs[i];
+        if (e->buffer_owner) {
+            continue;
+        }
+        if (!e->mmap_page && !event_setup_buffer(e)) {
+            PyErr_SetString(PyExc_ValueError, "no buffer allocated");
+            goto out;
+        }
+        if (path && e->aux_area) {
+            PyErr_SetString(PyExc_ValueError, "AUX data can't be written to a file: use read()");
+            goto out;
+        }
+        owners[n_owners++] = i;
+        for (j = 0; j < n_cpus && cpus[j] != e->cpu; ++j)
+            ;
+        if (j == n_cpus) {
+            cpus[n_cpus++] = e->cpu;
+        }
+    }
+    if (n_threads == 0 || n_threads > n_cpus) {
+        n_threads = n_cpus;
+    }
+    c->interval_ms = (int)(interval * 1000.0);
+    c->threads = (collector_thread_t *)calloc(n_threads, sizeof(collector_thread_t));
+    if (!c->threads) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    c->n_threads = n_threads;
+    for (i = 0; i < n_threads; ++i) {
+        c->threads[i].epfd = -1;
+    }
+    for (i = 0; i < n_threads; ++i) {
+        collector_thread_t *t = &c->threads[i];
+        t->c = c;
+        t->events = (EventObject **)malloc(n_owners * sizeof(EventObject *));
+        t->aux_idx = (unsigned int *)calloc(n_owners, sizeof(unsigned int));
+        t->q.size = capacity;
+        t->q.buf = (unsigned char *)malloc(capacity);
+        if (!t->events || !t->aux_idx || !t->q.buf) {
+            PyErr_NoMemory();
+            goto out;
+        }
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epfd < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto out;
+        }
+    }
+    for (i = 0; i < n_owners; ++i) {
+        EventObject *e = evs[owners[i]];
+        collector_thread_t *t;
+        struct epoll_event ev;
+        for (j = 0; cpus[j] != e->cpu; ++j)
+            ;
+        t = &c->threads[j % n_threads];
+        t->aux_idx[t->n_events] = collector_attr_index(evs, owners[i]);
+        t->events[t->n_events++] = e;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN;
+        ev.data.fd = e->fd;
+        (void)epoll_ctl(t->epfd, EPOLL_CTL_ADD, e->fd, &ev);
+    }
+    if (path) {
+        c->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        if (c->fd < 0 || !collector_write_header(c, evs, n_evs)) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            goto out;
+        }
+    }
+    rc = 0;
+out:
+    free(evs);
+    free(owners);
+    free(cpus);
+    return rc;
+}
+
+
+static PyObject *collector_start(PyObject *x)
+{
+    CollectorObject *c = (CollectorObject *)x;
+    unsigned int i, j;
+    if (c->running) {
+        PyErr_SetString(PyExc_ValueError, "collector is already running");
+        return NULL;
+    }
+    for (i = 0; i < c->n_threads; ++i) {
+        for (j = 0; j < c->threads[i].n_events; ++j) {
+            if (c->threads[i].events[j]->batch_pending) {
+                PyErr_SetString(PyExc_ValueError, "record batch has not been released");
+                return NULL;
+            }
+        }
+    }
+    c->stop = 0;
+    for (i = 0; i < c->n_threads; ++i) {
+        collector_thread_t *t = &c->threads[i];
+        for (j = 0; j < t->n_events; ++j) {
+            t->events[j]->collector_running = 1;
+        }
+        if (pthread_create(&t->thread, NULL, collector_thread_main, t) == 0) {
+            t->started = 1;
+        } else {
+            perror("perf_events: collector thread");
+        }
+    }
+    c->running = 1;
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Stop the threads, after they have drained the buffers once more.
+ */
+static void collector_do_stop(CollectorObject *c)
+{
+    unsigned int i, j;
+    if (!c->running) {
+        return;
+    }
+    c->stop = 1;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < c->n_threads; ++i) {
+        collector_thread_t *t = &c->threads[i];
+        if (t->started) {
+            pthread_join(t->thread, NULL);
+            t->started = 0;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    for (i = 0; i < c->n_threads; ++i) {
+        for (j = 0; j < c->threads[i].n_events; ++j) {
+            c->threads[i].events[j]->collector_running = 0;
+        }
+    }
+    c->running = 0;
+}
+
+
+static PyObject *collector_stop(PyObject *x)
+{
+    collector_do_stop((CollectorObject *)x);
+    Py_RETURN_NONE;
+}
 
 
-static PyMethodDef Reading_methods[] = {
-    {NULL}
-};
+/*
+ * Get all the records queued so far, from all threads, as bytes.
+ * The records from each thread are in order, but the threads' records
+ * are simply concatenated, not merged by time.
+ */
+static PyObject *collector_read(PyObject *x)
+{
+    CollectorObject *c = (CollectorObject *)x;
+    struct iovec (*iov)[2];
+    unsigned long *lens;
+    unsigned long total = 0;
+    unsigned int i;
+    PyObject *r;
+    unsigned char *p;
+    if (c->fd >= 0) {
+        /* Records are going to the file */
+        return MyBytes_FromStringAndSize(NULL, 0);
+    }
+    iov = malloc(c->n_threads * sizeof *iov);
+    lens = (unsigned long *)malloc(c->n_threads * sizeof *lens);
+    for (i = 0; i < c->n_threads; ++i) {
+        lens[i] = collector_queue_peek(&c->threads[i].q, iov[i]);
+        total += lens[i];
+    }
+    r = MyBytes_FromStringAndSize(NULL, total);
+    p = (unsigned char *)MyBytes_AsString(r);
+    for (i = 0; i < c->n_threads; ++i) {
+        memcpy(p, iov[i][0].iov_base, iov[i][0].iov_len);
+        p += iov[i][0].iov_len;
+        memcpy(p, iov[i][1].iov_base, iov[i][1].iov_len);
+        p += iov[i][1].iov_len;
+        collector_queue_consume(&c->threads[i].q, lens[i]);
+    }
+    free(lens);
+    free(iov);
+    return r;
+}
 
 
-static struct PyMemberDef Reading_members[] = {
-    {"raw_value", T_LONGLONG, offsetof(ReadingObject, base.sample.value), 0, "raw count"},
-    {"value", T_OBJECT, offsetof(ReadingObject, adjusted_value), 0, "adjusted count - None if event was never scheduled"},
-    {NULL}
-};
+static PyObject *collector_stats(PyObject *x)
+{
+    CollectorObject *c = (CollectorObject *)x;
+    unsigned long long records = 0, bytes = 0, dropped_records = 0, dropped_bytes = 0, aux_bytes = 0;
+    unsigned int i;
+    for (i = 0; i < c->n_threads; ++i) {
+        collector_thread_t const *t = &c->threads[i];
+        records += t->records;
+        bytes += t->bytes;
+        dropped_records += t->dropped_records;
+        dropped_bytes += t->dropped_bytes;
+        aux_bytes += t->aux_bytes;
+    }
+    return Py_BuildValue("{sKsKsKsKsKsI}",
+        "records", records,
+        "bytes", bytes,
+        "dropped_records", dropped_records,
+        "dropped_bytes", dropped_bytes,
+        "aux_bytes", aux_bytes,
+        "threads", c->n_threads);
+}
 
 
-static PyMethodDef GroupReading_methods[] = {
-    {NULL}
-};
+static PyObject *collector_close(PyObject *x)
+{
+    CollectorObject *c = (CollectorObject *)x;
+    collector_do_stop(c);
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    Py_RETURN_NONE;
+}
 
 
-static PySequenceMethods GroupReading_seqmethods = {
-    .sq_length = &groupreading_seq_length,
-    .sq_item = &groupreading_seq_item
-};
+static void collector_dealloc(PyObject *x)
+{
+    CollectorObject *c = (CollectorObject *)x;
+    unsigned int i;
+    Py_XDECREF(collector_close(x));
+    for (i = 0; i < c->n_threads; ++i) {
+        collector_thread_t *t = &c->threads[i];
+        if (t->epfd >= 0) {
+            close(t->epfd);
+        }
+        free(t->q.buf);
+        free(t->aux_idx);
+        free(t->events);
+    }
+    free(c->threads);
+    pthread_mutex_destroy(&c->file_lock);
+    Py_XDECREF(c->events);
+    x->ob_type->tp_free(x);
+}
 
 
-static struct PyMemberDef GroupReading_members[] = {
+static struct PyMethodDef Collector_methods[] = {
+    {"start", (PyCFunction)&collector_start, METH_NOARGS, "start the collector threads"},
+    {"stop", (PyCFunction)&collector_stop, METH_NOARGS, "stop the collector threads, after a final drain"},
+    {"read", (PyCFunction)&collector_read, METH_NOARGS, "bytes: get the records collected so far"},
+    {"stats", (PyCFunction)&collector_stats, METH_NOARGS, "dict: records collected and dropped"},
+    {"close", (PyCFunction)&collector_close, METH_NOARGS, "stop the collector and close its file"},
     {NULL}
 };
 
-
-static PyTypeObject BaseReadingType = {
+static PyTypeObject CollectorType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_basicsize = sizeof(BaseReadingObject),
-    .tp_name = "perf_events.BaseReading",
-    .tp_doc = "Base reading class",
+    .tp_basicsize = sizeof(CollectorObject),
+    .tp_name = "perf_events.Collector",
+    .tp_doc = "background threads draining event buffers",
     .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = BaseReading_methods,
-    .tp_members = BaseReading_members,
-    //.tp_str = basereading_str,
-    .tp_new = basereading_new,   /* should not be called */
-    .tp_dealloc = basereading_dealloc
+    .tp_methods = Collector_methods,
+    .tp_new = collector_new,
+    .tp_init = collector_init,
+    .tp_dealloc = collector_dealloc
 };
 
 
-static PyTypeObject ReadingType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_base = &BaseReadingType,
-    .tp_basicsize = sizeof(ReadingObject),
-    .tp_name = "perf_events.Reading",
-    .tp_doc = "A reading taken from a counting perf event",
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = Reading_methods,
-    .tp_members = Reading_members,
-    .tp_str = reading_str,
-    .tp_new = reading_new,
-    .tp_dealloc = reading_dealloc
-};
-
+/*
+ * Periodic sampling of counting events, on a dedicated thread.
+ *
+ * Calling Event.read() from a Python loop allocates a Reading each time,
+ * and the sampling period jitters with whatever the interpreter is doing.
+ * A CounterSampler reads a set of events (or groups) every 'interval'
+ * seconds, on an absolute timer, and appends a row of native integers
+ * to a ring for each sample:
+ *
+ *   timestamp (CLOCK_MONOTONIC, ns),
+ *   then for each counter: value, time_enabled, time_running
+ *
+ * take() returns the rows collected so far, as a 2-D memoryview.
+ *
+ * Reading counters from userspace (rdpmc/mrs) only works for events
+ * counting on the reading thread itself, so the sampler thread uses
+ * read(), once per event or group.
+ */
+typedef struct {
+    EventObject *e;
+    unsigned int n_values;          /* values returned by read(): 1, or the group size */
+    unsigned int size;              /* bytes returned by read() */
+    unsigned int column;            /* index of the first counter in the row */
+    unsigned int value_len;         /* u64s per group value: value, then optional id and lost */
+} counter_source_t;
 
-static PyTypeObject GroupReadingType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_base = &BaseReadingType,
-    .tp_basicsize = sizeof(GroupReadingObject),
-    .tp_name = "perf_events.GroupReading",
-    .tp_doc = "A reading taken from a counting perf event group",
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = GroupReading_methods,
-    .tp_members = GroupReading_members,
-    .tp_as_sequence = &GroupReading_seqmethods,
-    .tp_str = groupreading_str,
-    .tp_new = groupreading_new,
-    .tp_dealloc = groupreading_dealloc
-};
+typedef struct {
+    PyObject_HEAD
+    PyObject *events;               /* list of the events we read, to keep them alive */
+    PyObject *counters;             /* list of the event for each counter */
+    counter_source_t *sources;
+    unsigned int n_sources;
+    unsigned int n_counters;
+    unsigned long long *buf;        /* for read(): big enough for the largest source */
+    unsigned int buf_size;          /* in bytes */
+    unsigned int row_len;           /* row length, in u64 */
+    unsigned long long *rows;
+    unsigned long capacity;         /* ring size, in rows */
+    unsigned long head;             /* advanced by the sampler thread */
+    unsigned long tail;             /* advanced by take() */
+    unsigned long long interval_ns;
+    unsigned long long n_rows;
+    unsigned long long dropped;     /* rows lost because the ring was full */
+    unsigned long long overruns;    /* periods missed because we woke up late */
+    unsigned long long errors;      /* failed reads */
+    pthread_t thread;
+    int running;
+    int volatile stop;
+} CounterSamplerObject;
 
 
 /*
- * Convert a hardware timestamp to a kernel timestamp as found in perf.data.
+ * Read all the sources into one row. Events without time_enabled and
+ * time_running in their read_format get zeroes for those.
  */
-static PyObject *timeconv_to_time(PyObject *x, PyObject *v)
+static void countersampler_read_row(CounterSamplerObject *c, unsigned long long *row)
 {
-    TimeConvObject *c = (TimeConvObject *)x;
-    unsigned long cyc = PyLong_AsLong(v);
-    unsigned long long quot, rem, st;
-    quot = (cyc >> c->time_shift);
-    rem = cyc & ((1ULL << c->time_shift) - 1);
-    st = c->time_zero + quot*c->time_mult + ((rem*c->time_mult) >> c->time_shift);
-    return PyLong_FromLong(st); 
+    unsigned long long *const buf = c->buf;
+    unsigned int s;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    row[0] = (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    for (s = 0; s < c->n_sources; ++s) {
+        counter_source_t const *src = &c->sources[s];
+        unsigned long long const rf = src->e->attr.read_format;
+        unsigned long long *out = row + 1 + 3*src->column;
+        unsigned long long const *p = buf;
+        unsigned long long enabled = 0, running = 0;
+        unsigned int i;
+        if (read(src->e->fd, buf, src->size) != (ssize_t)src->size) {
+            memset(out, 0xff, 3 * src->n_values * sizeof *out);
+            c->errors++;
+            continue;
+        }
+        /* The times follow the value, or the number of values for a group */
+        ++p;
+        if (rf & PERF_FORMAT_TOTAL_TIME_ENABLED) {
+            enabled = *p++;
+        }
+        if (rf & PERF_FORMAT_TOTAL_TIME_RUNNING) {
+            running = *p++;
+        }
+        if (!(rf & PERF_FORMAT_GROUP)) {
+            out[0] = buf[0];
+            out[1] = enabled;
+            out[2] = running;
+            continue;
+        }
+        for (i = 0; i < src->n_values; ++i) {
+            out[3*i+0] = *p;
+            out[3*i+1] = enabled;
+            out[3*i+2] = running;
+            p += src->value_len;
+        }
+    }
 }
 
 
-static int timeconv_from_mmap(TimeConvObject *c, struct perf_event_mmap_page volatile *mp)
-{ 
-    if (!(mp->capabilities & _cap_user_time_zero)) {
-        /* Can't read timebase from userspace */
-        return 0;
-    }
-    unsigned int seq;
-    do {
-        seq = mp->lock;
-        barrier();
-        if (mp->capabilities & _cap_user_time_zero) {
-            //cyc = hardware_timestamp();
-            c->time_zero = mp->time_zero;
-            c->time_mult = mp->time_mult;
-            c->time_shift = mp->time_shift;
+static void *countersampler_thread_main(void *arg)
+{
+    CounterSamplerObject *c = (CounterSamplerObject *)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!c->stop) {
+        unsigned long const tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        struct timespec now;
+        unsigned long long next_ns, now_ns;
+        if (c->head - tail < c->capacity) {
+            countersampler_read_row(c, c->rows + (c->head % c->capacity) * c->row_len);
+            __atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+            c->n_rows++;
+        } else {
+            c->dropped++;
         }
-        barrier();
-    } while (mp->lock != seq);
-    return 1;
+        /* Wait for the next period, measured from the start, so we don't drift */
+        next_ns = (unsigned long long)next.tv_sec * 1000000000 + next.tv_nsec + c->interval_ns;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+        if (next_ns <= now_ns) {
+            /* We're late: skip the periods we've missed */
+            unsigned long long const missed = (now_ns - next_ns) / c->interval_ns + 1;
+            c->overruns += missed;
+            next_ns += missed * c->interval_ns;
+        }
+        next.tv_sec = next_ns / 1000000000;
+        next.tv_nsec = next_ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+
+static PyObject *countersampler_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+{
+    CounterSamplerObject *c = (CounterSamplerObject *)t->tp_alloc(t, 0);
+    assert(c != NULL);
+    return (PyObject *)c;
 }
 
 
 /*
- * Get the time conversion parameters - these are global, but if we don't
- * already have an event we need to open a dummy event to get them.
+ * CounterSampler(events, interval=0.001, capacity=4096)
+ *   events    counting events, or group leaders opened with PERF_FORMAT_GROUP
+ *   interval  sampling period, in seconds
+ *   capacity  number of rows held until take() is called
  */
-static int timeconv_from_dummy(TimeConvObject *c)
+static int countersampler_init(PyObject *x, PyObject *args, PyObject *kwds)
 {
-    int ok = 0;
-    struct perf_event_attr pa;
-    memset(&pa, 0, sizeof pa);
-    pa.size = sizeof pa;
-    pa.type = PERF_TYPE_SOFTWARE;
-    pa.config = PERF_COUNT_SW_DUMMY;
-    /* Open a temporary dummy event, which we will close before returning. */
-    int e_fd = perf_event_open(&pa, /*pid=*/0, -1, -1, 0);
-    if (e_fd < 0) {
-        perror("dummy event");
-        return 0;
+    static char *kwlist[] = {"events", "interval", "capacity", NULL};
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    PyObject *evo;
+    double interval = 0.001;
+    unsigned long capacity = 4096;
+    unsigned int i, j;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|dk", kwlist, &evo, &interval, &capacity)) {
+        return -1;
     }
-    unsigned int size = sysconf(_SC_PAGESIZE);
-    void *pmap = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, e_fd, 0);
-    if (pmap != MAP_FAILED) {
-        ok = timeconv_from_mmap(c, (struct perf_event_mmap_page *)pmap);
-        if (!ok) {
-            PyErr_SetString(PyExc_ValueError, "mmap buffer doesn't contain system time base");
+    if (interval <= 0.0 || capacity == 0) {
+        PyErr_SetString(PyExc_ValueError, "interval and capacity must be positive");
+        return -1;
+    }
+    c->events = PySequence_List(evo);
+    if (!c->events) {
+        return -1;
+    }
+    c->n_sources = PyList_GET_SIZE(c->events);
+    c->sources = (counter_source_t *)calloc(c->n_sources ? c->n_sources : 1, sizeof(counter_source_t));
+    c->counters = PyList_New(0);
+    c->buf_size = 64 * sizeof(unsigned long long);
+    c->buf = (unsigned long long *)malloc(c->buf_size);
+    if (!c->sources || !c->counters || !c->buf) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < c->n_sources; ++i) {
+        PyObject *eo = PyList_GET_ITEM(c->events, i);
+        counter_source_t *src = &c->sources[i];
+        EventObject *e;
+        unsigned long long const *buf;
+        unsigned int hdr;
+        ssize_t n;
+        if (!PyObject_TypeCheck(eo, &EventType)) {
+            PyErr_SetString(PyExc_TypeError, "CounterSampler needs Event objects");
+            return -1;
         }
-        munmap(pmap, size);
-    } else {
-        perror("mmap");
+        e = (EventObject *)eo;
+        if (e->fd < 0) {
+            PyErr_SetString(PyExc_ValueError, "event is closed");
+            return -1;
+        }
+        src->e = e;
+        src->column = c->n_counters;
+        /* Read once, to find the size of a group, growing the buffer until it fits */
+        while ((n = read(e->fd, c->buf, c->buf_size)) < 0 && errno == ENOSPC) {
+            unsigned long long *nb = (unsigned long long *)realloc(c->buf, 2 * c->buf_size);
+            if (!nb) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            c->buf = nb;
+            c->buf_size *= 2;
+        }
+        if (n <= 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        buf = c->buf;
+        src->size = n;
+        src->n_values = (e->attr.read_format & PERF_FORMAT_GROUP) ? (unsigned int)buf[0] : 1;
+        src->value_len = 1 + !!(e->attr.read_format & PERF_FORMAT_ID) +
+                             !!(e->attr.read_format & PERF_FORMAT_LOST);
+        hdr = 1 + !!(e->attr.read_format & PERF_FORMAT_TOTAL_TIME_ENABLED) +
+                  !!(e->attr.read_format & PERF_FORMAT_TOTAL_TIME_RUNNING);
+        for (j = 0; j < src->n_values; ++j) {
+            /* Find the event for each of a group's values, by its id */
+            EventObject *ce = e;
+            if ((e->attr.read_format & (PERF_FORMAT_GROUP|PERF_FORMAT_ID)) == (PERF_FORMAT_GROUP|PERF_FORMAT_ID)) {
+                EventObject *fe = event_find_by_id(buf[hdr + src->value_len*j + 1]);
+                if (fe) {
+                    ce = fe;
+                }
+            }
+            PyList_Append(c->counters, (PyObject *)ce);
+        }
+        c->n_counters += src->n_values;
     }
-    close(e_fd);    /* Close the temporary dummy event. */
-    return ok;
+    c->row_len = 1 + 3*c->n_counters;
+    c->capacity = capacity;
+    c->rows = (unsigned long long *)malloc(capacity * c->row_len * sizeof(unsigned long long));
+    if (!c->rows) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    c->interval_ns = (unsigned long long)(interval * 1e9);
+    if (c->interval_ns == 0) {
+        c->interval_ns = 1;
+    }
+    return 0;
 }
 
 
-static PyObject *timeconv_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
+static PyObject *countersampler_start(PyObject *x)
 {
-    TimeConvObject *c = (TimeConvObject *)t->tp_alloc(t, 0);
-    int ok = timeconv_from_dummy(c);
-    if (!ok) {
-        t->tp_free(c);
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    Py_ssize_t i;
+    if (c->running) {
+        PyErr_SetString(PyExc_ValueError, "sampler is already running");
         return NULL;
     }
-    return (PyObject *)c;
+    c->stop = 0;
+    if (pthread_create(&c->thread, NULL, countersampler_thread_main, c) != 0) {
+        PyErr_SetString(PyExc_OSError, "failed to create sampler thread");
+        return NULL;
+    }
+    c->running = 1;
+    for (i = 0; i < PyList_GET_SIZE(c->counters); ++i) {
+        ((EventObject *)PyList_GET_ITEM(c->counters, i))->samplers_running++;
+    }
+    Py_RETURN_NONE;
 }
 
 
-static void timeconv_dealloc(PyObject *x)
+static void countersampler_do_stop(CounterSamplerObject *c)
+{
+    Py_ssize_t i;
+    if (c->running) {
+        c->stop = 1;
+        Py_BEGIN_ALLOW_THREADS
+        pthread_join(c->thread, NULL);
+        Py_END_ALLOW_THREADS
+        c->running = 0;
+        for (i = 0; i < PyList_GET_SIZE(c->counters); ++i) {
+            ((EventObject *)PyList_GET_ITEM(c->counters, i))->samplers_running--;
+        }
+    }
+}
+
+
+static PyObject *countersampler_stop(PyObject *x)
+{
+    countersampler_do_stop((CounterSamplerObject *)x);
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Return the rows sampled since the last call, as a memoryview of
+ * unsigned 64-bit integers, with shape [rows, 1 + 3*counters]
+ * (or an empty one-dimensional view, if there are none).
+ */
+static PyObject *countersampler_take(PyObject *x)
+{
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    unsigned long const head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    unsigned long const n = head - c->tail;
+    unsigned long const row_bytes = c->row_len * sizeof(unsigned long long);
+    unsigned long const off = c->tail % c->capacity;
+    unsigned long const n1 = (n <= c->capacity - off) ? n : c->capacity - off;
+    PyObject *b = MyBytes_FromStringAndSize(NULL, n * row_bytes);
+    char *p = MyBytes_AsString(b);
+    memcpy(p, c->rows + off * c->row_len, n1 * row_bytes);
+    memcpy(p + n1 * row_bytes, c->rows, (n - n1) * row_bytes);
+    __atomic_store_n(&c->tail, head, __ATOMIC_RELEASE);
+#if PY_MAJOR_VERSION >= 3
+    {
+        PyObject *mv = PyMemoryView_FromObject(b), *r;
+        Py_DECREF(b);
+        if (!mv) {
+            return NULL;
+        }
+        if (n > 0) {
+            r = PyObject_CallMethod(mv, "cast", "s[kI]", "Q", n, c->row_len);
+        } else {
+            /* memoryview can't have a zero dimension in a multi-dimensional shape */
+            r = PyObject_CallMethod(mv, "cast", "s", "Q");
+        }
+        Py_DECREF(mv);
+        return r;
+    }
+#else
+    /* No memoryview.cast: return the raw array */
+    return b;
+#endif
+}
+
+
+static PyObject *countersampler_stats(PyObject *x)
+{
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    return Py_BuildValue("{sKsKsKsK}",
+        "rows", c->n_rows,
+        "dropped", c->dropped,
+        "overruns", c->overruns,
+        "errors", c->errors);
+}
+
+
+static PyObject *countersampler_get_counters(PyObject *x)
+{
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    return PySequence_List(c->counters);
+}
+
+
+static void countersampler_dealloc(PyObject *x)
 {
+    CounterSamplerObject *c = (CounterSamplerObject *)x;
+    countersampler_do_stop(c);
+    free(c->rows);
+    free(c->buf);
+    free(c->sources);
+    Py_XDECREF(c->counters);
+    Py_XDECREF(c->events);
     x->ob_type->tp_free(x);
 }
 
 
-static PyMethodDef TimeConv_methods[] = {
-    {"to_time", (PyCFunction)&timeconv_to_time, METH_O, "convert hardware timestamp to user time"},
+static struct PyMethodDef CounterSampler_methods[] = {
+    {"start", (PyCFunction)&countersampler_start, METH_NOARGS, "start the sampler thread"},
+    {"stop", (PyCFunction)&countersampler_stop, METH_NOARGS, "stop the sampler thread"},
+    {"take", (PyCFunction)&countersampler_take, METH_NOARGS, "memoryview: rows sampled since the last call"},
+    {"stats", (PyCFunction)&countersampler_stats, METH_NOARGS, "dict: rows sampled and dropped"},
+    {"counters", (PyCFunction)&countersampler_get_counters, METH_NOARGS, "list: event for each counter in a row"},
     {NULL}
 };
 
-static struct PyMemberDef TimeConv_members[] = {
-    {"time_zero", T_LONG, offsetof(TimeConvObject, time_zero), 0, "time zero"},
-    {"time_mult", T_LONG, offsetof(TimeConvObject, time_mult), 0, "time multiplier"},
-    {"time_shift", T_LONG, offsetof(TimeConvObject, time_shift), 0, "time shift"},
+static struct PyMemberDef CounterSampler_members[] = {
+    {"row_len", T_UINT, offsetof(CounterSamplerObject, row_len), READONLY, "row length: 1 + 3 * number of counters"},
+    {"interval_ns", T_ULONGLONG, offsetof(CounterSamplerObject, interval_ns), READONLY, "sampling period, in ns"},
     {NULL}
 };
 
-static PyTypeObject TimeConvType = {
+static PyTypeObject CounterSamplerType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_basicsize = sizeof(TimeConvObject),
-    .tp_name = "perf_events.TimeConv",
-    .tp_doc = "time conversion parameters",
+    .tp_basicsize = sizeof(CounterSamplerObject),
+    .tp_name = "perf_events.CounterSampler",
+    .tp_doc = "periodic sampling of counting events",
     .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = TimeConv_methods,
-    .tp_members = TimeConv_members,
-    //.tp_str = timeconv_str,
-    .tp_new = timeconv_new,
-    .tp_dealloc = timeconv_dealloc
+    .tp_methods = CounterSampler_methods,
+    .tp_members = CounterSampler_members,
+    .tp_new = countersampler_new,
+    .tp_init = countersampler_init,
+    .tp_dealloc = countersampler_dealloc
 };
 
 
@@ -3174,15 +7396,28 @@ static PyObject *perf_kernel_timestamp(PyObject *x)
 static PyObject *perf_fileno_event(PyObject *x, PyObject *ixo)
 {
     int ix = PyLong_AsLong(ixo);
-    if (ix < 0 || (unsigned int)ix >= n_fileno_events) {
+    PyObject *e = (ix < 0) ? NULL : (PyObject *)event_map_find(&fileno_map, ix);
+    if (e == NULL) {
         Py_RETURN_NONE;
-    } else if (fileno_events[ix] == NULL) {
+    }
+    Py_INCREF(e);
+    return e;
+}
+
+
+static PyObject *perf_id_event(PyObject *x, PyObject *ido)
+{
+    unsigned long long id = PyLong_AsUnsignedLongLong(ido);
+    PyObject *e;
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    e = (PyObject *)event_find_by_id(id);
+    if (e == NULL) {
         Py_RETURN_NONE;
-    } else {
-        PyObject *e = (PyObject *)fileno_events[ix];
-        Py_INCREF(e);
-        return e;
     }
+    Py_INCREF(e);
+    return e;
 }
 
 
@@ -3200,6 +7435,11 @@ static PyMethodDef funcs[] = {
     {"hardware_timestamp_frequency", (PyCFunction)&perf_hardware_timestamp_frequency, METH_NOARGS, PyDoc_STR("None -> int: read hardware timestamp frequency (Hz)")},
     {"kernel_timestamp", (PyCFunction)&perf_kernel_timestamp, METH_NOARGS, PyDoc_STR("None -> int: read kernel timestamp")},
     {"fileno_event", (PyCFunction)&perf_fileno_event, METH_O, PyDoc_STR("int -> get perf event for an OS file handle")},
+    {"id_event", (PyCFunction)&perf_id_event, METH_O, PyDoc_STR("int -> get perf event for a sample id")},
+    {"decode_spe", (PyCFunction)&perf_decode_spe, METH_VARARGS|METH_KEYWORDS, PyDoc_STR("buffer -> dict: decode Arm SPE data into columns")},
+    {"decode_etm", (PyCFunction)&perf_decode_etm, METH_VARARGS|METH_KEYWORDS, PyDoc_STR("buffer -> dict: decode ETE/ETMv4 trace into columns")},
+    {"etm_sync_points", (PyCFunction)&perf_etm_sync_points, METH_O, PyDoc_STR("buffer -> list: offsets of ETE/ETMv4 A-sync packets")},
+    {"etm_deformat", (PyCFunction)&perf_etm_deformat, METH_O, PyDoc_STR("buffer -> dict: split CoreSight formatted trace by trace id")},
     {NULL}
 };
 
@@ -3212,6 +7452,7 @@ static struct {
     CON(PERF_FLAG_READ_USERSPACE),
     CON(PERF_FLAG_NO_READ_USERSPACE),
     CON(PERF_FLAG_WEAK_GROUP),
+    CON(PERF_FLAG_OVERWRITE),
 };
 
 
@@ -3241,12 +7482,22 @@ PyMODINIT_FUNC INIT_NAME(MODULE_NAME)(void)
     PyObject_SetAttrString(pmod, "Event", (PyObject *)&EventType);
     PyType_Ready(&RecordType);
     PyObject_SetAttrString(pmod, "Record", (PyObject *)&RecordType);
+    PyType_Ready(&RecordBatchType);
+    PyObject_SetAttrString(pmod, "RecordBatch", (PyObject *)&RecordBatchType);
+    PyType_Ready(&SampleColumnsType);
+    PyObject_SetAttrString(pmod, "SampleColumns", (PyObject *)&SampleColumnsType);
     PyType_Ready(&ReadingType);
     PyObject_SetAttrString(pmod, "Reading", (PyObject *)&ReadingType);
     PyType_Ready(&GroupReadingType);
     PyObject_SetAttrString(pmod, "GroupReading", (PyObject *)&ReadingType);
     PyType_Ready(&TimeConvType);
     PyObject_SetAttrString(pmod, "TimeConv", (PyObject *)&TimeConvType);
+    PyType_Ready(&EventSetType);
+    PyObject_SetAttrString(pmod, "EventSet", (PyObject *)&EventSetType);
+    PyType_Ready(&CollectorType);
+    PyObject_SetAttrString(pmod, "Collector", (PyObject *)&CollectorType);
+    PyType_Ready(&CounterSamplerType);
+    PyObject_SetAttrString(pmod, "CounterSampler", (PyObject *)&CounterSamplerType);
     {
         unsigned int i;
         for (i = 0; i < (sizeof constants / sizeof constants[0]); ++i) {
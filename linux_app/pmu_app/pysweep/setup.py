@@ -23,8 +23,11 @@ src = [
     'src/loaddata.c',
     'src/loadgen.c',
     'src/prepcode.c',
+    'src/jitdump.c',
     'src/genelf.c',
     'src/sleep.c',
+    'src/isolate.c',
+    'src/steady.c',
     'src/branch_prediction.c',
 ]
 
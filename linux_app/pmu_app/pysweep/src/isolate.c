@@ -0,0 +1,203 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/*
+ * Support for running workloads on isolated CPUs.
+ *
+ * Measurements can be perturbed by timer ticks, device interrupts,
+ * preemption and migration. We can't always prevent this, but we can
+ * find CPUs that the kernel has set aside ("isolcpus=" and "nohz_full=")
+ * and we can count the interference that did happen, from
+ * /proc/self/task/<tid>/sched (or .../status) and /proc/interrupts.
+ */
+
+#include "isolate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <alloca.h>
+
+
+int isolate_read_cpulist(char const *path, cpu_set_t *cpus)
+{
+    FILE *fd = fopen(path, "r");
+    char buf[4096];
+    char *p;
+    CPU_ZERO(cpus);
+    if (!fd) {
+        return -1;
+    }
+    if (!fgets(buf, sizeof buf, fd)) {
+        buf[0] = '\0';
+    }
+    fclose(fd);
+    p = buf;
+    while (isdigit((unsigned char)*p)) {
+        unsigned long lo = strtoul(p, &p, 10);
+        unsigned long hi = lo;
+        unsigned long i;
+        if (*p == '-') {
+            hi = strtoul(p+1, &p, 10);
+        }
+        for (i = lo; i <= hi && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, cpus);
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return CPU_COUNT(cpus);
+}
+
+
+int isolate_isolated_cpus(cpu_set_t *cpus)
+{
+    cpu_set_t nohz;
+    (void)isolate_read_cpulist("/sys/devices/system/cpu/isolated", cpus);
+    if (isolate_read_cpulist("/sys/devices/system/cpu/nohz_full", &nohz) > 0) {
+        CPU_OR(cpus, cpus, &nohz);
+    }
+    return CPU_COUNT(cpus);
+}
+
+
+/*
+ * Find a "name : value" or "name: value" line in a /proc file.
+ */
+static int proc_field(char const *line, char const *name, unsigned long long *value)
+{
+    size_t len = strlen(name);
+    char const *p;
+    if (strncmp(line, name, len) != 0) {
+        return 0;
+    }
+    p = line + len;
+    while (*p == ' ' || *p == '\t') {
+        ++p;
+    }
+    if (*p != ':') {
+        return 0;
+    }
+    *value = strtoull(p+1, NULL, 10);
+    return 1;
+}
+
+
+int isolate_thread_noise(pid_t tid, struct thread_noise *n)
+{
+    char path[64];
+    char line[256];
+    FILE *fd;
+    int found = 0;
+    cpu_set_t cpus;
+    memset(n, 0, sizeof *n);
+    /* The sched file needs CONFIG_SCHED_DEBUG, but also has migrations. */
+    snprintf(path, sizeof path, "/proc/self/task/%d/sched", (int)tid);
+    fd = fopen(path, "r");
+    if (fd) {
+        while (fgets(line, sizeof line, fd)) {
+            found += proc_field(line, "nr_voluntary_switches", &n->nvcsw);
+            found += proc_field(line, "nr_involuntary_switches", &n->nivcsw);
+            (void)proc_field(line, "se.nr_migrations", &n->migrations);
+        }
+        fclose(fd);
+    }
+    if (found < 2) {
+        snprintf(path, sizeof path, "/proc/self/task/%d/status", (int)tid);
+        fd = fopen(path, "r");
+        if (!fd) {
+            return -1;
+        }
+        while (fgets(line, sizeof line, fd)) {
+            (void)proc_field(line, "voluntary_ctxt_switches", &n->nvcsw);
+            (void)proc_field(line, "nonvoluntary_ctxt_switches", &n->nivcsw);
+        }
+        fclose(fd);
+    }
+    if (sched_getaffinity(tid, sizeof cpus, &cpus) == 0) {
+        n->irqs = isolate_cpu_irqs(&cpus);
+    }
+    return 0;
+}
+
+
+unsigned long long isolate_cpu_irqs(cpu_set_t const *cpus)
+{
+    FILE *fd = fopen("/proc/interrupts", "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int n_cols = 0;
+    int *col_cpu = NULL;
+    unsigned long long total = 0;
+    if (!fd) {
+        return 0;
+    }
+    /* The header names the CPU for each column; offline CPUs are omitted. */
+    if (getline(&line, &line_size, fd) > 0) {
+        char *p = line;
+        col_cpu = (int *)malloc(CPU_SETSIZE * sizeof(int));
+        while ((p = strstr(p, "CPU")) != NULL && n_cols < CPU_SETSIZE) {
+            col_cpu[n_cols++] = (int)strtol(p+3, &p, 10);
+        }
+    }
+    while (n_cols > 0 && getline(&line, &line_size, fd) > 0) {
+        char *p = strchr(line, ':');
+        unsigned long long counts = 0;
+        unsigned int i;
+        if (!p) {
+            continue;
+        }
+        ++p;
+        /* Lines like "ERR:" have a single total, not a count per CPU. */
+        for (i = 0; i < n_cols; ++i) {
+            char *q;
+            unsigned long long v = strtoull(p, &q, 10);
+            if (q == p) {
+                break;
+            }
+            p = q;
+            if (CPU_ISSET(col_cpu[i], cpus)) {
+                counts += v;
+            }
+        }
+        if (i == n_cols) {
+            total += counts;
+        }
+    }
+    free(col_cpu);
+    free(line);
+    fclose(fd);
+    return total;
+}
+
+
+void isolate_prefault_stack(size_t bytes)
+{
+    if (bytes > 0) {
+        unsigned char volatile *p = (unsigned char volatile *)alloca(bytes);
+        size_t i;
+        for (i = 0; i < bytes; i += 1024) {
+            p[i] = 0;
+        }
+        p[bytes-1] = 0;
+    }
+}
+
+
+/* end of isolate.c */
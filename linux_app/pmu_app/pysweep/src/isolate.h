@@ -0,0 +1,74 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef __included_isolate_h
+#define __included_isolate_h
+
+/*
+ * Support for running workloads on isolated CPUs, and for detecting
+ * interference from the OS (preemption, migration and interrupts).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <sched.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Read a CPU list in the kernel's format (e.g. "1-3,6") from a file.
+ * Return the number of CPUs, or -1 if the file can't be read.
+ */
+int isolate_read_cpulist(char const *path, cpu_set_t *cpus);
+
+/*
+ * Get the CPUs that are isolated from the scheduler ("isolcpus=")
+ * or running tickless ("nohz_full="). Return the number of CPUs.
+ */
+int isolate_isolated_cpus(cpu_set_t *cpus);
+
+/*
+ * Interference counters for a thread. These are cumulative;
+ * callers should take differences.
+ */
+struct thread_noise {
+    unsigned long long nvcsw;        /* Voluntary context switches */
+    unsigned long long nivcsw;       /* Involuntary context switches (preemptions) */
+    unsigned long long migrations;   /* CPU migrations (if the kernel reports them) */
+    unsigned long long irqs;         /* Interrupts on the CPUs the thread may run on */
+};
+
+/*
+ * Read the interference counters for a thread in this process.
+ * Return 0 on success.
+ */
+int isolate_thread_noise(pid_t tid, struct thread_noise *);
+
+/*
+ * Total interrupts taken by a set of CPUs, from /proc/interrupts.
+ */
+unsigned long long isolate_cpu_irqs(cpu_set_t const *cpus);
+
+/*
+ * Touch the given amount of the current thread's stack, so that
+ * we don't take page faults on it later.
+ */
+void isolate_prefault_stack(size_t bytes);
+
+#endif /* included */
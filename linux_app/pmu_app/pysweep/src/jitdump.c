@@ -0,0 +1,297 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/*
+Write generated code descriptions in the format used by "perf inject --jit".
+See tools/perf/util/jitdump.h in the Linux sources.
+
+As well as the jitdump file itself, for each block of code that has notes
+we write a small listing, jit-<pid>-<index>.ops, with one line per operation.
+The debug info in the jitdump refers to lines of this listing, so that
+perf annotate can show which code generator operation produced each
+instruction.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "jitdump.h"
+
+#include "arch.h"
+#include "loadinst.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <time.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+
+#define JITHEADER_MAGIC      0x4A695444    /* "JiTD" */
+#define JITHEADER_VERSION    1
+
+struct jitheader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+enum jit_record_type {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_MOVE = 1,
+    JIT_CODE_DEBUG_INFO = 2,
+    JIT_CODE_CLOSE = 3
+};
+
+struct jr_prefix {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jr_code_load {
+    struct jr_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    /* followed by null-terminated name, then code */
+};
+
+struct jr_code_debug_info {
+    struct jr_prefix p;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    /* followed by debug entries */
+};
+
+struct debug_entry {
+    uint64_t addr;
+    int32_t lineno;
+    int32_t discrim;
+    /* followed by null-terminated source file name */
+};
+
+
+static FILE *jd_file;
+static void *jd_marker;        /* Executable mapping of the file, seen by perf record */
+static size_t jd_marker_size;
+static uint64_t jd_code_index;
+static char jd_dir[PATH_MAX];
+static char jd_filename[PATH_MAX];
+
+
+/*
+ * perf expects timestamps from the same clock it's using for samples.
+ * This needs "perf record -k mono".
+ */
+static uint64_t jd_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint32_t jd_elf_mach(void)
+{
+#if defined(ARCH_A64)
+    return EM_AARCH64;
+#elif defined(ARCH_A32) || defined(ARCH_T32)
+    return EM_ARM;
+#elif defined(__x86_64__)
+    return EM_X86_64;
+#else
+    return EM_NONE;
+#endif
+}
+
+
+int jitdump_open(char const *dir)
+{
+    struct jitheader h;
+    int fd;
+    if (jd_file) {
+        jitdump_close();
+    }
+    if (!dir) {
+        dir = ".";
+    }
+    if ((size_t)snprintf(jd_dir, sizeof jd_dir, "%s", dir) >= sizeof jd_dir ||
+        (size_t)snprintf(jd_filename, sizeof jd_filename, "%s/jit-%d.dump", dir, (int)getpid()) >= sizeof jd_filename) {
+        fprintf(stderr, "jitdump: directory name too long: %s\n", dir);
+        return -1;
+    }
+    fd = open(jd_filename, O_CREAT|O_TRUNC|O_RDWR, 0666);
+    if (fd < 0) {
+        perror(jd_filename);
+        return -1;
+    }
+    /* The marker is what tells "perf inject" where to find the jitdump:
+       it must be an executable mapping of the file. */
+    jd_marker_size = sysconf(_SC_PAGESIZE);
+    jd_marker = mmap(NULL, jd_marker_size, PROT_READ|PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (jd_marker == MAP_FAILED) {
+        perror("jitdump: mmap");
+        jd_marker = NULL;
+        close(fd);
+        return -1;
+    }
+    jd_file = fdopen(fd, "wb");
+    if (!jd_file) {
+        perror("jitdump: fdopen");
+        munmap(jd_marker, jd_marker_size);
+        jd_marker = NULL;
+        close(fd);
+        return -1;
+    }
+    memset(&h, 0, sizeof h);
+    h.magic = JITHEADER_MAGIC;
+    h.version = JITHEADER_VERSION;
+    h.total_size = sizeof h;
+    h.elf_mach = jd_elf_mach();
+    h.pid = getpid();
+    h.timestamp = jd_timestamp();
+    fwrite(&h, sizeof h, 1, jd_file);
+    fflush(jd_file);
+    return 0;
+}
+
+
+char const *jitdump_filename(void)
+{
+    return jd_file ? jd_filename : NULL;
+}
+
+
+static int note_compare(void const *a, void const *b)
+{
+    void const *pa = ((struct codestream_note const *)a)->addr;
+    void const *pb = ((struct codestream_note const *)b)->addr;
+    return (pa < pb) ? -1 : (pa > pb) ? 1 : 0;
+}
+
+
+/*
+ * Write the debug info for a code block, and the operation listing it refers to.
+ * Entries must be in address order.
+ */
+static void jitdump_debug_info(void const *code, struct codestream_note *notes, unsigned int n_notes)
+{
+    char ops_filename[PATH_MAX];
+    struct jr_code_debug_info r;
+    size_t name_size;
+    unsigned int i;
+    FILE *ops;
+
+    if ((size_t)snprintf(ops_filename, sizeof ops_filename, "%s/jit-%d-%llu.ops",
+            jd_dir, (int)getpid(), (unsigned long long)jd_code_index) >= sizeof ops_filename) {
+        fprintf(stderr, "jitdump: directory name too long: %s\n", jd_dir);
+        return;
+    }
+    ops = fopen(ops_filename, "w");
+    if (!ops) {
+        perror(ops_filename);
+        return;
+    }
+    qsort(notes, n_notes, sizeof(struct codestream_note), note_compare);
+    for (i = 0; i < n_notes; ++i) {
+        fprintf(ops, "%p: %s\n", notes[i].addr, notes[i].what);
+    }
+    fclose(ops);
+    name_size = strlen(ops_filename) + 1;
+    r.p.id = JIT_CODE_DEBUG_INFO;
+    r.p.total_size = sizeof r + n_notes * (sizeof(struct debug_entry) + name_size);
+    r.p.timestamp = jd_timestamp();
+    r.code_addr = (uint64_t)(unsigned long)code;
+    r.nr_entry = n_notes;
+    fwrite(&r, sizeof r, 1, jd_file);
+    for (i = 0; i < n_notes; ++i) {
+        struct debug_entry e;
+        e.addr = (uint64_t)(unsigned long)notes[i].addr;
+        e.lineno = i + 1;
+        e.discrim = 0;
+        fwrite(&e, sizeof e, 1, jd_file);
+        fwrite(ops_filename, name_size, 1, jd_file);
+    }
+}
+
+
+int jitdump_code_load(char const *name, void const *code, size_t size,
+                      struct codestream_note *notes, unsigned int n_notes)
+{
+    struct jr_code_load r;
+    size_t name_size = strlen(name) + 1;
+    if (!jd_file) {
+        return -1;
+    }
+    /* perf attaches debug info to the code load record that follows it */
+    if (notes && n_notes > 0) {
+        jitdump_debug_info(code, notes, n_notes);
+    }
+    r.p.id = JIT_CODE_LOAD;
+    r.p.total_size = sizeof r + name_size + size;
+    r.p.timestamp = jd_timestamp();
+    r.pid = getpid();
+    r.tid = (uint32_t)syscall(SYS_gettid);
+    r.vma = (uint64_t)(unsigned long)code;
+    r.code_addr = (uint64_t)(unsigned long)code;
+    r.code_size = size;
+    r.code_index = jd_code_index++;
+    fwrite(&r, sizeof r, 1, jd_file);
+    fwrite(name, name_size, 1, jd_file);
+    fwrite(code, size, 1, jd_file);
+    fflush(jd_file);
+    return 0;
+}
+
+
+void jitdump_close(void)
+{
+    struct jr_prefix r;
+    if (!jd_file) {
+        return;
+    }
+    r.id = JIT_CODE_CLOSE;
+    r.total_size = sizeof r;
+    r.timestamp = jd_timestamp();
+    fwrite(&r, sizeof r, 1, jd_file);
+    fclose(jd_file);
+    jd_file = NULL;
+    if (jd_marker) {
+        munmap(jd_marker, jd_marker_size);
+        jd_marker = NULL;
+    }
+}
+
+
+/* end of jitdump.c */
@@ -0,0 +1,63 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/*
+ * Write a perf "jitdump" file describing generated code.
+ *
+ * perf can then attribute samples in generated code to the code and
+ * (via debug info) to the code generator operations that produced it:
+ *
+ *   perf record -k mono ...
+ *   perf inject --jit -i perf.data -o perf.jit.data
+ *   perf report -i perf.jit.data
+ *
+ * The file is named jit-<pid>.dump, and must be mapped executable by
+ * the process so that perf record sees an MMAP event for it.
+ */
+
+#ifndef __included_jitdump_h
+#define __included_jitdump_h
+
+#include <stddef.h>
+
+struct codestream_note;
+
+/*
+ * Start writing a jitdump file in the given directory (NULL for the
+ * current directory). Return 0 on success.
+ */
+int jitdump_open(char const *dir);
+
+/*
+ * Return the name of the current jitdump file, or NULL if not writing.
+ */
+char const *jitdump_filename(void);
+
+/*
+ * Record a block of generated code, after it has been prepared for execution.
+ * Notes, if provided, generate debug info describing each operation.
+ * The notes may be re-ordered.
+ */
+int jitdump_code_load(char const *name, void const *code, size_t size,
+                      struct codestream_note *notes, unsigned int n_notes);
+
+/*
+ * Finish the jitdump file.
+ */
+void jitdump_close(void);
+
+#endif /* included */
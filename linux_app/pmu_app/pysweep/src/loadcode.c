@@ -27,6 +27,7 @@
 
 #include "loadinst.h"
 #include "prepcode.h"
+#include "jitdump.h"
 #include "arch.h"
 #include "genelf.h"
 
@@ -97,6 +98,12 @@ static void character_print(Character const *c)
     if (c->data_alignment != 0) {
         printf("    data alignment:      %d\n", c->data_alignment);
     }
+    if (c->workload_flags & WL_MEM_TLB) {
+        printf("    TLB page stride:     %#lx\n", (unsigned long)c->tlb_page_stride);
+        printf("    TLB lines per page:  %u\n", c->tlb_lines_per_page);
+        printf("    TLB huge pages:      %u%%\n", c->tlb_huge_fraction);
+        printf("    TLB walk stride:     %u\n", c->tlb_walk_stride);
+    }
     printf("  flags:            %#x\n", (unsigned int)c->workload_flags);
     printf("  FP intensity:     %lu\n", (unsigned long)c->fp_intensity);
     if (c->fp_intensity > 0) {
@@ -181,6 +188,9 @@ void *load_construct_code(Workload *w)
        unification (ARM). */
     int allow_write_and_exec = !(c->debug_flags & WORKLOAD_DEBUG_NO_WX);
 
+    struct codestream_note *notes;
+    unsigned int n_notes;
+
     void **dummy_data;
     dummy_data = (void **)&dummy_data;    /* Dummy circular chain */
 
@@ -235,6 +245,9 @@ void *load_construct_code(Workload *w)
     if (c->fp_flags & FP_FLAG_ALTERNATE) {
         codestream_use_alternate(cs);
     }
+    if (jitdump_filename()) {
+        codestream_keep_notes(cs);
+    }
     if (workload_verbose) {
         codestream_show(cs);
     }
@@ -549,6 +562,18 @@ end_of_loop:;
         codestream_pop_multiplier(cs, n_iters);
     }
 
+    /* Translation walks: for data, this depends on the data layout.
+       For code, we cross every page of the code working set in each
+       iteration of the inner loop. */
+    w->expected.n[COUNT_DTLB_WALK] = load_data_expected_walks(w, (unsigned long)w->n_chain_steps * n_iters);
+    if (c->workload_flags & WL_MEM_TLB) {
+        unsigned long const page = sysconf(_SC_PAGESIZE);
+        unsigned int const code_pages = round_size(size, page) / page;
+        if (code_pages > 1) {
+            w->expected.n[COUNT_ITLB_WALK] = code_pages * n_iters;
+        }
+    }
+
 #ifdef ARCH_A64
     if (c->fp_flags & FP_FLAG_ALTERNATE) {
         codestream_gen_direct(cs, 0x2520e040);    /* pseudo SVE instruction to ask ArmIE to stop trace */
@@ -568,6 +593,7 @@ generation_failed:
         return NULL;
     }
 
+    notes = codestream_take_notes(cs, &n_notes);
     codestream_free(cs);
 
     if (workload_verbose) {
@@ -589,10 +615,17 @@ generation_failed:
                               elf_image(w->elf_image), elf_image_size(w->elf_image));
         if (rc) {
             /* Generated code, but failed to mark it executable */
+            free(notes);
             load_free_mem(m);
             return NULL;
         }
     }
+    if (jitdump_filename()) {
+        char name[40];
+        snprintf(name, sizeof name, "pysweep_workload_%p", (void *)w);
+        jitdump_code_load(name, m->base, m->size, notes, n_notes);
+    }
+    free(notes);
     if (c->debug_flags & WORKLOAD_DEBUG_TRIAL_RUN) {
         /* test it - probably segfault if not right */
         printf("Testing generated branches at %p... 1 of 2\n", code_area);
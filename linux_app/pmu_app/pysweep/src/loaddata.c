@@ -297,6 +297,190 @@ static unsigned int line_data_placement(Character const *c, unsigned int i)
 }
 
 
+/*
+ * Layout of a TLB-stress working set. Pages are numbered as "slots":
+ * the first n_base slots are base pages, spaced by the page stride and
+ * optionally grouped so that each group starts in a fresh leaf page table;
+ * the remaining n_huge slots are each in their own huge page.
+ */
+struct tlb_layout {
+    unsigned long page;           /* Base page size */
+    unsigned long stride;         /* Distance between touched base pages */
+    unsigned int walk_stride;     /* Base pages per leaf table group, or 0 */
+    unsigned long group_span;     /* Address range of one group */
+    unsigned long huge;           /* Huge page size */
+    unsigned int n_base;          /* Slots in base pages */
+    unsigned int n_huge;          /* Slots in huge pages */
+    unsigned int lines_per_page;  /* Chain links in each slot */
+    unsigned int lines_in_page;   /* Cache lines in a base page */
+    unsigned int line;            /* Cache line size */
+    unsigned char *base_area;
+    unsigned char *huge_area;     /* Huge-page aligned */
+};
+
+
+static unsigned long tlb_slot_offset(struct tlb_layout const *t, unsigned int s)
+{
+    if (t->walk_stride) {
+        return (s / t->walk_stride) * t->group_span + (s % t->walk_stride) * t->stride;
+    }
+    return s * t->stride;
+}
+
+
+/*
+ * Return the address of link j in slot s. Links are spread through the page,
+ * and rotated by a hash of the slot so that we don't keep hitting the same
+ * cache set. Slot 0, link 0 is always at the start of its area.
+ */
+static unsigned char *tlb_link_address(struct tlb_layout const *t, unsigned int s, unsigned int j)
+{
+    unsigned int const spread = t->lines_in_page / t->lines_per_page;
+    unsigned int const ix = (hash_uint(s) + j*spread) % t->lines_in_page;
+    if (s < t->n_base) {
+        return t->base_area + tlb_slot_offset(t, s) + ix*t->line;
+    } else {
+        return t->huge_area + (unsigned long)(s - t->n_base) * t->huge + ix*t->line;
+    }
+}
+
+
+/*
+ * Construct a data working set designed to drive TLB misses and page walks.
+ * The data working set size gives the number of pages (translations)
+ * to touch, in units of the base page size. We visit the pages in a random
+ * cycle (or sequentially with WL_MEM_STREAM), touching some number of
+ * lines in each page before moving on.
+ *
+ * Only the touched pages are populated, so large strides are cheap in
+ * physical memory, although they do consume page tables.
+ */
+static void *load_construct_tlb_data(Workload *w)
+{
+    Character const *c = &w->c;
+    int debug = workload_verbose;
+    struct tlb_layout t;
+    unsigned int n_slots;
+    unsigned int n_links;
+    unsigned int s, j;
+    int *order = NULL;
+    void *first;
+
+    memset(&t, 0, sizeof t);
+    t.line = cache_line_length(c);
+    t.page = sysconf(_SC_PAGESIZE);
+    t.stride = round_size((c->tlb_page_stride > t.page ? c->tlb_page_stride : t.page), t.page);
+    t.lines_in_page = t.page / t.line;
+    t.lines_per_page = c->tlb_lines_per_page ? c->tlb_lines_per_page : 1;
+    if (t.lines_per_page > t.lines_in_page) {
+        t.lines_per_page = t.lines_in_page;
+    }
+    t.walk_stride = c->tlb_walk_stride;
+    if (t.walk_stride) {
+        /* A leaf page table maps as many pages as it has entries */
+        unsigned long const leaf_span = t.page * (t.page / sizeof(void *));
+        t.group_span = round_size(t.walk_stride * t.stride, leaf_span);
+    }
+    n_slots = round_size(c->data_working_set, t.page) / t.page;
+    if (n_slots == 0) {
+        return NULL;
+    }
+    if (c->tlb_huge_fraction > 0) {
+        t.huge = huge_page_size();
+        if (!t.huge) {
+            fprintf(stderr, "loadgen: no huge page size, TLB working set will use base pages only\n");
+        } else {
+            unsigned int pct = (c->tlb_huge_fraction <= 100) ? c->tlb_huge_fraction : 100;
+            t.n_huge = (unsigned int)(((unsigned long long)n_slots * pct) / 100);
+        }
+    }
+    t.n_base = n_slots - t.n_huge;
+    n_links = n_slots * t.lines_per_page;
+    if (debug >= 1) {
+        printf("Constructing TLB working set: %u base pages (stride %#lx, walk stride %u), %u huge pages, %u lines/page\n",
+            t.n_base, t.stride, t.walk_stride, t.n_huge, t.lines_per_page);
+    }
+    if (t.n_base > 0) {
+        struct workload_mem *m = &w->data_mem;
+        memset(m, 0, sizeof(struct workload_mem));
+        m->size_req = tlb_slot_offset(&t, t.n_base-1) + t.page;
+        m->is_no_hugepage = 1;
+        m->is_sparse = 1;
+        t.base_area = (unsigned char *)load_alloc_mem(m);
+        if (!t.base_area) {
+            fprintf(stderr, "loadgen: couldn't allocate %lu bytes for TLB working set\n", m->size_req);
+            return NULL;
+        }
+    }
+    if (t.n_huge > 0) {
+        /* Allow for an extra huge page, in case we fall back to transparent
+           huge pages and the mapping isn't huge-page aligned. */
+        struct workload_mem *m = &w->data_huge_mem;
+        memset(m, 0, sizeof(struct workload_mem));
+        m->size_req = (t.n_huge + 1) * t.huge;
+        m->is_force_hugepage = 1;
+        m->is_sparse = 1;
+        if (!load_alloc_mem(m)) {
+            fprintf(stderr, "loadgen: couldn't allocate %lu bytes for TLB huge-page working set\n", m->size_req);
+            load_free_data(w);
+            return NULL;
+        }
+        t.huge_area = (unsigned char *)round_size((unsigned long)m->base, t.huge);
+    }
+    if (!(c->workload_flags & WL_MEM_STREAM)) {
+        order = random_maximal_cycle(n_slots);
+    }
+    for (s = 0; s < n_slots; ++s) {
+        unsigned int next_s = order ? (unsigned int)order[s] : (s+1) % n_slots;
+        for (j = 0; j < t.lines_per_page; ++j) {
+            unsigned char *next = (j+1 < t.lines_per_page) ?
+                tlb_link_address(&t, s, j+1) : tlb_link_address(&t, next_s, 0);
+            *(void **)tlb_link_address(&t, s, j) = next - c->data_pointer_offset;
+        }
+    }
+    free(order);
+    first = tlb_link_address(&t, 0, 0) - c->data_pointer_offset;
+    {
+        unsigned int cl = chain_length(first, c->data_pointer_offset);
+        assert(cl == n_links);
+        if (debug >= 1) {
+            printf("TLB data chain length verified as %u\n", cl);
+        }
+    }
+    w->n_chain_links = n_links;
+    /* Every slot is in a different translation granule, so we change
+       translation once per slot visited - unless there is only one. */
+    w->n_chain_walks = (n_slots > 1) ? n_slots : 0;
+    return first;
+}
+
+
+/*
+ * Free the data working set(s).
+ */
+void load_free_data(Workload *w)
+{
+    load_free_mem(&w->data_mem);
+    load_free_mem(&w->data_huge_mem);
+}
+
+
+/*
+ * Given the number of chain steps per call, estimate the number of
+ * translation table walks, as if no translations were reused from the TLB
+ * after we moved to another page. This is an upper bound - it is only
+ * approached when the pages touched exceed the reach of the TLBs.
+ */
+unsigned int load_data_expected_walks(Workload const *w, unsigned long n_steps)
+{
+    if (!w->n_chain_links) {
+        return 0;
+    }
+    return (unsigned int)(((unsigned long long)n_steps * w->n_chain_walks + w->n_chain_links/2) / w->n_chain_links);
+}
+
+
+
 /* 
 Construct a data working set, given some characteristics. The output is a contiguous
 area of memory consisting of a granules (generally of cache line size) with a pointer
@@ -322,8 +506,10 @@ reset to the beginning of the chain.  If the workload is a relatively small numb
 instructions it must either be wrapped by a loop or must remember its state from
 one run to the next.
 */
-void *load_construct_data(Character const *c, struct workload_mem *m)
+void *load_construct_data(Workload *w)
 {
+    Character const *c = &w->c;
+    struct workload_mem *m = &w->data_mem;
     unsigned int i;
     int debug = workload_verbose;
     unsigned int const LINE = cache_line_length(c);
@@ -336,6 +522,9 @@ void *load_construct_data(Character const *c, struct workload_mem *m)
     void *adjusted_data;
     unsigned int expected_chain_length = n_lines;
 
+    if (c->workload_flags & WL_MEM_TLB) {
+        return load_construct_tlb_data(w);
+    }
     if (debug >= 1) {
         printf("Constructing data working set: size=%lu rounded=%lu lines=%u\n",
             (unsigned long)c->data_working_set,
@@ -446,6 +635,7 @@ void *load_construct_data(Character const *c, struct workload_mem *m)
                 (unsigned long)cl, ((unsigned long)cl * LINE), LINE);
         }
     }
+    w->n_chain_links = expected_chain_length;
     if (debug >= 1) {
         printf("Constructed data working set.\n");
     }
@@ -62,7 +62,7 @@ static unsigned long round_size_to_pages(unsigned long size)
  *
  * Return 0 if we can't find the size.
  */
-static unsigned long huge_page_size(void)
+unsigned long huge_page_size(void)
 {
     static unsigned long size = 1;   /* Never valid; initiates discovery */
     if (size == 1) {
@@ -91,8 +91,30 @@ static unsigned long huge_page_size(void)
 }
 
 
+/* Totals for all workloads. Workloads may be destroyed by the last
+   worker thread to run them, so these are updated atomically. */
 static unsigned long total_mmap_size = 0;
 static unsigned int total_mmap_count = 0;
+static unsigned long mmap_budget = 0;          /* Zero for no limit */
+static unsigned int mmap_budget_rejections = 0;
+
+
+/*
+ * Add to the mapped total, if it stays within the budget. The check and
+ * the add are one atomic update, so concurrent allocations can't both
+ * pass the check and go over. Return 0 if it would exceed the budget.
+ */
+static int load_reserve_mem(unsigned long rsize)
+{
+    unsigned long old;
+    do {
+        old = total_mmap_size;
+        if (mmap_budget != 0 && old + rsize > mmap_budget) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&total_mmap_size, old, old + rsize));
+    return 1;
+}
 
 
 /*
@@ -121,11 +143,22 @@ void *load_alloc_mem(struct workload_mem *m)
     /* We can't force mmap() to allocate with small pages.
        But we can allocate without population, then madvise(MADV_NOHUGEPAGE),
        then populate. */
-    if (!m->is_no_hugepage) {
+    if (!m->is_no_hugepage && !m->is_sparse) {
         flags |= MAP_POPULATE;
     }
     m->size = rsize;
     m->base = NULL;
+    if (!load_reserve_mem(rsize)) {
+        /* Refuse before we allocate - the caller may be able to free
+           something and try again. */
+        if (workload_verbose) {
+            fprintf(stderr, "loadgen: allocating %lu bytes would exceed budget: %lu of %lu bytes in use\n",
+                rsize, total_mmap_size, mmap_budget);
+        }
+        __sync_fetch_and_add(&mmap_budget_rejections, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
     if (1) {
         /* _GNU_SOURCE should have ensured we see MAP_ANONYMOUS */
         unsigned int prot = PROT_READ|PROT_WRITE;
@@ -149,6 +182,7 @@ void *load_alloc_mem(struct workload_mem *m)
             p = mmap(NULL, rsize, prot, flags, -1, 0);
         }
         if (p == MAP_FAILED) {
+            __sync_fetch_and_sub(&total_mmap_size, rsize);
             perror("mmap");
             fprintf(stderr, "Failed to allocate %lu/%#lx bytes (flags 0x%x, page size %lu): total out %u, %lu bytes\n",
                 (unsigned long)rsize, (unsigned long)rsize,
@@ -158,8 +192,8 @@ void *load_alloc_mem(struct workload_mem *m)
                 (unsigned long)total_mmap_size);
             return NULL;
         }
-        total_mmap_count += 1;
-        total_mmap_size += rsize;
+        /* total_mmap_size already includes this, from load_reserve_mem() */
+        __sync_fetch_and_add(&total_mmap_count, 1);
         m->is_mmap = 1;
         /* We don't need to use MADV_HUGEPAGE, as we will have mmap'ed with MAP_HUGETLB */
         if ((m->is_hugepage || m->is_force_hugepage) && !(flags & MAP_HUGETLB)) {
@@ -206,8 +240,8 @@ void load_free_mem(struct workload_mem *m)
             unsigned long rsize = round_size_to_pages(m->size);
             assert(total_mmap_size >= rsize);
             munmap(m->base, rsize);
-            total_mmap_count -= 1;
-            total_mmap_size -= rsize;
+            __sync_fetch_and_sub(&total_mmap_count, 1);
+            __sync_fetch_and_sub(&total_mmap_size, rsize);
         } else {
             free(m->base);
         }
@@ -216,6 +250,116 @@ void load_free_mem(struct workload_mem *m)
 }
 
 
+unsigned long workload_mem_total(unsigned int *count)
+{
+    if (count) {
+        *count = total_mmap_count;
+    }
+    return total_mmap_size;
+}
+
+
+unsigned long workload_mem_set_budget(unsigned long budget)
+{
+    unsigned long old = mmap_budget;
+    mmap_budget = budget;
+    return old;
+}
+
+
+unsigned long workload_mem_budget(void)
+{
+    return mmap_budget;
+}
+
+
+unsigned int workload_mem_rejections(void)
+{
+    return mmap_budget_rejections;
+}
+
+
+/*
+ * Find how much of an address range is resident, and how much is in
+ * huge pages. Residency comes from mincore(), which is exact.
+ * The huge page counts come from /proc/self/smaps, which reports
+ * per mapping; the kernel may have merged our mapping with a neighbour,
+ * so we take the overlapping fraction.
+ */
+void workload_mem_range_usage(void const *base, unsigned long size, struct workload_mem_usage *u)
+{
+    unsigned long const page = sysconf(_SC_PAGESIZE);
+    unsigned long const lo = (unsigned long)base;
+    unsigned long const hi = lo + size;
+    unsigned long n_pages, i, resident = 0;
+    unsigned char *vec;
+    FILE *fd;
+    if (!base || !size) {
+        return;
+    }
+    assert((lo % page) == 0);
+    u->reserved += size;
+    n_pages = (size + page - 1) / page;
+    vec = (unsigned char *)malloc(n_pages);
+    if (vec && mincore((void *)base, size, vec) == 0) {
+        for (i = 0; i < n_pages; ++i) {
+            resident += (vec[i] & 1);
+        }
+        resident *= page;
+    }
+    free(vec);
+    u->resident += resident;
+    fd = fopen("/proc/self/smaps", "r");
+    if (fd) {
+        char buf[256];
+        unsigned long vlo = 0, vhi = 0, huge = 0, kpage = 0;
+        int more = 1;
+        unsigned long huge_total = 0;
+        while (more) {
+            unsigned long a, b, kb;
+            more = (fgets(buf, sizeof buf, fd) != NULL);
+            if (!more || sscanf(buf, "%lx-%lx ", &a, &b) == 2) {
+                /* Start of the next mapping: account for the previous one */
+                if (vhi > lo && vlo < hi) {
+                    unsigned long olo = (vlo > lo) ? vlo : lo;
+                    unsigned long ohi = (vhi < hi) ? vhi : hi;
+                    double frac = (double)(ohi - olo) / (vhi - vlo);
+                    huge_total += (unsigned long)(huge * frac);
+                    if (kpage > page) {
+                        u->reserved_huge += (ohi - olo);
+                    }
+                }
+                if (more) {
+                    vlo = a;
+                    vhi = b;
+                    huge = kpage = 0;
+                }
+            } else if (sscanf(buf, "AnonHugePages: %lu kB", &kb) == 1 ||
+                       sscanf(buf, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                       sscanf(buf, "Shared_Hugetlb: %lu kB", &kb) == 1) {
+                huge += kb * 1024;
+            } else if (sscanf(buf, "KernelPageSize: %lu kB", &kb) == 1) {
+                kpage = kb * 1024;
+            }
+        }
+        fclose(fd);
+        u->resident_huge += (huge_total < resident) ? huge_total : resident;
+    }
+}
+
+
+void workload_mem_usage(Workload const *w, struct workload_mem_usage *code, struct workload_mem_usage *data)
+{
+    if (code) {
+        workload_mem_range_usage(w->code_mem.base, w->code_mem.size, code);
+    }
+    if (data) {
+        workload_mem_range_usage(w->data_mem.base, w->data_mem.size, data);
+        workload_mem_range_usage(w->data_huge_mem.base, w->data_huge_mem.size, data);
+    }
+}
+
+
 /*
 This function has the same API as the workload we create, and can be used
 as a stub when we're diagnosing crashes with the workload.
@@ -279,7 +423,7 @@ Workload *workload_create(Character const *c)
     /* Take a copy of the supplied workload characteristics.
        Later changes made by the caller will not take effect. */
     w->c = *c;
-    data = load_construct_data(&w->c, &w->data_mem);
+    data = load_construct_data(w);
     if (c->data_working_set > 0 && !data) {
         /* Data working set was requested but couldn't be constructed */
         free(w);
@@ -291,12 +435,16 @@ Workload *workload_create(Character const *c)
     if (w->data_mem.base != NULL) {
         elf_add_data(w->elf_image, w->data_mem.base, w->data_mem.size);
     }
+    if (w->data_huge_mem.base != NULL) {
+        elf_add_data(w->elf_image, w->data_huge_mem.base, w->data_huge_mem.size);
+    }
     if (workload_code_is_trivial(c)) {
         w->expected.n[COUNT_INST] = 100;    /* Just a guess */
         if (c->data_working_set) {
             w->entry = &dummy_workload_code;
             w->expected.n[COUNT_INST_RD] = 1;
             w->expected.n[COUNT_BYTES_RD] = sizeof(void *);
+            w->expected.n[COUNT_DTLB_WALK] = load_data_expected_walks(w, 1);
         } else {
             /* We mustn't try to run a chain pointer step when there's no
                data working set. */
@@ -312,6 +460,7 @@ Workload *workload_create(Character const *c)
            we might be able to fall back to a predefined function
            that would iterate through the data working set. But we don't
            currently support that. */
+        load_free_data(w);
         free(w);
         if (workload_verbose) {
             fprintf(stderr, "loadgen: couldn't create code working set\n");
@@ -393,7 +542,7 @@ static void workload_destroy(Workload *w)
     }
 #endif
     if (!(w->c.debug_flags & WORKLOAD_DEBUG_NO_FREE)) {
-        load_free_mem(&w->data_mem);
+        load_free_data(w);
         load_free_code(w);
     } else {
         fprintf(stderr, "loadgen: %p: debug request to not free working sets\n", w);
@@ -437,6 +586,12 @@ int workload_free(Workload *w)
 }
 
 
+unsigned int workload_runners(Workload const *w)
+{
+    return w->references - WORKLOAD_KEEP;
+}
+
+
 void workload_add_reference(Workload *w)
 {
     __sync_fetch_and_add(&w->references, 1);
@@ -78,7 +78,15 @@ typedef struct {
 #define WL_DEPEND         0x8000    /* Force total dependency chain */
 #define WL_MEM_BARRIER_SYSTEM 0x10000   /* e.g. DMB SY */
 #define WL_MEM_BARRIER_SYNC   0x20000   /* serializing wrt instructions: DSB instead of DMB */
+#define WL_MEM_TLB        0x40000   /* TLB-stress layout: see tlb_xxx fields */
     unsigned int workload_flags;   /* WL_xxx flags */
+    /* TLB-stress layout (WL_MEM_TLB). The data working set is then the
+       number of distinct translations needed, in units of the base page
+       size, and each chain step goes to a line in one of those pages. */
+    unsigned long tlb_page_stride;     /* Distance between touched pages: 0 for base page size */
+    unsigned int tlb_lines_per_page;   /* Lines touched in each page before moving on: 0 means 1 */
+    unsigned int tlb_huge_fraction;    /* Percentage of pages to be taken from huge pages */
+    unsigned int tlb_walk_stride;      /* Pages per leaf page table, to defeat walk caches: 0 to pack */
     /* Floating-point intensity - FP ops per memory reference. */
     unsigned int fp_intensity;
     /* Arithmetic precision */
@@ -159,6 +167,8 @@ typedef enum InstCounter {
     COUNT_INST_WR,       /* Memory write instructions */
     COUNT_BYTES_WR,      /* Memory write bytes */
     COUNT_FENCE,         /* Fences/barriers */
+    COUNT_DTLB_WALK,     /* Data translation table walks, assuming no TLB reuse between pages */
+    COUNT_ITLB_WALK,     /* Instruction translation table walks, likewise */
 #define COUNT_MEM_PREFETCH COUNT_INST   /* Don't count prefetches as reads */
     /* The following are more arbitrary measures, when we are generating
        sequences of instructions (e.g. dot-product). */
@@ -181,6 +191,7 @@ struct workload_mem {
     int is_no_hugepage:1;    /* Forbid allocation as huge pages */
     int is_hugepage:1;       /* Request opportunistic promotion to huge pages if large enough */
     int is_force_hugepage:1; /* Request promotion to huge pages even for small allocations */
+    int is_sparse:1;         /* Don't prepopulate - only pages we touch will be backed */
     /* Output */
     void *base;              /* Base virtual address */
     unsigned long size;      /* Size obtained - maybe rounded up to pages etc. */
@@ -198,6 +209,8 @@ typedef struct {
     /* Data about the generated workload code */
     struct inst_counters expected;  /* Count values per entry call */
     unsigned int n_chain_steps;  /* number of data steps per iteration */
+    unsigned int n_chain_links;  /* number of links in the data chain */
+    unsigned int n_chain_walks;  /* translation granule changes in one traversal of the chain */
     elf_t elf_image;     /* Internal descriptor for ELF generation */
 
     /* Data required to run the workload */
@@ -207,6 +220,7 @@ typedef struct {
     /* Following are internal details - shouldn't really be exposed here */
     struct workload_mem code_mem;
     struct workload_mem data_mem;
+    struct workload_mem data_huge_mem;   /* Huge-page part of a TLB-stress working set */
 
     /* Current status of the workload */
     volatile unsigned int references;   /* Number of threads running this workload */
@@ -254,5 +268,53 @@ void *workload_run(Workload *, void *, unsigned int);
  */
 int workload_dump(Workload *, char const *fn, unsigned int flags);
 
+/*
+ * Number of threads currently running a workload.
+ * Only valid until workload_free() is called.
+ */
+unsigned int workload_runners(Workload const *);
+
+/*
+ * Memory footprint of a workload, or of some other memory range.
+ * Huge pages may be hugetlbfs pages or transparent huge pages;
+ * only hugetlbfs pages are known to be huge when reserved.
+ */
+struct workload_mem_usage {
+    unsigned long reserved;       /* Bytes mapped */
+    unsigned long reserved_huge;  /* ... of which in hugetlbfs pages */
+    unsigned long resident;       /* Bytes resident (RSS) */
+    unsigned long resident_huge;  /* ... of which in huge pages */
+};
+
+/*
+ * Add the footprint of a page-aligned memory range to the totals.
+ */
+void workload_mem_range_usage(void const *, unsigned long size, struct workload_mem_usage *);
+
+/*
+ * Add the footprint of a workload's code and data to the totals.
+ * Either may be NULL.
+ */
+void workload_mem_usage(Workload const *, struct workload_mem_usage *code, struct workload_mem_usage *data);
+
+/*
+ * Total bytes mapped for all workloads, and optionally the number of mappings.
+ */
+unsigned long workload_mem_total(unsigned int *count);
+
+/*
+ * Set a limit on the total bytes mapped for all workloads, or zero for
+ * no limit. Allocations that would exceed this fail, and workload_create()
+ * returns NULL. Return the previous limit.
+ */
+unsigned long workload_mem_set_budget(unsigned long);
+
+unsigned long workload_mem_budget(void);
+
+/*
+ * Number of allocations refused because they would exceed the budget.
+ */
+unsigned int workload_mem_rejections(void);
+
 #endif /* included */
 
@@ -27,6 +27,8 @@
 
 extern int workload_verbose;
 
+extern unsigned long huge_page_size(void);
+
 extern void *load_alloc_mem(struct workload_mem *);
 
 extern void load_free_mem(struct workload_mem *);
@@ -35,7 +37,11 @@ extern void *load_construct_code(Workload *);
 
 extern void load_free_code(Workload *);
 
-extern void *load_construct_data(Character const *, struct workload_mem *);
+extern void *load_construct_data(Workload *);
+
+extern void load_free_data(Workload *);
+
+extern unsigned int load_data_expected_walks(Workload const *, unsigned long n_steps);
 
 #ifdef __cplusplus
 template<typename T>
@@ -73,6 +73,11 @@ struct codestream {
     code_t *p;                 /* running code pointer */
     int ran_out_of_space;
     int error;
+    /* Optional notes on which operation generated each instruction */
+    int keep_notes;
+    struct codestream_note *notes;
+    unsigned int n_notes;
+    unsigned int n_notes_alloc;
 };
 
 
@@ -181,9 +186,57 @@ int codestream_pop_multiplier(CS *cs, int m)
 
 void codestream_free(CS *cs)
 {
+    free(cs->notes);
     free(cs);
 }
 
+
+void codestream_keep_notes(CS *cs)
+{
+    cs->keep_notes = 1;
+}
+
+
+/*
+ * Note the operation that's about to be generated at the current position.
+ * When one generator calls another, the outer operation takes precedence.
+ */
+static void codestream_note(CS *cs, char const *what)
+{
+    struct codestream_note *n;
+    if (!cs->keep_notes) {
+        return;
+    }
+    if (cs->n_notes > 0 && cs->notes[cs->n_notes-1].addr == (void const *)cs->p) {
+        return;
+    }
+    if (cs->n_notes == cs->n_notes_alloc) {
+        unsigned int n_alloc = cs->n_notes_alloc ? cs->n_notes_alloc * 2 : 256;
+        struct codestream_note *notes = (struct codestream_note *)realloc(cs->notes, n_alloc * sizeof(struct codestream_note));
+        if (!notes) {
+            /* Notes are only for diagnostics - just stop taking them */
+            cs->keep_notes = 0;
+            return;
+        }
+        cs->notes = notes;
+        cs->n_notes_alloc = n_alloc;
+    }
+    n = &cs->notes[cs->n_notes++];
+    n->addr = cs->p;
+    n->what = what;
+}
+
+
+struct codestream_note *codestream_take_notes(CS *cs, unsigned int *n_notes)
+{
+    struct codestream_note *notes = cs->notes;
+    *n_notes = cs->n_notes;
+    cs->notes = NULL;
+    cs->n_notes = 0;
+    cs->n_notes_alloc = 0;
+    return notes;
+}
+
 void *codestream_addr(CS const *cs)
 {
     return cs->p;
@@ -270,6 +323,7 @@ static unsigned int codestream_bytes_left(CS const *cs)
 int codestream_gen_call(CS *cs, void *dest)
 {
     int disp;
+    codestream_note(cs, "call");
 #ifdef ARCH_T32
 #error TBD
 #elif defined(ARCH_A32)
@@ -289,6 +343,7 @@ int codestream_gen_call(CS *cs, void *dest)
 
 int codestream_gen_ret(CS *cs)
 {
+    codestream_note(cs, "return");
 #ifdef ARCH_T32
     codestream_gen(cs, 0x4770);
 #elif defined(ARCH_A32)
@@ -305,6 +360,7 @@ int codestream_gen_ret(CS *cs)
 
 int codestream_gen_ret_abi(CS *cs)
 {
+    codestream_note(cs, "return");
 #if defined(__x86_64__)
     /* Argument in RDI, return in RAX */
     if (cs->metrics->n[COUNT_FLOP_DP] || cs->metrics->n[COUNT_FLOP_SP]) {
@@ -368,6 +424,7 @@ typedef int cc_size_check[1/(sizeof x86_cc == CC_MAX)];
 int codestream_gen_branch(CS *cs, void *dest, cc_t cc)
 {
     int disp;
+    codestream_note(cs, (cc == CC_AL) ? "branch" : "conditional branch");
     /* Note that the pointer subtractions rely on code_t having the right size. */
 #ifdef ARCH_T32
     disp = ((code_t *)dest - (cs->p + 2));
@@ -435,6 +492,7 @@ int codestream_reserve(CS *cs, unsigned int bytes)
     } else {
         /* Generate a branch to the previous line */
         unsigned char *dest = (cs->line - cs->line_size);
+        codestream_note(cs, "next line");
         codestream_gen_branch(cs, dest, CC_AL);
         codestream_start_line(cs, dest);
         if (cs->line == cs->base) {
@@ -462,6 +520,11 @@ int codestream_gen_op(CS *cs, unsigned int op, flavor_t flavor, freg_t Rd, freg_
     assert(!is_simd || ((simd_bytes*8) >= esize_bits));
     unsigned int const simd_lanes = is_simd ? (simd_bytes / esize_bytes) : 1;
     assert(esize_bits == 16 || esize_bits == 32 || esize_bits == 64);
+    static char const *const op_notes[] = {
+        "fp move", "integer add", "integer xor", "fp negate",
+        "fp add", "fp multiply", "fp divide", "fp square root", "fp multiply-add"
+    };
+    codestream_note(cs, (op <= FP_OP_FMA) ? op_notes[op] : "fp op");
 
     //fprintf(stderr, "op=%u flav=%u Rd=%d Rx=%d Ry=%d Ra=%d\n", op, flavor, Rd, Rx, Ry, Ra);
     
@@ -816,6 +879,7 @@ a64regs:
 
 int codestream_gen_nop(CS *cs)
 {
+    codestream_note(cs, "nop");
 #if defined(ARCH_A64)
     codestream_gen(cs, 0xd503201f);
 #elif defined(__x86_64__)
@@ -855,6 +919,7 @@ static unsigned char reg_map(ireg_t r)
 int codestream_gen_decs(CS *cs, ireg_t Rd)
 {
     unsigned char k = 1;   /* The constant */
+    codestream_note(cs, "loop count");
 #if defined(ARCH_A64)
     codestream_gen(cs, (0x71000000 | (k << 10) | (Rd << 5) | (Rd)));
 #elif defined(__x86_64__)
@@ -873,6 +938,7 @@ int codestream_gen_decs(CS *cs, ireg_t Rd)
 
 int codestream_gen_iopk(CS *cs, unsigned int iop, ireg_t Rd, ireg_t Rn, int k)
 {
+    codestream_note(cs, "integer op");
 #if defined(ARCH_A64)
     unsigned int opcode = 0xBAD;
     if (iop == CS_IOP_ADD) {
@@ -898,6 +964,7 @@ int codestream_gen_iopk(CS *cs, unsigned int iop, ireg_t Rd, ireg_t Rn, int k)
  */
 int codestream_gen_movi32(CS *cs, ireg_t Rd, uint32_t n)
 {
+    codestream_note(cs, "move immediate");
 #if defined(ARCH_A64)
     /* On AArch64, constants must be done 16 bits at a time */
     codestream_gen(cs, 0xd2800000 | ((n & 0xffff) << 5) | Rd);
@@ -940,6 +1007,7 @@ static int __attribute__((unused)) fits_uimm(long x, unsigned int n_bits)
  */
 int codestream_gen_load(CS *cs, ireg_t Rt, ireg_t Rn, ireg_t Radd, int offset, unsigned int flags)
 {
+    codestream_note(cs, (flags & _internal_STORE) ? "store" : (flags & CS_LOAD_PREFETCH) ? "prefetch" : "load");
     assert((Rt == NR) == ((flags & CS_LOAD_PREFETCH) != 0));
 #if defined(ARCH_A64)
     /* flags[0] set to 1 for STRM */
@@ -1053,6 +1121,7 @@ int codestream_gen_store(CS *cs, ireg_t Rt, ireg_t Rn, ireg_t Radd, int offset,
 
 int codestream_gen_fp_load(CS *cs, flavor_t flavor, freg_t Rt, ireg_t Rn, int offset, unsigned int flags)
 {
+    codestream_note(cs, (flags & _internal_STORE) ? "fp store" : "fp load");
     assert(!(flags & CS_LOAD_PREFETCH));
 #if defined(ARCH_A64)
     unsigned int xflags = (flags & _internal_STORE) ? 0x00000000 : 0x00400000;
@@ -1083,6 +1152,7 @@ int codestream_gen_fp_store(CS *cs, flavor_t flavor, freg_t Rt, ireg_t Rn, int o
 
 int codestream_gen_fence(CS *cs, unsigned int flags)
 {
+    codestream_note(cs, "fence");
     assert((flags & (CS_FENCE_STORE|CS_FENCE_LOAD)) != 0);
 #if defined(ARCH_A64)
     unsigned int opcode = 0xd50338bf;   /* DMB ISH */
@@ -55,6 +55,21 @@ int codestream_errors(CS const *);
 
 void codestream_free(CS *);
 
+/*
+ * Optionally keep notes of which operation generated each instruction,
+ * e.g. for mapping samples in generated code back to the code generator.
+ * Notes are in address order within a code line.
+ */
+struct codestream_note {
+    void const *addr;          /* First instruction generated for the operation */
+    char const *what;          /* Static description */
+};
+
+void codestream_keep_notes(CS *);
+
+/* Transfer the notes to the caller, who should free() them */
+struct codestream_note *codestream_take_notes(CS *, unsigned int *n_notes);
+
 /*
  * Check there are enough consecutive bytes left in the current line
  * for the instruction we're about to generate. If so, do nothing.
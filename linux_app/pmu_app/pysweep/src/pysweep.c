@@ -56,7 +56,10 @@
 #include "loadgen.h"
 #include "loadgenp.h"     /* for diagnostics and benchmarking */
 #include "prepcode.h"
+#include "jitdump.h"
 #include "sleep.h"
+#include "isolate.h"
+#include "steady.h"
 #include "branch_prediction.h"
 #include "arch.h"
 
@@ -128,6 +131,11 @@ typedef struct {
 #define SUSPEND_ZEROAFF 0x02       /* Suspended because pinned to the empty set of threads */
 #define SUSPEND_BADWORK 0x04       /* Suspended because couldn't create workload */
     pthread_attr_t thread_attr;    /* Default thread attributes (including affinity) */
+    /* Isolated-core run mode: each thread is pinned to its own CPU
+       from this set, optionally with real-time priority. */
+    cpu_set_t isolate_cpus;        /* Empty unless isolate() has been called */
+    int isolate_priority;          /* SCHED_FIFO priority, or 0 to leave as is */
+    size_t prefault_stack;         /* Stack to prefault when a thread starts */
 } LoadObject;
 
 
@@ -146,6 +154,7 @@ struct load_thread {
     sem_t sem_started;            /* Thread has started and OS tid is available */
     sem_t sem_worktodo;           /* Contoller signals thread that there is work to do */
     load_thread_local_t volatile *loc;     /* Local, rapidly changing data */
+    struct thread_noise noise_base;        /* Interference counters at noise_reset() */
 };
 
 typedef load_thread_t ThreadObject;
@@ -185,6 +194,9 @@ static PyObject *load_new(PyTypeObject *t, PyObject *args, PyObject *kwds)
     p->suspend_reasons = 0;
     p->work = NULL;
     pthread_attr_init(&p->thread_attr);
+    CPU_ZERO(&p->isolate_cpus);
+    p->isolate_priority = 0;
+    p->prefault_stack = 0;
     return (PyObject *)p;
 }
 
@@ -271,6 +283,14 @@ static int setup_char(PyObject *spec, Character *c)
     if (rc) return rc;
     rc = update_field_int(&c->data_alignment, spec, "data_alignment");
     if (rc) return rc;
+    rc = update_field_long(&c->tlb_page_stride, spec, "tlb_page_stride");
+    if (rc) return rc;
+    rc = update_field_int(&c->tlb_lines_per_page, spec, "tlb_lines_per_page");
+    if (rc) return rc;
+    rc = update_field_int(&c->tlb_huge_fraction, spec, "tlb_huge_fraction");
+    if (rc) return rc;
+    rc = update_field_int(&c->tlb_walk_stride, spec, "tlb_walk_stride");
+    if (rc) return rc;
     rc = update_field_int(&c->fp_intensity, spec, "fp_intensity");
     if (rc) return rc;    
     rc = update_field_int(&c->fp_operation, spec, "fp_operation");
@@ -310,6 +330,7 @@ static int load_init(PyObject *x, PyObject *args, PyObject *kwds)
     static char *keys[] = { "spec", "threads", "verbose", NULL };
     int verbose = 0;
     int n_threads = p->n_threads;    /* load_new will have defaulted this to 1 */
+    unsigned int rejections;
     Character c;
     /* The default workload characteristics have no data and no FP operations.
        setup_char() will default the code working set to at least 1024 bytes. */
@@ -334,9 +355,14 @@ static int load_init(PyObject *x, PyObject *args, PyObject *kwds)
         fprintf(stderr, "pysweep: setting verbosity level to %d\n", verbose);
     }
     assert(p->work == NULL);
+    rejections = workload_mem_rejections();
     p->work = workload_create(&c);
     if (p->work == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "load could not be created");
+        if (workload_mem_rejections() != rejections) {
+            PyErr_SetString(PyExc_MemoryError, "load would exceed memory budget");
+        } else {
+            PyErr_SetString(PyExc_RuntimeError, "load could not be created");
+        }
         return -1;
     }
     if (workload_verbose) {
@@ -433,6 +459,28 @@ static PyObject *gfn_debug(PyObject *x, PyObject *args)
 }
 
 
+/*
+ * Start (or with None, stop) writing a perf jitdump file for workloads
+ * created from now on. Return the file name.
+ */
+static PyObject *gfn_jitdump(PyObject *x, PyObject *args)
+{
+    char const *dir = ".";
+    if (!PyArg_ParseTuple(args, "|z", &dir)) {
+        return NULL;
+    }
+    if (!dir) {
+        jitdump_close();
+        Py_RETURN_NONE;
+    }
+    if (jitdump_open(dir)) {
+        PyErr_SetString(PyExc_OSError, "failed to create jitdump file");
+        return NULL;
+    }
+    return PyString_FromFormat("%s", jitdump_filename());
+}
+
+
 #ifdef ARCH_AARCH64
 static unsigned long long get_ctr(void)
 {
@@ -458,7 +506,10 @@ static PyObject *gfn_sleep(PyObject *x, PyObject *args)
     if (!PyArg_ParseTuple(args, "d", &t)) {
         return NULL;
     }
+    /* Let other Python threads (e.g. a perf_mux rotation thread) run while we sleep */
+    Py_BEGIN_ALLOW_THREADS
     n_wait = microsleep(t);
+    Py_END_ALLOW_THREADS
     return PyInt_FromLong(n_wait);
 }
 
@@ -473,7 +524,9 @@ static PyObject *gfn_br_pred(PyObject *x, PyObject *args)
     if (!PyArg_ParseTuple(args, "i", &s)) {
         return NULL;
     }
+    Py_BEGIN_ALLOW_THREADS
     ret = branch_load_gen(s);
+    Py_END_ALLOW_THREADS
     return PyInt_FromLong(ret);
 }
 
@@ -495,6 +548,8 @@ static void *thread_start(void *ltv)
     /* Allow the thread to be cancelled immediately without waiting until it
        encounters a system call. */
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &otype);
+    /* Avoid taking page faults on the stack once we're measuring */
+    isolate_prefault_stack(lob->prefault_stack);
     /* We are good to go and can signal the parent to return to its caller. */
     sem_post(&lt->sem_started);
     /* Wait for the controller thread to release us */
@@ -584,6 +639,10 @@ static void load_update_thread_work(LoadObject *p, Workload *w)
 }
 
 
+static int load_apply_isolation(LoadObject *);
+static PyObject *load_noise_reset(PyObject *);
+
+
 /*
  * Create the worker threads for the load, using pthread_create().
  */
@@ -650,6 +709,12 @@ static PyObject *load_start(PyObject *x)
             }
         }
     }
+    if (CPU_COUNT(&p->isolate_cpus) > 0) {
+        if (load_apply_isolation(p) < 0) {
+            return NULL;
+        }
+    }
+    (void)load_noise_reset(x);
     /* All the threads have recorded their identifiers. We can now return
        to the caller and they can call the tids() method to get the tids. */
     /* First we release the threads, by setting the workload. */
@@ -763,6 +828,7 @@ static PyObject *load_release_internal(LoadObject *p, unsigned int reason)
 static PyObject *load_update(PyObject *x, PyObject *args)
 {
     Workload *w, *w_old;
+    unsigned int rejections;
     Character c;
     LoadObject *p = (LoadObject *)x;
     PyObject *spec;
@@ -777,7 +843,24 @@ static PyObject *load_update(PyObject *x, PyObject *args)
         return NULL;
     }
     /* Try to create a new workload with these characteristics. */
+    rejections = workload_mem_rejections();
     w = workload_create(&c);
+    if (w == NULL && p->work != NULL && workload_mem_rejections() != rejections) {
+        /* The old and new workloads together would exceed the memory budget.
+           Evict the old workload, wait for the threads to let go of it,
+           and try again. */
+        unsigned int n_waits = 0;
+        if (workload_verbose) {
+            fprintf(stderr, "pysweep: evicting workload %p to stay within memory budget\n", p->work);
+        }
+        load_suspend_internal(p, SUSPEND_BADWORK);
+        while (workload_runners(p->work) > 0 && n_waits++ < 1000) {
+            microsleep(0.001);
+        }
+        workload_free(p->work);
+        p->work = NULL;
+        w = workload_create(&c);
+    }
     /* Update the workload. At some point the worker threads will pick up this
        new workload and start running it. It's possible that we failed
        to create the workload and that w is NULL. */
@@ -796,6 +879,10 @@ static PyObject *load_update(PyObject *x, PyObject *args)
         fprintf(stderr, "pysweep: destroying old workload %p\n", w_old);
     }
     workload_free(w_old);     /* Will be deferred until no longer in use */    
+    if (w == NULL && workload_mem_rejections() != rejections) {
+        PyErr_SetString(PyExc_MemoryError, "load would exceed memory budget");
+        return NULL;
+    }
     if (workload_verbose) {
         fprintf(stderr, "pysweep: workload updated\n");
     }
@@ -1079,6 +1166,412 @@ static PyObject *thread_getaffinity(PyObject *x)
 }
 
 
+/*
+ * Pin each thread to its own CPU from the isolated set (wrapping round
+ * if there are more threads than CPUs) and set its scheduling policy.
+ * Threads that have to share a CPU stay with SCHED_OTHER: spinning
+ * SCHED_FIFO threads at one priority would never yield to each other.
+ * Return -1 with a Python exception set, if we fail.
+ */
+static int load_apply_isolation(LoadObject *p)
+{
+    load_thread_t *t;
+    int cpu = -1;
+    unsigned int const n_cpus = CPU_COUNT(&p->isolate_cpus);
+    unsigned int i = 0;
+    for (t = p->first_thread; t != NULL; t = t->next_thread, ++i) {
+        cpu_set_t one;
+        unsigned int const sharing = p->n_threads / n_cpus + ((i % n_cpus) < (p->n_threads % n_cpus));
+        int const priority = (sharing > 1) ? 0 : p->isolate_priority;
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(cpu, &p->isolate_cpus));
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(t->os_tid, sizeof one, &one) != 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        if (p->isolate_priority > 0) {
+            struct sched_param sp;
+            memset(&sp, 0, sizeof sp);
+            sp.sched_priority = priority;
+            if (sched_setscheduler(t->os_tid, (priority > 0 ? SCHED_FIFO : SCHED_OTHER), &sp) != 0) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                return -1;
+            }
+        }
+        if (workload_verbose) {
+            fprintf(stderr, "pysweep: [W %u] isolated on CPU %d, priority %d%s\n",
+                (unsigned int)t->os_tid, cpu, priority, (sharing > 1 ? " (CPU is shared)" : ""));
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Isolated-core run mode. By default, use the CPUs the kernel has isolated
+ * (isolcpus= or nohz_full=). Worker threads run with SCHED_FIFO at the given
+ * priority, so only use this on CPUs where nothing else needs to run.
+ * mlock locks memory as it's faulted in (MCL_ONFAULT), so sparse working
+ * sets aren't populated. Each worker thread prefaults this much of its
+ * stack when it starts, so a prefault must be set before start().
+ */
+static PyObject *load_isolate(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *keys[] = {"cpus", "priority", "mlock", "prefault", NULL};
+    LoadObject *p = (LoadObject *)x;
+    PyObject *cpus_obj = NULL;
+    int priority = 1;
+    int lock = 0;
+    Py_ssize_t prefault = 0;
+    cpu_set_t cpus;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oiin", keys, &cpus_obj, &priority, &lock, &prefault)) {
+        return NULL;
+    }
+    if (prefault > 0 && p->first_thread != NULL) {
+        PyErr_SetString(PyExc_ValueError, "stack prefault must be set before start()");
+        return NULL;
+    }
+    if (cpus_obj != NULL && cpus_obj != Py_None) {
+        if (!affinity_object_to_set(cpus_obj, &cpus)) {
+            return NULL;
+        }
+    } else {
+        (void)isolate_isolated_cpus(&cpus);
+    }
+    if (CPU_COUNT(&cpus) == 0) {
+        PyErr_SetString(PyExc_ValueError, "no isolated CPUs");
+        return NULL;
+    }
+#ifdef MCL_ONFAULT
+    if (lock && mlockall(MCL_CURRENT|MCL_FUTURE|MCL_ONFAULT) != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+#else
+    if (lock) {
+        PyErr_SetString(PyExc_ValueError, "mlock needs MCL_ONFAULT, which wasn't available when this module was built");
+        return NULL;
+    }
+#endif
+    p->isolate_cpus = cpus;
+    p->isolate_priority = priority;
+    p->prefault_stack = (prefault > 0) ? (size_t)prefault : 0;
+    /* Threads we start later will start on the isolated CPUs, before being pinned */
+    pthread_attr_setaffinity_np(&p->thread_attr, sizeof cpus, &cpus);
+    if (load_apply_isolation(p) < 0) {
+        return NULL;
+    }
+    return cpu_set_to_list(&cpus);
+}
+
+
+/*
+ * Start counting interference from now.
+ */
+static PyObject *load_noise_reset(PyObject *x)
+{
+    LoadObject *p = (LoadObject *)x;
+    load_thread_t *t;
+    for (t = p->first_thread; t != NULL; t = t->next_thread) {
+        (void)isolate_thread_noise(t->os_tid, &t->noise_base);
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Get the interference for a thread since the last noise_reset().
+ */
+static void thread_noise_delta(load_thread_t const *t, struct thread_noise *d)
+{
+    struct thread_noise now;
+    if (isolate_thread_noise(t->os_tid, &now) != 0) {
+        memset(d, 0, sizeof *d);
+        return;
+    }
+    d->nvcsw = now.nvcsw - t->noise_base.nvcsw;
+    d->nivcsw = now.nivcsw - t->noise_base.nivcsw;
+    d->migrations = now.migrations - t->noise_base.migrations;
+    d->irqs = (now.irqs >= t->noise_base.irqs) ? (now.irqs - t->noise_base.irqs) : 0;
+}
+
+
+static PyObject *load_noise(PyObject *x)
+{
+    LoadObject *p = (LoadObject *)x;
+    load_thread_t *t;
+    PyObject *tmap = PyDict_New();
+    for (t = p->first_thread; t != NULL; t = t->next_thread) {
+        struct thread_noise d;
+        PyObject *data = PyDict_New();
+        thread_noise_delta(t, &d);
+        PyDict_SetItemString(data, "voluntary", PyLong_FromUnsignedLongLong(d.nvcsw));
+        PyDict_SetItemString(data, "involuntary", PyLong_FromUnsignedLongLong(d.nivcsw));
+        PyDict_SetItemString(data, "migrations", PyLong_FromUnsignedLongLong(d.migrations));
+        PyDict_SetItemString(data, "irqs", PyLong_FromUnsignedLongLong(d.irqs));
+        PyDict_SetItem(tmap, PyInt_FromLong(t->os_tid), data);
+    }
+    return tmap;
+}
+
+
+/*
+ * Check if any thread has seen more than the threshold number of
+ * preemptions, migrations and interrupts since the last noise_reset().
+ */
+static PyObject *load_noisy(PyObject *x, PyObject *args)
+{
+    LoadObject *p = (LoadObject *)x;
+    unsigned long long threshold;
+    load_thread_t *t;
+    if (!PyArg_ParseTuple(args, "K", &threshold)) {
+        return NULL;
+    }
+    for (t = p->first_thread; t != NULL; t = t->next_thread) {
+        struct thread_noise d;
+        thread_noise_delta(t, &d);
+        if (d.nivcsw + d.migrations + d.irqs > threshold) {
+            Py_RETURN_TRUE;
+        }
+    }
+    Py_RETURN_FALSE;
+}
+
+
+/*
+ * Resume the workload and wait until it reaches steady state, i.e.
+ * the iteration rate and (if we can count them) the threads' cycle
+ * rates have stopped ramping up. The workload is left running.
+ * Return a dictionary describing the sustained rate.
+ */
+static PyObject *load_settle(PyObject *x, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"interval", "window", "cv", "timeout", NULL};
+    LoadObject *p = (LoadObject *)x;
+    double interval = 0.01;
+    unsigned int window = 10;
+    double cv_limit = 0.02;
+    double timeout = 5.0;
+    struct steady_state ss;
+    unsigned int n_threads = 0, n_cycles = 0, i;
+    load_thread_local_t volatile **locs;
+    int *fds;
+    load_thread_t *t;
+    double t_start, t_last, t_now = 0.0;
+    unsigned long long iters_last = 0, cycles_last = 0;
+    int settled = 0;
+    double rate, rate_cv, freq, freq_cv;
+    PyObject *r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dIdd", kwlist, &interval, &window, &cv_limit, &timeout)) {
+        return NULL;
+    }
+    if (interval <= 0.0) {
+        PyErr_SetString(PyExc_ValueError, "sampling interval must be positive");
+        return NULL;
+    }
+    for (t = p->first_thread; t != NULL; t = t->next_thread) {
+        ++n_threads;
+    }
+    if (n_threads == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "load has not been started");
+        return NULL;
+    }
+    locs = (load_thread_local_t volatile **)malloc(n_threads * sizeof *locs);
+    fds = (int *)malloc(n_threads * sizeof *fds);
+    if (!locs || !fds) {
+        free(locs);
+        free(fds);
+        return PyErr_NoMemory();
+    }
+    i = 0;
+    for (t = p->first_thread; t != NULL; t = t->next_thread, ++i) {
+        locs[i] = t->loc;
+        fds[i] = steady_cycles_open(t->os_tid);
+        if (fds[i] >= 0) {
+            ++n_cycles;
+        }
+    }
+    if (n_cycles < n_threads) {
+        /* Frequency would be averaged over the wrong number of threads */
+        for (i = 0; i < n_threads; ++i) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        n_cycles = 0;
+        if (workload_verbose) {
+            fprintf(stderr, "pysweep: can't count cycles, settling on iteration rate only\n");
+        }
+    }
+    steady_init(&ss, window, cv_limit);
+    load_release_internal(p, SUSPEND_REQUEST);
+
+    Py_BEGIN_ALLOW_THREADS
+    t_start = t_last = steady_now();
+    for (i = 0; i < n_threads; ++i) {
+        iters_last += locs[i]->n_iters;
+        cycles_last += steady_cycles_read(fds[i]);
+    }
+    while (!settled) {
+        unsigned long long iters_now = 0, cycles_now = 0;
+        double dt;
+        microsleep(interval);
+        t_now = steady_now();
+        for (i = 0; i < n_threads; ++i) {
+            iters_now += locs[i]->n_iters;
+            cycles_now += steady_cycles_read(fds[i]);
+        }
+        dt = t_now - t_last;
+        /* The iteration counters are 32-bit, so take the difference in that width */
+        settled = steady_add(&ss, (unsigned int)(iters_now - iters_last) / dt,
+                             n_cycles ? (cycles_now - cycles_last) / dt / n_threads : 0.0);
+        iters_last = iters_now;
+        cycles_last = cycles_now;
+        t_last = t_now;
+        if (t_now - t_start >= timeout) {
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < n_threads; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    free(fds);
+    free(locs);
+    (void)steady_rate(&ss, &rate, &rate_cv);
+    (void)steady_freq(&ss, &freq, &freq_cv);
+    if (workload_verbose) {
+        fprintf(stderr, "pysweep: %s after %.3fs: %.0f iterations/s (cv %.4f)\n",
+            (settled ? "settled" : "not settled"), t_now - t_start, rate, rate_cv);
+    }
+    r = PyDict_New();
+    PyDict_SetItemString(r, "settled", PyBool_FromLong(settled));
+    PyDict_SetItemString(r, "time", PyFloat_FromDouble(t_now - t_start));
+    PyDict_SetItemString(r, "samples", PyInt_FromLong(ss.n_samples));
+    PyDict_SetItemString(r, "rate", PyFloat_FromDouble(rate));
+    PyDict_SetItemString(r, "rate_cv", PyFloat_FromDouble(rate_cv));
+    if (n_cycles) {
+        PyDict_SetItemString(r, "frequency", PyFloat_FromDouble(freq));
+        PyDict_SetItemString(r, "frequency_cv", PyFloat_FromDouble(freq_cv));
+    }
+    return r;
+}
+
+
+static PyObject *mem_usage_dict(struct workload_mem_usage const *u)
+{
+    PyObject *d = PyDict_New();
+    PyDict_SetItemString(d, "reserved", PyLong_FromUnsignedLong(u->reserved));
+    PyDict_SetItemString(d, "reserved_huge", PyLong_FromUnsignedLong(u->reserved_huge));
+    PyDict_SetItemString(d, "resident", PyLong_FromUnsignedLong(u->resident));
+    PyDict_SetItemString(d, "resident_huge", PyLong_FromUnsignedLong(u->resident_huge));
+    return d;
+}
+
+
+static void mem_usage_add(struct workload_mem_usage *total, struct workload_mem_usage const *u)
+{
+    total->reserved += u->reserved;
+    total->reserved_huge += u->reserved_huge;
+    total->resident += u->resident;
+    total->resident_huge += u->resident_huge;
+}
+
+
+/*
+ * Report the memory held by a load: the workload's code and data,
+ * the worker threads' stacks, and our own descriptors.
+ * Descriptors are counted as reserved and resident.
+ */
+static PyObject *load_memory(PyObject *x)
+{
+    LoadObject *p = (LoadObject *)x;
+    struct workload_mem_usage code, data, stacks, other, total;
+    load_thread_t *t;
+    PyObject *r;
+    memset(&code, 0, sizeof code);
+    memset(&data, 0, sizeof data);
+    memset(&stacks, 0, sizeof stacks);
+    memset(&other, 0, sizeof other);
+    if (p->work != NULL) {
+        workload_mem_usage(p->work, &code, &data);
+        other.reserved += sizeof(Workload);
+    }
+    for (t = p->first_thread; t != NULL; t = t->next_thread) {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(t->pthread_id, &attr) == 0) {
+            void *stack;
+            size_t size;
+            if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+                workload_mem_range_usage(stack, size, &stacks);
+            }
+            pthread_attr_destroy(&attr);
+        }
+        other.reserved += sizeof(ThreadObject) + sizeof(load_thread_local_t);
+    }
+    other.resident = other.reserved;
+    total = code;
+    mem_usage_add(&total, &data);
+    mem_usage_add(&total, &stacks);
+    mem_usage_add(&total, &other);
+    r = PyDict_New();
+    PyDict_SetItemString(r, "code", mem_usage_dict(&code));
+    PyDict_SetItemString(r, "data", mem_usage_dict(&data));
+    PyDict_SetItemString(r, "stacks", mem_usage_dict(&stacks));
+    PyDict_SetItemString(r, "other", mem_usage_dict(&other));
+    PyDict_SetItemString(r, "total", mem_usage_dict(&total));
+    return r;
+}
+
+
+/*
+ * Report the memory mapped for all workloads.
+ */
+static PyObject *gfn_memory(PyObject *x)
+{
+    unsigned int count;
+    unsigned long total = workload_mem_total(&count);
+    unsigned long budget = workload_mem_budget();
+    PyObject *r = PyDict_New();
+    PyDict_SetItemString(r, "mappings", PyInt_FromLong(count));
+    PyDict_SetItemString(r, "reserved", PyLong_FromUnsignedLong(total));
+    PyDict_SetItemString(r, "budget", PyLong_FromUnsignedLong(budget));
+    PyDict_SetItemString(r, "rejections", PyInt_FromLong(workload_mem_rejections()));
+    return r;
+}
+
+
+/*
+ * Limit the memory mapped for all workloads. Creating or updating a load
+ * that would exceed the budget raises MemoryError - except that when
+ * updating, we first try evicting the load's old workload.
+ */
+static PyObject *gfn_memory_budget(PyObject *x, PyObject *args)
+{
+    unsigned long budget;
+    if (!PyArg_ParseTuple(args, "k", &budget)) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(workload_mem_set_budget(budget));
+}
+
+
+static PyObject *gfn_isolated_cpus(PyObject *x)
+{
+    cpu_set_t cpus;
+    (void)isolate_isolated_cpus(&cpus);
+    return cpu_set_to_list(&cpus);
+}
+
+
 /*
 Set affinity for the current (monitoring) thread.
 Input is an integer (up to 64 bits) representing a CPU mask.
@@ -1154,6 +1647,8 @@ static PyObject *load_expected(PyObject *x)
     SETITEM(flop_sp, FLOP_SP);
     SETITEM(flop_dp, FLOP_DP);
     SETITEM(fence, FENCE);
+    SETITEM(dtlb_walk, DTLB_WALK);
+    SETITEM(itlb_walk, ITLB_WALK);
     SETITEM(unit, UNIT);
 #undef SETITEM
     return data;
@@ -1220,6 +1715,11 @@ static PyMethodDef Load_methods[] = {
     {"update", (PyCFunction)&load_update, METH_VARARGS, "spec -> None: update load specification"},
     {"setaffinity", (PyCFunction)&load_setaffinity, METH_O, "list or mask -> None: set CPU affinity mask for workload"},
     {"getaffinity", (PyCFunction)&load_getaffinity, METH_NOARGS, "list: get CPU affinity"},
+    {"isolate", (PyCFunction)&load_isolate, METH_VARARGS|METH_KEYWORDS, "(cpus, priority, mlock, prefault) -> list: run threads on isolated CPUs"},
+    {"noise_reset", (PyCFunction)&load_noise_reset, METH_NOARGS, "None: start counting interference"},
+    {"noise", (PyCFunction)&load_noise, METH_NOARGS, "{}: get interference per thread since noise_reset"},
+    {"noisy", (PyCFunction)&load_noisy, METH_VARARGS, "int -> bool: check if interference exceeded threshold"},
+    {"settle", (PyCFunction)&load_settle, METH_VARARGS|METH_KEYWORDS, "(interval, window, cv, timeout) -> {}: resume and wait for steady state"},
     {"stop", (PyCFunction)&load_stop, METH_NOARGS, "None: stop (cancel) load threads"},
     {"suspend", (PyCFunction)&load_suspend, METH_NOARGS, "None: suspend load threads"},
     {"resume", (PyCFunction)&load_resume, METH_NOARGS, "None: resume load threads"},
@@ -1230,6 +1730,7 @@ static PyMethodDef Load_methods[] = {
     {"threads", (PyCFunction)&load_threads, METH_NOARGS, "{}: get set of threads"},
     {"tids", (PyCFunction)&load_tids, METH_NOARGS, "[tids]: get OS thread ids"},
     {"expected", (PyCFunction)&load_expected, METH_NOARGS, "{}: get expected instruction counts"},
+    {"memory", (PyCFunction)&load_memory, METH_NOARGS, "{}: get memory reserved and resident, by category"},
     {"dump", (PyCFunction)&load_dump, METH_VARARGS, "str -> int: generate program image file"},
     {NULL}
 };
@@ -1275,8 +1776,12 @@ static PyMethodDef funcs[] = {
     {"setaffinity", (PyCFunction)&gfn_setaffinity, METH_O, "list or mask -> None: set CPU affinity mask for future workloads"},
     {"sleep", (PyCFunction)&gfn_sleep, METH_VARARGS, "float -> int: sleep; like time.sleep() but correctly handling interrupts"},
     {"sched_yield", (PyCFunction)&gfn_sched_yield, METH_NOARGS, "None: yield to scheduler"},
+    {"memory", (PyCFunction)&gfn_memory, METH_NOARGS, "{}: get memory mapped for all workloads"},
+    {"memory_budget", (PyCFunction)&gfn_memory_budget, METH_VARARGS, "int -> int: set memory budget for all workloads (0 for none), return previous"},
+    {"isolated_cpus", (PyCFunction)&gfn_isolated_cpus, METH_NOARGS, "list: get CPUs isolated from the scheduler"},
     {"bench", (PyCFunction)&gfn_bench, METH_VARARGS, "(spec, int, int) -> None: measure workload creation time"},
     {"debug", (PyCFunction)&gfn_debug, METH_VARARGS, "int -> None: set diagnostic options"},
+    {"jitdump", (PyCFunction)&gfn_jitdump, METH_VARARGS, "[str] -> str: write perf jitdump for new workloads in directory, or stop if None"},
     {"br_pred", (PyCFunction)&gfn_br_pred, METH_VARARGS, "int -> scaling factor: Run Branch Prediction workload"},
 #ifdef ARCH_AARCH64
     {"ctr", (PyCFunction)&gfn_ctr, METH_NOARGS, "-> int: get value of Cache Type Register"},
@@ -1296,6 +1801,7 @@ static struct {
     { "MEM_FORCE_HUGEPAGE", WL_MEM_FORCE_HUGEPAGE },
     { "MEM_ACQUIRE", WL_MEM_ACQUIRE },
     { "MEM_BARRIER", WL_MEM_BARRIER },
+    { "MEM_TLB", WL_MEM_TLB },
     { "DEBUG_NO_CODE", WORKLOAD_DEBUG_DUMMY_CODE },
     { "DEBUG_NO_COHERENCE", WORKLOAD_DEBUG_NO_UNIFICATION },
     { "DEBUG_NO_MPROTECT", WORKLOAD_DEBUG_NO_MPROTECT },
@@ -0,0 +1,146 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/*
+ * Steady-state detection: see steady.h.
+ *
+ * The coefficient of variation (standard deviation over mean) is
+ * independent of the absolute rate, so a single limit will do for
+ * workloads of any size. Cycle rates are per-thread frequencies;
+ * if they are still varying, the CPU is ramping up or being throttled,
+ * even if the iteration rate happens to look stable.
+ */
+
+#include "steady.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+void steady_init(struct steady_state *s, unsigned int window, double cv_limit)
+{
+    memset(s, 0, sizeof *s);
+    if (window < 2) {
+        window = 2;
+    } else if (window > STEADY_MAX_WINDOW) {
+        window = STEADY_MAX_WINDOW;
+    }
+    s->window = window;
+    s->cv_limit = cv_limit;
+}
+
+
+static unsigned int window_stats(struct steady_state const *s, double const *x, double *mean, double *cv)
+{
+    unsigned int n = (s->n_samples < s->window) ? s->n_samples : s->window;
+    unsigned int i;
+    double sum = 0.0, sumsq = 0.0, m;
+    *mean = 0.0;
+    *cv = 0.0;
+    if (n == 0) {
+        return 0;
+    }
+    /* The window is the most recent n samples in the circular buffer. */
+    for (i = 0; i < n; ++i) {
+        sum += x[(s->n_samples - 1 - i) % s->window];
+    }
+    m = sum / n;
+    for (i = 0; i < n; ++i) {
+        double d = x[(s->n_samples - 1 - i) % s->window] - m;
+        sumsq += d * d;
+    }
+    *mean = m;
+    if (n > 1 && m > 0.0) {
+        *cv = sqrt(sumsq / (n - 1)) / m;
+    }
+    return n;
+}
+
+
+unsigned int steady_rate(struct steady_state const *s, double *mean, double *cv)
+{
+    return window_stats(s, s->rate, mean, cv);
+}
+
+
+unsigned int steady_freq(struct steady_state const *s, double *mean, double *cv)
+{
+    return window_stats(s, s->freq, mean, cv);
+}
+
+
+int steady_add(struct steady_state *s, double rate, double freq)
+{
+    double mean, cv;
+    s->rate[s->n_samples % s->window] = rate;
+    s->freq[s->n_samples % s->window] = freq;
+    ++s->n_samples;
+    if (s->n_samples < s->window) {
+        return 0;
+    }
+    if (steady_rate(s, &mean, &cv) == 0 || mean <= 0.0 || cv > s->cv_limit) {
+        return 0;
+    }
+    /* Cycle rates are all zero if we couldn't count cycles - don't wait for them. */
+    if (steady_freq(s, &mean, &cv) && mean > 0.0 && cv > s->cv_limit) {
+        return 0;
+    }
+    return 1;
+}
+
+
+int steady_cycles_open(pid_t tid)
+{
+    struct perf_event_attr attr;
+    int fd;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0) {
+        /* Try again without kernel cycles, in case we're not privileged. */
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    }
+    return fd;
+}
+
+
+unsigned long long steady_cycles_read(int fd)
+{
+    unsigned long long n = 0;
+    if (fd < 0 || read(fd, &n, sizeof n) != sizeof n) {
+        return 0;
+    }
+    return n;
+}
+
+
+double steady_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* end of steady.c */
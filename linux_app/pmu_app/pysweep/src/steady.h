@@ -0,0 +1,80 @@
+/** @file
+ * Copyright (c) 2023, Arm Limited or its affiliates. All rights reserved.
+ * SPDX-License-Identifier : Apache-2.0
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef __included_steady_h
+#define __included_steady_h
+
+/*
+ * Steady-state detection for a running workload.
+ *
+ * When a workload starts, the first part of its run is spent warming
+ * caches and predictors, and waiting for the CPU frequency to ramp up.
+ * We sample the iteration rate (and the cycle rate, if we can count
+ * cycles) over a sliding window, and consider the workload settled
+ * when the coefficient of variation of both rates is below a limit.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <sys/types.h>
+
+#define STEADY_MAX_WINDOW 64
+
+struct steady_state {
+    unsigned int window;      /* Number of samples to consider */
+    double cv_limit;          /* Settled when CV of rates is below this */
+    unsigned int n_samples;   /* Total samples added so far */
+    double rate[STEADY_MAX_WINDOW];   /* Iteration rate samples (circular) */
+    double freq[STEADY_MAX_WINDOW];   /* Cycle rate samples, or zero if not known */
+};
+
+/*
+ * Initialize a detector. The window is clipped to STEADY_MAX_WINDOW.
+ */
+void steady_init(struct steady_state *, unsigned int window, double cv_limit);
+
+/*
+ * Add a sample. Return 1 if the workload now looks settled.
+ */
+int steady_add(struct steady_state *, double rate, double freq);
+
+/*
+ * Get the mean and coefficient of variation of the samples in the
+ * current window. Return the number of samples used.
+ */
+unsigned int steady_rate(struct steady_state const *, double *mean, double *cv);
+unsigned int steady_freq(struct steady_state const *, double *mean, double *cv);
+
+/*
+ * Open a counter for the cycles used by a thread, including its
+ * time in the kernel if permitted. Return a file descriptor, or -1.
+ */
+int steady_cycles_open(pid_t tid);
+
+/*
+ * Read a cycle counter opened with steady_cycles_open.
+ */
+unsigned long long steady_cycles_read(int fd);
+
+/*
+ * Get a monotonic timestamp in seconds.
+ */
+double steady_now(void);
+
+#endif /* included */